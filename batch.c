@@ -0,0 +1,589 @@
+//
+// Batch manifests. satlink --batch jobs.txt runs a list of operations in one session instead of one
+// command per process:
+//
+//   # comments and blank lines are ignored
+//   write   0x06010000 assets.bin
+//   read    0x06000000 4096 header.bin
+//   bios    bios.bin
+//   execute 0x06004000 sl.bin
+//
+// Before anything is sent the operations are planned. Every operation is put in the earliest round
+// that keeps it behind the operations it depends on: a read behind the writes it overlaps, a write
+// behind the reads and writes it overlaps. Inside a round the writes that overlap or touch are merged
+// into one transfer (later ones win, like they would have in order), the reads that are close together
+// are merged into one READ_START..READ_END sequence, and everything is sent in address order. An
+// execute jumps into the program, so it ends the rounds before it and the operations after it start
+// new ones.
+//
+
+#define _GNU_SOURCE
+#include <sys/stat.h>
+#include "transport.h"
+#include "satlinkd.h"
+
+#define BATCH_READ      0
+#define BATCH_WRITE     1
+#define BATCH_EXECUTE   2
+
+#define BATCH_READ_GAP  (MAX_DATALEN * 2) // unwanted bytes read between two reads to keep them in one sequence
+#define BATCH_LINE      4096
+
+typedef struct _BATCH_OP
+{
+    int type;
+    int line;           // line of the manifest, for messages
+    DWORD address;
+    DWORD length;
+    char* filename;
+    BYTE* data;         // contents of the file for writes and executes
+    int segment;        // number of executes before this operation
+    int round;          // when it runs inside its segment
+} BATCH_OP, *PBATCH_OP;
+
+// a merged transfer
+typedef struct _BATCH_RANGE
+{
+    DWORD address;
+    DWORD length;
+} BATCH_RANGE, *PBATCH_RANGE;
+
+// reads the whole of filename into a malloc'd buffer
+// Returns 0 for success, <0 for error
+static int loadFile(const char* filename, BYTE** data, DWORD* length)
+{
+    struct stat status;
+    FILE* file;
+    
+    file = fopen(filename, "r");
+    if(file == NULL)
+    {
+        return -1;
+    }
+    
+    // directories and devices have no size to read
+    if(fstat(fileno(file), &status) != 0 || !S_ISREG(status.st_mode) || status.st_size == 0)
+    {
+        fclose(file);
+        return -2;
+    }
+    
+    *data = malloc(status.st_size);
+    if(*data == NULL || fread(*data, 1, status.st_size, file) != status.st_size)
+    {
+        // the caller frees whatever is left in *data
+        free(*data);
+        *data = NULL;
+        fclose(file);
+        return -3;
+    }
+    
+    fclose(file);
+    *length = status.st_size;
+    return 0;
+}
+
+// parses a decimal, 0x hex or octal number that makes up the whole of word
+// Returns 0 for success, <0 for error
+static int parseNumber(const char* word, DWORD* value)
+{
+    char* end;
+    
+    *value = strtoul(word, &end, 0);
+    return *end == '\0' ? 0 : -1;
+}
+
+// parses one line of the manifest into op
+// Returns 1 for an operation, 0 for a blank line or comment, <0 for error
+static int parseBatchLine(char* line, PBATCH_OP op)
+{
+    char* words[4];
+    char* end;
+    int numWords;
+    int result;
+    
+    end = strchr(line, '#');
+    if(end != NULL)
+    {
+        *end = '\0';
+    }
+    
+    for(numWords = 0; numWords < 4; numWords++)
+    {
+        words[numWords] = strtok(numWords == 0 ? line : NULL, " \t\r\n");
+        if(words[numWords] == NULL)
+        {
+            break;
+        }
+    }
+    if(numWords == 0)
+    {
+        return 0;
+    }
+    
+    memset(op, 0, sizeof(BATCH_OP));
+    result = 0;
+    
+    if(strcmp(words[0], "bios") == 0 && numWords == 2)
+    {
+        op->type = BATCH_READ;
+        op->address = BIOS_ADDR;
+        op->length = BIOS_SIZE;
+        op->filename = words[1];
+    }
+    else if(strcmp(words[0], "read") == 0 && numWords == 4)
+    {
+        op->type = BATCH_READ;
+        result = parseNumber(words[1], &op->address) | parseNumber(words[2], &op->length);
+        op->filename = words[3];
+    }
+    else if((strcmp(words[0], "write") == 0 || strcmp(words[0], "execute") == 0) && numWords == 3)
+    {
+        op->type = words[0][0] == 'w' ? BATCH_WRITE : BATCH_EXECUTE;
+        result = parseNumber(words[1], &op->address);
+        op->filename = words[2];
+    }
+    else
+    {
+        return -1;
+    }
+    
+    if(result != 0 || (op->type == BATCH_READ && op->length == 0))
+    {
+        return -2;
+    }
+    
+    op->filename = strdup(op->filename);
+    return 1;
+}
+
+static void freeBatch(PBATCH_OP ops, int numOps)
+{
+    int i;
+    
+    for(i = 0; i < numOps; i++)
+    {
+        free(ops[i].filename);
+        free(ops[i].data);
+    }
+    free(ops);
+}
+
+// reads the manifest ("-" for stdin) and the files to upload
+// Returns the number of operations, <0 for error
+static int loadBatch(const char* manifest, PBATCH_OP* ops)
+{
+    char line[BATCH_LINE];
+    PBATCH_OP list;
+    PBATCH_OP grown;
+    FILE* file;
+    int numOps;
+    int maxOps;
+    int lineNumber;
+    int result;
+    
+    file = strcmp(manifest, "-") == 0 ? stdin : fopen(manifest, "r");
+    if(file == NULL)
+    {
+        printf("Failed to open %s!!\n", manifest);
+        return -1;
+    }
+    
+    list = NULL;
+    numOps = 0;
+    maxOps = 0;
+    result = 0;
+    
+    for(lineNumber = 1; fgets(line, sizeof(line), file) != NULL; lineNumber++)
+    {
+        if(numOps == maxOps)
+        {
+            maxOps = maxOps ? maxOps * 2 : 16;
+            grown = realloc(list, maxOps * sizeof(BATCH_OP));
+            if(grown == NULL)
+            {
+                result = -2;
+                break;
+            }
+            list = grown;
+        }
+    
+        result = parseBatchLine(line, &list[numOps]);
+        if(result < 0)
+        {
+            printf("%s:%d: expected read address count file, bios file, write address file or execute address file!!\n",
+                   manifest, lineNumber);
+            break;
+        }
+        if(result == 0)
+        {
+            continue;
+        }
+        list[numOps].line = lineNumber;
+        numOps++;
+    
+        // the whole upload has to be known up front to merge it
+        if(list[numOps - 1].type != BATCH_READ)
+        {
+            result = loadFile(list[numOps - 1].filename, &list[numOps - 1].data, &list[numOps - 1].length);
+            if(result != 0)
+            {
+                printf("%s:%d: failed to read %s!!\n", manifest, lineNumber, list[numOps - 1].filename);
+                break;
+            }
+        }
+        result = 0;
+    }
+    
+    if(file != stdin)
+    {
+        fclose(file);
+    }
+    
+    if(result < 0)
+    {
+        freeBatch(list, numOps);
+        return result;
+    }
+    
+    *ops = list;
+    return numOps;
+}
+
+// returns the bytes of op that go out as WRITE packets. the first packet of an execute is held back
+// for the WRITE_EXECUTE at the end of its segment
+static void getWriteRange(PBATCH_OP op, DWORD* address, DWORD* length, DWORD* skip)
+{
+    *skip = op->type == BATCH_EXECUTE ? (op->length < MAX_DATALEN ? op->length : MAX_DATALEN) : 0;
+    *address = op->address + *skip;
+    *length = op->length - *skip;
+}
+
+// puts every operation in the earliest round that keeps it behind the ones it depends on
+static void planBatch(PBATCH_OP ops, int numOps)
+{
+    int segment;
+    int i;
+    int j;
+    
+    segment = 0;
+    for(i = 0; i < numOps; i++)
+    {
+        ops[i].segment = segment;
+        ops[i].round = 0;
+    
+        for(j = 0; j < i; j++)
+        {
+            if(ops[j].segment != segment || ops[j].address >= ops[i].address + ops[i].length ||
+               ops[i].address >= ops[j].address + ops[j].length)
+            {
+                continue;
+            }
+    
+            // overlapping reads don't depend on each other, overlapping writes can share a round
+            // because they are merged in manifest order
+            if(ops[i].type == BATCH_READ && ops[j].type == BATCH_READ)
+            {
+                continue;
+            }
+            if(ops[i].type != BATCH_READ && ops[j].type != BATCH_READ)
+            {
+                if(ops[i].round < ops[j].round)
+                {
+                    ops[i].round = ops[j].round;
+                }
+                continue;
+            }
+            if(ops[i].round <= ops[j].round)
+            {
+                ops[i].round = ops[j].round + 1;
+            }
+        }
+    
+        if(ops[i].type == BATCH_EXECUTE)
+        {
+            segment++;
+        }
+    }
+}
+
+static int compareRanges(const void* a, const void* b)
+{
+    DWORD addressA = ((PBATCH_RANGE)a)->address;
+    DWORD addressB = ((PBATCH_RANGE)b)->address;
+    
+    return addressA < addressB ? -1 : addressA > addressB;
+}
+
+// collects the reads or the writes of a round into ranges, merges the ones no more than gap bytes
+// apart and sorts them by address
+// Returns the number of ranges
+static int mergeRanges(PBATCH_OP ops, int numOps, int segment, int round, int reads, DWORD gap, PBATCH_RANGE ranges)
+{
+    DWORD skip;
+    int numRanges;
+    int merged;
+    int i;
+    
+    numRanges = 0;
+    for(i = 0; i < numOps; i++)
+    {
+        if(ops[i].segment != segment || ops[i].round != round || (ops[i].type == BATCH_READ) != reads)
+        {
+            continue;
+        }
+    
+        if(reads)
+        {
+            ranges[numRanges].address = ops[i].address;
+            ranges[numRanges].length = ops[i].length;
+        }
+        else
+        {
+            getWriteRange(&ops[i], &ranges[numRanges].address, &ranges[numRanges].length, &skip);
+        }
+    
+        if(ranges[numRanges].length > 0)
+        {
+            numRanges++;
+        }
+    }
+    
+    qsort(ranges, numRanges, sizeof(BATCH_RANGE), compareRanges);
+    
+    merged = 0;
+    for(i = 1; i < numRanges; i++)
+    {
+        if(ranges[i].address <= ranges[merged].address + ranges[merged].length + gap)
+        {
+            if(ranges[i].address + ranges[i].length > ranges[merged].address + ranges[merged].length)
+            {
+                ranges[merged].length = ranges[i].address + ranges[i].length - ranges[merged].address;
+            }
+            continue;
+        }
+        ranges[++merged] = ranges[i];
+    }
+    
+    return numRanges ? merged + 1 : 0;
+}
+
+// sends the merged writes of a round, each built from the operations it covers in manifest order
+// Returns 0 for success, <0 for error
+static int runBatchWrites(PSAT_TRANSPORT transport, int daemonSocket, PBATCH_OP ops, int numOps, int segment, int round,
+                          PBATCH_RANGE ranges, int numRanges)
+{
+    DWORD address;
+    DWORD length;
+    DWORD skip;
+    BYTE* buffer;
+    int result;
+    int i;
+    int j;
+    
+    for(i = 0; i < numRanges; i++)
+    {
+        buffer = malloc(ranges[i].length);
+        if(buffer == NULL)
+        {
+            printf("Failed to allocate 0x%x bytes!!\n", ranges[i].length);
+            return -3;
+        }
+    
+        for(j = 0; j < numOps; j++)
+        {
+            getWriteRange(&ops[j], &address, &length, &skip);
+            if(ops[j].segment == segment && ops[j].round == round && ops[j].type != BATCH_READ && length > 0 &&
+               address >= ranges[i].address && address + length <= ranges[i].address + ranges[i].length)
+            {
+                memcpy(buffer + (address - ranges[i].address), ops[j].data + skip, length);
+            }
+        }
+    
+        logInfo("Writing 0x%x bytes to 0x%x\n", ranges[i].length, ranges[i].address);
+        result = writeSatMemoryVia(transport, daemonSocket, ranges[i].address, buffer, ranges[i].length, 0);
+        free(buffer);
+        if(result != 0)
+        {
+            printf("Failed to write 0x%x bytes to 0x%x!!\n", ranges[i].length, ranges[i].address);
+            return result;
+        }
+    }
+    
+    return 0;
+}
+
+// saves length bytes of data to filename
+// Returns 0 for success, <0 for error
+static int saveFile(const char* filename, BYTE* data, DWORD length)
+{
+    FILE* file;
+    
+    file = fopen(filename, "w");
+    if(file == NULL)
+    {
+        return -1;
+    }
+    
+    if(fwrite(data, 1, length, file) != length)
+    {
+        fclose(file);
+        return -2;
+    }
+    
+    return fclose(file) == 0 ? 0 : -3;
+}
+
+// reads the merged ranges of a round and saves the part each read operation asked for
+// Returns 0 for success, <0 for error
+static int runBatchReads(PSAT_TRANSPORT transport, int daemonSocket, PBATCH_OP ops, int numOps, int segment, int round,
+                         PBATCH_RANGE ranges, int numRanges)
+{
+    BYTE* buffer;
+    DWORD length;
+    int result;
+    int i;
+    int j;
+    
+    for(i = 0; i < numRanges; i++)
+    {
+        // reads have to be atleast 4 bytes
+        length = ranges[i].length < 4 ? 4 : ranges[i].length;
+        buffer = malloc(length);
+        if(buffer == NULL)
+        {
+            printf("Failed to allocate 0x%x bytes!!\n", length);
+            return -3;
+        }
+    
+        logInfo("Reading 0x%x bytes at 0x%x\n", length, ranges[i].address);
+        result = readSatMemoryVia(transport, daemonSocket, buffer, ranges[i].address, length);
+        if(result != 0)
+        {
+            printf("Failed to read 0x%x bytes at 0x%x!!\n", length, ranges[i].address);
+            free(buffer);
+            return result;
+        }
+    
+        for(j = 0; j < numOps && result == 0; j++)
+        {
+            if(ops[j].segment == segment && ops[j].round == round && ops[j].type == BATCH_READ &&
+               ops[j].address >= ranges[i].address && ops[j].address + ops[j].length <= ranges[i].address + ranges[i].length)
+            {
+                result = saveFile(ops[j].filename, buffer + (ops[j].address - ranges[i].address), ops[j].length);
+                if(result != 0)
+                {
+                    printf("Failed to write %s!!\n", ops[j].filename);
+                }
+            }
+        }
+    
+        free(buffer);
+        if(result != 0)
+        {
+            return -4;
+        }
+    }
+    
+    return 0;
+}
+
+int runBatch(PSAT_TRANSPORT transport, int daemonSocket, const char* manifest)
+{
+    PBATCH_RANGE ranges;
+    PBATCH_OP ops;
+    DWORD length;
+    int numOps;
+    int numRanges;
+    int transfers;
+    int segment;
+    int round;
+    int maxRound;
+    int result;
+    int i;
+    
+    numOps = loadBatch(manifest, &ops);
+    if(numOps < 0)
+    {
+        return -1;
+    }
+    if(numOps == 0)
+    {
+        printf("%s has nothing to do\n", manifest);
+        free(ops);
+        return 0;
+    }
+    
+    ranges = malloc(numOps * sizeof(BATCH_RANGE));
+    if(ranges == NULL)
+    {
+        freeBatch(ops, numOps);
+        return -2;
+    }
+    
+    planBatch(ops, numOps);
+    result = 0;
+    
+    // the uploads change what --delta would compare against
+    for(i = 0; i < numOps && daemonSocket < 0; i++)
+    {
+        if(ops[i].type != BATCH_READ)
+        {
+            dropShadow(transport->serial, ops[i].address, ops[i].length);
+        }
+    }
+    transfers = 0;
+    
+    for(segment = 0; segment <= ops[numOps - 1].segment && result == 0; segment++)
+    {
+        maxRound = 0;
+        for(i = 0; i < numOps; i++)
+        {
+            if(ops[i].segment == segment && ops[i].round > maxRound)
+            {
+                maxRound = ops[i].round;
+            }
+        }
+    
+        for(round = 0; round <= maxRound && result == 0; round++)
+        {
+            // nothing in a round depends on anything else in it, the writes go first
+            numRanges = mergeRanges(ops, numOps, segment, round, 0, 0, ranges);
+            result = runBatchWrites(transport, daemonSocket, ops, numOps, segment, round, ranges, numRanges);
+            transfers += numRanges;
+            if(result != 0)
+            {
+                break;
+            }
+    
+            numRanges = mergeRanges(ops, numOps, segment, round, 1, BATCH_READ_GAP, ranges);
+            result = runBatchReads(transport, daemonSocket, ops, numOps, segment, round, ranges, numRanges);
+            transfers += numRanges;
+        }
+    
+        // the segment ends with the jump into the program
+        for(i = 0; i < numOps && result == 0; i++)
+        {
+            if(ops[i].segment == segment && ops[i].type == BATCH_EXECUTE)
+            {
+                length = ops[i].length < MAX_DATALEN ? ops[i].length : MAX_DATALEN;
+                logInfo("Executing 0x%x\n", ops[i].address);
+                result = writeSatMemoryVia(transport, daemonSocket, ops[i].address, ops[i].data, length, 1);
+                transfers++;
+                if(result != 0)
+                {
+                    printf("Failed to execute 0x%x!!\n", ops[i].address);
+                }
+            }
+        }
+    }
+    
+    if(result == 0)
+    {
+        printf("Ran %d operations in %d transfers\n", numOps, transfers);
+    }
+    
+    free(ranges);
+    freeBatch(ops, numOps);
+    return result;
+}
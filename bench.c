@@ -0,0 +1,355 @@
+//
+// Throughput benchmark for the protocol code against the simulated DataLink
+// run with 'make bench'
+//
+
+#include <time.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include "transport.h"
+#include "stream.h"
+
+#define BENCH_ADDR  0x06004000
+#define MAX_SIZES   16
+#define MAX_LINKS   16
+
+typedef int (*BENCH_FUNC)(PSAT_TRANSPORT transport, BYTE* buffer, DWORD numBytes);
+
+// one simulated DataLink running a transfer on its own thread
+typedef struct _BENCH_LINK
+{
+    SAT_TRANSPORT transport;
+    BENCH_FUNC func;
+    BYTE* buffer;
+    DWORD numBytes;
+    int result;
+    pthread_t thread;
+} BENCH_LINK, *PBENCH_LINK;
+
+static int savedStdout = -1;
+
+// the protocol code reports every packet on stdout, hide that while timing
+static void hideStdout()
+{
+    int devNull;
+    
+    fflush(stdout);
+    savedStdout = dup(1);
+    devNull = open("/dev/null", O_WRONLY);
+    dup2(devNull, 1);
+    close(devNull);
+}
+
+static void restoreStdout()
+{
+    fflush(stdout);
+    dup2(savedStdout, 1);
+    close(savedStdout);
+}
+
+static double getTime(clockid_t clock)
+{
+    struct timespec ts;
+    
+    clock_gettime(clock, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int benchRead(PSAT_TRANSPORT transport, BYTE* buffer, DWORD numBytes)
+{
+    int result;
+    
+    result = readSatMemory(transport, buffer, BENCH_ADDR, numBytes);
+    if(result == 0 && memcmp(buffer, getSimMemory(transport, BENCH_ADDR, numBytes), numBytes) != 0)
+    {
+        return -100;
+    }
+    
+    return result;
+}
+
+// streams the read to a temporary file through the writer thread, the way -r and -b do
+static int benchDump(PSAT_TRANSPORT transport, BYTE* buffer, DWORD numBytes)
+{
+    char path[] = "/tmp/satlink_benchXXXXXX";
+    DWORD bytesWritten;
+    int result;
+    int fd;
+    
+    fd = mkstemp(path);
+    if(fd < 0)
+    {
+        return -101;
+    }
+    unlink(path);
+    
+    result = readSatMemoryToFile(transport, fd, 0, BENCH_ADDR, numBytes, NULL, NULL, &bytesWritten);
+    if(result == 0 && (pread(fd, buffer, numBytes, 0) != numBytes || memcmp(buffer, getSimMemory(transport, BENCH_ADDR, numBytes), numBytes) != 0))
+    {
+        result = -100;
+    }
+    
+    close(fd);
+    return result;
+}
+
+static int benchWrite(PSAT_TRANSPORT transport, BYTE* buffer, DWORD numBytes)
+{
+    int result;
+    
+    result = writeSatMemory(transport, BENCH_ADDR, buffer, numBytes);
+    if(result == 0 && memcmp(buffer, getSimMemory(transport, BENCH_ADDR, numBytes), numBytes) != 0)
+    {
+        return -100;
+    }
+    
+    return result;
+}
+
+static int benchExecute(PSAT_TRANSPORT transport, BYTE* buffer, DWORD numBytes)
+{
+    SIM_STATS stats;
+    int result;
+    
+    result = writeSatMemoryAndExecute(transport, BENCH_ADDR, buffer, numBytes);
+    getSimStats(transport, &stats);
+    if(result == 0 && (memcmp(buffer, getSimMemory(transport, BENCH_ADDR, numBytes), numBytes) != 0 || stats.executeAddress != BENCH_ADDR))
+    {
+        return -100;
+    }
+    
+    return result;
+}
+
+static void* runBenchLink(void* context)
+{
+    PBENCH_LINK link = (PBENCH_LINK)context;
+    
+    link->result = link->func(&link->transport, link->buffer, link->numBytes);
+    return NULL;
+}
+
+// times the same transfer on every link at once and prints a line of results. with more than one link
+// the rates are for all of them together
+static int runBench(PBENCH_LINK links, int numLinks, const char* name, BENCH_FUNC func, DWORD numBytes)
+{
+    SIM_STATS before;
+    SIM_STATS after;
+    SAT_LINK_STATS linkBefore;
+    SAT_LINK_STATS linkAfter;
+    DWORD requests;
+    DWORD damaged;
+    DWORD retries;
+    double wireRate;
+    double elapsed;
+    double cpu;
+    double start;
+    double cpuStart;
+    DWORD i;
+    int result;
+    int k;
+    
+    for(k = 0; k < numLinks; k++)
+    {
+        links[k].func = func;
+        links[k].numBytes = numBytes;
+        links[k].buffer = malloc(numBytes);
+        if(links[k].buffer == NULL)
+        {
+            printf("Failed to allocate %d bytes!!\n", numBytes);
+            return -1;
+        }
+    
+        // fresh contents so a stale buffer can't pass the check
+        for(i = 0; i < numBytes; i++)
+        {
+            links[k].buffer[i] = rand();
+            getSimMemory(&links[k].transport, BENCH_ADDR, numBytes)[i] = rand();
+        }
+    }
+    
+    requests = 0;
+    damaged = 0;
+    retries = 0;
+    for(k = 0; k < numLinks; k++)
+    {
+        getSimStats(&links[k].transport, &before);
+        getLinkStats(&links[k].transport, &linkBefore);
+        requests -= before.requests;
+        damaged -= before.damaged;
+        retries -= linkBefore.retries;
+    }
+    
+    hideStdout();
+    start = getTime(CLOCK_MONOTONIC);
+    cpuStart = getTime(CLOCK_PROCESS_CPUTIME_ID);
+    if(numLinks == 1)
+    {
+        runBenchLink(&links[0]);
+    }
+    else
+    {
+        for(k = 0; k < numLinks; k++)
+        {
+            pthread_create(&links[k].thread, NULL, runBenchLink, &links[k]);
+        }
+        for(k = 0; k < numLinks; k++)
+        {
+            pthread_join(links[k].thread, NULL);
+        }
+    }
+    elapsed = getTime(CLOCK_MONOTONIC) - start;
+    cpu = getTime(CLOCK_PROCESS_CPUTIME_ID) - cpuStart;
+    restoreStdout();
+    
+    result = 0;
+    for(k = 0; k < numLinks; k++)
+    {
+        getSimStats(&links[k].transport, &after);
+        getLinkStats(&links[k].transport, &linkAfter);
+        requests += after.requests;
+        damaged += after.damaged;
+        retries += linkAfter.retries;
+        free(links[k].buffer);
+    
+        if(links[k].result != 0 && result == 0)
+        {
+            result = links[k].result;
+        }
+    }
+    
+    if(result != 0)
+    {
+        printf("%-8s %8d bytes  FAILED (%d)\n", name, numBytes, result);
+        return -1;
+    }
+    
+    // payload bytes per second the serial lines could carry with no protocol overhead at all
+    wireRate = (double)BAUD_RATE / BITS_PER_BYTE * numLinks;
+    
+    printf("%-8s %8d bytes  %8.3f s  %10.0f bytes/s  %8.1f packets/s  %5.1f%% of wire  %5.1f%% cpu",
+           name, numBytes, elapsed, numBytes * numLinks / elapsed, requests / elapsed,
+           100.0 * numBytes * numLinks / elapsed / wireRate, 100.0 * cpu / elapsed);
+    if(damaged != 0)
+    {
+        printf("  %d errors, %d retries", damaged, retries);
+    }
+    printf("\n");
+    
+    return 0;
+}
+
+static void usage()
+{
+    printf("satlink_bench [-b baud] [-l usb_latency_us] [-j jitter_us] [-n] [-e error_rate] [-r read_window] [-w write_window] [-f links] [-t] [-m metrics] [-s size]...\n");
+    printf("\t-n\tthe DataLink drops requests that arrive while the Saturn is busy\n");
+    printf("\t-e\tdamage, lose or add noise to a response about once every error_rate bytes\n");
+    printf("\t-f\trun every transfer on this many simulated DataLinks at once, each on its own thread\n");
+    printf("\t-t\trecord every packet in the trace ring while timing\n");
+    printf("\t-m\tsave the latency histograms and counters of every link to metrics (.prom or JSON) at the end\n");
+    exit(-1);
+}
+
+int main(int argc, char **argv)
+{
+    static BENCH_LINK links[MAX_LINKS];
+    PSAT_TRANSPORT transports[MAX_LINKS];
+    char* metricsFile = NULL;
+    SIM_CONFIG config;
+    DWORD sizes[MAX_SIZES] = { 1024, 16384, 65536 };
+    int numSizes = 3;
+    int customSizes = 0;
+    int numLinks = 1;
+    int readWindow = READ_WINDOW;
+    int writeWindow = WRITE_WINDOW;
+    int failed = 0;
+    int opt;
+    int i;
+    
+    getDefaultSimConfig(&config);
+    
+    while((opt = getopt(argc, argv, "b:l:j:ne:r:w:f:s:tm:")) != -1)
+    {
+        switch(opt)
+        {
+            case 'b': config.baudRate = atoi(optarg); break;
+            case 'l': config.usbLatencyUs = atoi(optarg); break;
+            case 'j': config.jitterUs = atoi(optarg); break;
+            case 'n': config.bufferRequests = 0; break;
+            case 'e': config.errorRate = atoi(optarg); break;
+            case 'r': readWindow = atoi(optarg); break;
+            case 'w': writeWindow = atoi(optarg); break;
+            case 'f': numLinks = atoi(optarg) < 1 ? 1 : atoi(optarg) > MAX_LINKS ? MAX_LINKS : atoi(optarg); break;
+            case 't': startTrace(); break;
+            case 'm': metricsFile = optarg; break;
+            case 's':
+            {
+                if(!customSizes)
+                {
+                    numSizes = 0;
+                    customSizes = 1;
+                }
+                if(numSizes < MAX_SIZES && atoi(optarg) >= 4 && atoi(optarg) <= 0x00100000 - (BENCH_ADDR & 0xFFFFF))
+                {
+                    sizes[numSizes++] = atoi(optarg);
+                }
+                break;
+            }
+            default: usage();
+        }
+    }
+    
+    // the trace ring is shared, only trace a single link
+    if(numLinks > 1 && traceEnabled)
+    {
+        printf("-t only works with a single link\n");
+        return -1;
+    }
+    
+    for(i = 0; i < numLinks; i++)
+    {
+        if(openSimDevice(&links[i].transport, &config) != 0)
+        {
+            return -1;
+        }
+        config.seed++;
+        setReadWindow(&links[i].transport, readWindow);
+        setWriteWindow(&links[i].transport, writeWindow);
+    }
+    
+    printf("Simulated DataLink: %d baud, usb latency %d us, jitter %d us, %s requests\n",
+           config.baudRate, config.usbLatencyUs, config.jitterUs, config.bufferRequests ? "buffered" : "unbuffered");
+    if(config.errorRate > 0)
+    {
+        printf("a response damaged about every %d bytes\n", config.errorRate);
+    }
+    if(numLinks > 1)
+    {
+        printf("%d DataLinks at once\n", numLinks);
+    }
+    printf("read window %d, write window %d\n\n", getReadWindow(&links[0].transport), getWriteWindow(&links[0].transport));
+    
+    for(i = 0; i < numSizes; i++)
+    {
+        failed |= runBench(links, numLinks, "read", benchRead, sizes[i]);
+        failed |= runBench(links, numLinks, "dump", benchDump, sizes[i]);
+        failed |= runBench(links, numLinks, "write", benchWrite, sizes[i]);
+        failed |= runBench(links, numLinks, "execute", benchExecute, sizes[i]);
+    }
+    
+    if(metricsFile != NULL)
+    {
+        for(i = 0; i < numLinks; i++)
+        {
+            transports[i] = &links[i].transport;
+        }
+        saveMetrics(metricsFile, transports, numLinks);
+    }
+    
+    for(i = 0; i < numLinks; i++)
+    {
+        links[i].transport.close(&links[i].transport);
+    }
+    return failed ? -1 : 0;
+}
@@ -0,0 +1,272 @@
+//
+// Link calibration. The FTDI latency timer, the usb chunk sizes and flow control decide how long
+// a small request/response packet takes to make the round trip. satlink --calibrate tries them
+// with real transfers and saves the fastest combination for the DataLink's serial number in
+// ~/.satlink_profiles, openFtdiDevice applies it from then on.
+//
+
+#include <time.h>
+#include "transport.h"
+
+#define PROFILE_FILE        ".satlink_profiles"
+#define CALIBRATE_ADDR      0x00200000  // low work RAM, read and written back unchanged
+#define CALIBRATE_SIZE      4096
+#define CALIBRATE_PINGS     16
+
+static const int latencyTimers[] = { 1, 2, 4, 8, 16, 32 };
+static const int readChunkSizes[] = { 64, 128, 256, 512, 1024, 4096 };
+static const int writeChunkSizes[] = { 64, 256, 1024, 4096 };
+static const int flowControls[] = { 0, 1 };
+
+#define COUNT(a) (sizeof(a)/sizeof(a[0]))
+
+// builds the path of the profile file into path
+// Returns 0 for success, <0 for error
+static int getProfilePath(char* path, int size)
+{
+    const char* home;
+    
+    home = getenv("HOME");
+    if(home == NULL)
+    {
+        return -1;
+    }
+    
+    snprintf(path, size, "%s/%s", home, PROFILE_FILE);
+    return 0;
+}
+
+int loadLinkProfile(const char* serial, PSAT_LINK_PROFILE profile)
+{
+    char path[1024];
+    char line[256];
+    char lineSerial[MAX_SERIAL];
+    SAT_LINK_PROFILE lineProfile;
+    FILE* file;
+    int result;
+    
+    if(getProfilePath(path, sizeof(path)) != 0)
+    {
+        return -1;
+    }
+    
+    file = fopen(path, "r");
+    if(file == NULL)
+    {
+        return -2;
+    }
+    
+    // one profile per line: serial latencyTimer readChunkSize writeChunkSize flowControl
+    result = -3;
+    while(fgets(line, sizeof(line), file) != NULL)
+    {
+        if(sscanf(line, "%63s %d %d %d %d", lineSerial, &lineProfile.latencyTimer, &lineProfile.readChunkSize,
+                  &lineProfile.writeChunkSize, &lineProfile.flowControl) == 5 && strcmp(lineSerial, serial) == 0)
+        {
+            memcpy(profile, &lineProfile, sizeof(SAT_LINK_PROFILE));
+            result = 0;
+        }
+    }
+    
+    fclose(file);
+    return result;
+}
+
+int saveLinkProfile(const char* serial, PSAT_LINK_PROFILE profile)
+{
+    char path[1024];
+    char tempPath[1040];
+    char line[256];
+    char lineSerial[MAX_SERIAL];
+    FILE* oldFile;
+    FILE* newFile;
+    
+    if(getProfilePath(path, sizeof(path)) != 0)
+    {
+        logError("saveLinkProfile: HOME isn't set!!\n");
+        return -1;
+    }
+    snprintf(tempPath, sizeof(tempPath), "%s.tmp", path);
+    
+    newFile = fopen(tempPath, "w");
+    if(newFile == NULL)
+    {
+        logError("saveLinkProfile: Failed to open %s for writing!!\n", tempPath);
+        return -2;
+    }
+    
+    // keep the profiles of every other DataLink
+    oldFile = fopen(path, "r");
+    if(oldFile != NULL)
+    {
+        while(fgets(line, sizeof(line), oldFile) != NULL)
+        {
+            if(sscanf(line, "%63s", lineSerial) == 1 && strcmp(lineSerial, serial) != 0)
+            {
+                fputs(line, newFile);
+            }
+        }
+        fclose(oldFile);
+    }
+    
+    fprintf(newFile, "%s %d %d %d %d\n", serial, profile->latencyTimer, profile->readChunkSize,
+            profile->writeChunkSize, profile->flowControl);
+    
+    if(fclose(newFile) != 0 || rename(tempPath, path) != 0)
+    {
+        logError("saveLinkProfile: Failed to write %s!!\n", path);
+        return -3;
+    }
+    
+    return 0;
+}
+
+static double getTime()
+{
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// applies profile and times small reads and a bulk read/write with it
+// the bulk data is written back to where it was read from so memory is left unchanged
+// Returns the total time taken in seconds, <0 if the link doesn't work with profile
+static double measureProfile(PSAT_TRANSPORT transport, PSAT_LINK_PROFILE profile, BYTE* buffer)
+{
+    double roundTrip;
+    double throughput;
+    double start;
+    double bulkStart;
+    double end;
+    SAT_LINK_STATE link;
+    int result;
+    int i;
+    
+    if(setFtdiProfile(transport, profile) != 0)
+    {
+        return -1;
+    }
+    transport->purge(transport);
+    
+    // errors shrink the packet size, fall back to stop-and-wait and stretch the response timeout. each
+    // profile starts from the same link state and leaves it as it was, a bad one would slow down the rest
+    memcpy(&link, &transport->link, sizeof(SAT_LINK_STATE));
+    result = 0;
+    
+    start = getTime();
+    for(i = 0; i < CALIBRATE_PINGS && result == 0; i++)
+    {
+        result = readSatMemory(transport, buffer, CALIBRATE_ADDR, 4);
+    }
+    
+    bulkStart = getTime();
+    if(result == 0)
+    {
+        result = readSatMemory(transport, buffer, CALIBRATE_ADDR, CALIBRATE_SIZE);
+    }
+    if(result == 0)
+    {
+        result = writeSatMemory(transport, CALIBRATE_ADDR, buffer, CALIBRATE_SIZE);
+    }
+    end = getTime();
+    
+    memcpy(&transport->link, &link, sizeof(SAT_LINK_STATE));
+    
+    if(result != 0)
+    {
+        transport->purge(transport);
+        logInfo("latency %2d ms, read chunk %4d, write chunk %4d, flow %-7s: failed\n", profile->latencyTimer,
+                profile->readChunkSize, profile->writeChunkSize, profile->flowControl ? "rts/cts" : "none");
+        return -1;
+    }
+    
+    roundTrip = (bulkStart - start) / CALIBRATE_PINGS;
+    throughput = 2 * CALIBRATE_SIZE / (end - bulkStart);
+    logInfo("latency %2d ms, read chunk %4d, write chunk %4d, flow %-7s: %6.2f ms per read, %6.0f bytes/s\n",
+            profile->latencyTimer, profile->readChunkSize, profile->writeChunkSize,
+            profile->flowControl ? "rts/cts" : "none", roundTrip * 1000, throughput);
+    
+    return end - start;
+}
+
+// tries every value in values for setting, leaving the fastest one in best
+// Returns the time taken by the best profile, <0 if none of them worked
+static double sweepSetting(PSAT_TRANSPORT transport, PSAT_LINK_PROFILE best, int* setting, const int* values, int numValues, BYTE* buffer)
+{
+    SAT_LINK_PROFILE trial;
+    double bestTime;
+    double time;
+    int bestValue;
+    int i;
+    
+    bestTime = -1;
+    bestValue = *setting;
+    
+    for(i = 0; i < numValues; i++)
+    {
+        *setting = values[i];
+        memcpy(&trial, best, sizeof(SAT_LINK_PROFILE));
+        
+        time = measureProfile(transport, &trial, buffer);
+        if(time >= 0 && (bestTime < 0 || time < bestTime))
+        {
+            bestTime = time;
+            bestValue = values[i];
+        }
+    }
+    
+    *setting = bestValue;
+    return bestTime;
+}
+
+int calibrateLink(PSAT_TRANSPORT transport)
+{
+    SAT_LINK_PROFILE best;
+    BYTE buffer[CALIBRATE_SIZE];
+    double time;
+    
+    if(strcmp(transport->name, "ftdi") != 0 || transport->serial[0] == '\0')
+    {
+        logError("calibrateLink: only FTDI DataLinks with a serial number can be calibrated!!\n");
+        return -1;
+    }
+    
+    logInfo("Calibrating DataLink %s\n", transport->serial);
+    
+    // start from the libftdi defaults and tune one setting at a time
+    best.latencyTimer = 16;
+    best.readChunkSize = 4096;
+    best.writeChunkSize = 4096;
+    best.flowControl = 0;
+    
+    time = sweepSetting(transport, &best, &best.latencyTimer, latencyTimers, COUNT(latencyTimers), buffer);
+    if(time >= 0)
+    {
+        time = sweepSetting(transport, &best, &best.readChunkSize, readChunkSizes, COUNT(readChunkSizes), buffer);
+    }
+    if(time >= 0)
+    {
+        time = sweepSetting(transport, &best, &best.writeChunkSize, writeChunkSizes, COUNT(writeChunkSizes), buffer);
+    }
+    if(time >= 0)
+    {
+        time = sweepSetting(transport, &best, &best.flowControl, flowControls, COUNT(flowControls), buffer);
+    }
+    
+    if(time < 0)
+    {
+        logError("calibrateLink: no setting worked, is the Saturn on?\n");
+        return -2;
+    }
+    
+    logInfo("Best profile: latency %d ms, read chunk %d, write chunk %d, flow %s\n", best.latencyTimer,
+            best.readChunkSize, best.writeChunkSize, best.flowControl ? "rts/cts" : "none");
+    
+    if(setFtdiProfile(transport, &best) != 0)
+    {
+        return -3;
+    }
+    
+    return saveLinkProfile(transport->serial, &best);
+}
@@ -0,0 +1,168 @@
+//
+// Fused copy and additive checksum.
+// Every packet is encoded or decoded by copying its payload and summing it in the same pass.
+// The widest kernel the cpu supports is picked the first time it is used.
+//
+
+#include "satlink.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS
+#endif
+
+static BYTE copyAndChecksumScalar(BYTE* dst, const BYTE* src, int length)
+{
+    unsigned int sum = 0;
+    int i;
+    
+    if(dst != NULL)
+    {
+        for(i = 0; i < length; i++)
+        {
+            dst[i] = src[i];
+            sum += src[i];
+        }
+    }
+    else
+    {
+        for(i = 0; i < length; i++)
+        {
+            sum += src[i];
+        }
+    }
+    
+    return (BYTE)sum;
+}
+
+#ifdef HAVE_X86_KERNELS
+
+// psadbw against zero adds up 8 bytes at a time into 64 bit lanes
+__attribute__((target("sse2")))
+static BYTE copyAndChecksumSse2(BYTE* dst, const BYTE* src, int length)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i sums = _mm_setzero_si128();
+    __m128i data;
+    unsigned int sum;
+    int i;
+    
+    for(i = 0; i + 16 <= length; i += 16)
+    {
+        data = _mm_loadu_si128((const __m128i*)(src + i));
+        if(dst != NULL)
+        {
+            _mm_storeu_si128((__m128i*)(dst + i), data);
+        }
+        sums = _mm_add_epi64(sums, _mm_sad_epu8(data, zero));
+    }
+    
+    sum = _mm_cvtsi128_si32(sums) + _mm_cvtsi128_si32(_mm_srli_si128(sums, 8));
+    
+    return (BYTE)(sum + copyAndChecksumScalar(dst ? dst + i : NULL, src + i, length - i));
+}
+
+// the tail is handled in here too, calling the sse2 kernel with dirty upper halves costs a transition stall
+__attribute__((target("avx2")))
+static BYTE copyAndChecksumAvx2(BYTE* dst, const BYTE* src, int length)
+{
+    __m256i zero = _mm256_setzero_si256();
+    __m256i sums = _mm256_setzero_si256();
+    __m256i data;
+    __m128i sums128;
+    __m128i data128;
+    unsigned int sum;
+    int i;
+    
+    for(i = 0; i + 32 <= length; i += 32)
+    {
+        data = _mm256_loadu_si256((const __m256i*)(src + i));
+        if(dst != NULL)
+        {
+            _mm256_storeu_si256((__m256i*)(dst + i), data);
+        }
+        sums = _mm256_add_epi64(sums, _mm256_sad_epu8(data, zero));
+    }
+    
+    sums128 = _mm_add_epi64(_mm256_castsi256_si128(sums), _mm256_extracti128_si256(sums, 1));
+    if(i + 16 <= length)
+    {
+        data128 = _mm_loadu_si128((const __m128i*)(src + i));
+        if(dst != NULL)
+        {
+            _mm_storeu_si128((__m128i*)(dst + i), data128);
+        }
+        sums128 = _mm_add_epi64(sums128, _mm_sad_epu8(data128, _mm256_castsi256_si128(zero)));
+        i += 16;
+    }
+    sum = _mm_cvtsi128_si32(sums128) + _mm_cvtsi128_si32(_mm_srli_si128(sums128, 8));
+    
+    for(; i < length; i++)
+    {
+        if(dst != NULL)
+        {
+            dst[i] = src[i];
+        }
+        sum += src[i];
+    }
+    
+    return (BYTE)sum;
+}
+
+#endif
+
+static BYTE copyAndChecksumInit(BYTE* dst, const BYTE* src, int length);
+
+static CHECKSUM_KERNEL kernel = copyAndChecksumInit;
+
+// picks the kernel on the first call
+static BYTE copyAndChecksumInit(BYTE* dst, const BYTE* src, int length)
+{
+    kernel = copyAndChecksumScalar;
+    
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))
+    {
+        kernel = copyAndChecksumAvx2;
+    }
+    else if(__builtin_cpu_supports("sse2"))
+    {
+        kernel = copyAndChecksumSse2;
+    }
+#endif
+    
+    return kernel(dst, src, length);
+}
+
+BYTE copyAndChecksum(BYTE* dst, const BYTE* src, int length)
+{
+    return kernel(dst, src, length);
+}
+
+int getChecksumKernels(const char** names, CHECKSUM_KERNEL* kernels, int max)
+{
+    int count = 0;
+    
+    if(count < max)
+    {
+        names[count] = "scalar";
+        kernels[count++] = copyAndChecksumScalar;
+    }
+    
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if(count < max && __builtin_cpu_supports("sse2"))
+    {
+        names[count] = "sse2";
+        kernels[count++] = copyAndChecksumSse2;
+    }
+    if(count < max && __builtin_cpu_supports("avx2"))
+    {
+        names[count] = "avx2";
+        kernels[count++] = copyAndChecksumAvx2;
+    }
+#endif
+    
+    return count;
+}
@@ -0,0 +1,125 @@
+//
+// Microbenchmark for the fused copy and checksum kernels
+// run with 'make bench-checksum'
+//
+
+#include <time.h>
+#include "satlink.h"
+
+#define ITERATIONS  100000
+#define MAX_KERNELS 8
+#define MISALIGNMENTS 32 // source and destination offsets the kernels are checked at, past the widest vector
+#define POISON      0xa5
+
+static volatile BYTE sink;
+
+// the byte at a time checksum loop followed by a memcpy, as the packet code did before checksum.c
+static BYTE legacyCopyAndChecksum(BYTE* dst, const BYTE* src, int length)
+{
+    BYTE checkSum = 0;
+    BYTE i;
+    
+    for(i = 0; i < length; i++)
+    {
+        checkSum += src[i];
+    }
+    memcpy(dst, src, length);
+    
+    return checkSum;
+}
+
+static double getTime()
+{
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// returns the time per call in nanoseconds
+static double timeKernel(CHECKSUM_KERNEL kernel, BYTE* dst, BYTE* src, int length)
+{
+    double start;
+    BYTE sum = 0;
+    int i;
+    
+    start = getTime();
+    for(i = 0; i < ITERATIONS; i++)
+    {
+        // vary the source so the call can't be hoisted out of the loop
+        src[0] = i;
+        sum += kernel(dst, src, length);
+    }
+    sink = sum;
+    
+    return (getTime() - start) * 1e9 / ITERATIONS;
+}
+
+int main(int argc, char **argv)
+{
+    const char* names[MAX_KERNELS];
+    CHECKSUM_KERNEL kernels[MAX_KERNELS];
+    BYTE src[MAX_PACKETLEN + 32];
+    BYTE dst[MAX_PACKETLEN + 32];
+    BYTE expected[MAX_PACKETLEN + 32];
+    BYTE checkSum;
+    int numKernels;
+    int srcOffset;
+    int dstOffset;
+    int length;
+    int i;
+    
+    numKernels = getChecksumKernels(names, kernels, MAX_KERNELS);
+    
+    // never the poison, or a byte that isn't copied could look right
+    for(i = 0; i < sizeof(src); i++)
+    {
+        src[i] = i * 31 != POISON ? i * 31 : 0;
+    }
+    
+    // every kernel has to agree with the old loop, on the checksum and on every byte it copies, before
+    // its timing means anything. both copies start out poisoned so a dropped or misplaced byte shows
+    for(srcOffset = 0; srcOffset < MISALIGNMENTS; srcOffset++)
+    {
+        for(dstOffset = 0; dstOffset < MISALIGNMENTS; dstOffset++)
+        {
+            for(length = 0; length <= MAX_PACKETLEN; length++)
+            {
+                memset(expected, POISON, sizeof(expected));
+                checkSum = legacyCopyAndChecksum(expected + dstOffset, src + srcOffset, length);
+    
+                for(i = 0; i < numKernels; i++)
+                {
+                    memset(dst, POISON, sizeof(dst));
+                    if(kernels[i](dst + dstOffset, src + srcOffset, length) != checkSum ||
+                       memcmp(dst, expected, sizeof(dst)) != 0 || kernels[i](NULL, src + srcOffset, length) != checkSum)
+                    {
+                        printf("%s kernel is wrong for %d bytes from offset %d to offset %d!!\n", names[i], length,
+                               srcOffset, dstOffset);
+                        return -1;
+                    }
+                }
+            }
+        }
+    }
+    
+    printf("ns per packet, copy plus checksum\n");
+    printf("%6s %8s", "bytes", "legacy");
+    for(i = 0; i < numKernels; i++)
+    {
+        printf(" %8s", names[i]);
+    }
+    printf("\n");
+    
+    for(length = 1; length <= MAX_PACKETLEN; length++)
+    {
+        printf("%6d %8.1f", length, timeKernel(legacyCopyAndChecksum, dst, src, length));
+        for(i = 0; i < numKernels; i++)
+        {
+            printf(" %8.1f", timeKernel(kernels[i], dst, src, length));
+        }
+        printf("\n");
+    }
+    
+    return 0;
+}
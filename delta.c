@@ -0,0 +1,298 @@
+//
+// Delta uploads. After every successful upload the image is kept in ~/.satlink_shadow under the
+// DataLink's serial number and the load address. satlink --delta compares the next image with it a
+// packet at a time and only sends the packets that changed, so rebuilding one function doesn't
+// re-upload the whole binary.
+//
+
+#include <sys/stat.h>
+#include <dirent.h>
+#include "transport.h"
+
+#define SHADOW_DIR          ".satlink_shadow"
+#define DELTA_GAP_PACKETS   1 // unchanged packets between two changed ranges that are sent anyway to keep the pipeline full
+
+// builds the path of the shadow copy for serial and address into path
+// Returns 0 for success, <0 for error
+static int getShadowPath(const char* serial, DWORD address, char* path, int size)
+{
+    const char* home;
+    
+    home = getenv("HOME");
+    if(home == NULL)
+    {
+        return -1;
+    }
+    
+    snprintf(path, size, "%s/%s/%s_%08x.bin", home, SHADOW_DIR, serial, address);
+    return 0;
+}
+
+int loadShadow(const char* serial, DWORD address, BYTE** shadow, DWORD* numBytes)
+{
+    char path[1024];
+    struct stat status;
+    FILE* file;
+    BYTE* buffer;
+    
+    if(getShadowPath(serial, address, path, sizeof(path)) != 0)
+    {
+        return -1;
+    }
+    
+    file = fopen(path, "r");
+    if(file == NULL)
+    {
+        return -2;
+    }
+    
+    if(fstat(fileno(file), &status) != 0 || status.st_size == 0)
+    {
+        fclose(file);
+        return -3;
+    }
+    
+    buffer = malloc(status.st_size);
+    if(buffer == NULL)
+    {
+        fclose(file);
+        return -4;
+    }
+    
+    if(fread(buffer, 1, status.st_size, file) != status.st_size)
+    {
+        free(buffer);
+        fclose(file);
+        return -5;
+    }
+    
+    fclose(file);
+    *shadow = buffer;
+    *numBytes = status.st_size;
+    return 0;
+}
+
+int saveShadow(const char* serial, DWORD address, BYTE* image, DWORD numBytes)
+{
+    char path[1024];
+    char tempPath[1040];
+    char* home;
+    FILE* file;
+    
+    home = getenv("HOME");
+    if(home == NULL || getShadowPath(serial, address, path, sizeof(path)) != 0)
+    {
+        logError("saveShadow: HOME isn't set!!\n");
+        return -1;
+    }
+    
+    snprintf(tempPath, sizeof(tempPath), "%s/%s", home, SHADOW_DIR);
+    mkdir(tempPath, 0755);
+    snprintf(tempPath, sizeof(tempPath), "%s.tmp", path);
+    
+    file = fopen(tempPath, "w");
+    if(file == NULL)
+    {
+        logError("saveShadow: Failed to open %s for writing!!\n", tempPath);
+        return -2;
+    }
+    
+    if(fwrite(image, 1, numBytes, file) != numBytes || fclose(file) != 0 || rename(tempPath, path) != 0)
+    {
+        logError("saveShadow: Failed to write %s!!\n", path);
+        unlink(tempPath);
+        return -3;
+    }
+    
+    return 0;
+}
+
+void dropShadow(const char* serial, DWORD address, DWORD numBytes)
+{
+    char path[1024];
+    char prefix[MAX_SERIAL + 2];
+    struct dirent* entry;
+    struct stat status;
+    unsigned int shadowAddress;
+    const char* home;
+    DIR* dir;
+    int prefixLength;
+    int end;
+    
+    home = getenv("HOME");
+    if(home == NULL)
+    {
+        return;
+    }
+    
+    snprintf(path, sizeof(path), "%s/%s", home, SHADOW_DIR);
+    dir = opendir(path);
+    if(dir == NULL)
+    {
+        return;
+    }
+    
+    // a shadow is named after its address and is as long as the upload it keeps, a write anywhere
+    // inside it makes it stale, not just one to the same address
+    prefixLength = snprintf(prefix, sizeof(prefix), "%s_", serial);
+    while((entry = readdir(dir)) != NULL)
+    {
+        end = -1;
+        if(strncmp(entry->d_name, prefix, prefixLength) != 0 ||
+           sscanf(entry->d_name + prefixLength, "%8x.bin%n", &shadowAddress, &end) != 1 ||
+           end != 12 || entry->d_name[prefixLength + end] != '\0')
+        {
+            continue;
+        }
+    
+        snprintf(path, sizeof(path), "%s/%s/%s", home, SHADOW_DIR, entry->d_name);
+        if(stat(path, &status) == 0 && shadowAddress < (unsigned long long)address + numBytes &&
+           address < (unsigned long long)shadowAddress + status.st_size)
+        {
+            unlink(path);
+        }
+    }
+    
+    closedir(dir);
+}
+
+// returns 1 if the packet at offset of image is different on the device
+static int packetChanged(BYTE* image, DWORD numBytes, BYTE* shadow, DWORD shadowBytes, DWORD offset)
+{
+    DWORD length;
+    
+    length = numBytes - offset;
+    if(length > MAX_DATALEN)
+    {
+        length = MAX_DATALEN;
+    }
+    
+    // anything past the end of the last upload has to be sent
+    if(offset + length > shadowBytes)
+    {
+        return 1;
+    }
+    
+    return memcmp(image + offset, shadow + offset, length) != 0;
+}
+
+int writeSatMemoryDelta(PSAT_TRANSPORT transport, DWORD address, BYTE* image, DWORD numBytes,
+                        BYTE* shadow, DWORD shadowBytes, BYTE execute, DWORD* bytesSent)
+{
+    DWORD rangeStart;
+    DWORD rangeEnd;
+    DWORD offset;
+    DWORD first;
+    DWORD gap;
+    int result;
+    
+    *bytesSent = 0;
+    
+    // validate numBytes
+    if(numBytes == 0)
+    {
+        logError("writeSatMemoryDelta: numBytes must be greater than zero.\n");
+        return -1;
+    }
+    
+    // the first packet is sent with WRITE_EXECUTE at the end, so it isn't part of the diff
+    first = execute ? MAX_DATALEN : 0;
+    
+    // nothing changed past the first packet, skip the compare loop
+    if(first < numBytes && numBytes <= shadowBytes && memcmp(image + first, shadow + first, numBytes - first) == 0)
+    {
+        first = numBytes;
+    }
+    
+    // walk the image a packet at a time so the changed ranges line up with MAX_DATALEN boundaries.
+    // ranges that are only a few unchanged packets apart are sent as one
+    offset = first;
+    while(offset < numBytes)
+    {
+        if(!packetChanged(image, numBytes, shadow, shadowBytes, offset))
+        {
+            offset += MAX_DATALEN;
+            continue;
+        }
+    
+        rangeStart = offset;
+        rangeEnd = offset;
+        gap = 0;
+        while(offset < numBytes && gap <= DELTA_GAP_PACKETS)
+        {
+            if(packetChanged(image, numBytes, shadow, shadowBytes, offset))
+            {
+                gap = 0;
+                rangeEnd = offset + MAX_DATALEN;
+            }
+            else
+            {
+                gap++;
+            }
+            offset += MAX_DATALEN;
+        }
+    
+        if(rangeEnd > numBytes)
+        {
+            rangeEnd = numBytes;
+        }
+    
+        result = writeSatMemory(transport, address + rangeStart, image + rangeStart, rangeEnd - rangeStart);
+        if(result != 0)
+        {
+            logError("writeSatMemoryDelta: failed to write 0x%x bytes at 0x%x!!\n", rangeEnd - rangeStart, address + rangeStart);
+            return result;
+        }
+        *bytesSent += rangeEnd - rangeStart;
+    }
+    
+    if(execute)
+    {
+        result = executeSatMemory(transport, address, image, numBytes < MAX_DATALEN ? numBytes : MAX_DATALEN);
+        if(result != 0)
+        {
+            return result;
+        }
+        *bytesSent += numBytes < MAX_DATALEN ? numBytes : MAX_DATALEN;
+    }
+    
+    return 0;
+}
+
+int uploadImage(PSAT_TRANSPORT transport, DWORD address, BYTE* image, DWORD numBytes, BYTE execute, BYTE delta, DWORD* bytesSent)
+{
+    BYTE* shadow;
+    DWORD shadowBytes;
+    int result;
+    
+    // the device memory is unknown until the upload is done
+    shadow = NULL;
+    shadowBytes = 0;
+    if(delta && loadShadow(transport->serial, address, &shadow, &shadowBytes) != 0)
+    {
+        logInfo("No earlier upload to 0x%x, sending the whole file\n", address);
+    }
+    dropShadow(transport->serial, address, numBytes);
+    
+    *bytesSent = numBytes;
+    if(shadow != NULL)
+    {
+        result = writeSatMemoryDelta(transport, address, image, numBytes, shadow, shadowBytes, execute, bytesSent);
+        free(shadow);
+    }
+    else if(execute)
+    {
+        result = writeSatMemoryAndExecute(transport, address, image, numBytes);
+    }
+    else
+    {
+        result = writeSatMemory(transport, address, image, numBytes);
+    }
+    if(result != 0)
+    {
+        return result;
+    }
+    
+    saveShadow(transport->serial, address, image, numBytes);
+    return 0;
+}
@@ -0,0 +1,735 @@
+//
+// GDB remote serial protocol bridge. satlink --gdb-server 2345 listens on localhost for gdb
+// ('target remote :2345' in sh-elf-gdb) and answers its memory requests over the DataLink, so the
+// memory of a running Saturn can be looked at with symbols. gdb reads a few bytes at a time, a word
+// for a variable, a few more for every frame of a backtrace, and a DataLink read costs a
+// READ_START..READ_END sequence however small it is. So reads go through a cache of MAX_DATALEN byte
+// blocks, aligned to MAX_DATALEN, and a miss reads GDB_READ_AHEAD blocks past what was asked for in
+// the same sequence. Writes go straight to the DataLink and drop the blocks they touch, continuing or
+// stepping drops the whole cache.
+//
+// The DataLink can only read, write and jump, it can't stop the SH-2 or see its registers. So the
+// Saturn keeps running the whole time, registers are reported as unavailable, breakpoints are refused
+// rather than written into the program, and c and s report a stop straight away.
+//
+
+#define _GNU_SOURCE
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <signal.h>
+#include <errno.h>
+#include "transport.h"
+#include "satlinkd.h"
+
+#define GDB_PACKET_SIZE     16384   // largest packet we take or send, told to gdb in qSupported
+#define GDB_CACHE_BLOCKS    512     // blocks of MAX_DATALEN bytes in the cache, direct mapped
+#define GDB_READ_AHEAD      4       // blocks read after the ones a miss needs
+#define GDB_MAX_BLOCK       (0xFFFFFFFF / MAX_DATALEN - 1) // last whole block below 4GB
+#define GDB_INTERRUPT       -100    // gdb sent a ^C
+
+// a cached block of MAX_DATALEN bytes
+typedef struct _GDB_BLOCK
+{
+    DWORD number;       // address / MAX_DATALEN
+    int valid;
+    BYTE data[MAX_DATALEN];
+} GDB_BLOCK, *PGDB_BLOCK;
+
+// a gdb connection
+typedef struct _GDB_SESSION
+{
+    PSAT_TRANSPORT transport;
+    int daemonSocket;   // -1 to use transport
+    int sock;
+    int noAck;          // QStartNoAckMode was agreed, packets are no longer acknowledged
+    BYTE input[4096];   // received but not yet parsed
+    int inputLength;
+    int inputOffset;
+    PGDB_BLOCK cache;
+    DWORD requests;     // memory reads gdb asked for
+    DWORD hits;         // of which were answered from the cache
+    DWORD linkReads;    // reads sent over the DataLink
+    DWORD writes;
+} GDB_SESSION, *PGDB_SESSION;
+
+static volatile sig_atomic_t gdbStopping = 0;
+
+static void handleGdbSignal(int sig)
+{
+    gdbStopping = 1;
+}
+
+// returns the next byte from gdb, <0 if the connection was closed or Ctrl-C was pressed
+static int readGdbByte(PGDB_SESSION session)
+{
+    ssize_t length;
+    
+    if(session->inputOffset == session->inputLength)
+    {
+        do
+        {
+            length = recv(session->sock, session->input, sizeof(session->input), 0);
+        } while(length < 0 && errno == EINTR && !gdbStopping);
+    
+        if(length <= 0)
+        {
+            return -1;
+        }
+        session->inputLength = length;
+        session->inputOffset = 0;
+    }
+    
+    return session->input[session->inputOffset++];
+}
+
+static int sendGdbBytes(PGDB_SESSION session, const char* data, int length)
+{
+    ssize_t sent;
+    
+    while(length > 0)
+    {
+        sent = send(session->sock, data, length, MSG_NOSIGNAL);
+        if(sent < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if(sent <= 0)
+        {
+            return -1;
+        }
+        data += sent;
+        length -= sent;
+    }
+    
+    return 0;
+}
+
+static int hexValue(int c)
+{
+    if(c >= '0' && c <= '9')
+    {
+        return c - '0';
+    }
+    if(c >= 'a' && c <= 'f')
+    {
+        return c - 'a' + 10;
+    }
+    if(c >= 'A' && c <= 'F')
+    {
+        return c - 'A' + 10;
+    }
+    
+    return -1;
+}
+
+// receives the next $packet#xx into packet, unescaped and terminated, and acknowledges it
+// Returns the length of the packet, GDB_INTERRUPT for a ^C, <0 if the connection was closed
+static int recvGdbPacket(PGDB_SESSION session, char* packet, int size)
+{
+    BYTE checksum;
+    int length;
+    int high;
+    int low;
+    int c;
+    
+    for(;;)
+    {
+        // acknowledgements of our packets and anything else between packets is skipped
+        c = readGdbByte(session);
+        if(c < 0)
+        {
+            return -1;
+        }
+        if(c == 0x03)
+        {
+            return GDB_INTERRUPT;
+        }
+        if(c != '$')
+        {
+            continue;
+        }
+    
+        checksum = 0;
+        length = 0;
+        while((c = readGdbByte(session)) >= 0 && c != '#')
+        {
+            checksum += c;
+    
+            // binary data escapes }, #, $ and * as } followed by the byte xor 0x20
+            if(c == '}')
+            {
+                c = readGdbByte(session);
+                if(c < 0)
+                {
+                    return -1;
+                }
+                checksum += c;
+                c ^= 0x20;
+            }
+            if(length < size - 1)
+            {
+                packet[length++] = c;
+            }
+        }
+    
+        high = hexValue(readGdbByte(session));
+        low = hexValue(readGdbByte(session));
+        if(c < 0)
+        {
+            return -1;
+        }
+        packet[length] = '\0';
+    
+        if(session->noAck)
+        {
+            return length;
+        }
+        if(high < 0 || low < 0 || ((high << 4) | low) != checksum)
+        {
+            logWarn("gdb: bad checksum, asking for the packet again\n");
+            sendGdbBytes(session, "-", 1);
+            continue;
+        }
+    
+        sendGdbBytes(session, "+", 1);
+        return length;
+    }
+}
+
+// sends data as a $packet#xx
+// Returns 0 for success, <0 for error
+static int sendGdbPacket(PGDB_SESSION session, const char* data)
+{
+    static const char hex[] = "0123456789abcdef";
+    char* frame;
+    BYTE checksum;
+    int length;
+    int result;
+    int c;
+    int i;
+    
+    c = 0;
+    length = strlen(data);
+    frame = malloc(length + 4);
+    if(frame == NULL)
+    {
+        return -1;
+    }
+    
+    checksum = 0;
+    frame[0] = '$';
+    for(i = 0; i < length; i++)
+    {
+        frame[i + 1] = data[i];
+        checksum += data[i];
+    }
+    frame[length + 1] = '#';
+    frame[length + 2] = hex[checksum >> 4];
+    frame[length + 3] = hex[checksum & 0xf];
+    
+    // gdb answers with - if the packet got damaged on the way
+    do
+    {
+        result = sendGdbBytes(session, frame, length + 4);
+        if(result != 0 || session->noAck)
+        {
+            break;
+        }
+        c = readGdbByte(session);
+    } while(c == '-');
+    
+    free(frame);
+    return result;
+}
+
+// drops every cached block
+static void invalidateGdbCache(PGDB_SESSION session)
+{
+    int i;
+    
+    for(i = 0; i < GDB_CACHE_BLOCKS; i++)
+    {
+        session->cache[i].valid = 0;
+    }
+}
+
+// returns the cache slot of block number
+static PGDB_BLOCK getGdbBlock(PGDB_SESSION session, DWORD number)
+{
+    return &session->cache[number % GDB_CACHE_BLOCKS];
+}
+
+static int isGdbBlockCached(PGDB_SESSION session, DWORD number)
+{
+    PGDB_BLOCK block = getGdbBlock(session, number);
+    
+    return block->valid && block->number == number;
+}
+
+// reads length bytes at address into buffer over the DataLink, without the cache
+// Returns 0 for success, <0 for error
+static int readGdbMemoryDirect(PGDB_SESSION session, DWORD address, BYTE* buffer, DWORD length)
+{
+    BYTE padded[4];
+    int result;
+    
+    session->linkReads++;
+    
+    // reads are atleast 4 bytes
+    if(length < 4)
+    {
+        result = readSatMemoryVia(session->transport, session->daemonSocket, padded, address, 4);
+        memcpy(buffer, padded, length);
+        return result;
+    }
+    
+    return readSatMemoryVia(session->transport, session->daemonSocket, buffer, address, length);
+}
+
+// reads length bytes at address into buffer, from the cache where it can. the blocks that are missing
+// are read in one sequence together with the GDB_READ_AHEAD blocks after them
+// Returns 0 for success, <0 for error
+static int readGdbMemory(PGDB_SESSION session, DWORD address, BYTE* buffer, DWORD length)
+{
+    PGDB_BLOCK block;
+    BYTE* data;
+    DWORD first;
+    DWORD last;
+    DWORD number;
+    DWORD offset;
+    DWORD count;
+    int result;
+    
+    session->requests++;
+    
+    first = address / MAX_DATALEN;
+    last = (DWORD)(((unsigned long long)address + length - 1) / MAX_DATALEN);
+    if(last > GDB_MAX_BLOCK)
+    {
+        // the top of the address space is read as asked
+        return readGdbMemoryDirect(session, address, buffer, length);
+    }
+    
+    while(first <= last && isGdbBlockCached(session, first))
+    {
+        first++;
+    }
+    while(last >= first && isGdbBlockCached(session, last))
+    {
+        last--;
+    }
+    
+    if(first > last)
+    {
+        session->hits++;
+    }
+    else
+    {
+        last = last + GDB_READ_AHEAD > GDB_MAX_BLOCK ? GDB_MAX_BLOCK : last + GDB_READ_AHEAD;
+        data = malloc((last - first + 1) * MAX_DATALEN);
+        if(data == NULL)
+        {
+            return -1;
+        }
+    
+        session->linkReads++;
+        result = readSatMemoryVia(session->transport, session->daemonSocket, data, first * MAX_DATALEN, (last - first + 1) * MAX_DATALEN);
+        if(result != 0)
+        {
+            // the blocks may run off the end of a memory region, fall back to just what was asked for
+            free(data);
+            logDebug("gdb: reading blocks 0x%x-0x%x failed, reading 0x%x bytes at 0x%x\n", first * MAX_DATALEN,
+                     (last + 1) * MAX_DATALEN - 1, length, address);
+            return readGdbMemoryDirect(session, address, buffer, length);
+        }
+    
+        for(number = first; number <= last; number++)
+        {
+            block = getGdbBlock(session, number);
+            memcpy(block->data, data + (number - first) * MAX_DATALEN, MAX_DATALEN);
+            block->number = number;
+            block->valid = 1;
+        }
+        free(data);
+    }
+    
+    // every block is cached now
+    while(length > 0)
+    {
+        block = getGdbBlock(session, address / MAX_DATALEN);
+        offset = address % MAX_DATALEN;
+        count = MAX_DATALEN - offset < length ? MAX_DATALEN - offset : length;
+        memcpy(buffer, block->data + offset, count);
+        buffer += count;
+        address += count;
+        length -= count;
+    }
+    
+    return 0;
+}
+
+// writes length bytes of buffer to address and drops the blocks it touched
+// Returns 0 for success, <0 for error
+static int writeGdbMemory(PGDB_SESSION session, DWORD address, BYTE* buffer, DWORD length)
+{
+    PGDB_BLOCK block;
+    DWORD number;
+    
+    // gdb probes for X support with an empty write
+    if(length == 0)
+    {
+        return 0;
+    }
+    
+    for(number = address / MAX_DATALEN; number <= ((unsigned long long)address + length - 1) / MAX_DATALEN; number++)
+    {
+        block = getGdbBlock(session, number);
+        if(block->number == number)
+        {
+            block->valid = 0;
+        }
+    }
+    
+    session->writes++;
+    return writeSatMemoryVia(session->transport, session->daemonSocket, address, buffer, length, 0);
+}
+
+// parses "addr,length" at the start of args, *end is set to the character after it
+// Returns 0 for success, <0 if it isn't there
+static int parseGdbRange(char* args, DWORD* address, DWORD* length, char** end)
+{
+    *address = strtoul(args, end, 16);
+    if(**end != ',')
+    {
+        return -1;
+    }
+    
+    *length = strtoul(*end + 1, end, 16);
+    return 0;
+}
+
+// answers one packet, reply has room for GDB_PACKET_SIZE characters
+// Returns 0 to carry on, 1 if gdb is done with the session, <0 for error
+static int handleGdbPacket(PGDB_SESSION session, char* packet, int packetLength, char* reply)
+{
+    static const char hex[] = "0123456789abcdef";
+    BYTE* data;
+    DWORD address;
+    DWORD length;
+    DWORD i;
+    char* end;
+    int result;
+    
+    reply[0] = '\0';
+    switch(packet[0])
+    {
+        case '?':
+        {
+            // the Saturn never stops, to gdb it looks stopped with a SIGTRAP
+            strcpy(reply, "S05");
+            break;
+        }
+    
+        case 'g':
+        {
+            // one unavailable register, gdb takes the rest as unavailable too
+            strcpy(reply, "xxxxxxxx");
+            break;
+        }
+    
+        case 'p':
+        {
+            strcpy(reply, "xxxxxxxx");
+            break;
+        }
+    
+        case 'G':
+        case 'P':
+        {
+            strcpy(reply, "E01");
+            break;
+        }
+    
+        case 'm':
+        {
+            // m addr,length
+            if(parseGdbRange(packet + 1, &address, &length, &end) != 0)
+            {
+                strcpy(reply, "E01");
+                break;
+            }
+    
+            // a shorter reply is fine, gdb asks for the rest
+            if(length > (GDB_PACKET_SIZE - 1) / 2)
+            {
+                length = (GDB_PACKET_SIZE - 1) / 2;
+            }
+            data = malloc(length ? length : 1);
+            if(data == NULL)
+            {
+                strcpy(reply, "E02");
+                break;
+            }
+    
+            result = length ? readGdbMemory(session, address, data, length) : 0;
+            if(result != 0)
+            {
+                logWarn("gdb: failed to read 0x%x bytes at 0x%x\n", length, address);
+                strcpy(reply, "E03");
+                free(data);
+                break;
+            }
+    
+            for(i = 0; i < length; i++)
+            {
+                reply[i * 2] = hex[data[i] >> 4];
+                reply[i * 2 + 1] = hex[data[i] & 0xf];
+            }
+            reply[length * 2] = '\0';
+            free(data);
+            break;
+        }
+    
+        case 'M':
+        case 'X':
+        {
+            // M addr,length:hex bytes, X addr,length:binary bytes
+            if(parseGdbRange(packet + 1, &address, &length, &end) != 0 || *end != ':')
+            {
+                strcpy(reply, "E01");
+                break;
+            }
+            end++;
+    
+            if(packet[0] == 'M')
+            {
+                if(strlen(end) < length * 2)
+                {
+                    strcpy(reply, "E01");
+                    break;
+                }
+                for(i = 0; i < length; i++)
+                {
+                    end[i] = (hexValue(end[i * 2]) << 4) | hexValue(end[i * 2 + 1]);
+                }
+            }
+            else if(end + length > packet + packetLength)
+            {
+                strcpy(reply, "E01");
+                break;
+            }
+    
+            result = writeGdbMemory(session, address, (BYTE*)end, length);
+            if(result != 0)
+            {
+                logWarn("gdb: failed to write 0x%x bytes at 0x%x\n", length, address);
+                strcpy(reply, "E03");
+                break;
+            }
+            strcpy(reply, "OK");
+            break;
+        }
+    
+        case 'c':
+        case 's':
+        {
+            // the Saturn has been running all along, whatever was cached is old by now
+            invalidateGdbCache(session);
+            strcpy(reply, "S05");
+            break;
+        }
+    
+        case 'Z':
+        case 'z':
+        {
+            // refused, otherwise gdb would write trap instructions into the running program
+            strcpy(reply, "E01");
+            break;
+        }
+    
+        case 'H':
+        {
+            strcpy(reply, "OK");
+            break;
+        }
+    
+        case 'q':
+        {
+            if(strncmp(packet, "qSupported", 10) == 0)
+            {
+                sprintf(reply, "PacketSize=%x;QStartNoAckMode+", GDB_PACKET_SIZE);
+            }
+            else if(strcmp(packet, "qAttached") == 0)
+            {
+                strcpy(reply, "1");
+            }
+            break;
+        }
+    
+        case 'Q':
+        {
+            if(strcmp(packet, "QStartNoAckMode") == 0)
+            {
+                // the OK still goes out acknowledged
+                result = sendGdbPacket(session, "OK");
+                session->noAck = 1;
+                return result;
+            }
+            break;
+        }
+    
+        case 'D':
+        {
+            sendGdbPacket(session, "OK");
+            return 1;
+        }
+    
+        case 'k':
+        {
+            return 1;
+        }
+    
+        default:
+        {
+            // an empty reply tells gdb we don't support the packet
+            break;
+        }
+    }
+    
+    return sendGdbPacket(session, reply);
+}
+
+// answers the packets of one gdb connection until it detaches or goes away
+static void serveGdbSession(PGDB_SESSION session)
+{
+    char* packet;
+    char* reply;
+    int length;
+    int result;
+    
+    packet = malloc(GDB_PACKET_SIZE);
+    reply = malloc(GDB_PACKET_SIZE);
+    if(packet == NULL || reply == NULL)
+    {
+        free(packet);
+        free(reply);
+        return;
+    }
+    
+    while(!gdbStopping)
+    {
+        length = recvGdbPacket(session, packet, GDB_PACKET_SIZE);
+        if(length == GDB_INTERRUPT)
+        {
+            // there is nothing to stop, the answer is the same as for ?
+            invalidateGdbCache(session);
+            result = sendGdbPacket(session, "S05");
+        }
+        else if(length < 0)
+        {
+            break;
+        }
+        else
+        {
+            logDebug("gdb: %s\n", packet);
+            result = handleGdbPacket(session, packet, length, reply);
+        }
+        if(result != 0)
+        {
+            break;
+        }
+    }
+    
+    free(packet);
+    free(reply);
+}
+
+int serveGdb(PSAT_TRANSPORT transport, int daemonSocket, int port)
+{
+    struct sockaddr_in address;
+    struct sigaction action;
+    struct sigaction oldAction;
+    GDB_SESSION session;
+    int listener;
+    int sock;
+    int on;
+    
+    listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(listener < 0)
+    {
+        printf("Failed to create the gdb socket!!\n");
+        return -1;
+    }
+    
+    // only gdb on this machine can connect, the DataLink has no access control of its own
+    on = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(bind(listener, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(listener, 1) != 0)
+    {
+        printf("Failed to listen on localhost:%d (%s)!!\n", port, strerror(errno));
+        close(listener);
+        return -2;
+    }
+    
+    memset(&session, 0, sizeof(session));
+    session.transport = transport;
+    session.daemonSocket = daemonSocket;
+    session.cache = calloc(GDB_CACHE_BLOCKS, sizeof(GDB_BLOCK));
+    if(session.cache == NULL)
+    {
+        close(listener);
+        return -3;
+    }
+    
+    // Ctrl-C stops the server, accept and recv return with EINTR
+    gdbStopping = 0;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handleGdbSignal;
+    sigaction(SIGINT, &action, &oldAction);
+    
+    printf("Waiting for gdb on localhost:%d ('target remote :%d'), Ctrl-C stops\n", port, port);
+    while(!gdbStopping)
+    {
+        sock = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+        if(sock < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            printf("Failed to accept a gdb connection (%s)!!\n", strerror(errno));
+            break;
+        }
+    
+        // replies are single small writes, waiting to fill a segment only adds latency
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    
+        printf("gdb connected\n");
+        session.sock = sock;
+        session.noAck = 0;
+        session.inputLength = 0;
+        session.inputOffset = 0;
+        session.requests = 0;
+        session.hits = 0;
+        session.linkReads = 0;
+        session.writes = 0;
+        invalidateGdbCache(&session);
+    
+        serveGdbSession(&session);
+        close(sock);
+    
+        printf("gdb disconnected. %u reads, %u from the cache, %u DataLink reads, %u writes\n",
+               session.requests, session.hits, session.linkReads, session.writes);
+    }
+    
+    sigaction(SIGINT, &oldAction, NULL);
+    free(session.cache);
+    close(listener);
+    return 0;
+}
@@ -0,0 +1,201 @@
+//
+// CRC32 and SHA-1 of a stream of bytes
+//
+
+#include <pthread.h>
+#include "stream.h"
+
+static DWORD crcTable[256];
+static pthread_once_t crcTableOnce = PTHREAD_ONCE_INIT; // the fleet workers start hashing at the same time
+
+static void initCrcTable()
+{
+    DWORD crc;
+    int i;
+    int j;
+    
+    for(i = 0; i < 256; i++)
+    {
+        crc = i;
+        for(j = 0; j < 8; j++)
+        {
+            crc = (crc & 1) ? 0xEDB88320 ^ (crc >> 1) : crc >> 1;
+        }
+        crcTable[i] = crc;
+    }
+}
+
+#define ROL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+static void sha1Block(DWORD* state, const BYTE* block)
+{
+    DWORD w[80];
+    DWORD a, b, c, d, e, f, k, temp;
+    int i;
+    
+    for(i = 0; i < 16; i++)
+    {
+        w[i] = (block[i*4] << 24) | (block[i*4+1] << 16) | (block[i*4+2] << 8) | block[i*4+3];
+    }
+    for(i = 16; i < 80; i++)
+    {
+        w[i] = ROL(w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16], 1);
+    }
+    
+    a = state[0];
+    b = state[1];
+    c = state[2];
+    d = state[3];
+    e = state[4];
+    
+    for(i = 0; i < 80; i++)
+    {
+        if(i < 20)
+        {
+            f = (b & c) | (~b & d);
+            k = 0x5A827999;
+        }
+        else if(i < 40)
+        {
+            f = b ^ c ^ d;
+            k = 0x6ED9EBA1;
+        }
+        else if(i < 60)
+        {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8F1BBCDC;
+        }
+        else
+        {
+            f = b ^ c ^ d;
+            k = 0xCA62C1D6;
+        }
+        
+        temp = ROL(a, 5) + f + e + k + w[i];
+        e = d;
+        d = c;
+        c = ROL(b, 30);
+        b = a;
+        a = temp;
+    }
+    
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+}
+
+void initHash(PSAT_HASH hash, int type)
+{
+    memset(hash, 0, sizeof(SAT_HASH));
+    hash->type = type;
+    hash->crc = 0xFFFFFFFF;
+    hash->sha1[0] = 0x67452301;
+    hash->sha1[1] = 0xEFCDAB89;
+    hash->sha1[2] = 0x98BADCFE;
+    hash->sha1[3] = 0x10325476;
+    hash->sha1[4] = 0xC3D2E1F0;
+    
+    if(type == HASH_CRC32)
+    {
+        pthread_once(&crcTableOnce, initCrcTable);
+    }
+}
+
+void updateHash(PSAT_HASH hash, const BYTE* data, DWORD length)
+{
+    DWORD crc;
+    DWORD i;
+    int n;
+    
+    hash->length += length;
+    
+    if(hash->type == HASH_CRC32)
+    {
+        crc = hash->crc;
+        for(i = 0; i < length; i++)
+        {
+            crc = crcTable[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+        }
+        hash->crc = crc;
+    }
+    else if(hash->type == HASH_SHA1)
+    {
+        while(length)
+        {
+            if(hash->blockLength == 0 && length >= 64)
+            {
+                sha1Block(hash->sha1, data);
+                data += 64;
+                length -= 64;
+                continue;
+            }
+            
+            n = 64 - hash->blockLength;
+            if(n > length)
+            {
+                n = length;
+            }
+            memcpy(hash->block + hash->blockLength, data, n);
+            hash->blockLength += n;
+            data += n;
+            length -= n;
+            
+            if(hash->blockLength == 64)
+            {
+                sha1Block(hash->sha1, hash->block);
+                hash->blockLength = 0;
+            }
+        }
+    }
+}
+
+void finishHash(PSAT_HASH hash, char* hex)
+{
+    unsigned long long bits;
+    int i;
+    
+    if(hash->type == HASH_CRC32)
+    {
+        sprintf(hex, "%08x", hash->crc ^ 0xFFFFFFFF);
+    }
+    else if(hash->type == HASH_SHA1)
+    {
+        // pad with 0x80, zeros and the length in bits
+        bits = hash->length * 8;
+        hash->block[hash->blockLength++] = 0x80;
+        if(hash->blockLength > 56)
+        {
+            memset(hash->block + hash->blockLength, 0, 64 - hash->blockLength);
+            sha1Block(hash->sha1, hash->block);
+            hash->blockLength = 0;
+        }
+        memset(hash->block + hash->blockLength, 0, 56 - hash->blockLength);
+        for(i = 0; i < 8; i++)
+        {
+            hash->block[63 - i] = (BYTE)(bits >> (i * 8));
+        }
+        sha1Block(hash->sha1, hash->block);
+        
+        for(i = 0; i < 5; i++)
+        {
+            sprintf(hex + i * 8, "%08x", hash->sha1[i]);
+        }
+    }
+    else
+    {
+        hex[0] = '\0';
+    }
+}
+
+const char* getHashName(int type)
+{
+    switch(type)
+    {
+        case HASH_CRC32: return "CRC32";
+        case HASH_SHA1: return "SHA-1";
+    }
+    
+    return "none";
+}
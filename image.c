@@ -0,0 +1,612 @@
+//
+// ELF, S-record and Intel HEX loaders. see image.h
+//
+// ELF files are used in place, every PT_LOAD segment with bytes in the file becomes a segment at its
+// physical address (where objcopy -O binary would put it), the BSS part past p_filesz is left alone.
+// The records of the text formats are decoded into one buffer, then joined into segments where they
+// touch. Where two records overlap the one further down the file wins.
+//
+
+#include <elf.h>
+#include <ctype.h>
+#include "image.h"
+
+// decoded bytes of one S-record or HEX data record
+typedef struct _IMAGE_RECORD
+{
+    DWORD address;
+    DWORD length;
+    DWORD offset;       // of the data in the decode buffer
+    int index;          // order in the file, later records win
+} IMAGE_RECORD, *PIMAGE_RECORD;
+
+// records of a text image as they are decoded
+typedef struct _RECORD_LIST
+{
+    PIMAGE_RECORD records;
+    int count;
+    int max;
+    BYTE* data;
+    DWORD dataLength;
+    DWORD dataMax;
+} RECORD_LIST, *PRECORD_LIST;
+
+static const char* formatNames[] = { "binary", "ELF", "S-record", "Intel HEX" };
+
+int getImageFormat(const BYTE* data, DWORD size)
+{
+    if(size >= SELFMAG && memcmp(data, ELFMAG, SELFMAG) == 0)
+    {
+        return IMAGE_ELF;
+    }
+    
+    if(size >= 2 && data[0] == 'S' && data[1] >= '0' && data[1] <= '9')
+    {
+        return IMAGE_SREC;
+    }
+    
+    if(size >= 1 && data[0] == ':')
+    {
+        return IMAGE_IHEX;
+    }
+    
+    return IMAGE_BIN;
+}
+
+const char* getImageFormatName(int format)
+{
+    return format >= IMAGE_BIN && format <= IMAGE_IHEX ? formatNames[format] : "unknown";
+}
+
+// adds a segment, they are sorted once they are all in
+// Returns 0 for success, <0 for error
+static int addSegment(PSAT_IMAGE image, DWORD address, BYTE* data, DWORD length)
+{
+    if(image->numSegments == MAX_IMAGE_SEGMENTS)
+    {
+        logError("loadImage: More than %d segments!!\n", MAX_IMAGE_SEGMENTS);
+        return -1;
+    }
+    
+    image->segments[image->numSegments].address = address;
+    image->segments[image->numSegments].data = data;
+    image->segments[image->numSegments].length = length;
+    image->numSegments++;
+    return 0;
+}
+
+static int compareSegments(const void* a, const void* b)
+{
+    DWORD addressA = ((PSAT_SEGMENT)a)->address;
+    DWORD addressB = ((PSAT_SEGMENT)b)->address;
+    
+    return addressA < addressB ? -1 : addressA > addressB;
+}
+
+// Returns 0 for success, <0 for error
+static int loadElf(const BYTE* data, DWORD size, PSAT_IMAGE image)
+{
+    Elf32_Ehdr* header;
+    Elf32_Phdr* program;
+    DWORD phoff;
+    DWORD phentsize;
+    DWORD offset;
+    DWORD filesz;
+    int phnum;
+    int i;
+    
+    header = (Elf32_Ehdr*)data;
+    if(size < sizeof(Elf32_Ehdr) || header->e_ident[EI_CLASS] != ELFCLASS32 || header->e_ident[EI_DATA] != ELFDATA2MSB)
+    {
+        logError("loadImage: Only 32 bit big-endian ELF files can run on the Saturn!!\n");
+        return -1;
+    }
+    
+    // the Saturn has 68000s too, but the DataLink loads code for the SH-2s
+    if(ntohs(header->e_machine) != EM_SH)
+    {
+        logWarn("loadImage: The ELF file isn't for the SH, machine %d\n", ntohs(header->e_machine));
+    }
+    
+    phoff = ntohl(header->e_phoff);
+    phentsize = ntohs(header->e_phentsize);
+    phnum = ntohs(header->e_phnum);
+    if(phnum == 0 || phentsize < sizeof(Elf32_Phdr) || phoff > size || (size - phoff) / phentsize < phnum)
+    {
+        logError("loadImage: The ELF file has no usable program headers!!\n");
+        return -2;
+    }
+    
+    for(i = 0; i < phnum; i++)
+    {
+        program = (Elf32_Phdr*)(data + phoff + i * phentsize);
+    
+        // bytes past p_filesz are BSS, the program clears them itself
+        offset = ntohl(program->p_offset);
+        filesz = ntohl(program->p_filesz);
+        if(ntohl(program->p_type) != PT_LOAD || filesz == 0)
+        {
+            continue;
+        }
+    
+        if(offset > size || size - offset < filesz)
+        {
+            logError("loadImage: Segment %d is past the end of the file!!\n", i);
+            return -3;
+        }
+    
+        if(addSegment(image, ntohl(program->p_paddr), (BYTE*)data + offset, filesz) != 0)
+        {
+            return -4;
+        }
+    }
+    
+    image->entry = ntohl(header->e_entry);
+    image->hasEntry = 1;
+    return 0;
+}
+
+// returns the value of the hex digits at text, <0 if one isn't a hex digit
+static int parseHexByte(const BYTE* text)
+{
+    int value;
+    int i;
+    
+    value = 0;
+    for(i = 0; i < 2; i++)
+    {
+        value <<= 4;
+        if(text[i] >= '0' && text[i] <= '9')
+        {
+            value |= text[i] - '0';
+        }
+        else if(toupper(text[i]) >= 'A' && toupper(text[i]) <= 'F')
+        {
+            value |= toupper(text[i]) - 'A' + 10;
+        }
+        else
+        {
+            return -1;
+        }
+    }
+    
+    return value;
+}
+
+// decodes the hex digits of the line at text into bytes
+// Returns the number of bytes, <0 for error
+static int parseHexLine(const BYTE* text, DWORD length, BYTE* bytes, int max)
+{
+    int value;
+    int count;
+    
+    if(length % 2 != 0 || length / 2 > max)
+    {
+        return -1;
+    }
+    
+    for(count = 0; count < length / 2; count++)
+    {
+        value = parseHexByte(text + count * 2);
+        if(value < 0)
+        {
+            return -2;
+        }
+        bytes[count] = value;
+    }
+    
+    return count;
+}
+
+// adds the data of a record
+// Returns 0 for success, <0 for error
+static int addRecord(PRECORD_LIST list, DWORD address, BYTE* data, DWORD length)
+{
+    PIMAGE_RECORD records;
+    BYTE* buffer;
+    
+    // there is no list when the file is only being checked
+    if(length == 0 || list == NULL)
+    {
+        return 0;
+    }
+    
+    if(list->count == list->max)
+    {
+        list->max = list->max ? list->max * 2 : 1024;
+        records = realloc(list->records, list->max * sizeof(IMAGE_RECORD));
+        if(records == NULL)
+        {
+            return -1;
+        }
+        list->records = records;
+    }
+    
+    if(list->dataLength + length > list->dataMax)
+    {
+        list->dataMax = list->dataMax ? list->dataMax * 2 : 65536;
+        buffer = realloc(list->data, list->dataMax);
+        if(buffer == NULL)
+        {
+            return -1;
+        }
+        list->data = buffer;
+    }
+    
+    list->records[list->count].address = address;
+    list->records[list->count].length = length;
+    list->records[list->count].offset = list->dataLength;
+    list->records[list->count].index = list->count;
+    memcpy(list->data + list->dataLength, data, length);
+    list->dataLength += length;
+    list->count++;
+    return 0;
+}
+
+// decodes one S-record line
+// Returns 0 for success, <0 for error
+static int parseSrecLine(const BYTE* line, DWORD length, PRECORD_LIST list, PSAT_IMAGE image)
+{
+    BYTE bytes[256];
+    DWORD address;
+    BYTE checksum;
+    int addressLength;
+    int count;
+    int i;
+    
+    if(length < 4 || line[0] != 'S')
+    {
+        return -1;
+    }
+    
+    count = parseHexLine(line + 2, length - 2, bytes, sizeof(bytes));
+    if(count < 1 || bytes[0] != count - 1)
+    {
+        return -2;
+    }
+    
+    // the checksum makes the count, address and data bytes add up to 0xff
+    checksum = 0;
+    for(i = 0; i < count; i++)
+    {
+        checksum += bytes[i];
+    }
+    if(checksum != 0xff)
+    {
+        return -3;
+    }
+    
+    switch(line[1])
+    {
+        case '1': case '9': addressLength = 2; break;
+        case '2': case '8': addressLength = 3; break;
+        case '3': case '7': addressLength = 4; break;
+        case '0': case '5': case '6': return 0;
+        default: return -4;
+    }
+    
+    if(count < addressLength + 2)
+    {
+        return -5;
+    }
+    
+    address = 0;
+    for(i = 0; i < addressLength; i++)
+    {
+        address = (address << 8) | bytes[1 + i];
+    }
+    
+    // S7, S8 and S9 give the entry point
+    if(line[1] >= '7')
+    {
+        image->entry = address;
+        image->hasEntry = 1;
+        return 0;
+    }
+    
+    return addRecord(list, address, bytes + 1 + addressLength, count - 2 - addressLength);
+}
+
+// decodes one Intel HEX line, *base is the address set by the last extended address record
+// Returns 0 for success, 1 at the end of file record, <0 for error
+static int parseHexRecord(const BYTE* line, DWORD length, PRECORD_LIST list, PSAT_IMAGE image, DWORD* base)
+{
+    BYTE bytes[256 + 5];
+    BYTE checksum;
+    DWORD value;
+    int count;
+    int i;
+    
+    if(length < 1 || line[0] != ':')
+    {
+        return -1;
+    }
+    
+    count = parseHexLine(line + 1, length - 1, bytes, sizeof(bytes));
+    if(count < 5 || bytes[0] != count - 5)
+    {
+        return -2;
+    }
+    
+    // all the bytes including the checksum add up to 0
+    checksum = 0;
+    for(i = 0; i < count; i++)
+    {
+        checksum += bytes[i];
+    }
+    if(checksum != 0)
+    {
+        return -3;
+    }
+    
+    value = 0;
+    for(i = 0; i < bytes[0] && i < 4; i++)
+    {
+        value = (value << 8) | bytes[4 + i];
+    }
+    
+    switch(bytes[3])
+    {
+        case 0x00: return addRecord(list, *base + ((bytes[1] << 8) | bytes[2]), bytes + 4, bytes[0]);
+        case 0x01: return 1;
+        case 0x02: *base = value << 4; return 0;
+        case 0x04: *base = value << 16; return 0;
+        case 0x03: image->entry = (value >> 16) * 16 + (value & 0xffff); image->hasEntry = 1; return 0;
+        case 0x05: image->entry = value; image->hasEntry = 1; return 0;
+        default: return -4;
+    }
+}
+
+static int compareRecordAddresses(const void* a, const void* b)
+{
+    DWORD addressA = ((PIMAGE_RECORD)a)->address;
+    DWORD addressB = ((PIMAGE_RECORD)b)->address;
+    
+    return addressA < addressB ? -1 : addressA > addressB;
+}
+
+static int compareRecordIndexes(const void* a, const void* b)
+{
+    return ((PIMAGE_RECORD)a)->index - ((PIMAGE_RECORD)b)->index;
+}
+
+// joins the records into segments where they touch or overlap and copies the data into them in file order
+// Returns 0 for success, <0 for error
+static int buildSegments(PRECORD_LIST list, PSAT_IMAGE image)
+{
+    PIMAGE_RECORD record;
+    PSAT_SEGMENT segment;
+    DWORD used;
+    int i;
+    int j;
+    
+    // joined segments never need more room than the records did
+    image->buffer = malloc(list->dataLength ? list->dataLength : 1);
+    if(image->buffer == NULL)
+    {
+        return -1;
+    }
+    
+    // lay out the segments in address order first
+    qsort(list->records, list->count, sizeof(IMAGE_RECORD), compareRecordAddresses);
+    segment = NULL;
+    for(i = 0; i < list->count; i++)
+    {
+        record = &list->records[i];
+        if(segment != NULL && record->address <= segment->address + segment->length)
+        {
+            if(record->address + record->length > segment->address + segment->length)
+            {
+                segment->length = record->address + record->length - segment->address;
+            }
+            continue;
+        }
+    
+        if(addSegment(image, record->address, NULL, record->length) != 0)
+        {
+            return -2;
+        }
+        segment = &image->segments[image->numSegments - 1];
+    }
+    
+    used = 0;
+    for(j = 0; j < image->numSegments; j++)
+    {
+        image->segments[j].data = image->buffer + used;
+        used += image->segments[j].length;
+    }
+    
+    // then copy the records in file order, so where two overlap the later one wins
+    qsort(list->records, list->count, sizeof(IMAGE_RECORD), compareRecordIndexes);
+    for(i = 0, j = 0; i < list->count; i++)
+    {
+        record = &list->records[i];
+        if(record->address < image->segments[j].address || record->address >= image->segments[j].address + image->segments[j].length)
+        {
+            for(j = 0; record->address >= image->segments[j].address + image->segments[j].length; j++)
+            {
+            }
+        }
+        memcpy(image->segments[j].data + (record->address - image->segments[j].address), list->data + record->offset, record->length);
+    }
+    
+    return 0;
+}
+
+// decodes the records of a text image into list, or only checks them if list is NULL
+// Returns 0 for success, <0 for error with *lineNumber set to the bad line
+static int parseTextImage(const BYTE* data, DWORD size, PRECORD_LIST list, PSAT_IMAGE image, DWORD* lineNumber)
+{
+    const BYTE* line;
+    DWORD length;
+    DWORD base;
+    DWORD pos;
+    int result;
+    
+    base = 0;
+    result = 0;
+    *lineNumber = 0;
+    
+    for(pos = 0; pos < size && result == 0; )
+    {
+        line = data + pos;
+        for(length = 0; pos + length < size && line[length] != '\n' && line[length] != '\r'; length++)
+        {
+        }
+        pos += length;
+        while(pos < size && (data[pos] == '\n' || data[pos] == '\r'))
+        {
+            pos++;
+        }
+        (*lineNumber)++;
+    
+        while(length > 0 && isspace(line[length - 1]))
+        {
+            length--;
+        }
+        if(length == 0)
+        {
+            continue;
+        }
+    
+        if(image->format == IMAGE_SREC)
+        {
+            result = parseSrecLine(line, length, list, image);
+        }
+        else
+        {
+            result = parseHexRecord(line, length, list, image, &base);
+        }
+    }
+    
+    return result < 0 ? result : 0;
+}
+
+// Returns 0 for success, <0 for error
+static int loadTextImage(const BYTE* data, DWORD size, PSAT_IMAGE image)
+{
+    RECORD_LIST list;
+    DWORD lineNumber;
+    int result;
+    
+    memset(&list, 0, sizeof(list));
+    
+    result = parseTextImage(data, size, &list, image, &lineNumber);
+    if(result < 0)
+    {
+        logError("loadImage: Bad %s record on line %d!!\n", getImageFormatName(image->format), lineNumber);
+    }
+    else
+    {
+        result = buildSegments(&list, image);
+    }
+    
+    free(list.records);
+    free(list.data);
+    return result < 0 ? -5 : 0;
+}
+
+int isTextImage(const BYTE* data, DWORD size)
+{
+    SAT_IMAGE image;
+    DWORD lineNumber;
+    
+    memset(&image, 0, sizeof(SAT_IMAGE));
+    image.format = getImageFormat(data, size);
+    if(image.format != IMAGE_SREC && image.format != IMAGE_IHEX)
+    {
+        return 0;
+    }
+    
+    return parseTextImage(data, size, NULL, &image, &lineNumber) == 0;
+}
+
+int loadImage(const BYTE* data, DWORD size, PSAT_IMAGE image)
+{
+    int result;
+    
+    memset(image, 0, sizeof(SAT_IMAGE));
+    image->format = getImageFormat(data, size);
+    
+    switch(image->format)
+    {
+        case IMAGE_ELF: result = loadElf(data, size, image); break;
+        case IMAGE_SREC:
+        case IMAGE_IHEX: result = loadTextImage(data, size, image); break;
+        default:
+            logError("loadImage: Not an ELF, S-record or HEX file!!\n");
+            return -1;
+    }
+    
+    if(result == 0 && image->numSegments == 0)
+    {
+        logError("loadImage: The file doesn't have anything to load!!\n");
+        result = -6;
+    }
+    if(result != 0)
+    {
+        freeImage(image);
+        return result;
+    }
+    
+    qsort(image->segments, image->numSegments, sizeof(SAT_SEGMENT), compareSegments);
+    
+    // two ELF segments at the same address would be uploaded one over the other
+    for(result = 1; result < image->numSegments; result++)
+    {
+        if(image->segments[result].address < image->segments[result - 1].address + image->segments[result - 1].length)
+        {
+            logError("loadImage: Segments at 0x%x and 0x%x overlap!!\n", image->segments[result - 1].address,
+                     image->segments[result].address);
+            freeImage(image);
+            return -7;
+        }
+    }
+    
+    return 0;
+}
+
+int splitImageAt(PSAT_IMAGE image, DWORD address)
+{
+    PSAT_SEGMENT segment;
+    DWORD head;
+    int i;
+    
+    for(i = 0; i < image->numSegments; i++)
+    {
+        segment = &image->segments[i];
+        if(address < segment->address || address - segment->address >= segment->length)
+        {
+            continue;
+        }
+    
+        if(address == segment->address)
+        {
+            return i;
+        }
+    
+        if(image->numSegments == MAX_IMAGE_SEGMENTS)
+        {
+            return -2;
+        }
+    
+        // the part before address stays where it is, the rest moves up one slot
+        head = address - segment->address;
+        memmove(segment + 1, segment, (image->numSegments - i) * sizeof(SAT_SEGMENT));
+        image->numSegments++;
+        segment->length = head;
+        segment[1].address = address;
+        segment[1].data += head;
+        segment[1].length -= head;
+        return i + 1;
+    }
+    
+    return -1;
+}
+
+void freeImage(PSAT_IMAGE image)
+{
+    free(image->buffer);
+    image->buffer = NULL;
+    image->numSegments = 0;
+}
@@ -0,0 +1,55 @@
+//
+// Executable images. -w and -e take ELF files, S-records and Intel HEX as well as flat binaries, and
+// only upload the bytes the file actually has, segment by segment, instead of a flat image padded
+// across the gaps between them.
+//
+
+#pragma once
+
+#include "transport.h"
+
+#define IMAGE_BIN       0 // anything that isn't one of the others, uploaded as is
+#define IMAGE_ELF       1 // ELF32 big-endian, the PT_LOAD segments at their physical addresses
+#define IMAGE_SREC      2 // Motorola S-records
+#define IMAGE_IHEX      3 // Intel HEX
+
+#define MAX_IMAGE_SEGMENTS  64
+
+// bytes to upload to one address range
+typedef struct _SAT_SEGMENT
+{
+    DWORD address;
+    DWORD length;
+    BYTE* data;
+} SAT_SEGMENT, *PSAT_SEGMENT;
+
+typedef struct _SAT_IMAGE
+{
+    int format;
+    SAT_SEGMENT segments[MAX_IMAGE_SEGMENTS]; // in address order, none of them overlap
+    int numSegments;
+    DWORD entry;
+    int hasEntry;       // non zero if the file gives an entry point
+    BYTE* buffer;       // decoded S-record or HEX data, ELF segments point into the file instead
+} SAT_IMAGE, *PSAT_IMAGE;
+
+// returns the IMAGE_ format of the size bytes at data
+int getImageFormat(const BYTE* data, DWORD size);
+
+// returns non zero if every line of the size bytes at data is a good S-record or HEX record. the first
+// bytes only say what a file looks like, a flat binary can start with ':' or 'S' and a digit too
+int isTextImage(const BYTE* data, DWORD size);
+
+// returns the name of an IMAGE_ format
+const char* getImageFormatName(int format);
+
+// finds the segments and entry point of the ELF, S-record or HEX file in data. ELF segments point into
+// data, so it must stay mapped until the image is freed
+// Returns 0 for success, <0 for error
+int loadImage(const BYTE* data, DWORD size, PSAT_IMAGE image);
+
+// splits the segment that holds address so one starts there
+// Returns the index of that segment, <0 if no segment holds address
+int splitImageAt(PSAT_IMAGE image, DWORD address);
+
+void freeImage(PSAT_IMAGE image);
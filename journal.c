@@ -0,0 +1,145 @@
+//
+// Checkpoint journals for resumable dumps.
+// While a dump is written, every range that is verified and safely on disk is appended to a small
+// sidecar file next to the output. satlink --resume reads it back and only requests what's missing.
+//
+
+#include "stream.h"
+
+#define JOURNAL_MAGIC "satlink-journal"
+
+// puts the ranges in offset order
+static int compareRanges(const void* a, const void* b)
+{
+    DWORD offsetA = ((PSAT_RANGE)a)->offset;
+    DWORD offsetB = ((PSAT_RANGE)b)->offset;
+    
+    return offsetA < offsetB ? -1 : offsetA > offsetB;
+}
+
+FILE* openJournal(const char* path, DWORD address, DWORD count, int resume)
+{
+    FILE* journal;
+    
+    if(resume)
+    {
+        return fopen(path, "a");
+    }
+    
+    journal = fopen(path, "w");
+    if(journal == NULL)
+    {
+        return NULL;
+    }
+    
+    fprintf(journal, "%s 0x%x %u\n", JOURNAL_MAGIC, address, count);
+    fflush(journal);
+    
+    return journal;
+}
+
+void journalRange(FILE* journal, DWORD offset, DWORD length)
+{
+    fprintf(journal, "%u %u\n", offset, length);
+    fflush(journal);
+    fdatasync(fileno(journal));
+}
+
+int loadJournal(const char* path, DWORD address, DWORD count, PSAT_RANGE* missing)
+{
+    PSAT_RANGE done;
+    PSAT_RANGE newDone;
+    char magic[32];
+    FILE* journal;
+    DWORD journalAddress;
+    DWORD journalCount;
+    DWORD offset;
+    DWORD length;
+    DWORD covered;
+    int numDone;
+    int maxDone;
+    int numMissing;
+    int i;
+    
+    journal = fopen(path, "r");
+    if(journal == NULL)
+    {
+        printf("loadJournal: Failed to open %s!!\n", path);
+        return -1;
+    }
+    
+    if(fscanf(journal, "%31s 0x%x %u", magic, &journalAddress, &journalCount) != 3 || strcmp(magic, JOURNAL_MAGIC) != 0)
+    {
+        printf("loadJournal: %s isn't a satlink journal!!\n", path);
+        fclose(journal);
+        return -2;
+    }
+    
+    if(journalAddress != address || journalCount != count)
+    {
+        printf("loadJournal: %s is for %u bytes at 0x%x, not %u bytes at 0x%x!!\n", path, journalCount, journalAddress, count, address);
+        fclose(journal);
+        return -3;
+    }
+    
+    // a record cut short by a crash just doesn't match and is ignored
+    numDone = 0;
+    maxDone = 0;
+    done = NULL;
+    while(fscanf(journal, "%u %u", &offset, &length) == 2)
+    {
+        if(offset >= count || length > count - offset)
+        {
+            continue;
+        }
+        
+        if(numDone == maxDone)
+        {
+            maxDone = maxDone ? maxDone * 2 : 64;
+            newDone = realloc(done, maxDone * sizeof(SAT_RANGE));
+            if(newDone == NULL)
+            {
+                free(done);
+                fclose(journal);
+                return -4;
+            }
+            done = newDone;
+        }
+        
+        done[numDone].offset = offset;
+        done[numDone].length = length;
+        numDone++;
+    }
+    fclose(journal);
+    
+    qsort(done, numDone, sizeof(SAT_RANGE), compareRanges);
+    
+    // the gaps between the verified ranges are what's missing, there can be at most one more of them
+    *missing = malloc((numDone + 1) * sizeof(SAT_RANGE));
+    if(*missing == NULL)
+    {
+        free(done);
+        return -4;
+    }
+    
+    numMissing = 0;
+    covered = 0;
+    for(i = 0; i <= numDone; i++)
+    {
+        offset = i < numDone ? done[i].offset : count;
+        if(offset > covered)
+        {
+            (*missing)[numMissing].offset = covered;
+            (*missing)[numMissing].length = offset - covered;
+            numMissing++;
+        }
+        
+        if(i < numDone && done[i].offset + done[i].length > covered)
+        {
+            covered = done[i].offset + done[i].length;
+        }
+    }
+    
+    free(done);
+    return numMissing;
+}
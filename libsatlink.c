@@ -0,0 +1,577 @@
+//
+// libsatlink job queue. see libsatlink.h
+// Every SATLINK has a thread that takes the jobs off its queues and runs them with the same
+// protocol functions satlink uses. There is a queue per priority and the thread always takes the
+// oldest job of the highest priority. A job runs in slices: the yield hook of the link state is
+// asked at every packet boundary and stops the slice when an interactive job is waiting behind a
+// bulk one, or when the job has had its quantum and another of its priority is waiting. A read ends
+// its READ_START..READ_END sequence with the next request, so sequences are never left open, and a
+// write waits for the packets in flight. The job then goes to the back of its queue and carries on
+// from where it stopped next time round. The lock only guards the queues and the job states, it is
+// never held while a job talks to the DataLink, so the yield hook reads the number of waiting jobs
+// with atomic loads. The progress hook of the link state reports every packet to the running job,
+// and log messages are caught on the way to the caller's handler so an error can be kept with the
+// job that logged it.
+//
+
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include "libsatlink.h"
+
+#define MAX_JOB_ERROR   256
+
+struct _SATLINK
+{
+    SAT_TRANSPORT transport;
+    SAT_LINK_STATS stats;   // copied from the transport after every job
+    PSAT_JOB head[SAT_NUM_PRIORITIES]; // queued jobs of each priority, oldest first
+    PSAT_JOB tail[SAT_NUM_PRIORITIES];
+    int waiting[SAT_NUM_PRIORITIES];   // jobs in each queue, changed with the lock held, read with atomic loads
+    DWORD sliceStart;       // bytesDone of the running job when its slice started
+    int closing;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t changed; // signalled whenever a job is queued, finishes or is cancelled
+};
+
+struct _SAT_JOB
+{
+    PSATLINK link;
+    PSAT_JOB next;          // next in the queue
+    int type;
+    int priority;
+    DWORD address;
+    BYTE* buffer;
+    DWORD numBytes;
+    SAT_PROGRESS_CALLBACK progress;
+    void* context;
+    DWORD bytesDone;        // written by the job thread, read with atomic loads
+    DWORD offset;           // where the next slice starts
+    int state;              // changed with the lock held, read with atomic loads
+    int result;
+    char error[MAX_JOB_ERROR];
+};
+
+static LOG_HANDLER userLogHandler = NULL;
+static void* userLogContext = NULL;
+static __thread PSAT_JOB runningJob = NULL; // the job the current thread is running, if any
+
+// keeps the errors of the running job and passes every message on to the caller's handler
+static void handleLog(int level, const char* message, void* context)
+{
+    LOG_HANDLER handler;
+    int length;
+    
+    if(level == LOG_ERROR && runningJob != NULL)
+    {
+        // without the line break, messages are printed with one
+        length = strlen(message);
+        if(length > 0 && message[length - 1] == '\n')
+        {
+            length--;
+        }
+        if(length >= MAX_JOB_ERROR)
+        {
+            length = MAX_JOB_ERROR - 1;
+        }
+        memcpy(runningJob->error, message, length);
+        runningJob->error[length] = '\0';
+    }
+    
+    handler = __atomic_load_n(&userLogHandler, __ATOMIC_ACQUIRE);
+    if(handler != NULL)
+    {
+        handler(level, message, __atomic_load_n(&userLogContext, __ATOMIC_RELAXED));
+    }
+}
+
+void satlinkSetLogHandler(LOG_HANDLER handler, void* context)
+{
+    __atomic_store_n(&userLogContext, context, __ATOMIC_RELAXED);
+    __atomic_store_n(&userLogHandler, handler, __ATOMIC_RELEASE);
+}
+
+// the progress hook of the link state, called after every packet of the running job
+static void reportProgress(void* context, DWORD bytes)
+{
+    PSAT_JOB job = (PSAT_JOB)context;
+    DWORD bytesDone;
+    
+    // a short read is padded to 4 bytes on the link
+    bytesDone = job->bytesDone + bytes;
+    if(bytesDone > job->numBytes)
+    {
+        bytesDone = job->numBytes;
+    }
+    __atomic_store_n(&job->bytesDone, bytesDone, __ATOMIC_RELAXED);
+    
+    if(job->progress != NULL)
+    {
+        job->progress(job, bytesDone, job->numBytes, job->context);
+    }
+}
+
+// the yield hook of the link state, asked at every packet boundary of the running job
+static int shouldYieldJob(void* context)
+{
+    PSAT_JOB job = (PSAT_JOB)context;
+    PSATLINK link = job->link;
+    int priority;
+    
+    // anything more urgent gets the link straight away
+    for(priority = 0; priority < job->priority; priority++)
+    {
+        if(__atomic_load_n(&link->waiting[priority], __ATOMIC_RELAXED) > 0)
+        {
+            return 1;
+        }
+    }
+    
+    return job->bytesDone - link->sliceStart >= SAT_JOB_QUANTUM && __atomic_load_n(&link->waiting[job->priority], __ATOMIC_RELAXED) > 0;
+}
+
+// runs a slice of job on the link, from job->offset until it is done or the yield hook stops it
+// Returns 0 for success, SAT_YIELDED if the job has more to do, <0 for error
+static int runJobSlice(PSATLINK link, PSAT_JOB job)
+{
+    SAT_READ_VEC vec;
+    DWORD numBytes;
+    DWORD done;
+    int result;
+    
+    done = 0;
+    switch(job->type)
+    {
+        case SAT_JOB_READ:
+            if(job->numBytes < 4)
+            {
+                vec.address = job->address;
+                vec.length = job->numBytes;
+                vec.buffer = job->buffer;
+                return readSatMemoryV(&link->transport, &vec, 1);
+            }
+    
+            // reads are atleast 4 bytes, a short rest is read with a few bytes from before it
+            if(job->numBytes - job->offset < 4)
+            {
+                job->offset = job->numBytes - 4;
+            }
+            result = readSatMemorySlice(&link->transport, job->buffer + job->offset, job->address + job->offset, job->numBytes - job->offset, &done);
+            break;
+    
+        case SAT_JOB_WRITE:
+            result = writeSatMemorySlice(&link->transport, job->address + job->offset, job->buffer + job->offset, job->numBytes - job->offset, &done);
+            break;
+    
+        case SAT_JOB_EXECUTE:
+            if(job->numBytes <= MAX_DATALEN)
+            {
+                return executeSatMemory(&link->transport, job->address, job->buffer, job->numBytes);
+            }
+    
+            // everything after the first packet is written in slices like a write, the first packet
+            // goes last with WRITE_EXECUTE. see writeSatMemoryAndExecute
+            numBytes = job->numBytes - MAX_DATALEN;
+            if(job->offset < numBytes)
+            {
+                result = writeSatMemorySlice(&link->transport, job->address + MAX_DATALEN + job->offset, job->buffer + MAX_DATALEN + job->offset, numBytes - job->offset, &done);
+                job->offset += done;
+                if(result != 0)
+                {
+                    if(result < 0)
+                    {
+                        logError("satlinkExecute: failed to write initial payload!!\n");
+                    }
+                    return result;
+                }
+            }
+            return executeSatMemory(&link->transport, job->address, job->buffer, MAX_DATALEN);
+    
+        default:
+            return -1;
+    }
+    
+    job->offset += done;
+    return result;
+}
+
+// takes the oldest job of the highest priority off its queue, the lock must be held
+// Returns the job, NULL if every queue is empty
+static PSAT_JOB takeJob(PSATLINK link)
+{
+    PSAT_JOB job;
+    int priority;
+    
+    for(priority = 0; priority < SAT_NUM_PRIORITIES; priority++)
+    {
+        job = link->head[priority];
+        if(job != NULL)
+        {
+            link->head[priority] = job->next;
+            if(link->head[priority] == NULL)
+            {
+                link->tail[priority] = NULL;
+            }
+            job->next = NULL;
+            __atomic_store_n(&link->waiting[priority], link->waiting[priority] - 1, __ATOMIC_RELAXED);
+            return job;
+        }
+    }
+    
+    return NULL;
+}
+
+// puts job at the back of its queue, the lock must be held
+static void queueJob(PSATLINK link, PSAT_JOB job)
+{
+    job->next = NULL;
+    if(link->tail[job->priority] != NULL)
+    {
+        link->tail[job->priority]->next = job;
+    }
+    else
+    {
+        link->head[job->priority] = job;
+    }
+    link->tail[job->priority] = job;
+    __atomic_store_n(&link->waiting[job->priority], link->waiting[job->priority] + 1, __ATOMIC_RELAXED);
+}
+
+static void* runJobs(void* arg)
+{
+    PSATLINK link = (PSATLINK)arg;
+    PSAT_JOB job;
+    int result;
+    
+    pthread_mutex_lock(&link->lock);
+    for(;;)
+    {
+        job = takeJob(link);
+        if(job == NULL)
+        {
+            if(link->closing)
+            {
+                break;
+            }
+            pthread_cond_wait(&link->changed, &link->lock);
+            continue;
+        }
+    
+        __atomic_store_n(&job->state, SAT_JOB_RUNNING, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&link->lock);
+    
+        runningJob = job;
+        link->sliceStart = job->bytesDone;
+        link->transport.link.progress = reportProgress;
+        link->transport.link.progressContext = job;
+        link->transport.link.yield = shouldYieldJob;
+        link->transport.link.yieldContext = job;
+        result = runJobSlice(link, job);
+        link->transport.link.progress = NULL;
+        link->transport.link.yield = NULL;
+        runningJob = NULL;
+    
+        pthread_mutex_lock(&link->lock);
+        getLinkStats(&link->transport, &link->stats);
+        if(result == SAT_YIELDED && !link->closing)
+        {
+            // its turn is over, it stays running for the caller but waits at the back of its queue
+            queueJob(link, job);
+            continue;
+        }
+    
+        if(result == SAT_YIELDED)
+        {
+            // satlinkClose cancelled the queues while it was stopping
+            job->result = -1;
+            __atomic_store_n(&job->state, SAT_JOB_CANCELLED, __ATOMIC_RELEASE);
+        }
+        else
+        {
+            job->result = result;
+            __atomic_store_n(&job->state, SAT_JOB_DONE, __ATOMIC_RELEASE);
+        }
+        pthread_cond_broadcast(&link->changed);
+    }
+    pthread_mutex_unlock(&link->lock);
+    
+    return NULL;
+}
+
+// starts the job thread of a link whose transport has just been opened
+// Returns the link, NULL for error
+static PSATLINK startLink(PSATLINK link)
+{
+    pthread_condattr_t attr;
+    
+    // satlinkWait times out against the monotonic clock
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&link->changed, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&link->lock, NULL);
+    
+    if(pthread_create(&link->thread, NULL, runJobs, link) != 0)
+    {
+        logError("satlinkOpen: Failed to start the job thread!!\n");
+        pthread_cond_destroy(&link->changed);
+        pthread_mutex_destroy(&link->lock);
+        link->transport.close(&link->transport);
+        free(link);
+        return NULL;
+    }
+    
+    return link;
+}
+
+PSATLINK satlinkOpen(const char* device)
+{
+    PSATLINK link;
+    
+    link = calloc(1, sizeof(SATLINK));
+    if(link == NULL)
+    {
+        return NULL;
+    }
+    
+    // the library never prints, messages only reach the caller's handler
+    setLogHandler(handleLog, NULL);
+    if(openFtdiDevice(&link->transport, 0, device) != 0)
+    {
+        free(link);
+        return NULL;
+    }
+    
+    return startLink(link);
+}
+
+PSATLINK satlinkOpenSim(PSIM_CONFIG config)
+{
+    PSATLINK link;
+    
+    link = calloc(1, sizeof(SATLINK));
+    if(link == NULL)
+    {
+        return NULL;
+    }
+    
+    setLogHandler(handleLog, NULL);
+    if(openSimDevice(&link->transport, config) != 0)
+    {
+        free(link);
+        return NULL;
+    }
+    
+    return startLink(link);
+}
+
+void satlinkClose(PSATLINK link)
+{
+    PSAT_JOB job;
+    PSAT_JOB next;
+    int priority;
+    
+    // once a job is cancelled the caller may free it, so next is read first
+    pthread_mutex_lock(&link->lock);
+    link->closing = 1;
+    for(priority = 0; priority < SAT_NUM_PRIORITIES; priority++)
+    {
+        for(job = link->head[priority]; job != NULL; job = next)
+        {
+            next = job->next;
+            job->result = -1;
+            __atomic_store_n(&job->state, SAT_JOB_CANCELLED, __ATOMIC_RELEASE);
+        }
+        link->head[priority] = NULL;
+        link->tail[priority] = NULL;
+        __atomic_store_n(&link->waiting[priority], 0, __ATOMIC_RELAXED);
+    }
+    pthread_cond_broadcast(&link->changed);
+    pthread_mutex_unlock(&link->lock);
+    
+    pthread_join(link->thread, NULL);
+    link->transport.close(&link->transport);
+    pthread_cond_destroy(&link->changed);
+    pthread_mutex_destroy(&link->lock);
+    free(link);
+}
+
+PSAT_TRANSPORT satlinkGetTransport(PSATLINK link)
+{
+    return &link->transport;
+}
+
+void satlinkGetStats(PSATLINK link, PSAT_LINK_STATS stats)
+{
+    pthread_mutex_lock(&link->lock);
+    memcpy(stats, &link->stats, sizeof(SAT_LINK_STATS));
+    pthread_mutex_unlock(&link->lock);
+}
+
+// queues a job of type for the job thread
+// Returns the job, NULL for error
+static PSAT_JOB submitJob(PSATLINK link, int type, DWORD address, BYTE* buffer, DWORD numBytes, int priority, SAT_PROGRESS_CALLBACK progress, void* context)
+{
+    PSAT_JOB job;
+    
+    if(numBytes == 0 || buffer == NULL)
+    {
+        logError("satlinkSubmit: a job needs a buffer and atleast 1 byte.\n");
+        return NULL;
+    }
+    if(priority < 0 || priority >= SAT_NUM_PRIORITIES)
+    {
+        logError("satlinkSubmit: invalid priority %d.\n", priority);
+        return NULL;
+    }
+    
+    job = calloc(1, sizeof(SAT_JOB));
+    if(job == NULL)
+    {
+        return NULL;
+    }
+    
+    job->link = link;
+    job->type = type;
+    job->priority = priority;
+    job->address = address;
+    job->buffer = buffer;
+    job->numBytes = numBytes;
+    job->progress = progress;
+    job->context = context;
+    job->state = SAT_JOB_QUEUED;
+    
+    pthread_mutex_lock(&link->lock);
+    if(link->closing)
+    {
+        pthread_mutex_unlock(&link->lock);
+        free(job);
+        return NULL;
+    }
+    queueJob(link, job);
+    pthread_cond_broadcast(&link->changed);
+    pthread_mutex_unlock(&link->lock);
+    
+    return job;
+}
+
+PSAT_JOB satlinkRead(PSATLINK link, DWORD address, BYTE* buffer, DWORD numBytes, int priority, SAT_PROGRESS_CALLBACK progress, void* context)
+{
+    return submitJob(link, SAT_JOB_READ, address, buffer, numBytes, priority, progress, context);
+}
+
+PSAT_JOB satlinkWrite(PSATLINK link, DWORD address, BYTE* buffer, DWORD numBytes, int priority, SAT_PROGRESS_CALLBACK progress, void* context)
+{
+    return submitJob(link, SAT_JOB_WRITE, address, buffer, numBytes, priority, progress, context);
+}
+
+PSAT_JOB satlinkExecute(PSATLINK link, DWORD address, BYTE* buffer, DWORD numBytes, int priority, SAT_PROGRESS_CALLBACK progress, void* context)
+{
+    return submitJob(link, SAT_JOB_EXECUTE, address, buffer, numBytes, priority, progress, context);
+}
+
+int satlinkPoll(PSAT_JOB job)
+{
+    return __atomic_load_n(&job->state, __ATOMIC_ACQUIRE);
+}
+
+// finished jobs are answered without touching the link, it may already be closed
+int satlinkWait(PSAT_JOB job, int timeoutMs)
+{
+    PSATLINK link = job->link;
+    struct timespec deadline;
+    int result;
+    
+    if(satlinkPoll(job) >= SAT_JOB_DONE)
+    {
+        return job->result;
+    }
+    
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeoutMs / 1000;
+    deadline.tv_nsec += (timeoutMs % 1000) * 1000000L;
+    if(deadline.tv_nsec >= 1000000000L)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    
+    pthread_mutex_lock(&link->lock);
+    while(job->state < SAT_JOB_DONE)
+    {
+        if(timeoutMs < 0)
+        {
+            pthread_cond_wait(&link->changed, &link->lock);
+        }
+        else if(pthread_cond_timedwait(&link->changed, &link->lock, &deadline) == ETIMEDOUT)
+        {
+            break;
+        }
+    }
+    result = job->state < SAT_JOB_DONE ? SATLINK_PENDING : job->result;
+    pthread_mutex_unlock(&link->lock);
+    
+    return result;
+}
+
+DWORD satlinkGetProgress(PSAT_JOB job)
+{
+    return __atomic_load_n(&job->bytesDone, __ATOMIC_RELAXED);
+}
+
+// the error is only written while the job runs, once it has finished it can be read freely
+const char* satlinkGetError(PSAT_JOB job)
+{
+    return satlinkPoll(job) >= SAT_JOB_DONE ? job->error : "";
+}
+
+int satlinkCancel(PSAT_JOB job)
+{
+    PSATLINK link = job->link;
+    PSAT_JOB* entry;
+    PSAT_JOB previous;
+    int result;
+    
+    if(satlinkPoll(job) != SAT_JOB_QUEUED)
+    {
+        return -1;
+    }
+    
+    pthread_mutex_lock(&link->lock);
+    result = -1;
+    previous = NULL;
+    for(entry = &link->head[job->priority]; *entry != NULL; entry = &(*entry)->next)
+    {
+        // a job interrupted part way through is back in the queue, but it has started
+        if(*entry == job && job->state == SAT_JOB_QUEUED)
+        {
+            *entry = job->next;
+            if(link->tail[job->priority] == job)
+            {
+                link->tail[job->priority] = previous;
+            }
+            __atomic_store_n(&link->waiting[job->priority], link->waiting[job->priority] - 1, __ATOMIC_RELAXED);
+            job->result = -1;
+            __atomic_store_n(&job->state, SAT_JOB_CANCELLED, __ATOMIC_RELEASE);
+            pthread_cond_broadcast(&link->changed);
+            result = 0;
+            break;
+        }
+        previous = *entry;
+    }
+    pthread_mutex_unlock(&link->lock);
+    
+    return result;
+}
+
+int satlinkFreeJob(PSAT_JOB job)
+{
+    if(satlinkPoll(job) < SAT_JOB_DONE)
+    {
+        return -1;
+    }
+    
+    free(job);
+    return 0;
+}
@@ -0,0 +1,101 @@
+//
+// libsatlink, the DataLink protocol as a library for programs that drive a Saturn without running
+// satlink. 'make lib' builds libsatlink.a and libsatlink.so.
+// A SATLINK owns one open DataLink and a thread that runs the jobs submitted to it one at a time.
+// Every job is interactive or bulk: an interactive job is always run before a bulk one, and a bulk job
+// that is running when an interactive one arrives is stopped at the next packet boundary and carried on
+// after it. Jobs of the same priority take turns a quantum of bytes at a time, in the order they were
+// submitted. Submitting a job doesn't wait for the link: the caller polls or waits for it to finish
+// and can follow it packet by packet with a progress callback. Jobs read into and write from the
+// caller's buffers, which must stay valid until the job has finished. Nothing is printed, log
+// messages go to the handler given to satlinkSetLogHandler and the last error logged while a job ran
+// is kept with the job.
+//
+
+#pragma once
+
+#include "transport.h"
+
+// job types
+#define SAT_JOB_READ        0
+#define SAT_JOB_WRITE       1
+#define SAT_JOB_EXECUTE     2 // write, then jump to the address
+
+// job states
+#define SAT_JOB_QUEUED      0
+#define SAT_JOB_RUNNING     1
+#define SAT_JOB_DONE        2 // finished, its result says whether it worked
+#define SAT_JOB_CANCELLED   3 // taken off the queue before it started, its result is -1
+
+// job priorities
+#define SAT_PRIORITY_INTERACTIVE    0 // small requests that someone is waiting for, run ahead of bulk jobs
+#define SAT_PRIORITY_BULK           1 // dumps and uploads, interrupted whenever an interactive job is waiting
+#define SAT_NUM_PRIORITIES          2
+
+#define SAT_JOB_QUANTUM     8192 // bytes a job transfers before letting a waiting job of the same priority have a turn
+
+#define SATLINK_PENDING     1 // satlinkWait timed out before the job finished
+
+// a DataLink and the thread running its jobs
+typedef struct _SATLINK SATLINK, *PSATLINK;
+
+// a read, write or execute submitted to a SATLINK
+typedef struct _SAT_JOB SAT_JOB, *PSAT_JOB;
+
+// called on the job thread after every packet with the data bytes the job has transferred so far
+typedef void (*SAT_PROGRESS_CALLBACK)(PSAT_JOB job, DWORD bytesDone, DWORD numBytes, void* context);
+
+// opens the FTDI DataLink with device as its serial number or bus path, the first one if device is NULL
+// Returns the link, NULL for error
+PSATLINK satlinkOpen(const char* device);
+
+// opens a simulated DataLink, see openSimDevice
+// Returns the link, NULL for error
+PSATLINK satlinkOpenSim(PSIM_CONFIG config);
+
+// cancels the queued jobs, including those interrupted part way through, waits for the running one and
+// closes the DataLink. the jobs still have to be freed
+void satlinkClose(PSATLINK link);
+
+// the DataLink of link, for getSimMemory and the like. only use it while no job is running
+PSAT_TRANSPORT satlinkGetTransport(PSATLINK link);
+
+// copies the link error counters as they were after the last job finished
+void satlinkGetStats(PSATLINK link, PSAT_LINK_STATS stats);
+
+// sends the log messages of every link to handler, they are dropped if it is NULL
+void satlinkSetLogHandler(LOG_HANDLER handler, void* context);
+
+// queues a read of numBytes at address into buffer, any length down to 1 byte
+// Returns the job, NULL for error
+PSAT_JOB satlinkRead(PSATLINK link, DWORD address, BYTE* buffer, DWORD numBytes, int priority, SAT_PROGRESS_CALLBACK progress, void* context);
+
+// queues a write of numBytes from buffer to address
+// Returns the job, NULL for error
+PSAT_JOB satlinkWrite(PSATLINK link, DWORD address, BYTE* buffer, DWORD numBytes, int priority, SAT_PROGRESS_CALLBACK progress, void* context);
+
+// queues a write of numBytes from buffer to address that then jumps to address. the jump is only made
+// once the whole buffer has been written, however many turns that takes
+// Returns the job, NULL for error
+PSAT_JOB satlinkExecute(PSATLINK link, DWORD address, BYTE* buffer, DWORD numBytes, int priority, SAT_PROGRESS_CALLBACK progress, void* context);
+
+// returns the SAT_JOB_ state of job without waiting
+int satlinkPoll(PSAT_JOB job);
+
+// waits up to timeoutMs for job to finish, <0 waits as long as it takes
+// Returns the result of the job (0 for success, <0 for error), SATLINK_PENDING if it is still queued or running
+int satlinkWait(PSAT_JOB job, int timeoutMs);
+
+// returns the data bytes job has transferred so far
+DWORD satlinkGetProgress(PSAT_JOB job);
+
+// returns the last error logged while job ran, an empty string if there wasn't one
+const char* satlinkGetError(PSAT_JOB job);
+
+// takes job off the queue if it hasn't started. a job interrupted part way through counts as started
+// Returns 0 for success, <0 if it is already running or finished
+int satlinkCancel(PSAT_JOB job);
+
+// frees a finished or cancelled job
+// Returns 0 for success, <0 if it is still queued or running
+int satlinkFreeJob(PSAT_JOB job);
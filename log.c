@@ -0,0 +1,220 @@
+//
+// Log levels and the packet trace ring. see log.h
+//
+
+#include <time.h>
+#include <stdarg.h>
+#include "satlink.h"
+
+#define MAX_LOG_MESSAGE 1024
+
+int logLevel = LOG_INFO;
+int traceEnabled = 0;
+
+static const char* levelNames[] = { "error", "warn", "info", "debug", "packet" };
+
+static LOG_HANDLER logHandler = NULL;
+static void* logContext = NULL;
+
+static SAT_TRACE_ENTRY traceRing[TRACE_ENTRIES];
+static unsigned long long traceCount = 0; // entries ever recorded, the ring keeps the last TRACE_ENTRIES
+
+int parseLogLevel(const char* name)
+{
+    int i;
+    
+    for(i = 0; i <= LOG_PACKET; i++)
+    {
+        if(strcmp(name, levelNames[i]) == 0)
+        {
+            return i;
+        }
+    }
+    
+    return -1;
+}
+
+void logMessage(int level, const char* format, ...)
+{
+    char message[MAX_LOG_MESSAGE];
+    va_list args;
+    
+    va_start(args, format);
+    if(logHandler != NULL)
+    {
+        vsnprintf(message, sizeof(message), format, args);
+        logHandler(level, message, logContext);
+    }
+#ifndef SATLINK_LIBRARY
+    else
+    {
+        vprintf(format, args);
+    }
+#endif
+    va_end(args);
+}
+
+void setLogHandler(LOG_HANDLER handler, void* context)
+{
+    logContext = context;
+    logHandler = handler;
+}
+
+void startTrace()
+{
+    traceCount = 0;
+    traceEnabled = 1;
+}
+
+// claims the next entry of the ring, overwriting the oldest one once it is full
+static PSAT_TRACE_ENTRY nextEntry(int event)
+{
+    PSAT_TRACE_ENTRY entry;
+    struct timespec ts;
+    
+    entry = &traceRing[traceCount++ % TRACE_ENTRIES];
+    memset(entry, 0, sizeof(SAT_TRACE_ENTRY));
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    entry->timeNs = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    entry->event = event;
+    
+    return entry;
+}
+
+void recordPacket(int event, BYTE* packet)
+{
+    PSAT_READ_REQ header;
+    PSAT_TRACE_ENTRY entry;
+    
+    header = (PSAT_READ_REQ)packet;
+    entry = nextEntry(event);
+    
+    entry->dir = header->dir;
+    entry->packetLength = header->packetLength;
+    entry->opcode = header->opcode;
+    entry->address = ntohl(header->address);
+    entry->dataLength = header->dataLength;
+    entry->checksum = packet[header->packetLength + 1];
+}
+
+void recordEvent(int event, int code)
+{
+    nextEntry(event)->code = code;
+}
+
+int saveTrace(const char* filename)
+{
+    unsigned long long first;
+    unsigned long long i;
+    DWORD count;
+    FILE* file;
+    
+    file = fopen(filename, "w");
+    if(file == NULL)
+    {
+        logError("saveTrace: Failed to open %s for writing!!\n", filename);
+        return -1;
+    }
+    
+    // only the newest TRACE_ENTRIES are still in the ring
+    first = traceCount > TRACE_ENTRIES ? traceCount - TRACE_ENTRIES : 0;
+    count = traceCount - first;
+    
+    fwrite(TRACE_MAGIC, 1, 8, file);
+    fwrite(&count, sizeof(count), 1, file);
+    for(i = first; i < traceCount; i++)
+    {
+        fwrite(&traceRing[i % TRACE_ENTRIES], sizeof(SAT_TRACE_ENTRY), 1, file);
+    }
+    
+    if(fclose(file) != 0)
+    {
+        logError("saveTrace: Failed to write %s!!\n", filename);
+        return -2;
+    }
+    
+    return 0;
+}
+
+static const char* getOpcodeName(BYTE dir, BYTE opcode)
+{
+    if(dir == TO_PC)
+    {
+        return opcode == RESP_SUCCESS ? "SUCCESS" : opcode == RESP_ERROR ? "ERROR" : "?";
+    }
+    
+    switch(opcode)
+    {
+        case READ_START:    return "READ_START";
+        case READ_CONT:     return "READ_CONT";
+        case READ_END:      return "READ_END";
+        case WRITE:         return "WRITE";
+        case WRITE_EXECUTE: return "WRITE_EXECUTE";
+        default:            return "?";
+    }
+}
+
+int decodeTrace(const char* filename)
+{
+    SAT_TRACE_ENTRY entry;
+    char magic[8];
+    long long startNs;
+    long long lastNs;
+    DWORD count;
+    DWORD i;
+    FILE* file;
+    
+    file = fopen(filename, "r");
+    if(file == NULL)
+    {
+        logError("decodeTrace: Failed to open %s!!\n", filename);
+        return -1;
+    }
+    
+    if(fread(magic, 1, 8, file) != 8 || memcmp(magic, TRACE_MAGIC, 8) != 0 || fread(&count, sizeof(count), 1, file) != 1)
+    {
+        logError("decodeTrace: %s isn't a satlink trace!!\n", filename);
+        fclose(file);
+        return -2;
+    }
+    
+    printf("%u entries\n", count);
+    printf("%12s %10s  %-3s %-13s %-10s %4s %5s\n", "time us", "delta us", "dir", "opcode", "address", "data", "csum");
+    
+    startNs = 0;
+    lastNs = 0;
+    for(i = 0; i < count && fread(&entry, sizeof(entry), 1, file) == 1; i++)
+    {
+        if(i == 0)
+        {
+            startNs = entry.timeNs;
+            lastNs = entry.timeNs;
+        }
+    
+        printf("%12.1f %10.1f  ", (entry.timeNs - startNs) / 1000.0, (entry.timeNs - lastNs) / 1000.0);
+        lastNs = entry.timeNs;
+    
+        switch(entry.event)
+        {
+            case TRACE_TX:
+            case TRACE_RX:
+                printf("%-3s %-13s 0x%08x %4d  0x%02x%s\n", entry.event == TRACE_TX ? ">" : "<",
+                       getOpcodeName(entry.dir, entry.opcode), entry.address, entry.dataLength, entry.checksum,
+                       entry.dir != (entry.event == TRACE_TX ? TO_SAT : TO_PC) ? "  bad dir" : "");
+                break;
+            case TRACE_TIMEOUT:
+                printf("--- timed out waiting for a response\n");
+                break;
+            case TRACE_ERROR:
+                printf("--- transfer failed with %d\n", entry.code);
+                break;
+            default:
+                printf("--- unknown event %d\n", entry.event);
+                break;
+        }
+    }
+    
+    fclose(file);
+    return 0;
+}
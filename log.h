@@ -0,0 +1,89 @@
+//
+// Logging and the packet trace ring.
+// Log messages are filtered by a level chosen at runtime. LOG_DEBUG and LOG_PACKET messages only
+// exist in builds with DEBUG defined ('make debug'), in release builds they compile to nothing.
+// They are printed to stdout unless a handler is set, libsatlink (SATLINK_LIBRARY defined) drops them
+// instead so it never prints anything.
+// The trace ring records every packet's header and checksum in binary with a timestamp, it costs
+// a clock read and a few stores per packet and is decoded afterwards with satlink --decode-trace.
+//
+
+#pragma once
+
+#define LOG_ERROR   0 // something failed
+#define LOG_WARN    1 // something went wrong but was recovered from
+#define LOG_INFO    2 // progress the user wants to see
+#define LOG_DEBUG   3 // progress of every request, debug builds only
+#define LOG_PACKET  4 // the bytes of every packet, debug builds only
+
+extern int logLevel;
+extern int traceEnabled;
+
+#define logPrint(level, ...)  do { if(logLevel >= (level)) logMessage(level, __VA_ARGS__); } while(0)
+#define logError(...)         logPrint(LOG_ERROR, __VA_ARGS__)
+#define logWarn(...)          logPrint(LOG_WARN, __VA_ARGS__)
+#define logInfo(...)          logPrint(LOG_INFO, __VA_ARGS__)
+
+#ifdef DEBUG
+#define logDebug(...)         logPrint(LOG_DEBUG, __VA_ARGS__)
+#define logPacket(packet)     do { if(logLevel >= LOG_PACKET) dumpPacket(packet); } while(0)
+#else
+#define logDebug(...)         do { } while(0)
+#define logPacket(packet)     do { } while(0)
+#endif
+
+// gets every log message that passes the level instead of stdout
+typedef void (*LOG_HANDLER)(int level, const char* message, void* context);
+
+// prints or hands a message to the handler, use the log macros instead
+void logMessage(int level, const char* format, ...) __attribute__((format(printf, 2, 3)));
+
+// sends the log messages to handler, NULL goes back to the default
+void setLogHandler(LOG_HANDLER handler, void* context);
+
+// returns the level called name (error, warn, info, debug or packet), <0 if there isn't one
+int parseLogLevel(const char* name);
+
+// trace events
+#define TRACE_TX        1 // a request packet was queued for the device
+#define TRACE_RX        2 // a response packet arrived
+#define TRACE_TIMEOUT   3 // no response arrived in time
+#define TRACE_ERROR     4 // a transfer failed with code
+
+#define TRACE_ENTRIES   16384
+#define TRACE_MAGIC     "SLTRACE1"
+
+// one traced event, the packet fields are copied straight from the frame
+typedef struct _SAT_TRACE_ENTRY
+{
+    long long timeNs;   // CLOCK_MONOTONIC
+    unsigned int address; // address field of the packet, host order
+    short code;         // error code of TRACE_ERROR
+    unsigned char event;
+    unsigned char dir;
+    unsigned char packetLength;
+    unsigned char opcode;
+    unsigned char dataLength;
+    unsigned char checksum;
+} SAT_TRACE_ENTRY, *PSAT_TRACE_ENTRY;
+
+// only a flag is tested while tracing is off
+#define tracePacket(event, packet)  do { if(traceEnabled) recordPacket(event, packet); } while(0)
+#define traceEvent(event, code)     do { if(traceEnabled) recordEvent(event, code); } while(0)
+
+// starts recording packets into the trace ring
+void startTrace();
+
+// records packet, a whole frame starting at the dir byte
+void recordPacket(int event, unsigned char* packet);
+
+// records an event without a packet
+void recordEvent(int event, int code);
+
+// writes the trace ring to filename, oldest entry first
+// Returns 0 for success, <0 for error
+int saveTrace(const char* filename);
+
+// pretty prints a trace written by saveTrace
+// Returns 0 for success, <0 for error
+int decodeTrace(const char* filename);
@@ -1,31 +1,100 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <unistd.h>
 #include <getopt.h>
-#include <ftdi.h>
 #include <string.h>
 #include <sys/stat.h>
-#include "satlink.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <time.h>
+#include "transport.h"
+#include "stream.h"
+#include "satlinkd.h"
+#include "image.h"
+#include "store.h"
 
-#define B375000 375000
+#define NO_ADDRESS  0xFFFFFFFF // -w and -e without an address, for files that carry their own
+
+// options that can appear anywhere on the command line
+static int hashType = HASH_NONE;
+static int resumeDump = 0;
+static int deltaUpload = 0;
+static int fullUpload = 0;
+static int noDaemon = 0;
+static char* traceFile = NULL;
+static char* metricsFile = NULL;
+static char* storeDir = NULL;
+static char* recordFile = NULL;
+static char* replayFile = NULL;
+static double replayScale = 1.0;
+
+// DataLinks picked with --device or --all, more than one runs the command on all of them at once
+#define MAX_FLEET   32
+static char* devices[MAX_FLEET];
+static int numDevices = 0;
+static int allDevices = 0;
+
+// connection to satlinkd when it is running, the DataLink is opened directly otherwise
+static int daemonSocket = -1;
 
 void usage();
-int openFtdiDevice(struct ftdi_context* ftdic, int interface);
-int dumpBiosToFile(struct ftdi_context* ftdic, char* filename);
-int dumpMemoryToFile(struct ftdi_context* ftdic, char* filename, DWORD address, DWORD count);
-int writeFileToMemory(struct ftdi_context* ftdic, char* filename, DWORD address, BYTE execute);
-int closeFtdiDevice(struct ftdi_context* ftdic);
+int dumpBiosToFile(PSAT_TRANSPORT transport, char* filename);
+int dumpMemoryToFile(PSAT_TRANSPORT transport, char* filename, DWORD address, DWORD count);
+int dumpMemoryToStore(PSAT_TRANSPORT transport, char* name, DWORD address, DWORD count);
+int extractSnapshot(char* name, DWORD address, DWORD count, char* filename);
+int writeFileToMemory(PSAT_TRANSPORT transport, char* filename, DWORD address, BYTE execute);
+int writeStreamToMemory(PSAT_TRANSPORT transport, int inFile, DWORD address, BYTE execute);
+int writeImageToMemory(PSAT_TRANSPORT transport, char* filename, BYTE* fileBuf, DWORD count, BYTE execute);
+int listDevices();
+int runFleet(char command, char* filename, DWORD address, DWORD count);
 
 void usage()
 {  
     printf("Satlink Usage:\n");
     printf("satlink -b output.bin\n \t(dumps bios to output.bin)\n");
     printf("satlink -r hex_address count output.bin\n \t(reads count bytes from hex_address to output.bin)\n");
-    printf("satlink -w hex_address input.bin\n \t(writes input.bin to hex_address)\n");
+    printf("satlink -w hex_address input.bin\n \t(writes input.bin to hex_address, - or a FIFO is sent as the data arrives)\n");
     printf("satlink -e hex_address sl.bin\n \t(writes sl.bin to hex_address and then executes it)\n");
+    printf("satlink -w|-e sl.elf\n \t(ELF, S-record and Intel HEX files are loaded at their own addresses, -e jumps to their entry point)\n");
+    printf("satlink --batch jobs.txt\n \t(runs the reads, writes and executes listed in jobs.txt, - for stdin, in one session)\n");
+    printf("satlink --watch addr:len[,addr:len...] [rate [samples]]\n \t(prints the bytes of the regions that change, sampling rate times a second or as fast as possible)\n");
+    printf("satlink --gdb-server port\n \t(lets gdb read and write memory with 'target remote :port', cached in 191 byte blocks)\n");
+    printf("satlink --calibrate\n \t(finds the fastest usb settings for this DataLink and saves them)\n");
+    printf("satlink --store DIR --extract snapshot hex_address count output.bin\n \t(copies count bytes from hex_address of a stored snapshot to output.bin)\n");
+    printf("satlink --store DIR --diff snapshot1 snapshot2\n \t(lists the address ranges that differ between two stored snapshots)\n");
+    printf("satlink --decode-trace trace.bin\n \t(prints a packet trace saved with --trace)\n");
+    printf("satlink --list\n \t(lists the serial number and usb bus path of every DataLink)\n");
+    
+    printf("\nOptions for -b and -r:\n");
+    printf("\t--crc32\tprints the CRC32 of the data as it is written\n");
+    printf("\t--sha1\tprints the SHA-1 of the data as it is written\n");
+    printf("\t--resume\tfinishes a dump that failed part way, only reading what's missing\n");
+    printf("\t--store DIR\tkeeps the dump in the snapshot store DIR, the output file is the snapshot name\n");
+    
+    printf("\nOptions for -w and -e:\n");
+    printf("\t--delta\tonly sends the parts of the file that changed since the last upload to the same address\n");
+    printf("\t--full\tsends the whole file, use it with --delta after the Saturn was reset\n");
+    
+    printf("\nOther options:\n");
+    printf("\t--device id\tuses the DataLink with this serial number or usb bus path, repeat it to use several at once\n");
+    printf("\t--all\truns the command on every DataLink at once. %%s in the output file of -b and -r is\n");
+    printf("\t\treplaced by the serial number, otherwise the serial number is added to the end\n");
+    printf("\t--no-daemon\topens the DataLink directly even if satlinkd is running\n");
+    printf("\t--log level\tshows error, warn, info (the default), debug or packet messages. debug and packet need 'make debug'\n");
+    printf("\t--trace trace.bin\tsaves the header of every packet to trace.bin\n");
+    printf("\t--record file.rec\tsaves every byte sent to and received from the DataLink, with timestamps, to file.rec\n");
+    printf("\t--replay file.rec\truns the command against a recording instead of a DataLink\n");
+    printf("\t--replay-scale x\tmultiplies the recorded timing when replaying, 0 replays as fast as possible (default 1)\n");
+    printf("\t--metrics file\tsaves latency histograms, throughput and error counters on exit, as a Prometheus\n");
+    printf("\t\ttextfile if file ends in .prom, JSON otherwise\n");
     
     printf("\nExamples:\n");
     printf("\tsatlink -b bios.bin\n");
     printf("\tsatlink -e 0x06004000 sl.bin\n");
+    printf("\tsatlink -e sl.elf\n");
+    printf("\tsatlink --all -e 0x06004000 sl.bin\n");
+    printf("\tsatlink --watch 0x060ffc00:16,0x25f80000:4 60\n");
     
     exit(-1);
     
@@ -34,17 +103,101 @@ void usage()
 
 int main(int argc, char **argv)
 {
-    struct ftdi_context ftdic;    
+    SAT_TRANSPORT transport;
+    PSAT_TRANSPORT pTransport;
     int interface = 0;       
     char* filename;
     char command;
     int count;
     DWORD address;
+    DWORD differences;
     int result;
     int execute;
+    int i;
+    int j;
     
     printf("Satlink %s\n", VER);    
     
+    // pull out the options, what's left is the command and its arguments
+    for(i = 1, j = 1; i < argc; i++)
+    {
+        if(strcmp(argv[i], "--crc32") == 0)
+        {
+            hashType = HASH_CRC32;
+        }
+        else if(strcmp(argv[i], "--sha1") == 0)
+        {
+            hashType = HASH_SHA1;
+        }
+        else if(strcmp(argv[i], "--resume") == 0)
+        {
+            resumeDump = 1;
+        }
+        else if(strcmp(argv[i], "--delta") == 0)
+        {
+            deltaUpload = 1;
+        }
+        else if(strcmp(argv[i], "--full") == 0)
+        {
+            fullUpload = 1;
+        }
+        else if(strcmp(argv[i], "--device") == 0 && i + 1 < argc)
+        {
+            if(numDevices == MAX_FLEET)
+            {
+                printf("Can't use more than %d DataLinks!!\n", MAX_FLEET);
+                usage();
+            }
+            devices[numDevices++] = argv[++i];
+        }
+        else if(strcmp(argv[i], "--all") == 0)
+        {
+            allDevices = 1;
+        }
+        else if(strcmp(argv[i], "--no-daemon") == 0)
+        {
+            noDaemon = 1;
+        }
+        else if(strcmp(argv[i], "--log") == 0 && i + 1 < argc)
+        {
+            logLevel = parseLogLevel(argv[++i]);
+            if(logLevel < 0)
+            {
+                printf("Unknown log level %s!!\n", argv[i]);
+                usage();
+            }
+        }
+        else if(strcmp(argv[i], "--trace") == 0 && i + 1 < argc)
+        {
+            traceFile = argv[++i];
+        }
+        else if(strcmp(argv[i], "--metrics") == 0 && i + 1 < argc)
+        {
+            metricsFile = argv[++i];
+        }
+        else if(strcmp(argv[i], "--store") == 0 && i + 1 < argc)
+        {
+            storeDir = argv[++i];
+        }
+        else if(strcmp(argv[i], "--record") == 0 && i + 1 < argc)
+        {
+            recordFile = argv[++i];
+        }
+        else if(strcmp(argv[i], "--replay") == 0 && i + 1 < argc)
+        {
+            replayFile = argv[++i];
+        }
+        else if(strcmp(argv[i], "--replay-scale") == 0 && i + 1 < argc)
+        {
+            replayScale = atof(argv[++i]);
+        }
+        else
+        {
+            argv[j++] = argv[i];
+        }
+    }
+    argc = j;
+    
     // validate cla
     if(argc < 2 || argv[1][0] != '-')
     {
@@ -54,13 +207,166 @@ int main(int argc, char **argv)
     command = argv[1][1];
     execute = 0;
     
-    // open the FTDI device
-    result = openFtdiDevice(&ftdic, interface);
-    if(result != 0)
+    // long commands
+    if(strcmp(argv[1], "--calibrate") == 0)
+    {
+        command = 'C';
+    }
+    else if(strcmp(argv[1], "--batch") == 0)
+    {
+        command = 'B';
+    }
+    else if(strcmp(argv[1], "--watch") == 0)
+    {
+        command = 'W';
+    }
+    else if(strcmp(argv[1], "--gdb-server") == 0)
+    {
+        command = 'G';
+    }
+    
+    // decoding a trace doesn't need the DataLink
+    if(strcmp(argv[1], "--decode-trace") == 0)
+    {
+        if(argc < 3)
+        {
+            printf("Invalid syntax\n");
+            usage();
+        }
+        return decodeTrace(argv[2]) == 0 ? 0 : -1;
+    }
+    
+    // neither does the snapshot store
+    if(strcmp(argv[1], "--extract") == 0 || strcmp(argv[1], "--diff") == 0)
+    {
+        if(storeDir == NULL)
+        {
+            printf("%s needs --store DIR\n", argv[1]);
+            usage();
+        }
+        
+        if(argv[1][2] == 'e' && argc >= 6 && sscanf(argv[3], "0x%x", &address) == 1)
+        {
+            return extractSnapshot(argv[2], address, strtoul(argv[4], NULL, 0), argv[5]) == 0 ? 0 : -1;
+        }
+        if(argv[1][2] == 'd' && argc >= 4)
+        {
+            return diffSnapshots(storeDir, argv[2], argv[3], &differences) == 0 ? 0 : -1;
+        }
+        
+        printf("Invalid syntax\n");
+        usage();
+    }
+    
+    if(strcmp(argv[1], "--list") == 0)
+    {
+        return listDevices() == 0 ? 0 : -1;
+    }
+    
+    // the same command on several DataLinks at once
+    if(allDevices || numDevices > 1)
+    {
+        if(traceFile != NULL || recordFile != NULL || replayFile != NULL)
+        {
+            printf("--trace, --record and --replay only work with one DataLink\n");
+            return -1;
+        }
+        
+        address = 0;
+        count = 0;
+        filename = NULL;
+        if(command == 'b' && argc >= 3)
+        {
+            filename = argv[2];
+            address = BIOS_ADDR;
+            count = BIOS_SIZE;
+        }
+        else if(command == 'r' && argc >= 5 && sscanf(argv[2], "0x%x", &address) == 1)
+        {
+            count = atoi(argv[3]);
+            filename = argv[4];
+        }
+        else if((command == 'w' || command == 'e') && argc >= 4 && sscanf(argv[2], "0x%x", &address) == 1)
+        {
+            filename = argv[3];
+        }
+        else if((command == 'w' || command == 'e') && argc == 3)
+        {
+            filename = argv[2];
+            address = NO_ADDRESS;
+        }
+        
+        if(filename == NULL)
+        {
+            printf("Invalid syntax\n");
+            usage();
+        }
+        
+        return runFleet(command, filename, address, count) == 0 ? 0 : -1;
+    }
+    
+    // satlinkd serves whichever DataLink it opened, a particular one is opened directly. so is one
+    // being recorded, and a replay has no DataLink at all
+    if(!noDaemon && numDevices == 0 && recordFile == NULL && replayFile == NULL)
+    {
+        daemonSocket = connectDaemon();
+    }
+    if(daemonSocket >= 0 && command == 'C')
     {
-        printf("Failed to open FTDI device.\n");
+        printf("satlinkd is using the DataLink, stop it before calibrating.\n");
         return -1;
-    }     
+    }
+    if(command == 'C' && (recordFile != NULL || replayFile != NULL))
+    {
+        printf("--calibrate can't be recorded or replayed\n");
+        return -1;
+    }
+    
+    // open the FTDI device, or the recording standing in for it
+    if(replayFile != NULL)
+    {
+        result = openReplayDevice(&transport, replayFile, replayScale);
+        if(result != 0)
+        {
+            printf("Failed to open recording %s.\n", replayFile);
+            return -1;
+        }
+    }
+    else if(daemonSocket < 0)
+    {
+        result = openFtdiDevice(&transport, interface, numDevices > 0 ? devices[0] : NULL);
+        if(result != 0)
+        {
+            printf("Failed to open FTDI device.\n");
+            return -1;
+        }
+        
+        if(recordFile != NULL && startRecording(&transport, recordFile) != 0)
+        {
+            printf("Failed to record to %s.\n", recordFile);
+            transport.close(&transport);
+            return -1;
+        }
+    }
+    else
+    {
+        printf("Using satlinkd\n");
+        if(traceFile != NULL)
+        {
+            printf("satlinkd is talking to the DataLink, trace it with satlinkd -t instead\n");
+            traceFile = NULL;
+        }
+        if(metricsFile != NULL)
+        {
+            printf("satlinkd is talking to the DataLink, get its metrics with satlinkd -m instead\n");
+            metricsFile = NULL;
+        }
+    }
+    
+    if(traceFile != NULL)
+    {
+        startTrace();
+    }
     
     switch(command)
     {
@@ -75,7 +381,7 @@ int main(int argc, char **argv)
             filename = argv[2];
             
             printf("Dumping bios to %s\n", filename);
-            result = dumpBiosToFile(&ftdic, filename);
+            result = dumpBiosToFile(&transport, filename);
             if(result != 0)
             {
                 printf("Failed to dump bios!!\n");
@@ -109,7 +415,7 @@ int main(int argc, char **argv)
             filename = argv[4];        
             printf("Reading %d bytes from address 0x%x to %s \n", count, address, filename);      
             
-            result = dumpMemoryToFile(&ftdic, filename, address, count);
+            result = dumpMemoryToFile(&transport, filename, address, count);
             if(result != 0)
             {
                 printf("Failed to dump bios!!\n");
@@ -129,25 +435,35 @@ int main(int argc, char **argv)
         case 'w':
         {
             // "satlink -w 0x06004000 input.bin        
-            if(argc < 4)
+            if(argc < 3)
             {
                 printf("Invalid syntax\n");
                 usage();        
             }
             
-            // read the hex address
-            result = sscanf(argv[2], "0x%x", &address);
-            if(result != 1)
+            // ELF, S-record and HEX files have their own addresses
+            if(argc == 3)
             {
-                printf("Failed to convert %s into a valid address!!\n", argv[2]);
-                usage();        
+                filename = argv[2];
+                address = NO_ADDRESS;
+                printf("Writing %s\n", filename);
+            }
+            else
+            {
+                // read the hex address
+                result = sscanf(argv[2], "0x%x", &address);
+                if(result != 1)
+                {
+                    printf("Failed to convert %s into a valid address!!\n", argv[2]);
+                    usage();        
+                }
+                
+                // filename 
+                filename = argv[3];        
+                printf("Writing %s to 0x%x\n", filename, address);
             }
             
-            // filename 
-            filename = argv[3];        
-            printf("Writing %s to 0x%x\n", filename, address);
-            
-            result = writeFileToMemory(&ftdic, filename, address, execute);
+            result = writeFileToMemory(&transport, filename, address, execute);
             if(result != 0)
             {
                 printf("Failed to write file to memory!!\n");
@@ -156,6 +472,72 @@ int main(int argc, char **argv)
             break;
         }
         
+        case 'B':
+        {
+            // satlink --batch jobs.txt
+            if(argc < 3)
+            {
+                printf("Invalid syntax\n");
+                usage();
+            }
+            
+            result = runBatch(&transport, daemonSocket, argv[2]);
+            if(result != 0)
+            {
+                printf("Failed to run %s!!\n", argv[2]);
+            }
+            break;
+        }
+        
+        case 'W':
+        {
+            // satlink --watch addr:len[,addr:len...] [rate [samples]]
+            if(argc < 3)
+            {
+                printf("Invalid syntax\n");
+                usage();
+            }
+            
+            result = watchMemory(&transport, daemonSocket, argv[2], argc >= 4 ? atoi(argv[3]) : 0,
+                                 argc >= 5 ? strtoul(argv[4], NULL, 0) : 0);
+            if(result != 0)
+            {
+                printf("Failed to watch %s!!\n", argv[2]);
+            }
+            break;
+        }
+        
+        case 'G':
+        {
+            // satlink --gdb-server 2345
+            if(argc < 3 || atoi(argv[2]) <= 0 || atoi(argv[2]) > 65535)
+            {
+                printf("Invalid syntax\n");
+                usage();
+            }
+            
+            result = serveGdb(&transport, daemonSocket, atoi(argv[2]));
+            if(result != 0)
+            {
+                printf("Failed to serve gdb!!\n");
+            }
+            break;
+        }
+        
+        case 'C':
+        {
+            // satlink --calibrate
+            result = calibrateLink(&transport);
+            if(result != 0)
+            {
+                printf("Failed to calibrate the DataLink!!\n");
+                break;
+            }
+            
+            printf("Saved calibrated profile for %s\n", transport.serial);
+            break;
+        }
+        
         default: 
         {
             printf("Invalid syntax\n");
@@ -163,170 +545,904 @@ int main(int argc, char **argv)
         }      
     };
     
+    if(traceFile != NULL)
+    {
+        saveTrace(traceFile);
+    }
+    
     // close the FTDI device
-    closeFtdiDevice(&ftdic);
+    if(daemonSocket >= 0)
+    {
+        close(daemonSocket);
+    }
+    else
+    {
+        logLinkStats(&transport);
+        if(metricsFile != NULL)
+        {
+            pTransport = &transport;
+            saveMetrics(metricsFile, &pTransport, 1);
+        }
+        transport.close(&transport);
+    }
     return 0;
 }
 
-int openFtdiDevice(struct ftdi_context* ftdic, int interface)
+// reads length bytes at address to offset of outFile, directly or through satlinkd
+// return 0 for success;
+int readRangeToFile(PSAT_TRANSPORT transport, int outFile, DWORD offset, DWORD address, DWORD length,
+                    PSAT_HASH hash, FILE* journal, DWORD* bytesWritten)
 {
-    int vid = 0x0403; // vendor id
-    int pid = 0x6001; // device idnt f;
-    int f;
+    BYTE* data;
+    DWORD done;
+    ssize_t written;
+    int result;
     
-    // Init  
-    if (ftdi_init(ftdic) < 0)  
+    if(daemonSocket < 0)
     {
-        printf("ftdi_init failed\n");
-        return EXIT_FAILURE;
+        return readSatMemoryToFile(transport, outFile, offset, address, length, hash, journal, bytesWritten);
     }
     
-    // Select first interface
-    ftdi_set_interface(ftdic, interface);
-    
-    // Open device
-    f = ftdi_usb_open(ftdic, vid, pid);
-    if (f < 0)
+    // satlinkd answers with the whole range in a memfd
+    *bytesWritten = 0;
+    result = daemonRead(daemonSocket, address, length, &data);
+    if(result != 0)
     {
-        printf("unable to open ftdi device: %d (%s)\n", f, ftdi_get_error_string(ftdic));
-        return -1;
+        return result;
     }
     
-    // Set baudrate
-    f = ftdi_set_baudrate(ftdic, 375000);
-    if (f < 0)
+    for(done = 0; done < length; done += written)
     {
-        printf("unable to set baudrate: %d (%s)\n", f, ftdi_get_error_string(ftdic));
-        return -1;
+        written = pwrite(outFile, data + done, length - done, offset + done);
+        if(written <= 0)
+        {
+            munmap(data, length);
+            return -13;
+        }
     }
     
-    // set the line property
-    // Data Bits: 8, Stop Bits: 2, Parity Bits: None    
-    f = ftdi_set_line_property(ftdic, BITS_8, STOP_BIT_2, NONE);
-    if(f < 0)
+    if(hash != NULL)
     {
-        printf("unable to set line property: %d (%s)\n", f, ftdi_get_error_string(ftdic));
-        return -1;
+        updateHash(hash, data, length);
     }
+    munmap(data, length);
     
-    return 0;
-}
-
-int closeFtdiDevice(struct ftdi_context* ftdic)
-{     
-    ftdi_usb_close(ftdic);
-    ftdi_deinit(ftdic);
+    if(fdatasync(outFile) != 0)
+    {
+        return -13;
+    }
+    journalRange(journal, offset, length);
     
+    *bytesWritten = length;
     return 0;
 }
 
-// writes the count bytes of address to filename
+// hashes the whole of filename, used when a resumed dump wasn't read in order
 // return 0 for success;
-int dumpMemoryToFile(struct ftdi_context* ftdic, char* filename, DWORD address, DWORD count)
+int hashFile(char* filename, PSAT_HASH hash)
 {
-    FILE* outFile;
-    BYTE* fileBuf;
-    int result;    
-    
-    fileBuf = malloc(count);
-    if(fileBuf == 0)
-    {
-        printf("Failed to allocate filebuffer!!\n");
-        return -1;      
-    } 
-    memset(fileBuf, 0, count);
+    BYTE buffer[65536];
+    FILE* file;
+    size_t length;
     
-    outFile = fopen(filename, "w");
-    if(outFile == NULL)
+    file = fopen(filename, "r");
+    if(file == NULL)
     {
-        printf("Failed to open %s for writing!!\n", filename);
-        return -2;
+        return -1;
     }
     
-    result = readSatMemory(ftdic, fileBuf, address, count);
-    if(result != 0)
+    while((length = fread(buffer, 1, sizeof(buffer), file)) > 0)
     {
-        printf("readSatMemory failed!!\n");
-        return -3;
+        updateHash(hash, buffer, length);
     }
     
-    result = fwrite(fileBuf, 1, count, outFile);
-    if(result != count)
-    {
-        printf("Didn't write enough bytes!!\n");
-        return -4;
-    } 
-    
-    fclose(outFile);    
-    return 0;  
-}
-
-int dumpBiosToFile(struct ftdi_context* ftdic, char* filename)
-{
-    // this is just a wrapper for dump memory
-    return dumpMemoryToFile(ftdic, filename, BIOS_ADDR, BIOS_SIZE);
+    fclose(file);
+    return 0;
 }
 
-int writeFileToMemory(struct ftdi_context* ftdic, char* filename, DWORD address, BYTE execute)
+// writes the count bytes of address to filename
+// the data is written to the file as it arrives, so memory use doesn't depend on count. every range that
+// is on disk is recorded in filename.journal, so a failed dump can be finished later with --resume
+// return 0 for success;
+int dumpMemoryToFile(PSAT_TRANSPORT transport, char* filename, DWORD address, DWORD count)
 {
-    FILE* inFile;
-    BYTE* fileBuf;
-    struct stat status;
-    int result;    
-    DWORD count = 0;
+    SAT_HASH hash;
+    SAT_RANGE whole;
+    PSAT_RANGE missing;
+    FILE* journal;
+    char journalPath[4096];
+    char hex[41];
+    DWORD bytesWritten;
+    DWORD offset;
+    DWORD length;
+    int numMissing;
+    int outFile;
+    int result;
+    int i;
     
-    // get the filesize
-    result = stat(filename, &status);
-    if(result != 0)
+    if(storeDir != NULL)
     {
-        printf("Failed to stat %s\n", filename);
-        return -1;
+        return dumpMemoryToStore(transport, filename, address, count);
     }
-    count = status.st_size;
-    
-    // open the file for reading
-    inFile = fopen(filename, "r");
-    if(inFile == NULL)
-    {
-        printf("Failed to open %s for writing!!\n", filename);
-        return -2;
-    }      
-    
-    fileBuf = malloc(count);
-    if(fileBuf == 0)
-    {
-        printf("Failed to allocate filebuffer!!\n");
-        return -3;      
-    } 
-    memset(fileBuf, 0, count);
     
-    printf("The file is %d bytes\n", count);
+    snprintf(journalPath, sizeof(journalPath), "%s.journal", filename);
     
-    // read the file to the buffer
-    result = fread(fileBuf, 1, count, inFile);
-    if(result != count)
+    if(resumeDump)
     {
-        printf("Didn't read enough bytes!!\n");
-        return -4;
-    }     
-    
-    if(execute)
-    {      
-        result = writeSatMemoryAndExecute(ftdic, address, fileBuf, count);
+        // only the ranges that aren't in the journal yet are read
+        numMissing = loadJournal(journalPath, address, count, &missing);
+        if(numMissing < 0)
+        {
+            printf("Can't resume the dump without its journal!!\n");
+            return -5;
+        }
+        outFile = open(filename, O_WRONLY | O_CREAT, 0644);
     }
     else
     {
-        result = writeSatMemory(ftdic, address, fileBuf, count);
+        whole.offset = 0;
+        whole.length = count;
+        missing = &whole;
+        numMissing = 1;
+        outFile = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
     }
-    if(result != 0)
+    
+    if(outFile < 0)
     {
-        printf("readSatMemory failed!!\n");
-        return -3;
+        printf("Failed to open %s for writing!!\n", filename);
+        result = -2;
+        goto done;
+    }
+    
+    journal = openJournal(journalPath, address, count, resumeDump);
+    if(journal == NULL)
+    {
+        printf("Failed to open %s for writing!!\n", journalPath);
+        close(outFile);
+        result = -2;
+        goto done;
     }
     
-    free(fileBuf);
-    fclose(inFile);    
-    return 0;  
+    initHash(&hash, hashType);
+    result = 0;
     
+    for(i = 0; i < numMissing; i++)
+    {
+        offset = missing[i].offset;
+        length = missing[i].length;
+        
+        // reads have to be atleast 4 bytes, read a little of what's already there
+        if(length < 4 && count >= 4)
+        {
+            offset = offset + length >= 4 ? offset + length - 4 : 0;
+            length = 4;
+        }
+        
+        if(resumeDump)
+        {
+            printf("Reading the missing %d bytes at 0x%x\n", length, address + offset);
+        }
+        
+        // a resumed dump isn't read in order so it is hashed from the file at the end
+        result = readRangeToFile(transport, outFile, offset, address + offset, length,
+                                     hashType != HASH_NONE && !resumeDump ? &hash : NULL, journal, &bytesWritten);
+        if(result != 0)
+        {
+            printf("readSatMemory failed after %d bytes!! Run the same command with --resume to finish the dump\n", bytesWritten);
+            result = -3;
+            break;
+        }
+    }
+    
+    fclose(journal);
+    
+    if(close(outFile) != 0 && result == 0)
+    {
+        printf("Didn't write enough bytes!!\n");
+        result = -4;
+    }
+    
+    if(result == 0)
+    {
+        // everything is on disk, the journal isn't needed anymore
+        unlink(journalPath);
+        
+        if(hashType != HASH_NONE)
+        {
+            if(resumeDump)
+            {
+                hashFile(filename, &hash);
+            }
+            finishHash(&hash, hex);
+            printf("%s: %s\n", getHashName(hashType), hex);
+        }
+    }
+    
+done:
+    if(missing != &whole)
+    {
+        free(missing);
+    }
+    
+    return result;  
+}
+
+// reads the count bytes of address and keeps them as snapshot name in storeDir
+// return 0 for success;
+int dumpMemoryToStore(PSAT_TRANSPORT transport, char* name, DWORD address, DWORD count)
+{
+    STORE_STATS stats;
+    SAT_HASH hash;
+    char hex[41];
+    BYTE* buffer;
+    int result;
+    
+    // the snapshot only exists once it is complete, there is nothing to resume
+    if(resumeDump)
+    {
+        printf("--resume doesn't work with --store, dump the snapshot again\n");
+        return -5;
+    }
+    
+    buffer = malloc(count);
+    if(buffer == NULL)
+    {
+        printf("Failed to allocate %u bytes!!\n", count);
+        return -1;
+    }
+    
+    result = readSatMemoryVia(transport, daemonSocket, buffer, address, count);
+    if(result != 0)
+    {
+        printf("readSatMemory failed!!\n");
+        free(buffer);
+        return -3;
+    }
+    
+    if(hashType != HASH_NONE)
+    {
+        initHash(&hash, hashType);
+        updateHash(&hash, buffer, count);
+        finishHash(&hash, hex);
+        printf("%s: %s\n", getHashName(hashType), hex);
+    }
+    
+    result = saveSnapshot(storeDir, name, address, buffer, count, &stats);
+    free(buffer);
+    if(result != 0)
+    {
+        printf("Failed to store snapshot %s in %s!!\n", name, storeDir);
+        return -2;
+    }
+    
+    printf("Stored %s in %s: %u chunks, %u new (%u bytes compressed)\n", name, storeDir, stats.chunks,
+           stats.newChunks, stats.newBytes);
+    return 0;
+}
+
+// copies count bytes at address out of snapshot name in storeDir to filename
+// return 0 for success;
+int extractSnapshot(char* name, DWORD address, DWORD count, char* filename)
+{
+    BYTE* buffer;
+    FILE* file;
+    int result;
+    
+    buffer = malloc(count);
+    if(buffer == NULL)
+    {
+        printf("Failed to allocate %u bytes!!\n", count);
+        return -1;
+    }
+    
+    result = readSnapshot(storeDir, name, address, buffer, count);
+    if(result != 0)
+    {
+        printf("Failed to read 0x%x bytes at 0x%x from snapshot %s!!\n", count, address, name);
+        free(buffer);
+        return -2;
+    }
+    
+    file = fopen(filename, "w");
+    if(file == NULL || fwrite(buffer, 1, count, file) != count || fclose(file) != 0)
+    {
+        printf("Failed to write %s!!\n", filename);
+        free(buffer);
+        return -3;
+    }
+    
+    free(buffer);
+    printf("Extracted %u bytes at 0x%x from %s to %s\n", count, address, name, filename);
+    return 0;
+}
+
+int dumpBiosToFile(PSAT_TRANSPORT transport, char* filename)
+{
+    // this is just a wrapper for dump memory
+    return dumpMemoryToFile(transport, filename, BIOS_ADDR, BIOS_SIZE);
+}
+
+// uploads a pipe or FIFO as its data arrives
+// return 0 for success;
+int writeStreamToMemory(PSAT_TRANSPORT transport, int inFile, DWORD address, BYTE execute)
+{
+    BYTE buffer[65536];
+    DWORD bytesSent;
+    DWORD count;
+    ssize_t length;
+    int memFile;
+    int result;
+    
+    // satlinkd maps the data it uploads, so the stream is collected in a memfd first
+    if(daemonSocket >= 0)
+    {
+        memFile = memfd_create("satlink-upload", MFD_CLOEXEC);
+        if(memFile < 0)
+        {
+            printf("Failed to create a memfd for the upload!!\n");
+            return -3;
+        }
+        
+        count = 0;
+        while((length = read(inFile, buffer, sizeof(buffer))) > 0)
+        {
+            if(write(memFile, buffer, length) != length)
+            {
+                break;
+            }
+            count += length;
+        }
+        
+        if(length != 0 || count == 0)
+        {
+            printf("Failed to read the input!!\n");
+            close(memFile);
+            return -4;
+        }
+        
+        printf("Read %d bytes\n", count);
+        result = daemonWrite(daemonSocket, address, memFile, count, execute, 0, &bytesSent);
+        close(memFile);
+        if(result != 0)
+        {
+            printf("satlinkd failed to write the file!!\n");
+            return -3;
+        }
+        return 0;
+    }
+    
+    // the whole image is never in memory, so there is nothing to compare with or keep for --delta
+    if(deltaUpload && !fullUpload)
+    {
+        printf("--delta needs a regular file, sending all of it\n");
+    }
+    dropShadow(transport->serial, address, 0xffffffff - address); // how far it goes isn't known yet
+    
+    result = writeSatMemoryFromFd(transport, inFile, address, execute, &count);
+    if(result != 0)
+    {
+        printf("Failed after %d bytes!!\n", count);
+        return -3;
+    }
+    
+    printf("Sent %d bytes\n", count);
+    return 0;
+}
+
+int writeFileToMemory(PSAT_TRANSPORT transport, char* filename, DWORD address, BYTE execute)
+{
+    BYTE header[4];
+    struct stat status;
+    BYTE* fileBuf;
+    DWORD bytesSent;
+    DWORD count;
+    int inFile;
+    int format;
+    int result;
+    
+    // - is stdin, so a build can pipe its image straight in
+    inFile = strcmp(filename, "-") == 0 ? dup(0) : open(filename, O_RDONLY | O_CLOEXEC);
+    if(inFile < 0)
+    {
+        printf("Failed to open %s for reading!!\n", filename);
+        return -2;
+    }
+    
+    if(fstat(inFile, &status) != 0)
+    {
+        printf("Failed to stat %s\n", filename);
+        close(inFile);
+        return -1;
+    }
+    
+    // pipes and FIFOs don't have a size, they are sent as the data comes in
+    if(!S_ISREG(status.st_mode) && address == NO_ADDRESS)
+    {
+        printf("Only a flat binary can be sent from a pipe, it needs an address\n");
+        close(inFile);
+        return -1;
+    }
+    if(!S_ISREG(status.st_mode))
+    {
+        result = writeStreamToMemory(transport, inFile, address, execute);
+        close(inFile);
+        return result;
+    }
+    
+    count = status.st_size;
+    if(count == 0)
+    {
+        printf("%s is empty!!\n", filename);
+        close(inFile);
+        return -1;
+    }
+    
+    printf("The file is %d bytes\n", count);
+    
+    // anything but a flat binary says where it goes itself. a flat binary can start like a text image
+    // though, so with an address given it's only taken as one when all of it parses
+    format = IMAGE_BIN;
+    if(pread(inFile, header, sizeof(header), 0) > 0)
+    {
+        format = getImageFormat(header, count < sizeof(header) ? count : sizeof(header));
+    }
+    
+    if(format != IMAGE_BIN)
+    {
+        fileBuf = mmap(NULL, count, PROT_READ, MAP_PRIVATE, inFile, 0);
+        if(fileBuf == MAP_FAILED)
+        {
+            printf("Failed to map %s!!\n", filename);
+            close(inFile);
+            return -3;
+        }
+    
+        if(format != IMAGE_ELF && address != NO_ADDRESS && !isTextImage(fileBuf, count))
+        {
+            logInfo("%s starts like %s but isn't, sending it as a flat binary\n", filename, getImageFormatName(format));
+            munmap(fileBuf, count);
+            format = IMAGE_BIN;
+        }
+    }
+    
+    if(format != IMAGE_BIN)
+    {
+        close(inFile);
+        if(address != NO_ADDRESS)
+        {
+            printf("%s has its own load addresses, ignoring 0x%x\n", filename, address);
+        }
+    
+        result = writeImageToMemory(transport, filename, fileBuf, count, execute);
+        munmap(fileBuf, count);
+        return result;
+    }
+    
+    if(address == NO_ADDRESS)
+    {
+        printf("%s is a flat binary, it needs an address\n", filename);
+        close(inFile);
+        return -1;
+    }
+    
+    // satlinkd maps the file itself, it doesn't have to be read here
+    if(daemonSocket >= 0)
+    {
+        result = daemonWrite(daemonSocket, address, inFile, count, execute,
+                             deltaUpload && !fullUpload ? SATLINKD_DELTA : 0, &bytesSent);
+        close(inFile);
+        if(result != 0)
+        {
+            printf("satlinkd failed to write the file!!\n");
+            return -3;
+        }
+        
+        if(bytesSent != count)
+        {
+            printf("Sent %d of %d bytes\n", bytesSent, count);
+        }
+        return 0;
+    }
+    
+    // map the file rather than copying it, the pages are read in as the upload gets to them
+    fileBuf = mmap(NULL, count, PROT_READ, MAP_PRIVATE, inFile, 0);
+    close(inFile);
+    if(fileBuf == MAP_FAILED)
+    {
+        printf("Failed to map %s!!\n", filename);
+        return -3;
+    }
+    madvise(fileBuf, count, MADV_SEQUENTIAL);
+    
+    result = uploadImage(transport, address, fileBuf, count, execute, deltaUpload && !fullUpload, &bytesSent);
+    munmap(fileBuf, count);
+    if(result != 0)
+    {
+        printf("writeSatMemory failed!!\n");
+        return -3;
+    }
+    
+    if(bytesSent != count)
+    {
+        printf("Sent %d of %d bytes\n", bytesSent, count);
+    }
+    
+    return 0;
+}
+
+// uploads length bytes of data to address, executing it if execute is set, directly or through satlinkd
+// return 0 for success;
+static int writeSegmentToMemory(PSAT_TRANSPORT transport, DWORD address, BYTE* data, DWORD length, BYTE execute, DWORD* bytesSent)
+{
+    int result;
+    int fd;
+    
+    if(daemonSocket < 0)
+    {
+        return uploadImage(transport, address, data, length, execute, deltaUpload && !fullUpload, bytesSent);
+    }
+    
+    // satlinkd maps what it uploads from an fd
+    fd = memfd_create("satlink-segment", MFD_CLOEXEC);
+    if(fd < 0)
+    {
+        return -20;
+    }
+    
+    if(write(fd, data, length) != length)
+    {
+        close(fd);
+        return -21;
+    }
+    
+    result = daemonWrite(daemonSocket, address, fd, length, execute, deltaUpload && !fullUpload ? SATLINKD_DELTA : 0, bytesSent);
+    close(fd);
+    return result;
+}
+
+// uploads the segments of an ELF, S-record or HEX file. with execute the segment holding the entry
+// point is sent last, from the entry point on, so its first packet is the WRITE_EXECUTE
+// return 0 for success;
+int writeImageToMemory(PSAT_TRANSPORT transport, char* filename, BYTE* fileBuf, DWORD count, BYTE execute)
+{
+    SAT_IMAGE image;
+    DWORD bytesSent;
+    DWORD loaded;
+    DWORD sent;
+    int entrySegment;
+    int result;
+    int i;
+    
+    if(loadImage(fileBuf, count, &image) != 0)
+    {
+        printf("Failed to load %s!!\n", filename);
+        return -1;
+    }
+    
+    loaded = 0;
+    for(i = 0; i < image.numSegments; i++)
+    {
+        loaded += image.segments[i].length;
+    }
+    printf("%s is %s, %d bytes in %d segments", filename, getImageFormatName(image.format), loaded, image.numSegments);
+    if(image.hasEntry)
+    {
+        printf(", entry point 0x%x", image.entry);
+    }
+    printf("\n");
+    
+    entrySegment = -1;
+    if(execute)
+    {
+        // a file without an entry point is run from its lowest address, like a flat binary
+        if(!image.hasEntry)
+        {
+            image.entry = image.segments[0].address;
+        }
+    
+        entrySegment = splitImageAt(&image, image.entry);
+        if(entrySegment < 0)
+        {
+            printf("The entry point 0x%x isn't in any segment of %s!!\n", image.entry, filename);
+            freeImage(&image);
+            return -1;
+        }
+    }
+    
+    result = 0;
+    sent = 0;
+    for(i = 0; i <= image.numSegments && result == 0; i++)
+    {
+        // the entry segment goes in the extra last turn
+        if(i == entrySegment || (i == image.numSegments && entrySegment < 0))
+        {
+            continue;
+        }
+    
+        if(i < image.numSegments)
+        {
+            logInfo("Writing 0x%x bytes to 0x%x\n", image.segments[i].length, image.segments[i].address);
+            result = writeSegmentToMemory(transport, image.segments[i].address, image.segments[i].data,
+                                          image.segments[i].length, 0, &bytesSent);
+        }
+        else
+        {
+            logInfo("Writing 0x%x bytes to 0x%x and executing it\n", image.segments[entrySegment].length, image.entry);
+            result = writeSegmentToMemory(transport, image.entry, image.segments[entrySegment].data,
+                                          image.segments[entrySegment].length, 1, &bytesSent);
+        }
+        sent += bytesSent;
+    }
+    
+    freeImage(&image);
+    if(result != 0)
+    {
+        printf("writeSatMemory failed!!\n");
+        return -3;
+    }
+    
+    if(sent != loaded)
+    {
+        printf("Sent %d of %d bytes\n", sent, loaded);
+    }
+    
+    return 0;
+}
+
+int listDevices()
+{
+    SAT_DEVICE_INFO found[MAX_FLEET];
+    int count;
+    int i;
+    
+    count = listFtdiDevices(found, MAX_FLEET);
+    if(count < 0)
+    {
+        return -1;
+    }
+    
+    printf("%d DataLinks\n", count);
+    for(i = 0; i < count; i++)
+    {
+        printf("%-16s %s\n", found[i].serial[0] != '\0' ? found[i].serial : "(in use)", found[i].path);
+    }
+    
+    return 0;
+}
+
+// one DataLink of a fleet, each has its own thread and FTDI context
+typedef struct _FLEET_WORKER
+{
+    SAT_TRANSPORT transport;
+    char device[MAX_BUS_PATH + MAX_SERIAL];   // serial number or bus path to open
+    char filename[4096];
+    char command;
+    DWORD address;
+    DWORD count;
+    pthread_t thread;
+    int started;
+    int result;
+    double seconds;
+    int opened;         // the DataLink is open and its byte counter counts, set and read with atomics
+    int finished;       // result and seconds are set, set and read with atomics
+} FLEET_WORKER, *PFLEET_WORKER;
+
+static double getTime()
+{
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// opens the worker's DataLink and runs its command. the usb setup of every DataLink happens in parallel too
+static void* runFleetWorker(void* context)
+{
+    PFLEET_WORKER worker = (PFLEET_WORKER)context;
+    double start;
+    
+    start = getTime();
+    
+    worker->result = openFtdiDevice(&worker->transport, 0, worker->device);
+    if(worker->result == 0)
+    {
+        __atomic_store_n(&worker->opened, 1, __ATOMIC_RELEASE);
+        if(worker->command == 'w' || worker->command == 'e')
+        {
+            worker->result = writeFileToMemory(&worker->transport, worker->filename, worker->address, worker->command == 'e');
+        }
+        else
+        {
+            worker->result = dumpMemoryToFile(&worker->transport, worker->filename, worker->address, worker->count);
+        }
+        logLinkStats(&worker->transport);
+    }
+    
+    worker->seconds = getTime() - start;
+    __atomic_store_n(&worker->finished, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+// builds the dump file of a DataLink, %s in filename is replaced by its serial number
+static void getFleetFilename(char* filename, const char* id, char* path, int size)
+{
+    char* marker;
+    
+    marker = strstr(filename, "%s");
+    if(marker == NULL)
+    {
+        snprintf(path, size, "%s.%s", filename, id);
+        return;
+    }
+    
+    snprintf(path, size, "%.*s%s%s", (int)(marker - filename), filename, id, marker + 2);
+}
+
+// runs command on every DataLink picked with --device or --all at once, printing the combined
+// progress every second and a summary at the end
+// return 0 if it worked on all of them;
+int runFleet(char command, char* filename, DWORD address, DWORD count)
+{
+    SAT_DEVICE_INFO found[MAX_FLEET];
+    PSAT_TRANSPORT transports[MAX_FLEET];
+    PFLEET_WORKER workers;
+    struct stat status;
+    DWORD expected;
+    DWORD done;
+    DWORD bytes;
+    double start;
+    double elapsed;
+    double nextReport;
+    int numWorkers;
+    int finished;
+    int failed;
+    int opened;
+    int i;
+    
+    // uploads send the same file to every DataLink
+    if(command == 'w' || command == 'e')
+    {
+        if(stat(filename, &status) != 0 || !S_ISREG(status.st_mode))
+        {
+            printf("Uploading to several DataLinks needs a regular file, %s isn't one\n", filename);
+            return -1;
+        }
+        count = status.st_size;
+    }
+    
+    numWorkers = numDevices;
+    if(allDevices)
+    {
+        numWorkers = listFtdiDevices(found, MAX_FLEET);
+        if(numWorkers <= 0)
+        {
+            printf("No DataLinks found!!\n");
+            return -1;
+        }
+    }
+    
+    workers = calloc(numWorkers, sizeof(FLEET_WORKER));
+    if(workers == NULL)
+    {
+        printf("Failed to allocate the fleet!!\n");
+        return -1;
+    }
+    
+    for(i = 0; i < numWorkers; i++)
+    {
+        // the bus path also finds DataLinks whose serial number couldn't be read
+        snprintf(workers[i].device, sizeof(workers[i].device), "%s", allDevices ? found[i].path : devices[i]);
+        workers[i].command = command;
+        workers[i].address = address;
+        workers[i].count = count;
+        
+        if(command == 'w' || command == 'e')
+        {
+            snprintf(workers[i].filename, sizeof(workers[i].filename), "%s", filename);
+        }
+        else
+        {
+            getFleetFilename(filename, allDevices && found[i].serial[0] != '\0' ? found[i].serial : workers[i].device,
+                             workers[i].filename, sizeof(workers[i].filename));
+        }
+    }
+    
+    printf("Running on %d DataLinks\n", numWorkers);
+    start = getTime();
+    
+    for(i = 0; i < numWorkers; i++)
+    {
+        workers[i].started = pthread_create(&workers[i].thread, NULL, runFleetWorker, &workers[i]) == 0;
+        if(!workers[i].started)
+        {
+            workers[i].result = -20;
+            workers[i].finished = 1;
+        }
+    }
+    
+    // the workers add to their byte counters with atomic stores, a slightly stale value just makes the
+    // line a little behind. a DataLink that failed doesn't count towards what's done
+    expected = count * numWorkers;
+    nextReport = 1;
+    do
+    {
+        usleep(100000);
+        
+        finished = 0;
+        done = 0;
+        for(i = 0; i < numWorkers; i++)
+        {
+            bytes = 0;
+            if(__atomic_load_n(&workers[i].finished, __ATOMIC_ACQUIRE))
+            {
+                finished++;
+                bytes = workers[i].result == 0 ? count : 0;
+            }
+            else if(__atomic_load_n(&workers[i].opened, __ATOMIC_ACQUIRE))
+            {
+                bytes = __atomic_load_n(&workers[i].transport.link.stats.bytes, __ATOMIC_RELAXED);
+            }
+            done += bytes < count ? bytes : count;
+        }
+        
+        elapsed = getTime() - start;
+        if(finished < numWorkers && elapsed >= nextReport)
+        {
+            nextReport += 1;
+            printf("%d of %d done, %3.0f%%, %.0f bytes/s\n", finished, numWorkers,
+                   expected ? 100.0 * done / expected : 100.0, done / elapsed);
+        }
+    } while(finished < numWorkers);
+    
+    for(i = 0; i < numWorkers; i++)
+    {
+        if(workers[i].started)
+        {
+            pthread_join(workers[i].thread, NULL);
+        }
+    }
+    elapsed = getTime() - start;
+    
+    failed = 0;
+    bytes = 0;
+    for(i = 0; i < numWorkers; i++)
+    {
+        if(workers[i].result != 0)
+        {
+            printf("%-16s %-12s FAILED (%d)\n", workers[i].transport.serial, workers[i].device, workers[i].result);
+            failed++;
+            continue;
+        }
+    
+        bytes += count;
+        printf("%-16s %-12s %8d bytes  %7.2f s  %8.0f bytes/s  %d retries\n", workers[i].transport.serial, workers[i].device,
+               count, workers[i].seconds, count / workers[i].seconds, workers[i].transport.link.stats.retries);
+    }
+    printf("%d of %d DataLinks done, %d bytes in %.2f s, %.0f bytes/s\n", numWorkers - failed, numWorkers, bytes,
+           elapsed, bytes / elapsed);
+    
+    // one file with a set of metrics for every DataLink that opened
+    if(metricsFile != NULL)
+    {
+        opened = 0;
+        for(i = 0; i < numWorkers; i++)
+        {
+            if(workers[i].transport.ctx != NULL)
+            {
+                transports[opened++] = &workers[i].transport;
+            }
+        }
+        saveMetrics(metricsFile, transports, opened);
+    }
+    
+    for(i = 0; i < numWorkers; i++)
+    {
+        if(workers[i].transport.ctx != NULL)
+        {
+            workers[i].transport.close(&workers[i].transport);
+        }
+    }
     
+    free(workers);
+    return failed ? -1 : 0;
 }
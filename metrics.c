@@ -0,0 +1,351 @@
+//
+// Link metrics. satlink.c times every request from the moment it is handed to the transport until
+// its response is in and adds it to a latency histogram of the request's opcode, and counts the bytes
+// and the time spent in transfers. --metrics saves them when satlink exits (satlinkd -m while it runs)
+// as JSON or as a Prometheus textfile, so link health can be tracked across hosts and cables.
+//
+
+#include <time.h>
+#include "transport.h"
+
+#define PROM_BUCKETS 12 // le bounds of the Prometheus histogram
+
+static const BYTE metricOpcodes[METRIC_OPCODES] = { READ_START, READ_CONT, READ_END, WRITE, WRITE_EXECUTE };
+static const char* metricOpcodeNames[METRIC_OPCODES] = { "read_start", "read_cont", "read_end", "write", "write_execute" };
+
+// upper bounds in microseconds, +Inf is added after them
+static const DWORD promBucketsUs[PROM_BUCKETS] = { 250, 500, 1000, 2000, 4000, 8000, 16000, 32000, 64000, 128000, 256000, 1000000 };
+
+void resetLinkMetrics(PSAT_LINK_METRICS metrics)
+{
+    int i;
+    
+    memset(metrics, 0, sizeof(SAT_LINK_METRICS));
+    for(i = 0; i < METRIC_OPCODES; i++)
+    {
+        metrics->latency[i].minUs = 0xFFFFFFFF;
+    }
+}
+
+// returns the bucket of value
+static int getLatencyBucket(DWORD value)
+{
+    int exponent;
+    
+    if(value < LATENCY_SUB_BUCKETS)
+    {
+        return value;
+    }
+    
+    // the top 4 bits below the highest set bit pick the sub bucket
+    exponent = 31 - __builtin_clz(value);
+    return (exponent - 3) * LATENCY_SUB_BUCKETS + ((value >> (exponent - 4)) & (LATENCY_SUB_BUCKETS - 1));
+}
+
+// returns the largest value that lands in bucket
+static DWORD getBucketLimit(int bucket)
+{
+    int exponent;
+    
+    if(bucket < LATENCY_SUB_BUCKETS)
+    {
+        return bucket;
+    }
+    
+    exponent = bucket / LATENCY_SUB_BUCKETS + 3;
+    return (((unsigned long long)(LATENCY_SUB_BUCKETS + bucket % LATENCY_SUB_BUCKETS + 1)) << (exponent - 4)) - 1;
+}
+
+void recordLatency(PSAT_LINK_METRICS metrics, BYTE opcode, long long ns)
+{
+    PSAT_LATENCY_HISTOGRAM histogram;
+    DWORD us;
+    int i;
+    
+    for(i = 0; i < METRIC_OPCODES && metricOpcodes[i] != opcode; i++)
+    {
+    }
+    if(i == METRIC_OPCODES)
+    {
+        return;
+    }
+    histogram = &metrics->latency[i];
+    
+    us = ns < 0 ? 0 : ns / 1000 > 0xFFFFFFFF ? 0xFFFFFFFF : ns / 1000;
+    
+    metricAdd(histogram->counts[getLatencyBucket(us)], 1);
+    metricAdd(histogram->count, 1);
+    metricAdd(histogram->sumUs, us);
+    if(us < histogram->minUs)
+    {
+        __atomic_store_n(&histogram->minUs, us, __ATOMIC_RELAXED);
+    }
+    if(us > histogram->maxUs)
+    {
+        __atomic_store_n(&histogram->maxUs, us, __ATOMIC_RELAXED);
+    }
+}
+
+DWORD getLatencyPercentile(PSAT_LATENCY_HISTOGRAM histogram, double percentile)
+{
+    unsigned long long wanted;
+    unsigned long long seen;
+    DWORD limit;
+    int i;
+    
+    if(histogram->count == 0)
+    {
+        return 0;
+    }
+    
+    wanted = (unsigned long long)(histogram->count * percentile / 100.0 + 0.5);
+    if(wanted < 1)
+    {
+        wanted = 1;
+    }
+    
+    seen = 0;
+    for(i = 0; i < LATENCY_BUCKETS; i++)
+    {
+        seen += histogram->counts[i];
+        if(seen >= wanted)
+        {
+            break;
+        }
+    }
+    
+    // the bucket only says roughly where the value is, the exact max is known though
+    limit = getBucketLimit(i < LATENCY_BUCKETS ? i : LATENCY_BUCKETS - 1);
+    return limit > histogram->maxUs ? histogram->maxUs : limit;
+}
+
+// returns the number of samples at or below us
+static unsigned long long countLatencyBelow(PSAT_LATENCY_HISTOGRAM histogram, DWORD us)
+{
+    unsigned long long count;
+    int i;
+    
+    // a bucket that straddles us isn't counted, so the buckets only ever err on the slow side
+    count = 0;
+    for(i = 0; i < LATENCY_BUCKETS && getBucketLimit(i) <= us; i++)
+    {
+        count += histogram->counts[i];
+    }
+    
+    return count;
+}
+
+// a snapshot of everything saved for one DataLink
+typedef struct _LINK_REPORT
+{
+    const char* serial;
+    const char* transport;
+    SAT_LINK_STATS stats;
+    SAT_LINK_METRICS* metrics;
+    double busySeconds;
+    double bytesPerSecond;
+    double wireEfficiency;  // bytes/s against the 375000 baud 8N2 serial line
+} LINK_REPORT, *PLINK_REPORT;
+
+static void getLinkReport(PSAT_TRANSPORT transport, PLINK_REPORT report)
+{
+    PSAT_LINK_METRICS metrics = &transport->link.metrics;
+    unsigned long long bytes;
+    
+    report->serial = transport->serial;
+    report->transport = transport->name;
+    getLinkStats(transport, &report->stats);
+    report->metrics = metrics;
+    
+    bytes = __atomic_load_n(&metrics->bytesRead, __ATOMIC_RELAXED) + __atomic_load_n(&metrics->bytesWritten, __ATOMIC_RELAXED);
+    report->busySeconds = __atomic_load_n(&metrics->busyNs, __ATOMIC_RELAXED) / 1e9;
+    report->bytesPerSecond = report->busySeconds > 0 ? bytes / report->busySeconds : 0;
+    report->wireEfficiency = report->bytesPerSecond / ((double)BAUD_RATE / BITS_PER_BYTE);
+}
+
+static void writeJson(FILE* file, PLINK_REPORT reports, int count)
+{
+    PSAT_LATENCY_HISTOGRAM histogram;
+    PLINK_REPORT report;
+    int i;
+    int j;
+    
+    fprintf(file, "{\n  \"version\": \"%s\",\n  \"wire_bytes_per_second\": %.1f,\n  \"links\": [\n", VER, (double)BAUD_RATE / BITS_PER_BYTE);
+    
+    for(i = 0; i < count; i++)
+    {
+        report = &reports[i];
+        fprintf(file, "    {\n      \"serial\": \"%s\",\n      \"transport\": \"%s\",\n", report->serial, report->transport);
+        fprintf(file, "      \"bytes_read\": %llu,\n      \"bytes_written\": %llu,\n      \"transfers\": %llu,\n",
+                report->metrics->bytesRead, report->metrics->bytesWritten, report->metrics->transfers);
+        fprintf(file, "      \"busy_seconds\": %.6f,\n      \"bytes_per_second\": %.1f,\n      \"wire_efficiency\": %.4f,\n",
+                report->busySeconds, report->bytesPerSecond, report->wireEfficiency);
+        fprintf(file, "      \"packets\": %u,\n      \"retries\": %u,\n      \"timeouts\": %u,\n      \"bad_packets\": %u,\n"
+                "      \"checksum_errors\": %u,\n      \"error_responses\": %u,\n      \"resync_bytes\": %u,\n      \"shrinks\": %u,\n",
+                report->stats.packets, report->stats.retries, report->stats.timeouts, report->stats.badPackets,
+                report->stats.checksumErrors, report->stats.errorResps, report->stats.resyncBytes, report->stats.shrinks);
+    
+        fprintf(file, "      \"latency_us\": {\n");
+        for(j = 0; j < METRIC_OPCODES; j++)
+        {
+            histogram = &report->metrics->latency[j];
+            fprintf(file, "        \"%s\": { \"count\": %llu", metricOpcodeNames[j], histogram->count);
+            if(histogram->count > 0)
+            {
+                fprintf(file, ", \"mean\": %.1f, \"min\": %u, \"p50\": %u, \"p90\": %u, \"p99\": %u, \"p999\": %u, \"max\": %u",
+                        (double)histogram->sumUs / histogram->count, histogram->minUs, getLatencyPercentile(histogram, 50),
+                        getLatencyPercentile(histogram, 90), getLatencyPercentile(histogram, 99),
+                        getLatencyPercentile(histogram, 99.9), histogram->maxUs);
+            }
+            fprintf(file, " }%s\n", j + 1 < METRIC_OPCODES ? "," : "");
+        }
+        fprintf(file, "      }\n    }%s\n", i + 1 < count ? "," : "");
+    }
+    
+    fprintf(file, "  ]\n}\n");
+}
+
+// one metric family, the HELP and TYPE lines come once before the samples of every DataLink
+static void writePromHeader(FILE* file, const char* name, const char* type, const char* help)
+{
+    fprintf(file, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void writeProm(FILE* file, PLINK_REPORT reports, int count)
+{
+    PSAT_LATENCY_HISTOGRAM histogram;
+    PLINK_REPORT report;
+    int i;
+    int j;
+    int k;
+    
+    writePromHeader(file, "satlink_bytes_total", "counter", "Data bytes read from or written to the Saturn.");
+    for(i = 0; i < count; i++)
+    {
+        fprintf(file, "satlink_bytes_total{device=\"%s\",direction=\"read\"} %llu\n", reports[i].serial, reports[i].metrics->bytesRead);
+        fprintf(file, "satlink_bytes_total{device=\"%s\",direction=\"write\"} %llu\n", reports[i].serial, reports[i].metrics->bytesWritten);
+    }
+    
+    writePromHeader(file, "satlink_transfers_total", "counter", "Reads, writes and executes.");
+    for(i = 0; i < count; i++)
+    {
+        fprintf(file, "satlink_transfers_total{device=\"%s\"} %llu\n", reports[i].serial, reports[i].metrics->transfers);
+    }
+    
+    writePromHeader(file, "satlink_busy_seconds_total", "counter", "Time spent in transfers.");
+    for(i = 0; i < count; i++)
+    {
+        fprintf(file, "satlink_busy_seconds_total{device=\"%s\"} %.6f\n", reports[i].serial, reports[i].busySeconds);
+    }
+    
+    writePromHeader(file, "satlink_bytes_per_second", "gauge", "Data bytes per second while transferring.");
+    for(i = 0; i < count; i++)
+    {
+        fprintf(file, "satlink_bytes_per_second{device=\"%s\"} %.1f\n", reports[i].serial, reports[i].bytesPerSecond);
+    }
+    
+    writePromHeader(file, "satlink_wire_efficiency", "gauge", "Throughput as a fraction of the 375000 baud 8N2 serial line.");
+    for(i = 0; i < count; i++)
+    {
+        fprintf(file, "satlink_wire_efficiency{device=\"%s\"} %.4f\n", reports[i].serial, reports[i].wireEfficiency);
+    }
+    
+    writePromHeader(file, "satlink_packets_total", "counter", "Packets that were answered correctly.");
+    for(i = 0; i < count; i++)
+    {
+        fprintf(file, "satlink_packets_total{device=\"%s\"} %u\n", reports[i].serial, reports[i].stats.packets);
+    }
+    
+    writePromHeader(file, "satlink_retries_total", "counter", "Times a transfer was resumed after a failure.");
+    for(i = 0; i < count; i++)
+    {
+        fprintf(file, "satlink_retries_total{device=\"%s\"} %u\n", reports[i].serial, reports[i].stats.retries);
+    }
+    
+    writePromHeader(file, "satlink_errors_total", "counter", "Failed responses by cause.");
+    for(i = 0; i < count; i++)
+    {
+        report = &reports[i];
+        fprintf(file, "satlink_errors_total{device=\"%s\",type=\"timeout\"} %u\n", report->serial, report->stats.timeouts);
+        fprintf(file, "satlink_errors_total{device=\"%s\",type=\"checksum\"} %u\n", report->serial, report->stats.checksumErrors);
+        fprintf(file, "satlink_errors_total{device=\"%s\",type=\"bad_packet\"} %u\n", report->serial,
+                report->stats.badPackets - report->stats.checksumErrors);
+        fprintf(file, "satlink_errors_total{device=\"%s\",type=\"error_response\"} %u\n", report->serial, report->stats.errorResps);
+    }
+    
+    writePromHeader(file, "satlink_resync_bytes_total", "counter", "Bytes skipped to find the start of a response.");
+    for(i = 0; i < count; i++)
+    {
+        fprintf(file, "satlink_resync_bytes_total{device=\"%s\"} %u\n", reports[i].serial, reports[i].stats.resyncBytes);
+    }
+    
+    writePromHeader(file, "satlink_request_duration_seconds", "histogram", "Round trip from sending a request to receiving its response.");
+    for(i = 0; i < count; i++)
+    {
+        for(j = 0; j < METRIC_OPCODES; j++)
+        {
+            histogram = &reports[i].metrics->latency[j];
+            for(k = 0; k < PROM_BUCKETS; k++)
+            {
+                fprintf(file, "satlink_request_duration_seconds_bucket{device=\"%s\",opcode=\"%s\",le=\"%g\"} %llu\n",
+                        reports[i].serial, metricOpcodeNames[j], promBucketsUs[k] / 1e6, countLatencyBelow(histogram, promBucketsUs[k]));
+            }
+            fprintf(file, "satlink_request_duration_seconds_bucket{device=\"%s\",opcode=\"%s\",le=\"+Inf\"} %llu\n",
+                    reports[i].serial, metricOpcodeNames[j], histogram->count);
+            fprintf(file, "satlink_request_duration_seconds_sum{device=\"%s\",opcode=\"%s\"} %.6f\n",
+                    reports[i].serial, metricOpcodeNames[j], histogram->sumUs / 1e6);
+            fprintf(file, "satlink_request_duration_seconds_count{device=\"%s\",opcode=\"%s\"} %llu\n",
+                    reports[i].serial, metricOpcodeNames[j], histogram->count);
+        }
+    }
+}
+
+int saveMetrics(const char* filename, PSAT_TRANSPORT* transports, int count)
+{
+    PLINK_REPORT reports;
+    char tempPath[4096];
+    const char* extension;
+    FILE* file;
+    int i;
+    
+    reports = calloc(count, sizeof(LINK_REPORT));
+    if(reports == NULL)
+    {
+        return -1;
+    }
+    
+    for(i = 0; i < count; i++)
+    {
+        getLinkReport(transports[i], &reports[i]);
+    }
+    
+    // the textfile collector may read the file at any time, so it is replaced in one go
+    snprintf(tempPath, sizeof(tempPath), "%s.tmp", filename);
+    file = fopen(tempPath, "w");
+    if(file == NULL)
+    {
+        logError("saveMetrics: Failed to open %s for writing!!\n", tempPath);
+        free(reports);
+        return -2;
+    }
+    
+    extension = strrchr(filename, '.');
+    if(extension != NULL && strcmp(extension, ".prom") == 0)
+    {
+        writeProm(file, reports, count);
+    }
+    else
+    {
+        writeJson(file, reports, count);
+    }
+    free(reports);
+    
+    if(fclose(file) != 0 || rename(tempPath, filename) != 0)
+    {
+        logError("saveMetrics: Failed to write %s!!\n", filename);
+        unlink(tempPath);
+        return -3;
+    }
+    
+    return 0;
+}
@@ -0,0 +1,166 @@
+//
+// Packet codec and frame rings.
+// Request packets are encoded straight into the transmit ring so a batch of them can be handed to the
+// transport in one write, and stay there until they are answered. Responses are received into the
+// receive ring and parsed where they land. A frame never wraps around the end of a ring, so it can
+// always be used in place.
+//
+
+#include "transport.h"
+
+void initRing(PSAT_RING ring)
+{
+    ring->head = 0;
+    ring->tail = 0;
+    ring->wrapEnd = 0;
+    ring->wrapped = 0;
+    ring->sendPos = 0;
+    ring->unsent = 0;
+    ring->count = 0;
+}
+
+BYTE* reserveFrame(PSAT_RING ring, int length)
+{
+    if(!ring->wrapped)
+    {
+        if(ring->tail + length <= RING_SIZE)
+        {
+            return ring->data + ring->tail;
+        }
+        
+        // no room before the end, start again at the front if the oldest frames have moved past it
+        if(length < ring->head)
+        {
+            if(ring->sendPos == ring->tail)
+            {
+                ring->sendPos = 0;
+            }
+            ring->wrapEnd = ring->tail;
+            ring->wrapped = 1;
+            ring->tail = 0;
+            return ring->data;
+        }
+        
+        return NULL;
+    }
+    
+    if(ring->tail + length <= ring->head)
+    {
+        return ring->data + ring->tail;
+    }
+    
+    return NULL;
+}
+
+void commitFrame(PSAT_RING ring, BYTE* frame)
+{
+    int frameLength = frame[1] + 2;
+    
+    ring->tail += frameLength;
+    ring->unsent += frameLength;
+    ring->count++;
+}
+
+BYTE* oldestFrame(PSAT_RING ring)
+{
+    if(ring->count == 0)
+    {
+        return NULL;
+    }
+    
+    return ring->data + ring->head;
+}
+
+void releaseFrame(PSAT_RING ring)
+{
+    if(ring->count == 0)
+    {
+        return;
+    }
+    
+    ring->head += ring->data[ring->head + 1] + 2;
+    ring->count--;
+    
+    if(ring->count == 0)
+    {
+        // empty, go back to the front so the next batch goes out in one piece
+        initRing(ring);
+    }
+    else if(ring->wrapped && ring->head == ring->wrapEnd)
+    {
+        ring->head = 0;
+        ring->wrapped = 0;
+        if(ring->sendPos == ring->wrapEnd)
+        {
+            ring->sendPos = 0;
+        }
+    }
+}
+
+BYTE* nextUnsent(PSAT_RING ring, int* length)
+{
+    int end;
+    
+    if(ring->unsent == 0)
+    {
+        *length = 0;
+        return NULL;
+    }
+    
+    // unsent bytes run to the wrap point if they are in the upper part of a wrapped ring
+    end = (ring->wrapped && ring->sendPos >= ring->head) ? ring->wrapEnd : ring->tail;
+    
+    *length = end - ring->sendPos;
+    if(*length > ring->unsent)
+    {
+        *length = ring->unsent;
+    }
+    
+    return ring->data + ring->sendPos;
+}
+
+void markSent(PSAT_RING ring, int length)
+{
+    ring->sendPos += length;
+    ring->unsent -= length;
+    
+    // the frames after the wrap point continue at the front
+    if(ring->wrapped && ring->sendPos == ring->wrapEnd)
+    {
+        ring->sendPos = 0;
+    }
+}
+
+int encodeReadReq(BYTE* frame, BYTE opcode, DWORD address, BYTE dataLength)
+{
+    PSAT_READ_REQ readReq = (PSAT_READ_REQ)frame;
+    
+    readReq->dir = TO_SAT;
+    readReq->packetLength = sizeof(SAT_READ_REQ) - 2; // subtract dir and checksum
+    readReq->opcode = opcode;
+    readReq->address = htonl(address);
+    readReq->dataLength = dataLength;
+    readReq->checksum = calculateChecksum(frame);
+    
+    return sizeof(SAT_READ_REQ);
+}
+
+int encodeWriteReq(BYTE* frame, BYTE opcode, DWORD address, BYTE* data, BYTE dataLength)
+{
+    PSAT_WRITE_REQ writeReq = (PSAT_WRITE_REQ)frame;
+    
+    writeReq->dir = TO_SAT;
+    writeReq->opcode = opcode;
+    writeReq->dataLength = dataLength;
+    
+    // packetlength includes the header but does not include the dir or checksum bytes
+    writeReq->packetLength = dataLength + sizeof(SAT_WRITE_RESP) - 2;
+    writeReq->address = htonl(address);
+    
+    // the checksum is the last byte in the packet. the payload is summed while it goes through
+    // the only copy it makes on its way from the caller's buffer to the wire
+    writeReq->data[dataLength] = copyAndChecksum(NULL, frame + 1, sizeof(SAT_WRITE_RESP) - 2) +
+                                 copyAndChecksum(writeReq->data, data, dataLength);
+    
+    return writeReq->packetLength + 2;
+}
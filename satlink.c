@@ -1,42 +1,43 @@
-#include "satlink.h"
+#include <time.h>
+#include "transport.h"
+
+// a read request that has been sent to the device
+typedef struct _SAT_READ_SLOT
+{
+    DWORD offset;       // offset of the requested bytes from the start of the read
+    BYTE dataLength;    // number of bytes requested
+    BYTE opcode;
+    BYTE inFlight;      // non zero while waiting for the response
+    BYTE received;      // non zero once the data is in but hasn't been handed to the sink yet
+    long long sentNs;   // when the request was handed to the transport, for the latency metrics
+} SAT_READ_SLOT, *PSAT_READ_SLOT;
 
 void dumpPacket(BYTE* packet)
 {
     BYTE packetLength = packet[1];
     BYTE i;
     
-    printf("Packet: ");
+    logPrint(LOG_PACKET, "Packet: ");
     
     // include the dir and checksum field
     for(i = 0; i < packetLength + 2; i++)
     {
         if(i % 10 == 0)
         {
-            printf("\n");
+            logPrint(LOG_PACKET, "\n");
         }
-        printf("0x%02x ", packet[i]);    
+        logPrint(LOG_PACKET, "0x%02x ", packet[i]);    
     }
     
-    printf("\n");  
+    logPrint(LOG_PACKET, "\n");  
 }
 
 // calculates and return an additive checksum of all bytes in the packet excluding the dir and checksum byte
 BYTE calculateChecksum(BYTE* packet)
 {
-    BYTE checkSum = 0;
-    BYTE packetLength = 0;
-    BYTE i;
-    
     // the 2nd byte is always the packetLength
-    packetLength = packet[1];
-    
     // packet length does not include the dir field or the ending checksum byte
-    for(i = 0; i < packetLength; i++)
-    {
-        checkSum += packet[i+1];
-    }   
-    
-    return checkSum;  
+    return copyAndChecksum(NULL, packet + 1, packet[1]);
 }
 
 // calculates and validates a checksum on the packetLength
@@ -44,21 +45,13 @@ BYTE calculateChecksum(BYTE* packet)
 // Returns 0 for success, <0 for error
 int validateChecksum(BYTE* packet)
 {
-    BYTE checkSum = 0;
-    BYTE packetLength = 0;
-    BYTE i;
+    BYTE packetLength;
     
     // the 2nd byte is always the packetLength
     packetLength = packet[1];
     
-    // packet length does not include the dir field or the ending checksum byte
-    for(i = 0; i < packetLength; i++)
-    {
-        checkSum += packet[i+1];
-    }   
-    
     // verify the checksum
-    if(checkSum != packet[packetLength+1])
+    if(copyAndChecksum(NULL, packet + 1, packetLength) != packet[packetLength+1])
     {
         return -1;
     }
@@ -66,427 +59,1082 @@ int validateChecksum(BYTE* packet)
     return 0;
 }
 
-// reads numBytes at address from saturn into outbuffer
-// outBuffer must be atleast numBytes length
-// Maximum bytes to request in a single packet is MAX_DATALEN.
-// All read requests must have atleast two packets (a READ_START and a READ_END)
+void initLink(PSAT_TRANSPORT transport)
+{
+    transport->link.readWindow = READ_WINDOW;
+    transport->link.writeWindow = WRITE_WINDOW;
+    transport->link.progress = NULL;
+    transport->link.yield = NULL;
+    resetLinkStats(transport);
+}
+
+void setReadWindow(PSAT_TRANSPORT transport, int window)
+{
+    if(window < 1)
+    {
+        window = 1;
+    }
+    else if(window > MAX_READ_WINDOW)
+    {
+        window = MAX_READ_WINDOW;
+    }
+    
+    transport->link.readWindow = window;
+}
+
+int getReadWindow(PSAT_TRANSPORT transport)
+{
+    return transport->link.readWindow;
+}
+
+void setWriteWindow(PSAT_TRANSPORT transport, int window)
+{
+    if(window < 1)
+    {
+        window = 1;
+    }
+    else if(window > MAX_WRITE_WINDOW)
+    {
+        window = MAX_WRITE_WINDOW;
+    }
+    
+    transport->link.writeWindow = window;
+}
+
+int getWriteWindow(PSAT_TRANSPORT transport)
+{
+    return transport->link.writeWindow;
+}
+
+void getLinkStats(PSAT_TRANSPORT transport, PSAT_LINK_STATS stats)
+{
+    memcpy(stats, &transport->link.stats, sizeof(SAT_LINK_STATS));
+}
+
+void resetLinkStats(PSAT_TRANSPORT transport)
+{
+    memset(&transport->link.stats, 0, sizeof(SAT_LINK_STATS));
+    transport->link.stats.packetSize = MAX_DATALEN;
+    transport->link.stats.responseTimeoutMs = RESP_TIMEOUT_MS;
+    transport->link.packetsSinceError = GROW_AFTER;
+    transport->link.slowestResponseMs = -1;
+    resetLinkMetrics(&transport->link.metrics);
+}
+
+void logLinkStats(PSAT_TRANSPORT transport)
+{
+    PSAT_LINK_STATS stats = &transport->link.stats;
+    
+    // a clean link isn't worth a line
+    if(stats->retries == 0 && stats->resyncBytes == 0)
+    {
+        return;
+    }
+    
+    logInfo("Link: %u packets, %u retries (%u timeouts, %u bad packets, %u error responses), %u resync bytes, %u shrinks\n",
+            stats->packets, stats->retries, stats->timeouts, stats->badPackets, stats->errorResps,
+            stats->resyncBytes, stats->shrinks);
+}
+
+// counts a correctly answered packet. once the link has been clean for a while the packet size grows back
+static void packetOk(PSAT_TRANSPORT transport)
+{
+    transport->link.stats.packets++;
+    transport->link.packetsSinceError++;
+    
+    if(transport->link.packetsSinceError >= GROW_AFTER && transport->link.stats.packetSize < MAX_DATALEN)
+    {
+        transport->link.stats.packetSize = transport->link.stats.packetSize * 2 > MAX_DATALEN ? MAX_DATALEN : transport->link.stats.packetSize * 2;
+        transport->link.packetsSinceError = 0;
+        logInfo("Link is clean again, packet size back up to %d\n", transport->link.stats.packetSize);
+    }
+}
+
+// returns a monotonic timestamp in nanoseconds
+static long long getTimeNs()
+{
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// returns a monotonic timestamp in milliseconds
+static long long getTimeMs()
+{
+    return getTimeNs() / 1000000;
+}
+
+// counts the data bytes of a packet that was read or acknowledged and reports them to the progress hook
+static void addProgress(PSAT_TRANSPORT transport, DWORD bytes)
+{
+    // runFleet reads it from another thread for its progress line
+    metricAdd(transport->link.stats.bytes, bytes);
+    if(transport->link.progress != NULL)
+    {
+        transport->link.progress(transport->link.progressContext, bytes);
+    }
+}
+
+// asks the yield hook whether the transfer should stop at this packet boundary
+static int shouldYield(PSAT_TRANSPORT transport)
+{
+    return transport->link.yield != NULL && transport->link.yield(transport->link.yieldContext);
+}
+
+// counts a finished read, write or execute for the throughput metrics
+static void recordTransfer(PSAT_TRANSPORT transport, long long startNs)
+{
+    metricAdd(transport->link.metrics.transfers, 1);
+    metricAdd(transport->link.metrics.busyNs, getTimeNs() - startNs);
+}
+
+// a lost response is given up on after a few times the slowest response seen lately instead of after
+// RESP_TIMEOUT_MS, so a retry starts quickly. every timeout doubles the allowance in case the link is slow
+static void updateResponseTimeout(PSAT_TRANSPORT transport, int waitedMs, int timedOut)
+{
+    if(timedOut)
+    {
+        transport->link.slowestResponseMs = transport->link.slowestResponseMs < 0 ? -1 : transport->link.slowestResponseMs * 2 + 1;
+    }
+    else if(waitedMs > transport->link.slowestResponseMs)
+    {
+        transport->link.slowestResponseMs = waitedMs;
+    }
+    else
+    {
+        transport->link.slowestResponseMs -= (transport->link.slowestResponseMs - waitedMs) / 16;
+    }
+    
+    if(transport->link.slowestResponseMs < 0)
+    {
+        transport->link.stats.responseTimeoutMs = RESP_TIMEOUT_MS;
+        return;
+    }
+    
+    transport->link.stats.responseTimeoutMs = transport->link.slowestResponseMs * 4 + 50;
+    if(transport->link.stats.responseTimeoutMs < MIN_RESP_TIMEOUT_MS)
+    {
+        transport->link.stats.responseTimeoutMs = MIN_RESP_TIMEOUT_MS;
+    }
+    else if(transport->link.stats.responseTimeoutMs > RESP_TIMEOUT_MS)
+    {
+        transport->link.stats.responseTimeoutMs = RESP_TIMEOUT_MS;
+    }
+}
+
+// hands every frame in the transmit ring that hasn't been sent yet to the transport
+// frames that are contiguous in the ring go out in a single write
 // Returns 0 for success, <0 for error
-int readSatMemory(struct ftdi_context* ftdic, BYTE* outBuffer, DWORD address, DWORD numBytes)
+static int sendFrames(PSAT_TRANSPORT transport)
 {
-    SAT_READ_REQ readReq;
-    PSAT_READ_RESP readResp;
-    BYTE buffer[255];    
+    BYTE* frames;
+    int length;
     int bytesSent;
+    
+    while((frames = nextUnsent(&transport->txRing, &length)) != NULL)
+    {
+        bytesSent = transport->write(transport, frames, length);
+        if(bytesSent <= 0)
+        {
+            logError("sendFrames: Failed to write to the device (%s)\n", transport->errorString(transport));
+            return -2;
+        }
+        
+        // a short write leaves the rest of the frames for the next go around
+        markSent(&transport->txRing, bytesSent);
+    }
+    
+    return 0;
+}
+
+// receives the next response frame into the receive ring, where the caller parses it in place
+// the transport blocks without using any cpu until the bytes arrive. the whole packet has to arrive
+// within timeoutMs, a stalled link returns a timeout error instead of waiting forever.
+// bytes that can't be the start of a response are skipped until a TO_PC header shows up
+// the caller must releaseFrame the receive ring once it is done with the frame
+// Returns the length of the frame (including dir and checksum) for success, <0 for error
+static int recvFrame(PSAT_TRANSPORT transport, BYTE** frame, int timeoutMs)
+{
+    PSAT_RING rx = &transport->rxRing;
+    long long start;
+    long long deadline;
+    long long remaining;
+    int received;
+    int bytesWanted;
     int bytesRecv;
-    int bytesRead;
-    int result;
     
-    // validate numBytes
-    if(numBytes < 4)
+    *frame = reserveFrame(rx, MAX_PACKETLEN + 2);
+    if(*frame == NULL)
     {
-        printf("readSatMemory: numBytes must be atleast 4.\n");
-        return -1;
+        logError("recvFrame: receive ring is full!!\n");
+        return -3;
     }
     
-    // this is how many bytes we have read from the memory so far
-    bytesRead = 0;    
+    start = getTimeMs();
+    deadline = start + timeoutMs;
+    received = 0;
     
-    // initialize the read request
-    memset(&readReq, 0, sizeof(readReq));
-    readReq.dir = TO_SAT;
-    readReq.packetLength = sizeof(readReq) - 2; // subtract dir and checksum
+    while(received < 2 || received < (*frame)[1] + 2)
+    {
+        // bytes before a TO_PC header with a sane packetLength are left over from an earlier failure,
+        // skip them one at a time until the next response starts
+        if((received >= 1 && (*frame)[0] != TO_PC) ||
+           (received >= 2 && ((*frame)[1] > MAX_PACKETLEN || (*frame)[1] < sizeof(SAT_WRITE_RESP) - 2)))
+        {
+            memmove(*frame, *frame + 1, received - 1);
+            received--;
+            transport->link.stats.resyncBytes++;
+            continue;
+        }
+        
+        // read the dir and packetLength bytes first, then exactly the rest of the packet.
+        // if the usb transfer splits the packet the transport keeps reading until it's all there
+        bytesWanted = received < 2 ? 2 - received : (*frame)[1] + 2 - received;
+        
+        remaining = deadline - getTimeMs();
+        if(remaining < 0)
+        {
+            remaining = 0;
+        }
+        
+        bytesRecv = transport->read(transport, *frame + received, bytesWanted, remaining);
+        if(bytesRecv < 0)
+        {
+            logError("recvFrame: Failed to read data (%s)\n", transport->errorString(transport));
+            return -3;
+        }
+        received += bytesRecv;
+        
+        if(bytesRecv < bytesWanted)
+        {
+            traceEvent(TRACE_TIMEOUT, 0);
+            logWarn("recvFrame: Timed out waiting for a response!!\n");
+            updateResponseTimeout(transport, 0, 1);
+            return -10;
+        }
+    }
+    
+    updateResponseTimeout(transport, getTimeMs() - start, 0);
+    commitFrame(rx, *frame);
+    tracePacket(TRACE_RX, *frame);
+    logPacket(*frame);
+    return received;
+}
+
+// gets the link ready to carry on after a transfer failed with error on its attempt'th retry in a row.
+// the error is counted and the packet size halved if errors are clustering. after the backoff everything
+// the DataLink still sends for the failed requests is read and thrown away until the link goes quiet
+static void recoverLink(PSAT_TRANSPORT transport, int error, int attempt)
+{
+    BYTE discard[MAX_PACKETLEN + 2];
+    long long deadline;
+    int bytesRecv;
+    
+    traceEvent(TRACE_ERROR, error);
+    transport->link.stats.retries++;
+    
+    switch(error)
+    {
+        case -10: transport->link.stats.timeouts++; break;
+        case -9:  transport->link.stats.errorResps++; break;
+        case -5:  transport->link.stats.checksumErrors++; transport->link.stats.badPackets++; break;
+        default:  transport->link.stats.badPackets++; break;
+    }
+    
+    if(transport->link.packetsSinceError < SHRINK_WINDOW && transport->link.stats.packetSize > MIN_PACKET_DATALEN)
+    {
+        transport->link.stats.packetSize = transport->link.stats.packetSize / 2 < MIN_PACKET_DATALEN ? MIN_PACKET_DATALEN : transport->link.stats.packetSize / 2;
+        transport->link.stats.shrinks++;
+        logWarn("Link errors are clustering, packet size down to %d\n", transport->link.stats.packetSize);
+    }
+    transport->link.packetsSinceError = 0;
+    
+    transport->purge(transport);
+    usleep((RETRY_BACKOFF_MS << (attempt - 1)) * 1000);
+    
+    deadline = getTimeMs() + RESP_TIMEOUT_MS;
+    do
+    {
+        bytesRecv = transport->read(transport, discard, sizeof(discard), RESYNC_QUIET_MS);
+        if(bytesRecv > 0)
+        {
+            transport->link.stats.resyncBytes += bytesRecv;
+        }
+    } while(bytesRecv > 0 && getTimeMs() < deadline);
+    
+    transport->purge(transport);
+}
+
+// validates a read response and copies its data to the sink at the offset of the in flight request it answers
+// the data is checksummed while it is copied, this is the only pass over it between the receive ring and the sink
+// Returns the index of the answered request for success, <0 for error
+static int handleReadResp(BYTE* packet, int packetLength, PSAT_READ_SINK sink, DWORD address, DWORD sinkOffset, PSAT_READ_SLOT slots, int numSlots)
+{
+    PSAT_READ_RESP readResp;
+    DWORD respAddress;
+    BYTE checkSum;
+    BYTE* dest;
+    int i;
+    
+    readResp = (PSAT_READ_RESP)packet;
+    
+    if(packetLength < sizeof(SAT_READ_REQ))
+    {
+        logWarn("readSatMemory: Didn't recieve enough bytes in response!!\n");
+        return -4;
+    }
     
-    while(numBytes)
-    {    
-        // first iteration through loop
-        if(bytesRead == 0)
-        {  
-            // read always start with a READ_START
-            readReq.opcode = READ_START;        
-            if(numBytes <= MAX_DATALEN)
+    if(packetLength < readResp->dataLength + 9 || readResp->dataLength > MAX_DATALEN)
+    {
+        logWarn("readSatMemory: BytesRecv is less than dataLength!!\n");
+        return -7;
+    }
+    
+    // verify that the packet was a success packet
+    if(readResp->dir != TO_PC || readResp->opcode != RESP_SUCCESS)
+    {
+        if(validateChecksum(packet) != 0)
+        {
+            logWarn("readSatMemory: failed to validate checksum for packet!!\n");
+            return -5;
+        }
+        
+        logWarn("readSatMemory: Packet was error response!!\n");
+        return -9;
+    }
+    
+    // match the response to the request for the same address
+    respAddress = ntohl(readResp->address);
+    for(i = 0; i < numSlots; i++)
+    {
+        if(slots[i].inFlight && address + slots[i].offset == respAddress)
+        {
+            break;
+        }
+    }
+    
+    if(i == numSlots)
+    {
+        logWarn("readSatMemory: Response for unexpected address 0x%x!!\n", respAddress);
+        return -11;
+    }
+    
+    if(readResp->dataLength != slots[i].dataLength)
+    {
+        logWarn("readSatMemory: Response length doesn't match the request!!\n");
+        return -8;
+    }
+    
+    dest = sink->getBuffer(sink, sinkOffset + slots[i].offset, slots[i].dataLength);
+    if(dest == NULL)
+    {
+        logWarn("readSatMemory: No buffer for the data!!\n");
+        return -12;
+    }
+    
+    // copy the requested bytes into the buffer and validate the checksum of the whole packet
+    checkSum = copyAndChecksum(NULL, packet + 1, sizeof(SAT_READ_REQ) - 2);
+    checkSum += copyAndChecksum(dest, readResp->data, readResp->dataLength);
+    if(checkSum != readResp->data[readResp->dataLength])
+    {
+        logWarn("readSatMemory: failed to validate checksum for packet!!\n");
+        return -5;
+    }
+    
+    slots[i].inFlight = 0;
+    slots[i].received = 1;
+    
+    return i;
+}
+
+// reads numBytes at address with up to window requests in flight and hands the data to sink
+// the sink sees the data at sinkOffset onwards
+// *bytesDone is set to the number of bytes handed to sink->complete, even if the read fails
+// When the yield hook asks for the link the next request is sent as the READ_END, so the sequence is
+// closed after one more packet instead of being left open
+// Returns 0 for success, SAT_YIELDED if the read stopped early, <0 for error
+static int readSatMemoryWindowed(PSAT_TRANSPORT transport, PSAT_READ_SINK sink, DWORD address, DWORD numBytes, DWORD sinkOffset, int window, DWORD* bytesDone)
+{
+    SAT_READ_SLOT slots[MAX_READ_WINDOW];
+    DWORD bytesRequested;
+    BYTE opcode;
+    BYTE dataLength;
+    BYTE* frame;
+    int frameLength;
+    int yielded;
+    int result;
+    int i;
+    
+    memset(slots, 0, sizeof(slots));
+    initRing(&transport->txRing);
+    initRing(&transport->rxRing);
+    bytesRequested = 0;
+    *bytesDone = 0;
+    
+    // nothing has been sent yet, the link can be handed over straight away
+    if(shouldYield(transport))
+    {
+        return SAT_YIELDED;
+    }
+    yielded = 0;
+    
+    while(*bytesDone < numBytes)
+    {
+        // top up the window. the READ_START is sent on its own so the sequence is open before we pipeline
+        for(i = 0; i < window && bytesRequested < numBytes; i++)
+        {
+            if(slots[i].inFlight || slots[i].received)
             {
-                // we need to split this up into two requests even though it could fit in one
-                readReq.dataLength = numBytes/2;          
+                continue;
             }
-            else
+            
+            if(bytesRequested == 0)
             {
-                // we can only read MAX_DATALEN bytes at a time
-                readReq.dataLength = MAX_DATALEN;
-            }        
-        }
-        else
-        {    // since we are not the 1st packet, determine if we are either the last or a middle packet
-            if(numBytes <= MAX_DATALEN)
+                // read always start with a READ_START
+                opcode = READ_START;
+                if(numBytes <= transport->link.stats.packetSize)
+                {
+                    // we need to split this up into two requests even though it could fit in one
+                    dataLength = numBytes/2;
+                }
+                else
+                {
+                    // we can only read packetSize bytes at a time
+                    dataLength = transport->link.stats.packetSize;
+                }
+            }
+            else if(numBytes - bytesRequested <= transport->link.stats.packetSize)
             {
                 //this is the last packet
-                readReq.dataLength = numBytes;          
-                readReq.opcode = READ_END;
+                dataLength = numBytes - bytesRequested;
+                opcode = READ_END;
+            }
+            else if(shouldYield(transport))
+            {
+                // end the sequence here with as little as the DataLink takes, the rest is read in a new one later
+                dataLength = 4;
+                opcode = READ_END;
+                yielded = 1;
             }
             else
             {
-                // this is not the last packet
-                readReq.dataLength = MAX_DATALEN;
-                readReq.opcode = READ_CONT;          
+                // this is a middle packet
+                dataLength = transport->link.stats.packetSize;
+                opcode = READ_CONT;
+            }
+            
+            // the request is built in the transmit ring and stays there until it is answered
+            frame = reserveFrame(&transport->txRing, sizeof(SAT_READ_REQ));
+            encodeReadReq(frame, opcode, address + bytesRequested, dataLength);
+            commitFrame(&transport->txRing, frame);
+            tracePacket(TRACE_TX, frame);
+            logPacket(frame);
+            
+            slots[i].offset = bytesRequested;
+            slots[i].dataLength = dataLength;
+            slots[i].opcode = opcode;
+            slots[i].sentNs = getTimeNs();
+            slots[i].inFlight = 1;
+            bytesRequested += dataLength;
+            
+            if(opcode == READ_START)
+            {
+                break;
+            }
+            if(yielded)
+            {
+                numBytes = bytesRequested;
+                break;
             }
         }
         
-        // add the address to read and calculate the checksum of the packet
-        readReq.address = ntohl(address+bytesRead);        
-        readReq.checksum = calculateChecksum((BYTE*)&readReq);
+        // send all of the new requests to the device in one write
+        result = sendFrames(transport);
+        if(result != 0)
+        {
+            return result;
+        }
         
-        //printf("The checksum is %d\n", readReq.checksum);
-        dumpPacket((BYTE*)&readReq);
+        // wait for the oldest response, then go back and refill the window
+        frameLength = recvFrame(transport, &frame, transport->link.stats.responseTimeoutMs);
+        if(frameLength < 0)
+        {
+            return frameLength;
+        }
         
-        // send packet to the device
-        bytesSent = ftdi_write_data (ftdic, (BYTE*)&readReq, readReq.packetLength + 2);
-        if(bytesSent < 0)
+        result = handleReadResp(frame, frameLength, sink, address, sinkOffset, slots, window);
+        releaseFrame(&transport->rxRing);
+        if(result < 0)
         {
-            printf("readSatMemory: Failed to write to the device (%s)\n", ftdi_get_error_string(ftdic));
-            return -2;    
+            return result;
         }
-        printf("Wrote %d bytes!!\n", bytesSent);      
+        recordLatency(&transport->link.metrics, slots[result].opcode, getTimeNs() - slots[result].sentNs);
+        packetOk(transport);
+        releaseFrame(&transport->txRing);
         
-        // Read data forever
-        printf("waiting for read!!\n");
-        do
+        // hand the sink everything that is now contiguous, always in address order
+        for(i = 0; i < window; i++)
         {
-            bytesRecv = ftdi_read_data(ftdic, buffer, sizeof(buffer));
-            if(bytesRecv == 0)
+            if(slots[i].received && slots[i].offset == *bytesDone)
             {
-                //printf("recved 0\n");
-                usleep(1);
+                if(sink->complete(sink, sinkOffset + slots[i].offset, slots[i].dataLength) != 0)
+                {
+                    logError("readSatMemory: read was aborted!!\n");
+                    return -12;
+                }
+                
+                *bytesDone += slots[i].dataLength;
+                addProgress(transport, slots[i].dataLength);
+                metricAdd(transport->link.metrics.bytesRead, slots[i].dataLength);
+                slots[i].received = 0;
+                i = -1;
             }
         }
-        while(bytesRecv == 0);
         
-        if(bytesRecv <= 0)
+        logDebug("%d bytes remaining\n", numBytes - *bytesDone);
+    } // while()
+    
+    return yielded ? SAT_YIELDED : 0;
+}
+
+// sink that puts the data in a caller supplied buffer
+typedef struct _SAT_BUFFER_SINK
+{
+    SAT_READ_SINK sink;
+    BYTE* buffer;
+} SAT_BUFFER_SINK, *PSAT_BUFFER_SINK;
+
+static BYTE* getBufferSinkBuffer(PSAT_READ_SINK sink, DWORD offset, int length)
+{
+    return ((PSAT_BUFFER_SINK)sink)->buffer + offset;
+}
+
+static int completeBufferSink(PSAT_READ_SINK sink, DWORD offset, int length)
+{
+    return 0;
+}
+
+// reads the last bytes of a read that are too few for a read of their own. the last 4 bytes at
+// address + numBytes - 4 are read and the ones the sink is missing from bytesDone on are passed on
+// Returns 0 for success, <0 for error
+static int readSatMemoryTail(PSAT_TRANSPORT transport, PSAT_READ_SINK sink, DWORD address, DWORD numBytes, DWORD bytesDone)
+{
+    SAT_BUFFER_SINK tailSink;
+    BYTE tail[4];
+    BYTE* dest;
+    DWORD tailDone;
+    int result;
+    
+    tailSink.sink.getBuffer = getBufferSinkBuffer;
+    tailSink.sink.complete = completeBufferSink;
+    tailSink.buffer = tail;
+    
+    result = readSatMemoryWindowed(transport, &tailSink.sink, address + numBytes - 4, 4, 0, transport->link.readWindow, &tailDone);
+    if(result != 0)
+    {
+        return result;
+    }
+    
+    dest = sink->getBuffer(sink, bytesDone, numBytes - bytesDone);
+    if(dest == NULL)
+    {
+        return -12;
+    }
+    memcpy(dest, tail + 4 - (numBytes - bytesDone), numBytes - bytesDone);
+    
+    return sink->complete(sink, bytesDone, numBytes - bytesDone) == 0 ? 0 : -12;
+}
+
+// reads numBytes at address and hands the data to sink as each packet is verified
+// Maximum bytes to request in a single packet is the adaptive packet size, at most MAX_DATALEN.
+// All read requests must have atleast two packets (a READ_START and a READ_END)
+// Up to readWindow READ_CONT/READ_END requests are kept in flight. When a packet fails the link is
+// resynchronized and the read carries on with a new sequence from the first byte the sink is missing,
+// so only the failed packet and the ones in flight behind it are sent again. A transfer gives up after
+// RETRY_LIMIT failures in a row without progress. If the DataLink keeps timing out on pipelined requests
+// the window drops to 1 and stays there from then on. *done is set to the number of bytes handed to the sink
+// Returns 0 for success, SAT_YIELDED if the yield hook stopped the read early, <0 for error
+static int readSatMemoryRetrying(PSAT_TRANSPORT transport, PSAT_READ_SINK sink, DWORD address, DWORD numBytes, DWORD* done)
+{
+    DWORD bytesDone;
+    int attempt;
+    int timeouts;
+    int result;
+    
+    // validate numBytes
+    if(numBytes < 4)
+    {
+        logError("readSatMemory: numBytes must be atleast 4.\n");
+        return -1;
+    }
+    
+    *done = 0;
+    attempt = 0;
+    timeouts = 0;
+    
+    for(;;)
+    {
+        if(numBytes - *done >= 4)
         {
-            printf("readSatMemory: Failed to read data!!\n");
-            return -3;      
+            // start a new sequence where the sink left off
+            result = readSatMemoryWindowed(transport, sink, address + *done, numBytes - *done, *done, transport->link.readWindow, &bytesDone);
         }
-        else if(bytesRecv < sizeof(SAT_READ_REQ))
+        else
         {
-            printf("readSatMemory: Didn't recieve enough bytes in response!!\n");
-            return -4;
+            result = readSatMemoryTail(transport, sink, address, numBytes, *done);
+            bytesDone = result == 0 ? numBytes - *done : 0;
         }
+        *done += bytesDone;
         
-        // packet looks sane, let's validate the checksum
-        result = validateChecksum((BYTE*)buffer);
-        if(result != 0)
+        // the sink giving up isn't a link problem, and neither is handing the link over
+        if(result == 0 || result == -12 || result == SAT_YIELDED)
         {
-            printf("readSatMemory: failed to validate checksum for packet!!\n");
-            return -5;
+            return result;
         }
         
-        // we have enough bytes to validate the buffer    
-        dumpPacket((BYTE*)buffer);
-        
-        readResp = (PSAT_READ_RESP)buffer;
-        
-        // validates the length that came back
-        if(bytesRecv < readResp->packetLength + 2 || readResp->packetLength > MAX_PACKETLEN)
+        if(bytesDone > 0)
         {
-            printf("readSatMemory: BytesRecv is less than packetLength!!\n");
-            return -6;
+            attempt = 0;
         }
-        
-        if(bytesRecv < readResp->dataLength + 9 || readResp->dataLength > MAX_DATALEN)
+        if(++attempt > RETRY_LIMIT)
         {
-            printf("readSatMemory: BytesRecv is less than dataLength!!\n");
-            return -7;
+            logError("readSatMemory: giving up at 0x%x after %d retries!!\n", address + *done, RETRY_LIMIT);
+            return result;
         }
         
-        if(numBytes < readResp->dataLength)
+        // a DataLink that drops pipelined requests times out before it gets through the first window,
+        // every time. a noisy link loses responses at random and makes progress in between
+        if(result == -10 && bytesDone < transport->link.readWindow * transport->link.stats.packetSize)
         {
-            printf("readSatMemory: Not enough bytes left in recv buffer!!\n");
-            return -8;
+            timeouts++;
         }
-        
-        // verify that the packet was a success packet
-        if(readResp->dir != TO_PC || readResp->opcode != RESP_SUCCESS)
+        else
         {
-            printf("readSatMemory: Packet was error response!!\n");
-            return -9;
+            timeouts = 0;
+        }
+        if(transport->link.readWindow > 1 && timeouts >= 2)
+        {
+            logWarn("readSatMemory: pipelined requests keep timing out, using a window of 1\n");
+            transport->link.readWindow = 1;
         }
         
-        // copy the requested bytes into the buffer
-        memcpy(outBuffer + bytesRead, readResp->data, readResp->dataLength);
-        
-        // increment counters
-        numBytes -= readResp->dataLength;
-        bytesRead += readResp->dataLength;
-        printf("%d bytes remaining\n", numBytes);
-        
-        
-    } // while()        
+        logWarn("readSatMemory: retrying from 0x%x\n", address + *done);
+        recoverLink(transport, result, attempt);
+    }
+}
+
+// reads numBytes at address and hands the data to sink, timing the read for the metrics
+// Returns 0 for success, <0 for error
+int readSatMemoryStream(PSAT_TRANSPORT transport, PSAT_READ_SINK sink, DWORD address, DWORD numBytes)
+{
+    int (*yield)(void* context);
+    long long start;
+    DWORD done;
+    int result;
     
-    return 0;
+    // only slices stop early for the yield hook
+    yield = transport->link.yield;
+    transport->link.yield = NULL;
+    start = getTimeNs();
+    result = readSatMemoryRetrying(transport, sink, address, numBytes, &done);
+    recordTransfer(transport, start);
+    transport->link.yield = yield;
+    
+    return result;
+}
+
+// reads numBytes at address from saturn into outbuffer
+// outBuffer must be atleast numBytes length
+// Returns 0 for success, <0 for error
+int readSatMemory(PSAT_TRANSPORT transport, BYTE* outBuffer, DWORD address, DWORD numBytes)
+{
+    SAT_BUFFER_SINK bufferSink;
+    
+    bufferSink.sink.getBuffer = getBufferSinkBuffer;
+    bufferSink.sink.complete = completeBufferSink;
+    bufferSink.buffer = outBuffer;
+    
+    return readSatMemoryStream(transport, &bufferSink.sink, address, numBytes);
+}
+
+// reads numBytes at address into outBuffer until the yield hook asks for the link
+// *bytesDone is set to the number of bytes read, the rest can be read later from there
+// Returns 0 for success, SAT_YIELDED if the read stopped early, <0 for error
+int readSatMemorySlice(PSAT_TRANSPORT transport, BYTE* outBuffer, DWORD address, DWORD numBytes, DWORD* bytesDone)
+{
+    SAT_BUFFER_SINK bufferSink;
+    long long start;
+    int result;
+    
+    bufferSink.sink.getBuffer = getBufferSinkBuffer;
+    bufferSink.sink.complete = completeBufferSink;
+    bufferSink.buffer = outBuffer;
+    
+    start = getTimeNs();
+    result = readSatMemoryRetrying(transport, &bufferSink.sink, address, numBytes, bytesDone);
+    recordTransfer(transport, start);
+    
+    return result;
 }
 
 // reads the saturn's bios into outBuffer. outBuffer must be BIOS_SIZE
-int readSatBios(struct ftdi_context* ftdic, BYTE* outBuffer)
+int readSatBios(PSAT_TRANSPORT transport, BYTE* outBuffer)
 {
     int result;
     
     // this is simply a wrapper for readsatmory. 
-    result = readSatMemory(ftdic, outBuffer, BIOS_ADDR, BIOS_SIZE);
+    result = readSatMemory(transport, outBuffer, BIOS_ADDR, BIOS_SIZE);
     if(result != 0)
     {
-        printf("Failed to read BIOS!!\n");
+        logError("Failed to read BIOS!!\n");
         return -1;      
     }   
     
     return result;    
 }
 
-// write numBytes at address from inBuffer
-int writeSatMemory(struct ftdi_context* ftdic, DWORD address, BYTE* inBuffer, DWORD numBytes)
+// validates the acknowledgement of the WRITE or WRITE_EXECUTE packet for address
+// Returns 0 for success, <0 for error
+static int checkWriteResp(BYTE* packet, int packetLength, DWORD address)
+{
+    PSAT_WRITE_RESP writeResp;
+    
+    writeResp = (PSAT_WRITE_RESP)packet;
+    
+    if(packetLength < sizeof(SAT_WRITE_RESP))
+    {
+        logWarn("writeSatMemory: Didn't recieve enough bytes in response for packet 0x%x!!\n", address);
+        return -4;
+    }
+    
+    // packet looks sane, let's validate the checksum
+    if(validateChecksum(packet) != 0)
+    {
+        logWarn("writeSatMemory: failed to validate checksum for packet 0x%x!!\n", address);
+        return -5;
+    }
+    
+    if(writeResp->dataLength != 0)
+    {
+        logWarn("writeSatMemory: BytesRecv is less than dataLength for packet 0x%x!!\n", address);
+        return -7;
+    }
+    
+    // verify that the packet was a success packet
+    if(writeResp->dir != TO_PC || writeResp->opcode != RESP_SUCCESS)
+    {
+        logWarn("writeSatMemory: Packet 0x%x was error response!!\n", address);
+        return -9;
+    }
+    
+    return 0;
+}
+
+// waits for the acknowledgement of the oldest frame in the transmit ring, sent at sentNs, and releases the frame
+// Returns the number of data bytes the frame wrote for success, <0 for error
+static int recvWriteAck(PSAT_TRANSPORT transport, long long sentNs)
 {
     PSAT_WRITE_REQ writeReq;
-    SAT_WRITE_RESP writeResp;
-    BYTE buffer[255];    
-    int bytesSent;
-    int bytesRecv;
-    int bytesWritten;
-    int result;    
+    BYTE* frame;
+    int frameLength;
+    int result;
     
-    // validate numBytes
-    if(numBytes == 0)
+    writeReq = (PSAT_WRITE_REQ)oldestFrame(&transport->txRing);
+    
+    frameLength = recvFrame(transport, &frame, transport->link.stats.responseTimeoutMs);
+    if(frameLength < 0)
     {
-        printf("writeSatMemory: numBytes must be greater than zero.\n");
-        return -1;
+        logWarn("writeSatMemory: No acknowledgement for packet 0x%x!!\n", ntohl(writeReq->address));
+        return frameLength;
     }
     
-    // this is how many bytes we have written to memory so far
-    bytesWritten = 0;
-    writeReq = (PSAT_WRITE_REQ)buffer;
+    result = checkWriteResp(frame, frameLength, ntohl(writeReq->address));
+    releaseFrame(&transport->rxRing);
+    if(result != 0)
+    {
+        return result;
+    }
+    recordLatency(&transport->link.metrics, writeReq->opcode, getTimeNs() - sentNs);
+    packetOk(transport);
     
-    while(numBytes)
-    {    
-        // initialize the read request
-        memset(buffer, 0, sizeof(buffer));
-        writeReq->dir = TO_SAT;    
-        writeReq->opcode = WRITE;
-        
-        if(numBytes <= MAX_DATALEN)
-        {
-            //this is the last packet
-            writeReq->dataLength = numBytes;                  
-        }
-        else
+    result = writeReq->dataLength;
+    addProgress(transport, result);
+    metricAdd(transport->link.metrics.bytesWritten, result);
+    releaseFrame(&transport->txRing);
+    
+    return result;
+}
+
+// writes numBytes at address from inBuffer with up to window packets in flight
+// *bytesDone is set to the number of bytes that were acknowledged, even if the write fails
+// When the yield hook asks for the link no more packets are queued and the ones in flight are waited for
+// Returns 0 for success, SAT_YIELDED if the write stopped early, <0 for error
+static int writeSatMemoryWindowed(PSAT_TRANSPORT transport, DWORD address, BYTE* inBuffer, DWORD numBytes, int window, DWORD* bytesDone)
+{
+    long long sentNs[MAX_WRITE_WINDOW]; // when each packet in flight was sent, indexed by packet number
+    DWORD bytesQueued;
+    DWORD packetsQueued;
+    DWORD packetsDone;
+    BYTE* frame;
+    int dataLength;
+    int yielded;
+    int result;
+    
+    // this is how many bytes we have sent and had acknowledged so far
+    yielded = 0;
+    bytesQueued = 0;
+    packetsQueued = 0;
+    packetsDone = 0;
+    *bytesDone = 0;
+    initRing(&transport->txRing);
+    initRing(&transport->rxRing);
+    
+    while(*bytesDone < numBytes)
+    {
+        // once half of the window is free, queue another batch of packets behind the ones in flight
+        if(bytesQueued < numBytes && transport->txRing.count <= window / 2)
         {
-            // this is not the last packet
-            writeReq->dataLength = MAX_DATALEN;        
+            while(bytesQueued < numBytes && transport->txRing.count < window)
+            {
+                // stop queueing when the yield hook wants the link, the packets in flight still finish
+                if(shouldYield(transport))
+                {
+                    numBytes = bytesQueued;
+                    yielded = 1;
+                    break;
+                }
+    
+                dataLength = numBytes - bytesQueued;
+                if(dataLength > transport->link.stats.packetSize)
+                {
+                    dataLength = transport->link.stats.packetSize;
+                }
+                
+                frame = reserveFrame(&transport->txRing, dataLength + sizeof(SAT_WRITE_RESP));
+                if(frame == NULL)
+                {
+                    break;
+                }
+                
+                encodeWriteReq(frame, WRITE, address + bytesQueued, inBuffer + bytesQueued, dataLength);
+                commitFrame(&transport->txRing, frame);
+                tracePacket(TRACE_TX, frame);
+                logPacket(frame);
+                
+                sentNs[packetsQueued++ % MAX_WRITE_WINDOW] = getTimeNs();
+                bytesQueued += dataLength;
+            }
+            
+            // send the whole batch to the device
+            result = sendFrames(transport);
+            if(result != 0)
+            {
+                return result;
+            }
+            if(*bytesDone == numBytes)
+            {
+                break;
+            }
         }
         
-        // packetlength includes the header but does not include the dir or checksum bytes
-        writeReq->packetLength = writeReq->dataLength + sizeof(SAT_WRITE_RESP) - 2;
-        
-        // add the address to write to
-        writeReq->address = ntohl(address+bytesWritten);      
-        
-        // copy the bytes to write in
-        memcpy(writeReq->data, inBuffer+bytesWritten, writeReq->dataLength);
-        
-        // the checksum is the last byte in the packet
-        writeReq->data[writeReq->dataLength] = calculateChecksum((BYTE*)writeReq);
-        
-        //printf("The checksum is %d\n", readReq.checksum);
-        dumpPacket((BYTE*)writeReq);
-        
-        // send packet to the device
-        bytesSent = ftdi_write_data (ftdic, (BYTE*)writeReq, writeReq->packetLength + 2);
-        if(bytesSent < 0)
+        // the oldest packet in flight is the one being acknowledged
+        result = recvWriteAck(transport, sentNs[packetsDone++ % MAX_WRITE_WINDOW]);
+        if(result < 0)
         {
-            printf("writeSatMemory: Failed to write to the device (%s)\n", ftdi_get_error_string(ftdic));
-            return -2;    
+            return result;
         }
-        printf("Wrote %d bytes!!\n", bytesSent);      
         
-        // Read data forever
-        printf("waiting for read!!\n");
-        do
+        // increment counters
+        *bytesDone += result;
+        logDebug("%d bytes remaining\n", numBytes - *bytesDone);
+    } // while()
+    
+    return yielded ? SAT_YIELDED : 0;
+}
+
+// write numBytes at address from inBuffer
+// Up to writeWindow WRITE packets are encoded into the transmit ring and handed to the transport in a
+// single write. The acknowledgements are checked as they come back, in the order the packets were sent,
+// so a failed ack is reported with the address of the packet it belongs to. Each packet stays in the
+// ring until it is acknowledged. When an acknowledgement fails the link is resynchronized and the write
+// carries on from the first packet that wasn't acknowledged, writing the same data twice is harmless.
+// This only returns once every packet has been acknowledged or RETRY_LIMIT failures in a row didn't
+// make any progress, or the yield hook stopped it early. *done is set to the number of bytes acknowledged
+// Returns 0 for success, SAT_YIELDED if the write stopped early, <0 for error
+static int writeSatMemoryRetrying(PSAT_TRANSPORT transport, DWORD address, BYTE* inBuffer, DWORD numBytes, DWORD* done)
+{
+    DWORD bytesDone;
+    int attempt;
+    int timeouts;
+    int result;
+    
+    // validate numBytes
+    if(numBytes == 0)
+    {
+        logError("writeSatMemory: numBytes must be greater than zero.\n");
+        return -1;
+    }
+    
+    *done = 0;
+    attempt = 0;
+    timeouts = 0;
+    
+    for(;;)
+    {
+        result = writeSatMemoryWindowed(transport, address + *done, inBuffer + *done, numBytes - *done, transport->link.writeWindow, &bytesDone);
+        *done += bytesDone;
+        if(result == 0 || result == SAT_YIELDED)
         {
-            bytesRecv = ftdi_read_data(ftdic, (BYTE*)&writeResp, sizeof(writeResp));
-            if(bytesRecv == 0)
-            {
-                printf("recved 0\n");
-                usleep(1);
-            }
+            return result;
         }
-        while(bytesRecv == 0);
         
-        
-        if(bytesRecv <= 0)
+        if(bytesDone > 0)
         {
-            printf("writeSatMemory: Failed to read data!!\n");
-            return -3;      
+            attempt = 0;
         }
-        else if(bytesRecv < sizeof(SAT_WRITE_RESP))
-        {
-            printf("writeSatMemory: Didn't recieve enough bytes in response!!\n");
-            return -4;
-        }        
-        
-        // validates the length that came back
-        if(bytesRecv != writeResp.packetLength + 2)
+        if(++attempt > RETRY_LIMIT)
         {
-            printf("writeSatMemory: BytesRecv is less than packetLength!!\n");
-            return -6;
+            logError("writeSatMemory: giving up at 0x%x after %d retries!!\n", address + *done, RETRY_LIMIT);
+            return result;
         }
         
-        // we have enough bytes to validate the buffer    
-        dumpPacket((BYTE*)&writeResp);
-        
-        // packet looks sane, let's validate the checksum
-        result = validateChecksum((BYTE*)&writeResp);
-        if(result != 0)
+        // a DataLink that drops pipelined requests times out before it gets through the first window,
+        // every time. a noisy link loses responses at random and makes progress in between
+        if(result == -10 && bytesDone < transport->link.writeWindow * transport->link.stats.packetSize)
         {
-            printf("writeSatMemory: failed to validate checksum for packet!!\n");
-            return -5;
+            timeouts++;
         }
-        
-        if(writeResp.dataLength != 0)
+        else
         {
-            printf("writeSatMemory: BytesRecv is less than dataLength!!\n");
-            return -7;
+            timeouts = 0;
         }
-        
-        // verify that the packet was a success packet
-        if(writeResp.dir != TO_PC || writeResp.opcode != RESP_SUCCESS)
+        if(transport->link.writeWindow > 1 && timeouts >= 2)
         {
-            printf("writeSatMemory: Packet was error response!!\n");
-            return -9;
+            logWarn("writeSatMemory: pipelined packets keep timing out, using a window of 1\n");
+            transport->link.writeWindow = 1;
         }
         
-        // increment counters
-        numBytes -= writeReq->dataLength;
-        bytesWritten += writeReq->dataLength;
-        printf("%d bytes remaining\n", numBytes);    
-        
-    } // while()        
+        logWarn("writeSatMemory: retrying from 0x%x\n", address + *done);
+        recoverLink(transport, result, attempt);
+    }
+}
+
+// write numBytes at address from inBuffer, timing the write for the metrics
+// Returns 0 for success, <0 for error
+int writeSatMemory(PSAT_TRANSPORT transport, DWORD address, BYTE* inBuffer, DWORD numBytes)
+{
+    int (*yield)(void* context);
+    long long start;
+    DWORD done;
+    int result;
     
-    return 0;
+    // only slices stop early for the yield hook
+    yield = transport->link.yield;
+    transport->link.yield = NULL;
+    start = getTimeNs();
+    result = writeSatMemoryRetrying(transport, address, inBuffer, numBytes, &done);
+    recordTransfer(transport, start);
+    transport->link.yield = yield;
+    
+    return result;
 }
 
-// write numBytes at address from inBuffer then jumps to address
-int writeSatMemoryAndExecute(struct ftdi_context* ftdic, DWORD address, BYTE* inBuffer, DWORD numBytes)
+// writes numBytes at address from inBuffer until the yield hook asks for the link
+// *bytesDone is set to the number of bytes acknowledged, the rest can be written later from there
+// Returns 0 for success, SAT_YIELDED if the write stopped early, <0 for error
+int writeSatMemorySlice(PSAT_TRANSPORT transport, DWORD address, BYTE* inBuffer, DWORD numBytes, DWORD* bytesDone)
 {
-    PSAT_WRITE_REQ writeReq;
-    SAT_WRITE_RESP writeResp;
-    BYTE buffer[255];    
-    int bytesSent;
-    int bytesRecv;
-    int result;    
+    long long start;
+    int result;
     
+    start = getTimeNs();
+    result = writeSatMemoryRetrying(transport, address, inBuffer, numBytes, bytesDone);
+    recordTransfer(transport, start);
     
+    return result;
+}
+
+// write numBytes at address from inBuffer then jumps to address
+// Returns 0 for success, <0 for error
+int writeSatMemoryAndExecute(PSAT_TRANSPORT transport, DWORD address, BYTE* inBuffer, DWORD numBytes)
+{
+    int result;
     
     // validate numBytes
     if(numBytes > MAX_DATALEN)
     {
         // since the amount to write and execute is greater than the MAX_DATALEN we start writing the initial payload
-        // with the regular write function
-        result = writeSatMemory(ftdic, address + MAX_DATALEN, inBuffer + MAX_DATALEN, numBytes - MAX_DATALEN);
+        // with the regular write function. it only returns once every packet has been acknowledged
+        result = writeSatMemory(transport, address + MAX_DATALEN, inBuffer + MAX_DATALEN, numBytes - MAX_DATALEN);
         if(result != 0)
         {
-            printf("writeSatMemoryAndExecute: failed to write initial payload!!\n");
+            logError("writeSatMemoryAndExecute: failed to write initial payload!!\n");
             return -1;
         }
         
         // we should have exactly one full packet left now
-        numBytes = MAX_DATALEN;    
+        numBytes = MAX_DATALEN;
     }
     
-    printf("Returned from writeSatmemoryAndExecute\n");
-    
-    writeReq = (PSAT_WRITE_REQ)buffer;
-    
-    // initialize the read request
-    memset(writeReq, 0, sizeof(buffer));
-    writeReq->dir = TO_SAT;    
-    writeReq->opcode = WRITE_EXECUTE;
+    logDebug("Returned from writeSatmemoryAndExecute\n");
     
     //this is the last packet
-    writeReq->dataLength = numBytes;                  
-    
-    // packetlength includes the header but does not include the dir or checksum bytes
-    writeReq->packetLength = writeReq->dataLength + sizeof(SAT_WRITE_RESP) - 2;
-    
-    // add the address to write to
-    writeReq->address = ntohl(address);      
-    
-    memcpy(writeReq->data, inBuffer, writeReq->dataLength);
-    
-    // the checksum is the last byte in the packet
-    writeReq->data[writeReq->dataLength] = calculateChecksum((BYTE*)writeReq);
-    
-    //printf("The checksum is %d\n", readReq.checksum);
-    dumpPacket((BYTE*)writeReq);
+    return executeSatMemory(transport, address, inBuffer, numBytes);
+}
+
+// sends the WRITE_EXECUTE packet. it is only sent again when the DataLink answered with RESP_ERROR,
+// any other failure may mean the Saturn is already running the program
+int executeSatMemory(PSAT_TRANSPORT transport, DWORD address, BYTE* inBuffer, DWORD numBytes)
+{
+    long long start;
+    long long sent;
+    BYTE* frame;
+    int attempt;
+    int result;
     
-    // send packet to the device
-    bytesSent = ftdi_write_data (ftdic, (BYTE*)writeReq, writeReq->packetLength + 2);
-    if(bytesSent < 0)
+    // validate numBytes
+    if(numBytes == 0 || numBytes > MAX_DATALEN)
     {
-        printf("writeSatMemory: Failed to write to the device (%s)\n", ftdi_get_error_string(ftdic));
-        return -2;    
+        logError("executeSatMemory: numBytes must be between 1 and %d.\n", MAX_DATALEN);
+        return -1;
     }
-    printf("Wrote %d bytes!!\n", bytesSent);      
     
-    // Read data forever
-    printf("waiting for read!!\n");
-    do
+    start = getTimeNs();
+    for(attempt = 1; ; attempt++)
     {
-        bytesRecv = ftdi_read_data(ftdic, (BYTE*)&writeResp, sizeof(writeResp));
-        if(bytesRecv == 0)
+        initRing(&transport->txRing);
+        initRing(&transport->rxRing);
+        frame = reserveFrame(&transport->txRing, numBytes + sizeof(SAT_WRITE_RESP));
+        encodeWriteReq(frame, WRITE_EXECUTE, address, inBuffer, numBytes);
+        commitFrame(&transport->txRing, frame);
+        tracePacket(TRACE_TX, frame);
+        logPacket(frame);
+        
+        // send packet to the device
+        sent = getTimeNs();
+        result = sendFrames(transport);
+        if(result != 0)
         {
-            printf("recved 0\n");
-            usleep(1);
+            break;
         }
-    }
-    while(bytesRecv == 0);
-    
-    if(bytesRecv <= 0)
-    {
-        printf("writeSatMemory: Failed to read data!!\n");
-        return -3;      
-    }
-    else if(bytesRecv < sizeof(SAT_WRITE_RESP))
-    {
-        printf("writeSatMemory: Didn't recieve enough bytes in response!!\n");
-        return -4;
-    }        
-    
-    // validates the length that came back
-    if(bytesRecv != writeResp.packetLength + 2)
-    {
-        printf("writeSatMemory: BytesRecv is less than packetLength!!\n");
-        return -6;
-    }
-    
-    // we have enough bytes to validate the buffer    
-    dumpPacket((BYTE*)&writeResp);
-    
-    // packet looks sane, let's validate the checksum
-    result = validateChecksum((BYTE*)&writeResp);
-    if(result != 0)
-    {
-        printf("writeSatMemory: failed to validate checksum for packet!!\n");
-        return -5;
-    }
-    
-    if(writeResp.dataLength != 0)
-    {
-        printf("writeSatMemory: BytesRecv is less than dataLength!!\n");
-        return -7;
+        
+        result = recvWriteAck(transport, sent);
+        if(result >= 0)
+        {
+            result = 0;
+            break;
+        }
+        
+        if(result != -9 || attempt > RETRY_LIMIT)
+        {
+            break;
+        }
+        
+        logWarn("executeSatMemory: retrying 0x%x\n", address);
+        recoverLink(transport, result, attempt);
     }
     
-    // verify that the packet was a success packet
-    if(writeResp.dir != TO_PC || writeResp.opcode != RESP_SUCCESS)
-    {
-        printf("writeSatMemory: Packet was error response!!\n");
-        return -9;
-    }    
-    
-    return 0;
+    recordTransfer(transport, start);
+    return result;
 }
-
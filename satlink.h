@@ -9,19 +9,15 @@
 #include <stdlib.h>
 #include <string.h>
 #include <netinet/in.h>
-#include <ftdi.h>
 #include <unistd.h>
 
-#define DEBUG
-
-#ifdef DEBUG
-#define debugprintf    printf
-#else
-#define debugprintf    
-#endif
+#include "log.h"
 
 #define VER         "v0.10"
 
+#define BAUD_RATE      375000
+#define BITS_PER_BYTE  11      // 8N2 plus the start bit
+
 #define BIOS_SIZE   524288
 #define BIOS_ADDR   0
 
@@ -41,7 +37,23 @@
 #define RESP_ERROR       0x00 // erroor response message from the saturn
 
 #define MAX_DATALEN      191
-#define MAX_PACKETLEN    MAX_DATALEN + 7
+#define MAX_PACKETLEN    (MAX_DATALEN + 7)
+
+#define READ_WINDOW      8    // default number of READ_CONT requests kept in flight
+#define MAX_READ_WINDOW  32
+#define WRITE_WINDOW     8    // default number of WRITE packets kept in flight
+#define MAX_WRITE_WINDOW 32
+#define RESP_TIMEOUT_MS  1000 // give up on a response after this long without any bytes
+#define MIN_RESP_TIMEOUT_MS 100 // the adaptive response timeout doesn't go below this
+
+#define RETRY_LIMIT        5    // failed attempts in a row without progress before a transfer gives up
+#define RETRY_BACKOFF_MS   10   // wait before the first retry, doubled for every retry after it
+#define MIN_PACKET_DATALEN 16   // the adaptive packet size doesn't go below this
+#define SHRINK_WINDOW      16   // an error within this many packets of the last one halves the packet size
+#define GROW_AFTER         128  // packets without an error before the packet size is doubled again
+#define RESYNC_QUIET_MS    20   // the link is back in sync once nothing has arrived for this long
+
+#define SAT_YIELDED        1    // a slice stopped early because the yield hook asked for the link
 
 typedef unsigned char BYTE;
 typedef unsigned int DWORD;
@@ -73,12 +85,154 @@ typedef struct _SAT_READ_RESP
 
 #pragma pack(pop)
 
+#define RING_SIZE        8192 // bytes in each frame ring, enough for a full window of the largest packets
+
+// preallocated buffer of whole frames, oldest first. see packet.c
+typedef struct _SAT_RING
+{
+    BYTE data[RING_SIZE];
+    int head;           // offset of the oldest frame
+    int tail;           // offset the next frame is written to
+    int wrapEnd;        // end of the frames before tail went back to the front
+    int wrapped;        // non zero while frames continue at the front of data
+    int sendPos;        // offset of the first frame that hasn't been handed to the transport
+    int unsent;         // bytes that haven't been handed to the transport
+    int count;          // frames in the ring
+} SAT_RING, *PSAT_RING;
+
+// where readSatMemoryStream puts the data it reads
+typedef struct _SAT_READ_SINK SAT_READ_SINK, *PSAT_READ_SINK;
+struct _SAT_READ_SINK
+{
+    // returns where to put length bytes read from offset (from the start of the read), NULL to abort
+    BYTE* (*getBuffer)(PSAT_READ_SINK sink, DWORD offset, int length);
+    
+    // the bytes at offset have been read and verified. called in address order, only once per byte
+    // returns 0 to carry on, <0 to abort the read
+    int (*complete)(PSAT_READ_SINK sink, DWORD offset, int length);
+};
+
+// link error counters, reported at the end of a run to spot bad cables
+typedef struct _SAT_LINK_STATS
+{
+    DWORD packets;      // packets that were answered correctly
+    DWORD bytes;        // data bytes read or acknowledged, for progress reports
+    DWORD retries;      // times a transfer was resumed after a failure
+    DWORD timeouts;     // responses that never arrived
+    DWORD badPackets;   // responses with a bad checksum, length, header or address
+    DWORD checksumErrors; // the responses in badPackets that failed because of their checksum
+    DWORD errorResps;   // RESP_ERROR responses
+    DWORD resyncBytes;  // bytes skipped looking for the TO_PC header of a response
+    DWORD shrinks;      // times the packet size was halved because errors clustered
+    DWORD packetSize;   // data bytes per packet right now
+    DWORD responseTimeoutMs; // how long a response is waited for right now
+} SAT_LINK_STATS, *PSAT_LINK_STATS;
+
+#define METRIC_OPCODES      5   // READ_START, READ_CONT, READ_END, WRITE and WRITE_EXECUTE
+#define LATENCY_SUB_BUCKETS 16  // buckets per power of two, the histogram is accurate to 1/16th
+#define LATENCY_BUCKETS     ((32 - 3) * LATENCY_SUB_BUCKETS) // microseconds up to 2^32
+
+// HDR style histogram of round trip times in microseconds. values below LATENCY_SUB_BUCKETS get a
+// bucket each, above that every power of two is split into LATENCY_SUB_BUCKETS buckets. see metrics.c
+typedef struct _SAT_LATENCY_HISTOGRAM
+{
+    unsigned long long counts[LATENCY_BUCKETS];
+    unsigned long long count;
+    unsigned long long sumUs;
+    DWORD minUs;
+    DWORD maxUs;
+} SAT_LATENCY_HISTOGRAM, *PSAT_LATENCY_HISTOGRAM;
+
+// performance counters of one DataLink for --metrics. only the thread driving the DataLink writes them,
+// with atomic stores, so other threads can read them at any time without a lock
+typedef struct _SAT_LINK_METRICS
+{
+    SAT_LATENCY_HISTOGRAM latency[METRIC_OPCODES]; // request to response round trip of each opcode
+    unsigned long long bytesRead;
+    unsigned long long bytesWritten;
+    unsigned long long transfers;   // reads, writes and executes
+    unsigned long long busyNs;      // time spent in them, the throughput is worked out against this
+} SAT_LINK_METRICS, *PSAT_LINK_METRICS;
+
+// protocol state of one DataLink, kept in its SAT_TRANSPORT so several DataLinks can be driven at once
+typedef struct _SAT_LINK_STATE
+{
+    int readWindow;     // READ_CONT requests readSatMemory keeps in flight (1 = stop-and-wait)
+    int writeWindow;    // WRITE packets writeSatMemory keeps in flight (1 = stop-and-wait)
+    SAT_LINK_STATS stats;
+    SAT_LINK_METRICS metrics;
+    DWORD packetsSinceError;
+    int slowestResponseMs; // decaying maximum of the time responses took to arrive, -1 until one has
+    void (*progress)(void* context, DWORD bytes); // called with the data bytes of every packet read or acknowledged, NULL for none
+    void* progressContext;
+    int (*yield)(void* context); // asked at every packet boundary of a slice, non zero stops it there. NULL for never
+    void* yieldContext;
+} SAT_LINK_STATE, *PSAT_LINK_STATE;
+
+// the DataLink the protocol functions talk to. see transport.h
+typedef struct _SAT_TRANSPORT SAT_TRANSPORT, *PSAT_TRANSPORT;
+
 // helper functions
 void dumpPacket(BYTE* packet);
+void initLink(PSAT_TRANSPORT transport); // sets the default windows and clears the stats, the open functions call it
+void setReadWindow(PSAT_TRANSPORT transport, int window); // number of READ_CONT requests readSatMemory keeps in flight (1 = stop-and-wait)
+int getReadWindow(PSAT_TRANSPORT transport);
+void setWriteWindow(PSAT_TRANSPORT transport, int window); // number of WRITE packets writeSatMemory keeps in flight (1 = stop-and-wait)
+int getWriteWindow(PSAT_TRANSPORT transport);
+void getLinkStats(PSAT_TRANSPORT transport, PSAT_LINK_STATS stats); // copies the link error counters to stats
+void resetLinkStats(PSAT_TRANSPORT transport);
+void logLinkStats(PSAT_TRANSPORT transport); // prints the link error counters if anything went wrong
 BYTE calculateChecksum(BYTE* packet);
 int validateChecksum(BYTE* packet);
-int readSatMemory(struct ftdi_context* ftdic, BYTE* outBuffer, DWORD address, DWORD numBytes); // reads numBytes at address into outBuffer
-int writeSatMemory(struct ftdi_context* ftdic, DWORD address, BYTE* inBuffer, DWORD numBytes); // write numBytes at address from inBuffer
-int writeSatMemoryAndExecute(struct ftdi_context* ftdic, DWORD address, BYTE* inBuffer, DWORD numBytes); // write numBytes at address from inBuffer then jumps to address
-int readSatBios(struct ftdi_context* ftdic, BYTE* outBuffer); // reads the saturn's bios into outBuffer. outBuffer must be BIOS_SIZE
+int readSatMemory(PSAT_TRANSPORT transport, BYTE* outBuffer, DWORD address, DWORD numBytes); // reads numBytes at address into outBuffer
+int readSatMemoryStream(PSAT_TRANSPORT transport, PSAT_READ_SINK sink, DWORD address, DWORD numBytes); // reads numBytes at address, handing the data to sink as it arrives
+int writeSatMemory(PSAT_TRANSPORT transport, DWORD address, BYTE* inBuffer, DWORD numBytes); // write numBytes at address from inBuffer
+int readSatMemorySlice(PSAT_TRANSPORT transport, BYTE* outBuffer, DWORD address, DWORD numBytes, DWORD* bytesDone); // readSatMemory that returns SAT_YIELDED at a packet boundary when the yield hook asks, *bytesDone read so far
+int writeSatMemorySlice(PSAT_TRANSPORT transport, DWORD address, BYTE* inBuffer, DWORD numBytes, DWORD* bytesDone); // writeSatMemory that returns SAT_YIELDED at a packet boundary when the yield hook asks, *bytesDone written so far
+int writeSatMemoryAndExecute(PSAT_TRANSPORT transport, DWORD address, BYTE* inBuffer, DWORD numBytes); // write numBytes at address from inBuffer then jumps to address
+int executeSatMemory(PSAT_TRANSPORT transport, DWORD address, BYTE* inBuffer, DWORD numBytes); // writes one packet of at most MAX_DATALEN bytes at address then jumps to address
+int readSatBios(PSAT_TRANSPORT transport, BYTE* outBuffer); // reads the saturn's bios into outBuffer. outBuffer must be BIOS_SIZE
+
+// one range of a scatter/gather read
+typedef struct _SAT_READ_VEC
+{
+    DWORD address;
+    DWORD length;
+    BYTE* buffer;       // gets the length bytes at address
+} SAT_READ_VEC, *PSAT_READ_VEC;
+
+// one READ_START..READ_END sequence planned by planSatReads
+typedef struct _SAT_READ_SPAN
+{
+    DWORD address;
+    DWORD length;
+    DWORD offset;       // where the bytes go in a buffer holding every span one after the other
+} SAT_READ_SPAN, *PSAT_READ_SPAN;
+
+// scatter/gather reads (scatter.c)
+int planSatReads(PSAT_READ_VEC vec, int count, PSAT_READ_SPAN spans, int* spanOf, DWORD* totalLength); // the cheapest sequences reading every entry, spans needs room for count. returns the number of spans, <0 for error
+int readSatMemoryV(PSAT_TRANSPORT transport, PSAT_READ_VEC vec, int count); // reads every entry into its buffer in as little link time as possible, in any order and of any length
+
+// fused copy and checksum (checksum.c)
+typedef BYTE (*CHECKSUM_KERNEL)(BYTE* dst, const BYTE* src, int length);
+BYTE copyAndChecksum(BYTE* dst, const BYTE* src, int length); // copies length bytes from src to dst (unless dst is NULL) and returns their additive checksum
+int getChecksumKernels(const char** names, CHECKSUM_KERNEL* kernels, int max); // every kernel this cpu can run, for benchmarking
+
+// link metrics (metrics.c)
+#define metricAdd(counter, n)   __atomic_store_n(&(counter), __atomic_load_n(&(counter), __ATOMIC_RELAXED) + (n), __ATOMIC_RELAXED)
+void resetLinkMetrics(PSAT_LINK_METRICS metrics);
+void recordLatency(PSAT_LINK_METRICS metrics, BYTE opcode, long long ns); // adds a request to response round trip of opcode
+DWORD getLatencyPercentile(PSAT_LATENCY_HISTOGRAM histogram, double percentile); // in microseconds, 0 if the histogram is empty
+int saveMetrics(const char* filename, PSAT_TRANSPORT* transports, int count); // JSON, or a Prometheus textfile if filename ends in .prom
+
+// packet codec and frame rings (packet.c)
+void initRing(PSAT_RING ring);
+BYTE* reserveFrame(PSAT_RING ring, int length); // contiguous room for a frame of up to length bytes, NULL if the ring is full
+void commitFrame(PSAT_RING ring, BYTE* frame); // adds the frame written to the reserved room
+BYTE* oldestFrame(PSAT_RING ring); // NULL if the ring is empty
+void releaseFrame(PSAT_RING ring); // drops the oldest frame
+BYTE* nextUnsent(PSAT_RING ring, int* length); // next contiguous run of frames that haven't been sent yet
+void markSent(PSAT_RING ring, int length);
+int encodeReadReq(BYTE* frame, BYTE opcode, DWORD address, BYTE dataLength); // returns the frame length
+int encodeWriteReq(BYTE* frame, BYTE opcode, DWORD address, BYTE* data, BYTE dataLength); // returns the frame length
 
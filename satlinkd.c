@@ -0,0 +1,462 @@
+//
+// satlinkd - keeps a DataLink open and runs requests for satlink clients, so they don't pay for
+// opening and setting up the FTDI device every time. Requests from every client go through one
+// queue in the order they arrive, the DataLink only ever works on one of them at a time.
+//
+// satlinkd [-s] [-d device] [-l level] [-t trace.bin] [-m metrics]
+//   -s uses the simulated DataLink instead of the FTDI one
+//   -d serves the DataLink with this serial number or usb bus path instead of the first one
+//   -l sets the log level, -t saves the packet trace when satlinkd stops
+//   -m keeps the link metrics in a file, updated between requests every METRICS_INTERVAL seconds
+//
+
+#define _GNU_SOURCE
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <signal.h>
+#include <errno.h>
+#include <getopt.h>
+#include <time.h>
+#include "transport.h"
+#include "satlinkd.h"
+
+#define METRICS_INTERVAL    10 // seconds between metrics updates while requests are coming in
+
+// a connected client, id changes every time the slot is reused so late responses can be dropped
+typedef struct _SATLINKD_CLIENT
+{
+    int sock;
+    DWORD id;
+} SATLINKD_CLIENT, *PSATLINKD_CLIENT;
+
+// a request waiting for the DataLink
+typedef struct _SATLINKD_JOB
+{
+    int client;
+    DWORD id;
+    int fd;             // data of writes, -1 for reads
+    SATLINKD_REQ req;
+} SATLINKD_JOB, *PSATLINKD_JOB;
+
+static SATLINKD_CLIENT clients[SATLINKD_MAX_CLIENTS];
+static SATLINKD_JOB queue[SATLINKD_MAX_QUEUE];
+static int queueHead = 0;
+static int queueCount = 0;
+static DWORD nextId = 1;
+static volatile sig_atomic_t stopping = 0;
+
+static void handleSignal(int sig)
+{
+    stopping = 1;
+}
+
+// creates the listening socket, replacing the socket of a daemon that is no longer running
+// Returns the socket, <0 for error
+static int listenDaemon(char* path)
+{
+    struct sockaddr_un addr;
+    int sock;
+    
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    
+    if(makeDaemonDir() != 0)
+    {
+        return -4;
+    }
+    
+    sock = connectDaemon();
+    if(sock >= 0)
+    {
+        printf("satlinkd is already running on %s!!\n", path);
+        close(sock);
+        return -1;
+    }
+    unlink(path);
+    
+    sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(sock < 0)
+    {
+        return -2;
+    }
+    
+    if(bind(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(sock, SATLINKD_MAX_CLIENTS) != 0)
+    {
+        printf("Failed to listen on %s!!\n", path);
+        close(sock);
+        return -3;
+    }
+    
+    // the DataLink belongs to whoever can use the socket
+    chmod(path, 0600);
+    return sock;
+}
+
+static void acceptClient(int listenSock)
+{
+    int sock;
+    int i;
+    
+    sock = accept4(listenSock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if(sock < 0)
+    {
+        return;
+    }
+    
+    for(i = 0; i < SATLINKD_MAX_CLIENTS; i++)
+    {
+        if(clients[i].sock < 0)
+        {
+            clients[i].sock = sock;
+            clients[i].id = nextId++;
+            return;
+        }
+    }
+    
+    printf("Too many clients, dropping a connection\n");
+    close(sock);
+}
+
+static void closeClient(int client)
+{
+    close(clients[client].sock);
+    clients[client].sock = -1;
+    clients[client].id = 0;
+}
+
+// queues every request client has sent so far
+static void recvRequests(int client)
+{
+    PSATLINKD_JOB job;
+    SATLINKD_REQ req;
+    int result;
+    int fd;
+    
+    while(queueCount < SATLINKD_MAX_QUEUE)
+    {
+        result = recvDaemonMessage(clients[client].sock, &req, sizeof(req), &fd);
+        if(result == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            return;
+        }
+    
+        // a broken request means the client doesn't speak the protocol, stop listening to it. reads
+        // don't carry an fd, one would never be closed
+        if(result != 0 || req.magic != SATLINKD_MAGIC || req.length == 0 || req.length > SATLINKD_MAX_LENGTH ||
+           (req.op != SATLINKD_READ && fd < 0) || (req.op == SATLINKD_READ && fd >= 0) ||
+           req.op < SATLINKD_READ || req.op > SATLINKD_EXECUTE)
+        {
+            if(result == 0 && fd >= 0)
+            {
+                close(fd);
+            }
+            closeClient(client);
+            return;
+        }
+    
+        job = &queue[(queueHead + queueCount) % SATLINKD_MAX_QUEUE];
+        job->client = client;
+        job->id = clients[client].id;
+        job->fd = fd;
+        memcpy(&job->req, &req, sizeof(req));
+        queueCount++;
+    }
+}
+
+// reads into a new memfd, which is handed to the client in the response
+// Returns 0 for success, <0 for error
+static int runRead(PSAT_TRANSPORT transport, PSATLINKD_REQ req, int* memFd)
+{
+    BYTE* data;
+    int result;
+    
+    *memFd = memfd_create("satlinkd-read", MFD_CLOEXEC);
+    if(*memFd < 0)
+    {
+        return -20;
+    }
+    
+    data = MAP_FAILED;
+    if(ftruncate(*memFd, req->length) == 0)
+    {
+        data = mmap(NULL, req->length, PROT_READ | PROT_WRITE, MAP_SHARED, *memFd, 0);
+    }
+    if(data == MAP_FAILED)
+    {
+        close(*memFd);
+        *memFd = -1;
+        return -21;
+    }
+    
+    result = readSatMemory(transport, data, req->address, req->length);
+    munmap(data, req->length);
+    
+    if(result != 0)
+    {
+        close(*memFd);
+        *memFd = -1;
+    }
+    
+    return result;
+}
+
+// uploads the data of the client's fd without copying it
+// Returns 0 for success, <0 for error
+static int runWrite(PSAT_TRANSPORT transport, PSATLINKD_REQ req, int fd, DWORD* bytesSent)
+{
+    struct stat status;
+    BYTE* data;
+    int result;
+    
+    // mapping past the end of the file would fault while uploading
+    if(fstat(fd, &status) != 0 || status.st_size < req->length)
+    {
+        return -22;
+    }
+    
+    data = mmap(NULL, req->length, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(data == MAP_FAILED)
+    {
+        return -21;
+    }
+    
+    result = uploadImage(transport, req->address, data, req->length, req->op == SATLINKD_EXECUTE,
+                         (req->flags & SATLINKD_DELTA) != 0, bytesSent);
+    
+    munmap(data, req->length);
+    return result;
+}
+
+// runs the oldest queued request and answers its client
+static void runJob(PSAT_TRANSPORT transport)
+{
+    PSATLINKD_JOB job;
+    SATLINKD_RESP resp;
+    int memFd;
+    
+    job = &queue[queueHead];
+    queueHead = (queueHead + 1) % SATLINKD_MAX_QUEUE;
+    queueCount--;
+    
+    memset(&resp, 0, sizeof(resp));
+    resp.magic = SATLINKD_MAGIC;
+    memFd = -1;
+    
+    // the client went away while the request was queued
+    if(clients[job->client].id != job->id)
+    {
+        if(job->fd >= 0)
+        {
+            close(job->fd);
+        }
+        return;
+    }
+    
+    if(job->req.op == SATLINKD_READ)
+    {
+        resp.result = runRead(transport, &job->req, &memFd);
+        resp.length = resp.result == 0 ? job->req.length : 0;
+    }
+    else
+    {
+        resp.result = runWrite(transport, &job->req, job->fd, &resp.bytesSent);
+        close(job->fd);
+    }
+    
+    // don't let a failed request leave half a response behind for the next one
+    if(resp.result != 0)
+    {
+        logWarn("Request %d for 0x%x bytes at 0x%x failed with %d\n", job->req.op, job->req.length,
+               job->req.address, resp.result);
+        transport->purge(transport);
+    }
+    
+    if(sendDaemonMessage(clients[job->client].sock, &resp, sizeof(resp), memFd) != 0)
+    {
+        closeClient(job->client);
+    }
+    
+    if(memFd >= 0)
+    {
+        close(memFd);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    SAT_TRANSPORT transport;
+    SIM_CONFIG simConfig;
+    struct pollfd fds[SATLINKD_MAX_CLIENTS + 1];
+    struct sigaction action;
+    char path[108];
+    PSAT_TRANSPORT pTransport;
+    char* traceFile;
+    char* metricsFile;
+    char* device;
+    time_t metricsSaved;
+    int listenSock;
+    int useSim;
+    int opt;
+    int result;
+    int i;
+    
+    useSim = 0;
+    traceFile = NULL;
+    metricsFile = NULL;
+    device = NULL;
+    while((opt = getopt(argc, argv, "sd:l:t:m:")) != -1)
+    {
+        switch(opt)
+        {
+            case 's': useSim = 1; break;
+            case 'd': device = optarg; break;
+            case 'l': logLevel = parseLogLevel(optarg); break;
+            case 't': traceFile = optarg; break;
+            case 'm': metricsFile = optarg; break;
+            default:
+                logLevel = -1;
+                break;
+        }
+    }
+    
+    if(logLevel < 0)
+    {
+        printf("Usage: satlinkd [-s] [-d device] [-l level] [-t trace.bin] [-m metrics]\n\t-s use the simulated DataLink\n");
+        printf("\t-d serial number or usb bus path of the DataLink to serve, see satlink --list\n");
+        printf("\t-l error, warn, info, debug or packet\n\t-t save the packet trace to trace.bin when stopping\n");
+        printf("\t-m keep the link metrics in this file, a Prometheus textfile if it ends in .prom, JSON otherwise\n");
+        return -1;
+    }
+    
+    if(traceFile != NULL)
+    {
+        startTrace();
+    }
+    
+    printf("satlinkd %s\n", VER);
+    
+    getDaemonPath(path, sizeof(path));
+    listenSock = listenDaemon(path);
+    if(listenSock < 0)
+    {
+        return -1;
+    }
+    
+    if(useSim)
+    {
+        getDefaultSimConfig(&simConfig);
+        result = openSimDevice(&transport, &simConfig);
+    }
+    else
+    {
+        result = openFtdiDevice(&transport, 0, device);
+    }
+    if(result != 0)
+    {
+        printf("Failed to open the DataLink.\n");
+        close(listenSock);
+        unlink(path);
+        return -1;
+    }
+    
+    // stop cleanly so the socket is removed, clients that hang up must not kill the daemon
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handleSignal;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    
+    for(i = 0; i < SATLINKD_MAX_CLIENTS; i++)
+    {
+        clients[i].sock = -1;
+    }
+    
+    printf("Serving DataLink %s on %s\n", transport.serial, path);
+    pTransport = &transport;
+    metricsSaved = time(NULL);
+    
+    while(!stopping)
+    {
+        // new requests are picked up between jobs, when the queue is full they wait in the sockets
+        fds[0].fd = listenSock;
+        fds[0].events = POLLIN;
+        for(i = 0; i < SATLINKD_MAX_CLIENTS; i++)
+        {
+            fds[i + 1].fd = clients[i].sock;
+            fds[i + 1].events = queueCount < SATLINKD_MAX_QUEUE ? POLLIN : 0;
+        }
+    
+        result = poll(fds, SATLINKD_MAX_CLIENTS + 1, queueCount > 0 ? 0 : -1);
+        if(result < 0 && errno != EINTR)
+        {
+            break;
+        }
+    
+        if(result > 0)
+        {
+            if(fds[0].revents & POLLIN)
+            {
+                acceptClient(listenSock);
+            }
+    
+            for(i = 0; i < SATLINKD_MAX_CLIENTS; i++)
+            {
+                if(clients[i].sock >= 0 && fds[i + 1].fd == clients[i].sock && fds[i + 1].revents != 0)
+                {
+                    recvRequests(i);
+                }
+            }
+        }
+    
+        if(queueCount > 0)
+        {
+            runJob(&transport);
+    
+            // saved between jobs so a scraper sees the numbers of a daemon that never stops
+            if(metricsFile != NULL && time(NULL) - metricsSaved >= METRICS_INTERVAL)
+            {
+                saveMetrics(metricsFile, &pTransport, 1);
+                metricsSaved = time(NULL);
+            }
+        }
+    }
+    
+    printf("satlinkd stopping\n");
+    
+    while(queueCount > 0)
+    {
+        if(queue[queueHead].fd >= 0)
+        {
+            close(queue[queueHead].fd);
+        }
+        queueHead = (queueHead + 1) % SATLINKD_MAX_QUEUE;
+        queueCount--;
+    }
+    
+    for(i = 0; i < SATLINKD_MAX_CLIENTS; i++)
+    {
+        if(clients[i].sock >= 0)
+        {
+            closeClient(i);
+        }
+    }
+    
+    close(listenSock);
+    unlink(path);
+    logLinkStats(&transport);
+    if(metricsFile != NULL)
+    {
+        saveMetrics(metricsFile, &pTransport, 1);
+    }
+    transport.close(&transport);
+    
+    if(traceFile != NULL)
+    {
+        saveTrace(traceFile);
+    }
+    return 0;
+}
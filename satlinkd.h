@@ -0,0 +1,78 @@
+//
+// satlinkd keeps the DataLink open and runs read, write and execute requests for local clients.
+// Requests and responses are single SOCK_SEQPACKET messages on a UNIX socket. Payloads never go
+// through the socket: a write passes the fd of its data (usually the input file itself) which the
+// daemon maps, a read is answered with a memfd holding the data which the client maps.
+//
+
+#pragma once
+
+#include "satlink.h"
+
+#define SATLINKD_MAGIC          0x4b4e4c53  // "SLNK"
+#define SATLINKD_SOCKET         "satlinkd.sock"
+#define SATLINKD_MAX_CLIENTS    32
+#define SATLINKD_MAX_QUEUE      64          // requests waiting for the DataLink, clients aren't read while it's full
+#define SATLINKD_MAX_LENGTH     0x08000000  // largest read or write in one request
+
+// request opcodes
+#define SATLINKD_READ       1 // read length bytes at address, answered with a memfd
+#define SATLINKD_WRITE      2 // write length bytes of the passed fd to address
+#define SATLINKD_EXECUTE    3 // write length bytes of the passed fd to address then jump to it
+
+// request flags
+#define SATLINKD_DELTA      0x1 // only send what changed since the last upload to address, see delta.c
+
+typedef struct _SATLINKD_REQ
+{
+    DWORD magic;
+    DWORD op;
+    DWORD flags;
+    DWORD address;
+    DWORD length;
+} SATLINKD_REQ, *PSATLINKD_REQ;
+
+typedef struct _SATLINKD_RESP
+{
+    DWORD magic;
+    int result;         // 0 for success, otherwise the error code of the protocol function
+    DWORD length;       // bytes in the passed memfd for reads
+    DWORD bytesSent;    // bytes that went over the link for writes
+} SATLINKD_RESP, *PSATLINKD_RESP;
+
+// builds the path of the daemon's socket into path: $SATLINKD_SOCKET, $XDG_RUNTIME_DIR/satlinkd.sock
+// or /tmp/satlinkd-<uid>/satlinkd.sock
+void getDaemonPath(char* path, int size);
+
+// sends req and the optional fd (-1 for none) as one message
+// Returns 0 for success, <0 for error
+int sendDaemonMessage(int sock, void* message, int size, int fd);
+
+// receives one message of size bytes and the fd that came with it (-1 for none)
+// Returns 0 for success, 1 if the other end closed the socket, <0 for error
+int recvDaemonMessage(int sock, void* message, int size, int* fd);
+
+// creates the directory of the socket when getDaemonPath falls back to /tmp, readable by this user only
+// Returns 0 for success, <0 if it can't be made or someone else owns it
+int makeDaemonDir();
+
+// connects to a running satlinkd, only if it runs as the same user
+// Returns the socket, <0 if the daemon isn't running
+int connectDaemon();
+
+// reads numBytes at address through the daemon, *data is mapped and has to be released with munmap
+// Returns 0 for success, <0 for error
+int daemonRead(int sock, DWORD address, DWORD numBytes, BYTE** data);
+
+// writes numBytes of fd (from offset 0) to address through the daemon, then executes it if execute is set
+// Returns 0 for success, <0 for error
+int daemonWrite(int sock, DWORD address, int fd, DWORD numBytes, BYTE execute, DWORD flags, DWORD* bytesSent);
+
+// reads numBytes at address into outBuffer through the daemon on sock, or with transport if sock is -1
+// Returns 0 for success, <0 for error
+int readSatMemoryVia(PSAT_TRANSPORT transport, int sock, BYTE* outBuffer, DWORD address, DWORD numBytes);
+
+// writes numBytes of inBuffer to address through the daemon on sock, or with transport if sock is -1,
+// then jumps to address if execute is set
+// Returns 0 for success, <0 for error
+int writeSatMemoryVia(PSAT_TRANSPORT transport, int sock, DWORD address, BYTE* inBuffer, DWORD numBytes, BYTE execute);
@@ -0,0 +1,319 @@
+//
+// Client side of the satlinkd socket protocol, also used by the daemon for framing.
+//
+
+#define _GNU_SOURCE
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include "transport.h"
+#include "satlinkd.h"
+
+void getDaemonPath(char* path, int size)
+{
+    const char* dir;
+    
+    if(getenv("SATLINKD_SOCKET") != NULL)
+    {
+        snprintf(path, size, "%s", getenv("SATLINKD_SOCKET"));
+        return;
+    }
+    
+    dir = getenv("XDG_RUNTIME_DIR");
+    if(dir != NULL)
+    {
+        snprintf(path, size, "%s/%s", dir, SATLINKD_SOCKET);
+        return;
+    }
+    
+    // /tmp is shared, the socket goes in a directory only we can get into
+    snprintf(path, size, "/tmp/satlinkd-%d/%s", getuid(), SATLINKD_SOCKET);
+}
+
+int makeDaemonDir()
+{
+    struct stat status;
+    char dir[64];
+    
+    if(getenv("SATLINKD_SOCKET") != NULL || getenv("XDG_RUNTIME_DIR") != NULL)
+    {
+        return 0;
+    }
+    
+    snprintf(dir, sizeof(dir), "/tmp/satlinkd-%d", getuid());
+    if(mkdir(dir, 0700) != 0 && errno != EEXIST)
+    {
+        printf("Failed to create %s!!\n", dir);
+        return -1;
+    }
+    
+    // someone else could have made it first
+    if(lstat(dir, &status) != 0 || !S_ISDIR(status.st_mode) || status.st_uid != getuid() || (status.st_mode & 077) != 0)
+    {
+        printf("%s isn't a private directory of this user, not using it!!\n", dir);
+        return -2;
+    }
+    
+    return 0;
+}
+
+int sendDaemonMessage(int sock, void* message, int size, int fd)
+{
+    char control[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr* cmsg;
+    struct msghdr msg;
+    struct iovec iov;
+    
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = message;
+    iov.iov_len = size;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    
+    // the payload goes with the message as a file descriptor
+    if(fd >= 0)
+    {
+        memset(control, 0, sizeof(control));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+    
+    if(sendmsg(sock, &msg, MSG_NOSIGNAL) != size)
+    {
+        return -1;
+    }
+    
+    return 0;
+}
+
+int recvDaemonMessage(int sock, void* message, int size, int* fd)
+{
+    char control[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr* cmsg;
+    struct msghdr msg;
+    struct iovec iov;
+    ssize_t length;
+    
+    *fd = -1;
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = message;
+    iov.iov_len = size;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    
+    length = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    if(length == 0)
+    {
+        return 1;
+    }
+    if(length < 0)
+    {
+        return -1;
+    }
+    
+    for(cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+        {
+            memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+        }
+    }
+    
+    // every message is exactly one request or response
+    if(length != size || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) != 0)
+    {
+        if(*fd >= 0)
+        {
+            close(*fd);
+            *fd = -1;
+        }
+        return -2;
+    }
+    
+    return 0;
+}
+
+int connectDaemon()
+{
+    struct sockaddr_un addr;
+    struct ucred peer;
+    socklen_t length;
+    int sock;
+    
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    getDaemonPath(addr.sun_path, sizeof(addr.sun_path));
+    
+    sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if(sock < 0)
+    {
+        return -1;
+    }
+    
+    if(connect(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+    {
+        close(sock);
+        return -2;
+    }
+    
+    // uploads and dumps only go to a daemon run by the same user
+    length = sizeof(peer);
+    if(getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &peer, &length) != 0 || peer.uid != getuid())
+    {
+        printf("%s isn't served by this user, ignoring it!!\n", addr.sun_path);
+        close(sock);
+        return -3;
+    }
+    
+    return sock;
+}
+
+// sends req with fd and waits for its response
+// Returns 0 for success, <0 for error
+static int daemonRequest(int sock, PSATLINKD_REQ req, int fd, PSATLINKD_RESP resp, int* respFd)
+{
+    req->magic = SATLINKD_MAGIC;
+    memset(resp, 0, sizeof(SATLINKD_RESP));
+    *respFd = -1;
+    
+    if(sendDaemonMessage(sock, req, sizeof(SATLINKD_REQ), fd) != 0)
+    {
+        printf("daemonRequest: failed to send the request to satlinkd!!\n");
+        return -1;
+    }
+    
+    if(recvDaemonMessage(sock, resp, sizeof(SATLINKD_RESP), respFd) != 0 || resp->magic != SATLINKD_MAGIC)
+    {
+        printf("daemonRequest: satlinkd didn't answer!!\n");
+        return -2;
+    }
+    
+    return resp->result;
+}
+
+int daemonRead(int sock, DWORD address, DWORD numBytes, BYTE** data)
+{
+    SATLINKD_REQ req;
+    SATLINKD_RESP resp;
+    int memFd;
+    int result;
+    
+    req.op = SATLINKD_READ;
+    req.flags = 0;
+    req.address = address;
+    req.length = numBytes;
+    
+    result = daemonRequest(sock, &req, -1, &resp, &memFd);
+    if(result != 0)
+    {
+        if(memFd >= 0)
+        {
+            close(memFd);
+        }
+        return result;
+    }
+    
+    if(memFd < 0 || resp.length != numBytes)
+    {
+        printf("daemonRead: satlinkd didn't send the data!!\n");
+        if(memFd >= 0)
+        {
+            close(memFd);
+        }
+        return -3;
+    }
+    
+    // the mapping keeps the data after the fd is closed
+    *data = mmap(NULL, numBytes, PROT_READ, MAP_SHARED, memFd, 0);
+    close(memFd);
+    if(*data == MAP_FAILED)
+    {
+        printf("daemonRead: failed to map the data!!\n");
+        return -4;
+    }
+    
+    return 0;
+}
+
+int daemonWrite(int sock, DWORD address, int fd, DWORD numBytes, BYTE execute, DWORD flags, DWORD* bytesSent)
+{
+    SATLINKD_REQ req;
+    SATLINKD_RESP resp;
+    int respFd;
+    int result;
+    
+    req.op = execute ? SATLINKD_EXECUTE : SATLINKD_WRITE;
+    req.flags = flags;
+    req.address = address;
+    req.length = numBytes;
+    
+    result = daemonRequest(sock, &req, fd, &resp, &respFd);
+    if(respFd >= 0)
+    {
+        close(respFd);
+    }
+    
+    *bytesSent = resp.bytesSent;
+    return result;
+}
+
+int readSatMemoryVia(PSAT_TRANSPORT transport, int sock, BYTE* outBuffer, DWORD address, DWORD numBytes)
+{
+    BYTE* data;
+    int result;
+    
+    if(sock < 0)
+    {
+        return readSatMemory(transport, outBuffer, address, numBytes);
+    }
+    
+    result = daemonRead(sock, address, numBytes, &data);
+    if(result != 0)
+    {
+        return result;
+    }
+    
+    memcpy(outBuffer, data, numBytes);
+    munmap(data, numBytes);
+    return 0;
+}
+
+int writeSatMemoryVia(PSAT_TRANSPORT transport, int sock, DWORD address, BYTE* inBuffer, DWORD numBytes, BYTE execute)
+{
+    DWORD bytesSent;
+    int result;
+    int fd;
+    
+    // satlinkd keeps the shadow copies of its DataLink itself
+    if(sock < 0)
+    {
+        dropShadow(transport->serial, address, numBytes);
+        return execute ? writeSatMemoryAndExecute(transport, address, inBuffer, numBytes) : writeSatMemory(transport, address, inBuffer, numBytes);
+    }
+    
+    // satlinkd maps the data from an fd
+    fd = memfd_create("satlink-write", MFD_CLOEXEC);
+    if(fd < 0)
+    {
+        return -20;
+    }
+    
+    if(write(fd, inBuffer, numBytes) != numBytes)
+    {
+        close(fd);
+        return -21;
+    }
+    
+    result = daemonWrite(sock, address, fd, numBytes, execute, 0, &bytesSent);
+    close(fd);
+    return result;
+}
@@ -0,0 +1,233 @@
+//
+// Scatter/gather reads. readSatMemoryV reads a list of (address, length, buffer) entries with as
+// little link time as possible. Every READ_START..READ_END sequence costs a round trip for the
+// READ_START and at least two packets, so entries close together are read in one sequence and the
+// bytes between them thrown away, while entries far apart get a sequence each. Which ones to join is
+// worked out exactly, over the entries sorted by address.
+//
+
+#define _GNU_SOURCE
+#include "transport.h"
+
+#define READ_SEQUENCE_COST  (2 * MAX_DATALEN)           // a READ_START round trip, in byte times on the wire
+#define READ_PACKET_COST    (2 * sizeof(SAT_READ_REQ))  // header bytes of a request and its response
+
+// the entries of a READ_VEC that touch or overlap, read as a whole
+typedef struct _READ_ISLAND
+{
+    DWORD address;
+    DWORD end;
+} READ_ISLAND, *PREAD_ISLAND;
+
+// returns the link time of a sequence reading length bytes, in byte times
+static DWORD getSequenceCost(DWORD length)
+{
+    DWORD packets;
+    
+    // a sequence is atleast 4 bytes in a READ_START and a READ_END
+    if(length < 4)
+    {
+        length = 4;
+    }
+    packets = (length + MAX_DATALEN - 1) / MAX_DATALEN;
+    if(packets < 2)
+    {
+        packets = 2;
+    }
+    
+    return READ_SEQUENCE_COST + packets * READ_PACKET_COST + length;
+}
+
+// sorts an index array by the address of the entries, set up through the qsort_r context
+static int compareVecAddresses(const void* a, const void* b, void* context)
+{
+    PSAT_READ_VEC vec = (PSAT_READ_VEC)context;
+    DWORD addressA = vec[*(const int*)a].address;
+    DWORD addressB = vec[*(const int*)b].address;
+    
+    return addressA < addressB ? -1 : addressA > addressB;
+}
+
+int planSatReads(PSAT_READ_VEC vec, int count, PSAT_READ_SPAN spans, int* spanOf, DWORD* totalLength)
+{
+    PREAD_ISLAND islands;
+    DWORD* best;
+    DWORD cost;
+    int* order;
+    int* from;
+    int numIslands;
+    int numSpans;
+    int i;
+    int j;
+    
+    *totalLength = 0;
+    if(count <= 0)
+    {
+        return 0;
+    }
+    
+    order = malloc(count * sizeof(int));
+    islands = malloc(count * sizeof(READ_ISLAND));
+    best = malloc((count + 1) * sizeof(DWORD));
+    from = malloc((count + 1) * sizeof(int));
+    if(order == NULL || islands == NULL || best == NULL || from == NULL)
+    {
+        free(order);
+        free(islands);
+        free(best);
+        free(from);
+        return -1;
+    }
+    
+    // entries that touch or overlap are always read together
+    for(i = 0; i < count; i++)
+    {
+        order[i] = i;
+    }
+    qsort_r(order, count, sizeof(int), compareVecAddresses, vec);
+    
+    numIslands = 0;
+    for(i = 0; i < count; i++)
+    {
+        if(numIslands > 0 && vec[order[i]].address <= islands[numIslands - 1].end)
+        {
+            if(vec[order[i]].address + vec[order[i]].length > islands[numIslands - 1].end)
+            {
+                islands[numIslands - 1].end = vec[order[i]].address + vec[order[i]].length;
+            }
+            continue;
+        }
+    
+        islands[numIslands].address = vec[order[i]].address;
+        islands[numIslands].end = vec[order[i]].address + vec[order[i]].length;
+        numIslands++;
+    }
+    
+    // best[i] is the cheapest way to read the first i islands, the last sequence starting at from[i].
+    // reading across a gap wider than a sequence and a few packets never pays, so the search stops there
+    best[0] = 0;
+    for(i = 1; i <= numIslands; i++)
+    {
+        best[i] = 0xFFFFFFFF;
+        for(j = i - 1; j >= 0; j--)
+        {
+            cost = best[j] + getSequenceCost(islands[i - 1].end - islands[j].address);
+            if(cost < best[i])
+            {
+                best[i] = cost;
+                from[i] = j;
+            }
+    
+            if(j > 0 && islands[j].address - islands[j - 1].end > READ_SEQUENCE_COST + 4 * READ_PACKET_COST)
+            {
+                break;
+            }
+        }
+    }
+    
+    // walk back from the end to get the sequences, then put them in address order
+    numSpans = 0;
+    for(i = numIslands; i > 0; i = from[i])
+    {
+        numSpans++;
+    }
+    
+    j = numSpans;
+    for(i = numIslands; i > 0; i = from[i])
+    {
+        j--;
+        spans[j].address = islands[from[i]].address;
+        spans[j].length = islands[i - 1].end - islands[from[i]].address;
+    
+        // reads have to be atleast 4 bytes, a short one gets the bytes after it too
+        if(spans[j].length < 4)
+        {
+            spans[j].length = 4;
+        }
+    }
+    
+    for(j = 0; j < numSpans; j++)
+    {
+        spans[j].offset = *totalLength;
+        *totalLength += spans[j].length;
+    }
+    
+    // every entry lies inside exactly one span, found walking both in address order
+    for(i = 0, j = 0; i < count; i++)
+    {
+        while(vec[order[i]].address >= spans[j].address + spans[j].length && j + 1 < numSpans)
+        {
+            j++;
+        }
+        spanOf[order[i]] = j;
+    }
+    
+    free(order);
+    free(islands);
+    free(best);
+    free(from);
+    return numSpans;
+}
+
+int readSatMemoryV(PSAT_TRANSPORT transport, PSAT_READ_VEC vec, int count)
+{
+    PSAT_READ_SPAN spans;
+    PSAT_READ_SPAN span;
+    DWORD totalLength;
+    BYTE* buffer;
+    int* spanOf;
+    int numSpans;
+    int result;
+    int i;
+    
+    for(i = 0; i < count; i++)
+    {
+        if(vec[i].length == 0)
+        {
+            logError("readSatMemoryV: entry %d is empty.\n", i);
+            return -1;
+        }
+    }
+    
+    spans = malloc(count * sizeof(SAT_READ_SPAN));
+    spanOf = malloc(count * sizeof(int));
+    if(spans == NULL || spanOf == NULL)
+    {
+        free(spans);
+        free(spanOf);
+        return -1;
+    }
+    
+    buffer = NULL;
+    numSpans = planSatReads(vec, count, spans, spanOf, &totalLength);
+    if(numSpans > 0)
+    {
+        buffer = malloc(totalLength);
+    }
+    if(numSpans < 0 || (numSpans > 0 && buffer == NULL))
+    {
+        logError("readSatMemoryV: Failed to plan %d reads!!\n", count);
+        free(spans);
+        free(spanOf);
+        return -1;
+    }
+    
+    result = 0;
+    for(i = 0; i < numSpans && result == 0; i++)
+    {
+        logDebug("readSatMemoryV: reading 0x%x bytes at 0x%x\n", spans[i].length, spans[i].address);
+        result = readSatMemory(transport, buffer + spans[i].offset, spans[i].address, spans[i].length);
+    }
+    
+    // hand every entry its bytes
+    for(i = 0; i < count && result == 0; i++)
+    {
+        span = &spans[spanOf[i]];
+        memcpy(vec[i].buffer, buffer + span->offset + (vec[i].address - span->address), vec[i].length);
+    }
+    
+    free(buffer);
+    free(spans);
+    free(spanOf);
+    return result;
+}
@@ -0,0 +1,513 @@
+//
+// Snapshot store. see store.h
+// Chunk boundaries come from a gear hash: every byte shifts the fingerprint left and adds a random
+// number picked by the byte, so the fingerprint only depends on the last 64 bytes and a boundary is
+// found again after a change as soon as 64 unchanged bytes have gone by. Memory that never hits the
+// pattern, like zeroed work RAM, is cut every STORE_MAX_CHUNK bytes from the start of the snapshot
+// rather than from the last boundary, so those cuts line up again after a change too. Chunks are stored as zlib
+// streams in DIR/chunks/xx/<sha1>, xx being the first two digits, and snapshot indexes in
+// DIR/snapshots/<name>. Both are written to a temporary file and renamed into place, so a store is
+// never left with half a chunk or half an index and several dumps can share one.
+//
+
+#include <sys/stat.h>
+#include <pthread.h>
+#include <zlib.h>
+#include "store.h"
+#include "stream.h"
+
+#define CHUNK_MASK  (((1ULL << STORE_CHUNK_BITS) - 1) << (64 - STORE_CHUNK_BITS)) // the top bits mix the most bytes
+
+// most chunks length bytes can be split into. only the chunk before a forced cut can be shorter than
+// STORE_MIN_CHUNK, and there is one of those every STORE_MAX_CHUNK bytes
+#define MAX_CHUNKS(length)  ((length) / STORE_MIN_CHUNK + (length) / STORE_MAX_CHUNK + 1)
+
+static unsigned long long gearTable[256];
+static pthread_once_t gearTableOnce = PTHREAD_ONCE_INIT; // --all stores the dump of every DataLink at once
+
+// the same numbers every time, or the chunks of one run wouldn't match the next
+static void initGearTable()
+{
+    unsigned long long seed;
+    unsigned long long value;
+    int i;
+    
+    // splitmix64
+    seed = 0x5361744C696E6B00ULL;
+    for(i = 0; i < 256; i++)
+    {
+        seed += 0x9E3779B97F4A7C15ULL;
+        value = seed;
+        value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        value = (value ^ (value >> 27)) * 0x94D049BB133111EBULL;
+        gearTable[i] = value ^ (value >> 31);
+    }
+}
+
+// returns the length of the chunk at the start of the length bytes of data, which are offset bytes into
+// the snapshot. a chunk never crosses a multiple of STORE_MAX_CHUNK
+static DWORD findChunkEnd(const BYTE* data, DWORD offset, DWORD length)
+{
+    unsigned long long fingerprint;
+    DWORD i;
+    
+    if(length > STORE_MAX_CHUNK - offset % STORE_MAX_CHUNK)
+    {
+        length = STORE_MAX_CHUNK - offset % STORE_MAX_CHUNK;
+    }
+    if(length <= STORE_MIN_CHUNK)
+    {
+        return length;
+    }
+    
+    // only the last 64 bytes count, so the ones well before the minimum are skipped
+    fingerprint = 0;
+    for(i = STORE_MIN_CHUNK - 64; i < STORE_MIN_CHUNK; i++)
+    {
+        fingerprint = (fingerprint << 1) + gearTable[data[i]];
+    }
+    
+    for(; i < length; i++)
+    {
+        fingerprint = (fingerprint << 1) + gearTable[data[i]];
+        if((fingerprint & CHUNK_MASK) == 0)
+        {
+            return i + 1;
+        }
+    }
+    
+    return length;
+}
+
+// snapshot names end up in paths
+static int isValidName(const char* name)
+{
+    return name[0] != '\0' && name[0] != '.' && strchr(name, '/') == NULL;
+}
+
+static void getChunkPath(const char* dir, const char* hash, char* path, int size)
+{
+    snprintf(path, size, "%s/chunks/%.2s/%.40s", dir, hash, hash);
+}
+
+// writes length bytes of data to path through a temporary file next to it
+// Returns 0 for success, <0 for error
+static int writeAtomically(const char* path, const void* header, DWORD headerLength, const void* data, DWORD length)
+{
+    char tempPath[4096];
+    FILE* file;
+    int fd;
+    
+    snprintf(tempPath, sizeof(tempPath), "%s.XXXXXX", path);
+    fd = mkstemp(tempPath);
+    if(fd < 0)
+    {
+        logError("writeAtomically: Failed to create %s!!\n", tempPath);
+        return -1;
+    }
+    
+    file = fdopen(fd, "w");
+    if(file == NULL)
+    {
+        close(fd);
+        unlink(tempPath);
+        return -1;
+    }
+    fchmod(fd, 0644);
+    
+    if(fwrite(header, 1, headerLength, file) != headerLength || fwrite(data, 1, length, file) != length ||
+       fclose(file) != 0 || rename(tempPath, path) != 0)
+    {
+        logError("writeAtomically: Failed to write %s!!\n", path);
+        unlink(tempPath);
+        return -2;
+    }
+    
+    return 0;
+}
+
+// compresses and stores a chunk unless the store already has it
+// Returns the compressed length of a new chunk, 0 if it was already stored, <0 for error
+static int storeChunk(const char* dir, const char* hash, const BYTE* data, DWORD length)
+{
+    char path[4096];
+    uLongf compressedLength;
+    BYTE* compressed;
+    int result;
+    
+    getChunkPath(dir, hash, path, sizeof(path));
+    if(access(path, F_OK) == 0)
+    {
+        return 0;
+    }
+    
+    // the directory of the chunk
+    path[strlen(path) - 41] = '\0';
+    mkdir(path, 0755);
+    getChunkPath(dir, hash, path, sizeof(path));
+    
+    compressedLength = compressBound(length);
+    compressed = malloc(compressedLength);
+    if(compressed == NULL)
+    {
+        return -1;
+    }
+    
+    if(compress2(compressed, &compressedLength, data, length, Z_DEFAULT_COMPRESSION) != Z_OK)
+    {
+        logError("storeChunk: Failed to compress chunk %.40s!!\n", hash);
+        free(compressed);
+        return -2;
+    }
+    
+    result = writeAtomically(path, NULL, 0, compressed, compressedLength);
+    free(compressed);
+    
+    return result == 0 ? compressedLength : -3;
+}
+
+// decompresses a chunk into buffer, which must hold chunk->length bytes
+// Returns 0 for success, <0 for error
+static int loadChunk(const char* dir, PSTORE_CHUNK chunk, BYTE* buffer)
+{
+    struct stat status;
+    char path[4096];
+    uLongf length;
+    BYTE* compressed;
+    FILE* file;
+    int result;
+    
+    getChunkPath(dir, chunk->hash, path, sizeof(path));
+    file = fopen(path, "r");
+    if(file == NULL || fstat(fileno(file), &status) != 0)
+    {
+        logError("loadChunk: chunk %.40s is missing from the store!!\n", chunk->hash);
+        if(file != NULL)
+        {
+            fclose(file);
+        }
+        return -1;
+    }
+    
+    compressed = malloc(status.st_size);
+    if(compressed == NULL)
+    {
+        fclose(file);
+        return -2;
+    }
+    
+    result = 0;
+    length = chunk->length;
+    if(fread(compressed, 1, status.st_size, file) != status.st_size ||
+       uncompress(buffer, &length, compressed, status.st_size) != Z_OK || length != chunk->length)
+    {
+        logError("loadChunk: chunk %.40s is damaged!!\n", chunk->hash);
+        result = -3;
+    }
+    
+    free(compressed);
+    fclose(file);
+    return result;
+}
+
+int saveSnapshot(const char* dir, const char* name, DWORD address, const BYTE* data, DWORD length, PSTORE_STATS stats)
+{
+    SAT_SNAPSHOT snapshot;
+    PSTORE_CHUNK chunk;
+    SAT_HASH hash;
+    char header[sizeof(SNAPSHOT_MAGIC) - 1 + 3 * sizeof(DWORD)];
+    char path[4096];
+    char hex[41];
+    DWORD offset;
+    int result;
+    
+    memset(stats, 0, sizeof(STORE_STATS));
+    if(!isValidName(name))
+    {
+        logError("saveSnapshot: %s can't be used as a snapshot name!!\n", name);
+        return -1;
+    }
+    
+    pthread_once(&gearTableOnce, initGearTable);
+    
+    snapshot.address = address;
+    snapshot.length = length;
+    snapshot.numChunks = 0;
+    snapshot.chunks = malloc(MAX_CHUNKS(length) * sizeof(STORE_CHUNK));
+    if(snapshot.chunks == NULL)
+    {
+        return -2;
+    }
+    
+    mkdir(dir, 0755);
+    snprintf(path, sizeof(path), "%s/chunks", dir);
+    mkdir(path, 0755);
+    snprintf(path, sizeof(path), "%s/snapshots", dir);
+    mkdir(path, 0755);
+    
+    result = 0;
+    for(offset = 0; offset < length; offset += chunk->length)
+    {
+        chunk = &snapshot.chunks[snapshot.numChunks++];
+        chunk->offset = offset;
+        chunk->length = findChunkEnd(data + offset, offset, length - offset);
+    
+        initHash(&hash, HASH_SHA1);
+        updateHash(&hash, data + offset, chunk->length);
+        finishHash(&hash, hex);
+        memcpy(chunk->hash, hex, sizeof(chunk->hash));
+    
+        result = storeChunk(dir, chunk->hash, data + offset, chunk->length);
+        if(result < 0)
+        {
+            free(snapshot.chunks);
+            return -3;
+        }
+        if(result > 0)
+        {
+            stats->newChunks++;
+            stats->newBytes += result;
+        }
+    }
+    stats->chunks = snapshot.numChunks;
+    
+    // the index goes last, once every chunk it lists is in the store
+    memcpy(header, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC) - 1);
+    memcpy(header + sizeof(SNAPSHOT_MAGIC) - 1, &snapshot, 3 * sizeof(DWORD));
+    snprintf(path, sizeof(path), "%s/snapshots/%s", dir, name);
+    result = writeAtomically(path, header, sizeof(header), snapshot.chunks, snapshot.numChunks * sizeof(STORE_CHUNK));
+    
+    free(snapshot.chunks);
+    return result == 0 ? 0 : -4;
+}
+
+int loadSnapshot(const char* dir, const char* name, PSAT_SNAPSHOT snapshot)
+{
+    char magic[sizeof(SNAPSHOT_MAGIC) - 1];
+    char path[4096];
+    DWORD offset;
+    DWORD i;
+    FILE* file;
+    
+    snapshot->chunks = NULL;
+    if(!isValidName(name))
+    {
+        logError("loadSnapshot: %s can't be a snapshot name!!\n", name);
+        return -1;
+    }
+    
+    snprintf(path, sizeof(path), "%s/snapshots/%s", dir, name);
+    file = fopen(path, "r");
+    if(file == NULL)
+    {
+        logError("loadSnapshot: There's no snapshot called %s in %s!!\n", name, dir);
+        return -2;
+    }
+    
+    if(fread(magic, 1, sizeof(magic), file) != sizeof(magic) || memcmp(magic, SNAPSHOT_MAGIC, sizeof(magic)) != 0 ||
+       fread(snapshot, sizeof(DWORD), 3, file) != 3 || snapshot->numChunks > MAX_CHUNKS(snapshot->length))
+    {
+        logError("loadSnapshot: %s isn't a snapshot index!!\n", path);
+        fclose(file);
+        return -3;
+    }
+    
+    snapshot->chunks = malloc(snapshot->numChunks * sizeof(STORE_CHUNK) + 1);
+    if(snapshot->chunks == NULL || fread(snapshot->chunks, sizeof(STORE_CHUNK), snapshot->numChunks, file) != snapshot->numChunks)
+    {
+        logError("loadSnapshot: Failed to read %s!!\n", path);
+        free(snapshot->chunks);
+        snapshot->chunks = NULL;
+        fclose(file);
+        return -4;
+    }
+    fclose(file);
+    
+    // the chunks have to cover the snapshot one after the other, and fit the buffer loadChunk inflates into
+    offset = 0;
+    for(i = 0; i < snapshot->numChunks && snapshot->chunks[i].offset == offset &&
+        snapshot->chunks[i].length != 0 && snapshot->chunks[i].length <= STORE_MAX_CHUNK; i++)
+    {
+        offset += snapshot->chunks[i].length;
+    }
+    if(i != snapshot->numChunks || offset != snapshot->length)
+    {
+        logError("loadSnapshot: %s is damaged!!\n", path);
+        free(snapshot->chunks);
+        snapshot->chunks = NULL;
+        return -5;
+    }
+    
+    return 0;
+}
+
+int readSnapshot(const char* dir, const char* name, DWORD address, BYTE* buffer, DWORD length)
+{
+    SAT_SNAPSHOT snapshot;
+    PSTORE_CHUNK chunk;
+    BYTE data[STORE_MAX_CHUNK];
+    DWORD offset;
+    DWORD start;
+    DWORD count;
+    DWORD low;
+    DWORD high;
+    DWORD i;
+    int result;
+    
+    result = loadSnapshot(dir, name, &snapshot);
+    if(result != 0)
+    {
+        return result;
+    }
+    
+    if(address < snapshot.address || length > snapshot.length || address - snapshot.address > snapshot.length - length)
+    {
+        logError("readSnapshot: 0x%x bytes at 0x%x aren't in %s (0x%x bytes at 0x%x)!!\n", length, address, name,
+                 snapshot.length, snapshot.address);
+        free(snapshot.chunks);
+        return -6;
+    }
+    offset = address - snapshot.address;
+    
+    // binary search for the chunk holding the first byte
+    low = 0;
+    high = snapshot.numChunks;
+    while(high - low > 1)
+    {
+        i = (low + high) / 2;
+        if(snapshot.chunks[i].offset <= offset)
+        {
+            low = i;
+        }
+        else
+        {
+            high = i;
+        }
+    }
+    
+    result = 0;
+    for(i = low, count = 0; count < length && result == 0; i++)
+    {
+        chunk = &snapshot.chunks[i];
+        result = loadChunk(dir, chunk, data);
+        if(result != 0)
+        {
+            break;
+        }
+    
+        start = offset + count - chunk->offset;
+        if(chunk->length - start > length - count)
+        {
+            memcpy(buffer + count, data + start, length - count);
+            count = length;
+        }
+        else
+        {
+            memcpy(buffer + count, data + start, chunk->length - start);
+            count += chunk->length - start;
+        }
+    }
+    
+    free(snapshot.chunks);
+    return result;
+}
+
+// prints a range of addresses that differs between two snapshots
+static void printDifference(DWORD start, DWORD end, DWORD* differences)
+{
+    printf("0x%08x-0x%08x differs (%u bytes)\n", start, end - 1, end - start);
+    (*differences)++;
+}
+
+int diffSnapshots(const char* dir, const char* nameA, const char* nameB, DWORD* differences)
+{
+    SAT_SNAPSHOT a;
+    SAT_SNAPSHOT b;
+    PSTORE_CHUNK chunkA;
+    PSTORE_CHUNK chunkB;
+    unsigned long long startA;
+    unsigned long long startB;
+    unsigned long long endA;
+    unsigned long long endB;
+    unsigned long long diffStart;
+    unsigned long long diffEnd;
+    DWORD shared;
+    DWORD i;
+    DWORD j;
+    int open;
+    int result;
+    
+    *differences = 0;
+    result = loadSnapshot(dir, nameA, &a);
+    if(result != 0)
+    {
+        return result;
+    }
+    result = loadSnapshot(dir, nameB, &b);
+    if(result != 0)
+    {
+        free(a.chunks);
+        return result;
+    }
+    
+    // walk both chunk lists in address order. chunks that start at the same address with the same hash
+    // are the same bytes, anything else differs until the boundaries meet up again
+    i = 0;
+    j = 0;
+    open = 0;
+    shared = 0;
+    diffStart = 0;
+    diffEnd = 0;
+    while(i < a.numChunks || j < b.numChunks)
+    {
+        chunkA = i < a.numChunks ? &a.chunks[i] : NULL;
+        chunkB = j < b.numChunks ? &b.chunks[j] : NULL;
+        startA = chunkA != NULL ? (unsigned long long)a.address + chunkA->offset : ~0ULL;
+        startB = chunkB != NULL ? (unsigned long long)b.address + chunkB->offset : ~0ULL;
+        endA = chunkA != NULL ? startA + chunkA->length : ~0ULL;
+        endB = chunkB != NULL ? startB + chunkB->length : ~0ULL;
+    
+        if(chunkA != NULL && chunkB != NULL && startA == startB && chunkA->length == chunkB->length &&
+           memcmp(chunkA->hash, chunkB->hash, sizeof(chunkA->hash)) == 0)
+        {
+            if(open)
+            {
+                printDifference(diffStart, diffEnd, differences);
+                open = 0;
+            }
+            shared++;
+            i++;
+            j++;
+            continue;
+        }
+    
+        if(!open)
+        {
+            diffStart = startA < startB ? startA : startB;
+            diffEnd = 0;
+            open = 1;
+        }
+    
+        // move on past whichever chunk ends first, both if they end together
+        if(endA <= endB)
+        {
+            diffEnd = endA > diffEnd ? endA : diffEnd;
+            i++;
+        }
+        if(endB <= endA)
+        {
+            diffEnd = endB > diffEnd ? endB : diffEnd;
+            j++;
+        }
+    }
+    if(open)
+    {
+        printDifference(diffStart, diffEnd, differences);
+    }
+    
+    printf("%u ranges differ, %u of %u and %u chunks are the same\n", *differences, shared, a.numChunks, b.numChunks);
+    
+    free(a.chunks);
+    free(b.chunks);
+    return 0;
+}
@@ -0,0 +1,61 @@
+//
+// Snapshot store. satlink --store DIR keeps dumps as snapshots made of content defined chunks instead
+// of flat files. A chunk ends wherever a rolling hash of the bytes before it hits a pattern, so a
+// change only moves the chunk boundaries around it and the rest of the snapshot splits into the same
+// chunks as the one before. Every chunk is stored once, compressed, under its SHA-1 in DIR/chunks,
+// and DIR/snapshots has an index per snapshot listing its chunks in address order.
+//
+
+#pragma once
+
+#include "transport.h"
+
+#define STORE_MIN_CHUNK     1024    // no boundary before this many bytes
+#define STORE_CHUNK_BITS    12      // a boundary is 1 in 2^STORE_CHUNK_BITS bytes after that, about 4KB apart
+#define STORE_MAX_CHUNK     16384   // always a boundary at every multiple of this into the snapshot
+
+#define SNAPSHOT_MAGIC      "SLSNAP01"
+
+// one chunk of a snapshot
+typedef struct _STORE_CHUNK
+{
+    DWORD offset;       // from the start of the snapshot
+    DWORD length;
+    char hash[40];      // SHA-1 of the bytes in hex, not terminated
+} STORE_CHUNK, *PSTORE_CHUNK;
+
+// a snapshot index, SNAPSHOT_MAGIC and the fields up to chunks followed by the chunks
+typedef struct _SAT_SNAPSHOT
+{
+    DWORD address;
+    DWORD length;
+    DWORD numChunks;
+    PSTORE_CHUNK chunks;
+} SAT_SNAPSHOT, *PSAT_SNAPSHOT;
+
+// what saveSnapshot added to the store
+typedef struct _STORE_STATS
+{
+    DWORD chunks;       // chunks in the snapshot
+    DWORD newChunks;    // chunks that weren't in the store yet
+    DWORD newBytes;     // compressed bytes of the new chunks
+} STORE_STATS, *PSTORE_STATS;
+
+// splits the length bytes of data, read from address, into chunks, stores the ones the store doesn't
+// have yet and writes the index of snapshot name, replacing any snapshot called name
+// Returns 0 for success, <0 for error
+int saveSnapshot(const char* dir, const char* name, DWORD address, const BYTE* data, DWORD length, PSTORE_STATS stats);
+
+// loads the index of snapshot name, snapshot->chunks must be freed
+// Returns 0 for success, <0 for error
+int loadSnapshot(const char* dir, const char* name, PSAT_SNAPSHOT snapshot);
+
+// copies length bytes at address out of snapshot name into buffer, only decompressing the chunks that
+// hold them
+// Returns 0 for success, <0 for error
+int readSnapshot(const char* dir, const char* name, DWORD address, BYTE* buffer, DWORD length);
+
+// prints the address ranges whose chunks differ between snapshots nameA and nameB, comparing only the
+// indexes. *differences is set to the number of ranges
+// Returns 0 for success, <0 for error
+int diffSnapshots(const char* dir, const char* nameA, const char* nameB, DWORD* differences);
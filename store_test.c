@@ -0,0 +1,148 @@
+//
+// Checks that a small change to a snapshot only changes the chunks around it, in zeroed memory where
+// the rolling hash never finds a boundary and every cut is a forced one
+// run with 'make test-store'
+//
+
+#include "store.h"
+
+#define TEST_ADDRESS    0x06000000
+#define TEST_LENGTH     200000
+#define WRITE_OFFSET    0x10000
+#define WRITE_LENGTH    3000
+
+// returns 1 if snapshot has a chunk with the same bytes at the same place as chunk
+static int hasChunk(PSAT_SNAPSHOT snapshot, PSTORE_CHUNK chunk)
+{
+    DWORD i;
+    
+    for(i = 0; i < snapshot->numChunks; i++)
+    {
+        if(snapshot->chunks[i].offset == chunk->offset && snapshot->chunks[i].length == chunk->length &&
+           memcmp(snapshot->chunks[i].hash, chunk->hash, sizeof(chunk->hash)) == 0)
+        {
+            return 1;
+        }
+    }
+    
+    return 0;
+}
+
+// Returns 0 for success, <0 for error
+static int runTest(const char* dir, BYTE* data, BYTE* readBack)
+{
+    SAT_SNAPSHOT a;
+    SAT_SNAPSHOT b;
+    STORE_STATS stats;
+    DWORD differences;
+    DWORD windowStart;
+    DWORD windowEnd;
+    DWORD changedStart;
+    DWORD changedEnd;
+    DWORD i;
+    int result;
+    
+    if(saveSnapshot(dir, "a", TEST_ADDRESS, data, TEST_LENGTH, &stats) != 0)
+    {
+        printf("Failed to save snapshot a!!\n");
+        return -1;
+    }
+    
+    srand(1);
+    for(i = 0; i < WRITE_LENGTH; i++)
+    {
+        data[WRITE_OFFSET + i] = rand();
+    }
+    
+    if(saveSnapshot(dir, "b", TEST_ADDRESS, data, TEST_LENGTH, &stats) != 0)
+    {
+        printf("Failed to save snapshot b!!\n");
+        return -2;
+    }
+    
+    if(diffSnapshots(dir, "a", "b", &differences) != 0 || differences != 1)
+    {
+        printf("The write should be one range that differs!!\n");
+        return -3;
+    }
+    
+    if(loadSnapshot(dir, "a", &a) != 0)
+    {
+        return -4;
+    }
+    if(loadSnapshot(dir, "b", &b) != 0)
+    {
+        free(a.chunks);
+        return -4;
+    }
+    
+    // every chunk of b that a doesn't have has to be inside the STORE_MAX_CHUNK windows the write touched
+    windowStart = WRITE_OFFSET / STORE_MAX_CHUNK * STORE_MAX_CHUNK;
+    windowEnd = (WRITE_OFFSET + WRITE_LENGTH + STORE_MAX_CHUNK - 1) / STORE_MAX_CHUNK * STORE_MAX_CHUNK;
+    changedStart = TEST_LENGTH;
+    changedEnd = 0;
+    for(i = 0; i < b.numChunks; i++)
+    {
+        if(!hasChunk(&a, &b.chunks[i]))
+        {
+            changedStart = b.chunks[i].offset < changedStart ? b.chunks[i].offset : changedStart;
+            changedEnd = b.chunks[i].offset + b.chunks[i].length > changedEnd ? b.chunks[i].offset + b.chunks[i].length : changedEnd;
+        }
+    }
+    free(a.chunks);
+    free(b.chunks);
+    
+    result = 0;
+    if(changedStart < windowStart || changedEnd > windowEnd)
+    {
+        printf("0x%x-0x%x changed, only 0x%x-0x%x should have!!\n", changedStart, changedEnd, windowStart, windowEnd);
+        result = -5;
+    }
+    else if(stats.newChunks > b.numChunks - (TEST_LENGTH - (windowEnd - windowStart)) / STORE_MAX_CHUNK)
+    {
+        printf("%u of %u chunks were stored again!!\n", stats.newChunks, b.numChunks);
+        result = -6;
+    }
+    
+    if(result == 0 && (readSnapshot(dir, "b", TEST_ADDRESS, readBack, TEST_LENGTH) != 0 ||
+                       memcmp(readBack, data, TEST_LENGTH) != 0))
+    {
+        printf("Snapshot b doesn't read back as it was saved!!\n");
+        result = -7;
+    }
+    
+    return result;
+}
+
+int main(int argc, char **argv)
+{
+    char dir[] = "/tmp/satlink_store_test.XXXXXX";
+    char command[64];
+    BYTE* data;
+    BYTE* readBack;
+    int result;
+    
+    if(mkdtemp(dir) == NULL)
+    {
+        printf("Failed to create a store!!\n");
+        return -1;
+    }
+    
+    // zeroed work RAM, as the Saturn usually has it
+    data = calloc(TEST_LENGTH, 1);
+    readBack = malloc(TEST_LENGTH);
+    if(data == NULL || readBack == NULL)
+    {
+        return -1;
+    }
+    
+    result = runTest(dir, data, readBack);
+    
+    free(data);
+    free(readBack);
+    snprintf(command, sizeof(command), "rm -rf %s", dir);
+    system(command);
+    
+    printf(result == 0 ? "store test passed\n" : "store test failed!!\n");
+    return result;
+}
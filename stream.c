@@ -0,0 +1,380 @@
+//
+// Streaming dumps. The read engine fills chunk buffers in address order, a writer thread writes each
+// full chunk to the file with pwrite and hashes it while the next packets are in flight. Only
+// STREAM_BUFFERS chunks exist, so memory use doesn't depend on the size of the dump.
+//
+// Streaming uploads go the other way: whatever a pipe has delivered is sent as soon as there is a
+// packet's worth of it, while the program on the other end keeps writing into the pipe.
+//
+
+#include <pthread.h>
+#include <errno.h>
+#include "stream.h"
+
+#define BUFFER_FREE     0 // can be claimed for the next chunk
+#define BUFFER_FILLING  1 // the read engine is putting data in it
+#define BUFFER_FULL     2 // waiting for the writer thread
+
+typedef struct _STREAM_BUFFER
+{
+    BYTE data[STREAM_CHUNK];
+    DWORD offset;       // offset of the chunk from the start of the read
+    DWORD length;       // bytes in the chunk
+    DWORD filled;       // bytes handed over by the read engine so far
+    int state;
+} STREAM_BUFFER, *PSTREAM_BUFFER;
+
+typedef struct _FILE_STREAM
+{
+    SAT_READ_SINK sink;         // must be first, the read engine hands this back to us
+    int fd;
+    DWORD fileOffset;
+    DWORD numBytes;
+    PSAT_HASH hash;
+    FILE* journal;
+    
+    STREAM_BUFFER* buffers;
+    BYTE spill[MAX_DATALEN];    // a packet that straddles two chunks lands here and is split on complete
+    DWORD spillOffset;
+    int spillLength;
+    int nextWrite;              // the buffer the writer thread handles next
+    DWORD bytesWritten;         // bytes written to the file, in order from the start
+    int finished;               // set once the read engine is done, successfully or not
+    int writeError;
+    
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} FILE_STREAM, *PFILE_STREAM;
+
+// claims the buffer for the chunk at chunkOffset, waiting for the writer thread to free one up.
+// must be called with the lock held
+// Returns the buffer, NULL if the writer thread failed
+static PSTREAM_BUFFER claimStreamBuffer(PFILE_STREAM stream, DWORD chunkOffset)
+{
+    PSTREAM_BUFFER buffer;
+    
+    buffer = &stream->buffers[(chunkOffset / STREAM_CHUNK) % STREAM_BUFFERS];
+    
+    if(buffer->state != BUFFER_FILLING || buffer->offset != chunkOffset)
+    {
+        while(buffer->state != BUFFER_FREE && !stream->writeError)
+        {
+            pthread_cond_wait(&stream->changed, &stream->lock);
+        }
+        
+        buffer->state = BUFFER_FILLING;
+        buffer->offset = chunkOffset;
+        buffer->length = stream->numBytes - chunkOffset < STREAM_CHUNK ? stream->numBytes - chunkOffset : STREAM_CHUNK;
+        buffer->filled = 0;
+    }
+    
+    return stream->writeError ? NULL : buffer;
+}
+
+// hands over length bytes of the chunk buffer, must be called with the lock held
+static void fillStreamBuffer(PFILE_STREAM stream, PSTREAM_BUFFER buffer, DWORD length)
+{
+    buffer->filled += length;
+    if(buffer->filled == buffer->length)
+    {
+        buffer->state = BUFFER_FULL;
+        pthread_cond_broadcast(&stream->changed);
+    }
+}
+
+// claims a buffer for the chunk that holds offset. packets usually fit in one chunk, but after the
+// read engine has retried or changed the packet size one can straddle two, it goes to the spill buffer
+static BYTE* getStreamBuffer(PSAT_READ_SINK sink, DWORD offset, int length)
+{
+    PFILE_STREAM stream = (PFILE_STREAM)sink;
+    PSTREAM_BUFFER buffer;
+    DWORD chunkOffset;
+    BYTE* dest;
+    
+    chunkOffset = offset - offset % STREAM_CHUNK;
+    
+    pthread_mutex_lock(&stream->lock);
+    
+    dest = NULL;
+    buffer = claimStreamBuffer(stream, chunkOffset);
+    if(buffer != NULL && offset + length > chunkOffset + STREAM_CHUNK)
+    {
+        // a failed attempt may have left an older spill behind, it was never completed so reuse it
+        if(claimStreamBuffer(stream, chunkOffset + STREAM_CHUNK) != NULL)
+        {
+            stream->spillOffset = offset;
+            stream->spillLength = length;
+            dest = stream->spill;
+        }
+    }
+    else if(buffer != NULL)
+    {
+        dest = buffer->data + (offset - chunkOffset);
+    }
+    
+    pthread_mutex_unlock(&stream->lock);
+    return dest;
+}
+
+// data is handed over in address order, so a chunk is done once all of its bytes have been handed over
+static int completeStreamBuffer(PSAT_READ_SINK sink, DWORD offset, int length)
+{
+    PFILE_STREAM stream = (PFILE_STREAM)sink;
+    PSTREAM_BUFFER buffer;
+    PSTREAM_BUFFER next;
+    DWORD first;
+    int error;
+    
+    buffer = &stream->buffers[(offset / STREAM_CHUNK) % STREAM_BUFFERS];
+    
+    pthread_mutex_lock(&stream->lock);
+    
+    if(stream->spillLength != 0 && offset == stream->spillOffset && length == stream->spillLength)
+    {
+        // split the spilled packet between the end of its chunk and the start of the next one
+        next = &stream->buffers[(offset / STREAM_CHUNK + 1) % STREAM_BUFFERS];
+        first = buffer->offset + STREAM_CHUNK - offset;
+        memcpy(buffer->data + (offset - buffer->offset), stream->spill, first);
+        memcpy(next->data, stream->spill + first, length - first);
+        stream->spillLength = 0;
+        
+        fillStreamBuffer(stream, buffer, first);
+        fillStreamBuffer(stream, next, length - first);
+    }
+    else
+    {
+        fillStreamBuffer(stream, buffer, length);
+    }
+    
+    error = stream->writeError;
+    pthread_mutex_unlock(&stream->lock);
+    
+    return error ? -1 : 0;
+}
+
+// writes full chunks in order until the read is finished and everything handed over is on disk
+static void* streamWriter(void* context)
+{
+    PFILE_STREAM stream = (PFILE_STREAM)context;
+    PSTREAM_BUFFER buffer;
+    DWORD length;
+    ssize_t result;
+    DWORD done;
+    
+    pthread_mutex_lock(&stream->lock);
+    
+    while(1)
+    {
+        buffer = &stream->buffers[stream->nextWrite];
+        
+        // once the read is over, a chunk that was only partly filled is written up to where it got to
+        if(stream->finished && buffer->state == BUFFER_FILLING && buffer->offset == stream->bytesWritten && buffer->filled)
+        {
+            buffer->length = buffer->filled;
+            buffer->state = BUFFER_FULL;
+        }
+        
+        if(buffer->state != BUFFER_FULL)
+        {
+            if(stream->finished || stream->writeError)
+            {
+                break;
+            }
+            
+            pthread_cond_wait(&stream->changed, &stream->lock);
+            continue;
+        }
+        
+        length = buffer->length;
+        pthread_mutex_unlock(&stream->lock);
+        
+        for(done = 0; done < length; done += result)
+        {
+            result = pwrite(stream->fd, buffer->data + done, length - done, (off_t)stream->fileOffset + buffer->offset + done);
+            if(result <= 0)
+            {
+                break;
+            }
+        }
+        
+        if(stream->hash != NULL)
+        {
+            updateHash(stream->hash, buffer->data, done);
+        }
+        
+        // the range only goes in the journal once it is really on disk
+        if(stream->journal != NULL && done == length)
+        {
+            if(fdatasync(stream->fd) == 0)
+            {
+                journalRange(stream->journal, stream->fileOffset + buffer->offset, length);
+            }
+        }
+        
+        pthread_mutex_lock(&stream->lock);
+        
+        if(done != length)
+        {
+            logError("streamWriter: Failed to write to the file!!\n");
+            stream->writeError = 1;
+            pthread_cond_broadcast(&stream->changed);
+            break;
+        }
+        
+        stream->bytesWritten += length;
+        buffer->state = BUFFER_FREE;
+        stream->nextWrite = (stream->nextWrite + 1) % STREAM_BUFFERS;
+        pthread_cond_broadcast(&stream->changed);
+    }
+    
+    pthread_mutex_unlock(&stream->lock);
+    return NULL;
+}
+
+int readSatMemoryToFile(PSAT_TRANSPORT transport, int fd, DWORD fileOffset, DWORD address, DWORD numBytes, PSAT_HASH hash, FILE* journal, DWORD* bytesWritten)
+{
+    FILE_STREAM stream;
+    pthread_t writer;
+    int result;
+    int i;
+    
+    *bytesWritten = 0;
+    
+    memset(&stream, 0, sizeof(stream));
+    stream.sink.getBuffer = getStreamBuffer;
+    stream.sink.complete = completeStreamBuffer;
+    stream.fd = fd;
+    stream.fileOffset = fileOffset;
+    stream.numBytes = numBytes;
+    stream.hash = hash;
+    stream.journal = journal;
+    
+    stream.buffers = malloc(STREAM_BUFFERS * sizeof(STREAM_BUFFER));
+    if(stream.buffers == NULL)
+    {
+        logError("readSatMemoryToFile: Failed to allocate stream buffers!!\n");
+        return -1;
+    }
+    for(i = 0; i < STREAM_BUFFERS; i++)
+    {
+        stream.buffers[i].state = BUFFER_FREE;
+    }
+    
+    pthread_mutex_init(&stream.lock, NULL);
+    pthread_cond_init(&stream.changed, NULL);
+    
+    if(pthread_create(&writer, NULL, streamWriter, &stream) != 0)
+    {
+        logError("readSatMemoryToFile: Failed to start the writer thread!!\n");
+        free(stream.buffers);
+        return -2;
+    }
+    
+    result = readSatMemoryStream(transport, &stream.sink, address, numBytes);
+    
+    // let the writer drain what has been read and stop
+    pthread_mutex_lock(&stream.lock);
+    stream.finished = 1;
+    pthread_cond_broadcast(&stream.changed);
+    pthread_mutex_unlock(&stream.lock);
+    pthread_join(writer, NULL);
+    
+    *bytesWritten = stream.bytesWritten;
+    if(result == 0 && stream.writeError)
+    {
+        result = -13;
+    }
+    
+    pthread_cond_destroy(&stream.changed);
+    pthread_mutex_destroy(&stream.lock);
+    free(stream.buffers);
+    
+    return result;
+}
+
+int writeSatMemoryFromFd(PSAT_TRANSPORT transport, int fd, DWORD address, BYTE execute, DWORD* numBytes)
+{
+    BYTE head[MAX_DATALEN];
+    BYTE* buffer;
+    DWORD headLength;
+    DWORD filled;
+    DWORD sendLength;
+    ssize_t length;
+    int eof;
+    int result;
+    
+    *numBytes = 0;
+    
+    buffer = malloc(STREAM_CHUNK);
+    if(buffer == NULL)
+    {
+        logError("writeSatMemoryFromFd: Failed to allocate the upload buffer!!\n");
+        return -1;
+    }
+    
+    headLength = 0;
+    filled = 0;
+    eof = 0;
+    result = 0;
+    
+    while(!eof || filled > 0)
+    {
+        // wait for a packet's worth, a read returns everything the pipe has up to the space left
+        while(!eof && filled < MAX_DATALEN)
+        {
+            length = read(fd, buffer + filled, STREAM_CHUNK - filled);
+            if(length < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if(length < 0)
+            {
+                logError("writeSatMemoryFromFd: Failed to read the input!!\n");
+                result = -13;
+                goto done;
+            }
+            
+            eof = length == 0;
+            filled += length;
+        }
+        
+        // the WRITE_EXECUTE has to be the last packet, so the first packet of an execute is held back
+        if(execute && *numBytes == 0 && headLength == 0 && filled > 0)
+        {
+            headLength = filled < MAX_DATALEN ? filled : MAX_DATALEN;
+            memcpy(head, buffer, headLength);
+            memmove(buffer, buffer + headLength, filled - headLength);
+            filled -= headLength;
+            *numBytes = headLength;
+        }
+        
+        // send whole packets, a partial one waits for more data unless the input is over
+        sendLength = eof ? filled : filled - filled % MAX_DATALEN;
+        if(sendLength > 0)
+        {
+            result = writeSatMemory(transport, address + *numBytes, buffer, sendLength);
+            if(result != 0)
+            {
+                goto done;
+            }
+            
+            *numBytes += sendLength;
+            memmove(buffer, buffer + sendLength, filled - sendLength);
+            filled -= sendLength;
+        }
+    }
+    
+    if(*numBytes == 0)
+    {
+        logError("writeSatMemoryFromFd: The input was empty!!\n");
+        result = -1;
+    }
+    else if(execute)
+    {
+        result = executeSatMemory(transport, address, head, headLength);
+    }
+    
+done:
+    free(buffer);
+    return result;
+}
@@ -0,0 +1,55 @@
+//
+// Streaming dumps. Data read from the Saturn is handed to a writer thread that writes it to the
+// output file while the next packets are in flight, through a fixed number of chunk buffers.
+//
+
+#pragma once
+
+#include "transport.h"
+
+#define STREAM_CHUNK    (MAX_DATALEN * 343) // a whole number of full size packets, so usually no packet straddles two chunks
+#define STREAM_BUFFERS  4
+
+// hashes that can be calculated over a dump while it is written
+#define HASH_NONE   0
+#define HASH_CRC32  1
+#define HASH_SHA1   2
+
+typedef struct _SAT_HASH
+{
+    int type;
+    DWORD crc;
+    DWORD sha1[5];
+    BYTE block[64];     // sha1 bytes that don't fill a whole block yet
+    int blockLength;
+    unsigned long long length;
+} SAT_HASH, *PSAT_HASH;
+
+void initHash(PSAT_HASH hash, int type);
+void updateHash(PSAT_HASH hash, const BYTE* data, DWORD length);
+void finishHash(PSAT_HASH hash, char* hex); // hex must be atleast 41 bytes
+const char* getHashName(int type);
+
+// a range of a dump, from the start of the dump
+typedef struct _SAT_RANGE
+{
+    DWORD offset;
+    DWORD length;
+} SAT_RANGE, *PSAT_RANGE;
+
+// reads numBytes at address and writes them to fd at fileOffset onwards, hashing the data in hash if
+// it isn't NULL. If journal isn't NULL every range is synced to disk and then recorded in it.
+// *bytesWritten is set to the number of bytes safely written, even if the read fails
+// Returns 0 for success, <0 for error
+int readSatMemoryToFile(PSAT_TRANSPORT transport, int fd, DWORD fileOffset, DWORD address, DWORD numBytes, PSAT_HASH hash, FILE* journal, DWORD* bytesWritten);
+
+// writes everything that can be read from fd to address, sending it as it arrives so a pipe doesn't have
+// to be read to the end first. with execute the first packet is held back and sent with WRITE_EXECUTE
+// once the input is over. *numBytes is set to the number of bytes sent or held back so far
+// Returns 0 for success, <0 for error
+int writeSatMemoryFromFd(PSAT_TRANSPORT transport, int fd, DWORD address, BYTE execute, DWORD* numBytes);
+
+// checkpoint journals (journal.c)
+FILE* openJournal(const char* path, DWORD address, DWORD count, int resume); // starts a new journal, or appends to the old one when resuming
+void journalRange(FILE* journal, DWORD offset, DWORD length); // records that length bytes at offset are verified and on disk
+int loadJournal(const char* path, DWORD address, DWORD count, PSAT_RANGE* missing); // returns the number of ranges still missing, <0 for error. *missing must be freed
@@ -0,0 +1,163 @@
+//
+// Transports move raw protocol bytes between satlink and a DataLink.
+// The protocol code in satlink.c only talks to a SAT_TRANSPORT so it can run against
+// a real FTDI based DataLink or the simulated one used by the benchmark.
+//
+
+#pragma once
+
+#include "satlink.h"
+
+#define MAX_SERIAL      64
+#define MAX_BUS_PATH    32
+
+struct _SAT_TRANSPORT
+{
+    const char* name;
+    char serial[MAX_SERIAL]; // serial number of the DataLink, used to key per device settings
+    void* ctx;          // backend specific state
+    SAT_RING txRing;    // request frames waiting to be sent or answered, used by satlink.c
+    SAT_RING rxRing;    // response frames being received, used by satlink.c
+    SAT_LINK_STATE link; // windows, packet size and error counters, used by satlink.c
+    
+    // writes size bytes to the device, returns the number of bytes written or <0 for error
+    int (*write)(PSAT_TRANSPORT transport, BYTE* buffer, int size);
+    
+    // waits up to timeoutMs for size bytes to arrive from the device without using any cpu while blocked
+    // returns the number of bytes read (less than size if the deadline passed) or <0 for error
+    int (*read)(PSAT_TRANSPORT transport, BYTE* buffer, int size, int timeoutMs);
+    
+    // throws away anything buffered in either direction
+    int (*purge)(PSAT_TRANSPORT transport);
+    
+    // description of the last error
+    const char* (*errorString)(PSAT_TRANSPORT transport);
+    
+    // closes the device and frees ctx
+    void (*close)(PSAT_TRANSPORT transport);
+};
+
+// FTDI settings that decide the round trip time of small packets. see calibrate.c
+typedef struct _SAT_LINK_PROFILE
+{
+    int latencyTimer;   // ms the FTDI chip waits before sending a partially filled usb packet, 1-255
+    int readChunkSize;  // size of the usb transfers used to read from the device
+    int writeChunkSize; // size of the usb transfers used to write to the device
+    int flowControl;    // non zero for RTS/CTS flow control
+} SAT_LINK_PROFILE, *PSAT_LINK_PROFILE;
+
+// settings for the simulated DataLink
+typedef struct _SIM_CONFIG
+{
+    int baudRate;       // serial rate between the DataLink and the Saturn. 8N2 so a byte takes 11 bit times
+    int usbFrameUs;     // delay before a write reaches the DataLink and before a full usb packet reaches the host
+    int usbLatencyUs;   // delay before a partial usb packet reaches the host (the FTDI latency timer)
+    int jitterUs;       // random delay of up to jitterUs added to every response
+    int processingUs;   // time the Saturn takes to handle a request
+    int bufferRequests; // non zero if requests that arrive while the Saturn is busy are queued, otherwise they are dropped
+    int errorRate;      // a response is damaged, lost or preceded by noise for about one in errorRate bytes sent (0 for a clean link)
+    unsigned int seed;  // seed for the jitter and the errors
+} SIM_CONFIG, *PSIM_CONFIG;
+
+// counters kept by the simulated DataLink
+typedef struct _SIM_STATS
+{
+    DWORD requests;     // request packets handled
+    DWORD dropped;      // request packets dropped because the Saturn was busy
+    DWORD errors;       // RESP_ERROR responses sent
+    DWORD executed;     // number of WRITE_EXECUTE packets handled
+    DWORD executeAddress; // address of the last WRITE_EXECUTE
+    DWORD damaged;      // responses damaged, lost or preceded by noise because of errorRate
+} SIM_STATS, *PSIM_STATS;
+
+// a DataLink found on the usb bus
+typedef struct _SAT_DEVICE_INFO
+{
+    char serial[MAX_SERIAL]; // empty if it couldn't be read, usually because the DataLink is in use
+    char path[MAX_BUS_PATH]; // usb bus and ports, like 1-1.4. stays the same as long as the cable isn't moved
+} SAT_DEVICE_INFO, *PSAT_DEVICE_INFO;
+
+// fills devices with up to max DataLinks
+// Returns the number of DataLinks found, <0 for error
+int listFtdiDevices(PSAT_DEVICE_INFO devices, int max);
+
+// opens the FTDI DataLink on interface with device as its serial number or bus path, the first one if device is NULL
+// Returns 0 for success, <0 for error
+int openFtdiDevice(PSAT_TRANSPORT transport, int interface, const char* device);
+
+// applies profile to an open FTDI DataLink
+// Returns 0 for success, <0 for error
+int setFtdiProfile(PSAT_TRANSPORT transport, PSAT_LINK_PROFILE profile);
+
+// loads the saved profile for the DataLink with serial
+// Returns 0 for success, <0 if there isn't one
+int loadLinkProfile(const char* serial, PSAT_LINK_PROFILE profile);
+
+// saves profile for the DataLink with serial, replacing any older profile for it
+// Returns 0 for success, <0 for error
+int saveLinkProfile(const char* serial, PSAT_LINK_PROFILE profile);
+
+// loads the image last uploaded to address on the DataLink with serial into a malloc'd *shadow
+// Returns 0 for success, <0 if there isn't one
+int loadShadow(const char* serial, DWORD address, BYTE** shadow, DWORD* numBytes);
+
+// keeps image as the contents of address on the DataLink with serial for the next delta upload
+// Returns 0 for success, <0 for error
+int saveShadow(const char* serial, DWORD address, BYTE* image, DWORD numBytes);
+
+// forgets every shadow copy that overlaps the numBytes at address, used when the device memory there is no
+// longer known
+void dropShadow(const char* serial, DWORD address, DWORD numBytes);
+
+// writes the MAX_DATALEN packets of image that differ from shadow to address, then jumps to address with
+// WRITE_EXECUTE if execute is set. bytesSent is set to the number of bytes that went over the link
+// Returns 0 for success, <0 for error
+int writeSatMemoryDelta(PSAT_TRANSPORT transport, DWORD address, BYTE* image, DWORD numBytes,
+                        BYTE* shadow, DWORD shadowBytes, BYTE execute, DWORD* bytesSent);
+
+// uploads image to address the way -w and -e do, only sending what changed since the last upload when
+// delta is set and there is a shadow copy. the shadow copy is replaced once the upload is done
+// Returns 0 for success, <0 for error
+int uploadImage(PSAT_TRANSPORT transport, DWORD address, BYTE* image, DWORD numBytes, BYTE execute, BYTE delta, DWORD* bytesSent);
+
+// runs the read, write and execute operations listed in manifest ("-" for stdin) in one session, merged
+// and reordered where that doesn't change the result. see batch.c. daemonSocket is -1 to use transport
+// Returns 0 for success, <0 for error
+int runBatch(PSAT_TRANSPORT transport, int daemonSocket, const char* manifest);
+
+// polls the regions in "addr:len[,addr:len...]" rate times a second, 0 for as fast as the link allows,
+// and prints the bytes that change until Ctrl-C or samples samples, 0 for no limit
+// Returns 0 for success, <0 for error
+int watchMemory(PSAT_TRANSPORT transport, int daemonSocket, const char* regions, int rate, DWORD samples);
+
+// serves the gdb remote serial protocol on localhost:port, one connection at a time until Ctrl-C, and
+// answers memory requests over the DataLink through a block cache. see gdb.c
+// Returns 0 for success, <0 for error
+int serveGdb(PSAT_TRANSPORT transport, int daemonSocket, int port);
+
+// sweeps the FTDI settings of an open DataLink with real transfers and saves the fastest profile
+// Returns 0 for success, <0 for error
+int calibrateLink(PSAT_TRANSPORT transport);
+
+// fills config with the timings of a DataLink with default FTDI settings
+void getDefaultSimConfig(PSIM_CONFIG config);
+
+// opens a simulated DataLink attached to a Saturn with BIOS, low and high work RAM
+// Returns 0 for success, <0 for error
+int openSimDevice(PSAT_TRANSPORT transport, PSIM_CONFIG config);
+
+// returns a pointer to numBytes of simulated Saturn memory at address, or NULL if the range isn't mapped
+BYTE* getSimMemory(PSAT_TRANSPORT transport, DWORD address, DWORD numBytes);
+
+// copies the simulated DataLink's counters to stats
+void getSimStats(PSAT_TRANSPORT transport, PSIM_STATS stats);
+
+// logs every write, read and purge made through an open transport to filename from now on, with the
+// bytes and how long each call took. closing the transport finishes the log. see transport_replay.c
+// Returns 0 for success, <0 for error
+int startRecording(PSAT_TRANSPORT transport, const char* filename);
+
+// opens a log made by startRecording as a DataLink that answers with the logged results and bytes,
+// taking timeScale times as long as each call took when it was logged, 0 for no waiting
+// Returns 0 for success, <0 for error
+int openReplayDevice(PSAT_TRANSPORT transport, const char* filename, double timeScale);
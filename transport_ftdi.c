@@ -0,0 +1,290 @@
+#include <time.h>
+#include <ftdi.h>
+#include "transport.h"
+
+#define DATALINK_VID    0x0403 // FTDI
+#define DATALINK_PID    0x6001 // FT232
+
+// returns a monotonic timestamp in milliseconds
+static long long getTimeMs()
+{
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int ftdiWrite(PSAT_TRANSPORT transport, BYTE* buffer, int size)
+{
+    return ftdi_write_data((struct ftdi_context*)transport->ctx, buffer, size);
+}
+
+// submits an asynchronous read for exactly size bytes and sleeps in libusb's event handling until it
+// completes or the deadline passes. ftdi_transfer_data_done is only called once the transfer is complete
+// because it polls libusb with a zero timeout
+static int ftdiRead(PSAT_TRANSPORT transport, BYTE* buffer, int size, int timeoutMs)
+{
+    struct ftdi_context* ftdic = (struct ftdi_context*)transport->ctx;
+    struct ftdi_transfer_control* tc;
+    struct timeval cancelTimeout = { 0, 100000 };
+    struct timeval timeout;
+    long long deadline;
+    long long remaining;
+    int bytesRead;
+    
+    tc = ftdi_read_data_submit(ftdic, buffer, size);
+    if(tc == NULL)
+    {
+        return -1;
+    }
+    
+    deadline = getTimeMs() + timeoutMs;
+    while(!tc->completed)
+    {
+        remaining = deadline - getTimeMs();
+        if(remaining <= 0)
+        {
+            // stalled, give back whatever made it
+            bytesRead = tc->offset;
+            ftdi_transfer_data_cancel(tc, &cancelTimeout);
+            return bytesRead;
+        }
+        
+        timeout.tv_sec = remaining / 1000;
+        timeout.tv_usec = (remaining % 1000) * 1000;
+        if(libusb_handle_events_timeout_completed(ftdic->usb_ctx, &timeout, &tc->completed) < 0)
+        {
+            ftdi_transfer_data_cancel(tc, &cancelTimeout);
+            return -1;
+        }
+    }
+    
+    return ftdi_transfer_data_done(tc);
+}
+
+static int ftdiPurge(PSAT_TRANSPORT transport)
+{
+    return ftdi_usb_purge_buffers((struct ftdi_context*)transport->ctx);
+}
+
+static const char* ftdiErrorString(PSAT_TRANSPORT transport)
+{
+    return ftdi_get_error_string((struct ftdi_context*)transport->ctx);
+}
+
+static void closeFtdiDevice(PSAT_TRANSPORT transport)
+{
+    struct ftdi_context* ftdic = (struct ftdi_context*)transport->ctx;
+    
+    ftdi_usb_close(ftdic);
+    ftdi_deinit(ftdic);
+    free(ftdic);
+    
+    transport->ctx = NULL;
+}
+
+int setFtdiProfile(PSAT_TRANSPORT transport, PSAT_LINK_PROFILE profile)
+{
+    struct ftdi_context* ftdic = (struct ftdi_context*)transport->ctx;
+    int f;
+    
+    f = ftdi_set_latency_timer(ftdic, profile->latencyTimer);
+    if(f < 0)
+    {
+        logError("unable to set latency timer: %d (%s)\n", f, ftdi_get_error_string(ftdic));
+        return -1;
+    }
+    
+    f = ftdi_read_data_set_chunksize(ftdic, profile->readChunkSize);
+    if(f < 0)
+    {
+        logError("unable to set read chunk size: %d (%s)\n", f, ftdi_get_error_string(ftdic));
+        return -1;
+    }
+    
+    f = ftdi_write_data_set_chunksize(ftdic, profile->writeChunkSize);
+    if(f < 0)
+    {
+        logError("unable to set write chunk size: %d (%s)\n", f, ftdi_get_error_string(ftdic));
+        return -1;
+    }
+    
+    f = ftdi_setflowctrl(ftdic, profile->flowControl ? SIO_RTS_CTS_HS : SIO_DISABLE_FLOW_CTRL);
+    if(f < 0)
+    {
+        logError("unable to set flow control: %d (%s)\n", f, ftdi_get_error_string(ftdic));
+        return -1;
+    }
+    
+    return 0;
+}
+
+// builds the bus path of dev the way the kernel names usb devices, 1-1.4 is port 4 of the hub on port 1 of bus 1
+static void getBusPath(libusb_device* dev, char* path, int size)
+{
+    BYTE ports[8];
+    int numPorts;
+    int length;
+    int i;
+    
+    length = snprintf(path, size, "%d", libusb_get_bus_number(dev));
+    numPorts = libusb_get_port_numbers(dev, ports, sizeof(ports));
+    for(i = 0; i < numPorts && length < size; i++)
+    {
+        length += snprintf(path + length, size - length, "%c%d", i == 0 ? '-' : '.', ports[i]);
+    }
+}
+
+int listFtdiDevices(PSAT_DEVICE_INFO devices, int max)
+{
+    struct ftdi_context ftdic;
+    struct ftdi_device_list* list;
+    struct ftdi_device_list* entry;
+    int count;
+    
+    if(ftdi_init(&ftdic) < 0)
+    {
+        logError("ftdi_init failed\n");
+        return -1;
+    }
+    
+    if(ftdi_usb_find_all(&ftdic, &list, DATALINK_VID, DATALINK_PID) < 0)
+    {
+        logError("unable to list ftdi devices (%s)\n", ftdi_get_error_string(&ftdic));
+        ftdi_deinit(&ftdic);
+        return -2;
+    }
+    
+    count = 0;
+    for(entry = list; entry != NULL && count < max; entry = entry->next)
+    {
+        // a DataLink that another process has open has no readable serial number
+        if(ftdi_usb_get_strings(&ftdic, entry->dev, NULL, 0, NULL, 0, devices[count].serial, MAX_SERIAL) < 0)
+        {
+            devices[count].serial[0] = '\0';
+        }
+        getBusPath(entry->dev, devices[count].path, MAX_BUS_PATH);
+        count++;
+    }
+    
+    ftdi_list_free(&list);
+    ftdi_deinit(&ftdic);
+    return count;
+}
+
+int openFtdiDevice(PSAT_TRANSPORT transport, int interface, const char* device)
+{
+    struct ftdi_context* ftdic;
+    struct ftdi_device_list* devices;
+    struct ftdi_device_list* entry;
+    SAT_LINK_PROFILE profile;
+    char path[MAX_BUS_PATH];
+    int f;
+    
+    memset(transport, 0, sizeof(SAT_TRANSPORT));
+    
+    ftdic = malloc(sizeof(struct ftdi_context));
+    if(ftdic == NULL)
+    {
+        logError("Failed to allocate ftdi context!!\n");
+        return -1;
+    }
+    
+    // Init  
+    if (ftdi_init(ftdic) < 0)  
+    {
+        logError("ftdi_init failed\n");
+        free(ftdic);
+        return -1;
+    }
+    
+    // Select first interface
+    ftdi_set_interface(ftdic, interface);
+    
+    // find the requested device, its serial number picks the saved profile
+    f = ftdi_usb_find_all(ftdic, &devices, DATALINK_VID, DATALINK_PID);
+    if (f <= 0)
+    {
+        logError("unable to find ftdi device: %d (%s)\n", f, ftdi_get_error_string(ftdic));
+        ftdi_deinit(ftdic);
+        free(ftdic);
+        return -1;
+    }
+    
+    for(entry = devices; entry != NULL; entry = entry->next)
+    {
+        f = ftdi_usb_get_strings(ftdic, entry->dev, NULL, 0, NULL, 0, transport->serial, sizeof(transport->serial));
+        if (f < 0)
+        {
+            transport->serial[0] = '\0';
+        }
+        getBusPath(entry->dev, path, sizeof(path));
+        
+        // no device asked for means the first one
+        if(device == NULL || strcmp(device, transport->serial) == 0 || strcmp(device, path) == 0)
+        {
+            break;
+        }
+    }
+    
+    if(entry == NULL)
+    {
+        logError("unable to find DataLink %s\n", device);
+        ftdi_list_free(&devices);
+        ftdi_deinit(ftdic);
+        free(ftdic);
+        return -1;
+    }
+    
+    // Open device
+    f = ftdi_usb_open_dev(ftdic, entry->dev);
+    ftdi_list_free(&devices);
+    if (f < 0)
+    {
+        logError("unable to open ftdi device: %d (%s)\n", f, ftdi_get_error_string(ftdic));
+        ftdi_deinit(ftdic);
+        free(ftdic);
+        return -1;
+    }
+    
+    transport->name = "ftdi";
+    transport->ctx = ftdic;
+    transport->write = ftdiWrite;
+    transport->read = ftdiRead;
+    transport->purge = ftdiPurge;
+    transport->errorString = ftdiErrorString;
+    transport->close = closeFtdiDevice;
+    initLink(transport);
+    
+    // Set baudrate
+    f = ftdi_set_baudrate(ftdic, BAUD_RATE);
+    if (f < 0)
+    {
+        logError("unable to set baudrate: %d (%s)\n", f, ftdi_get_error_string(ftdic));
+        closeFtdiDevice(transport);
+        return -1;
+    }
+    
+    // set the line property
+    // Data Bits: 8, Stop Bits: 2, Parity Bits: None    
+    f = ftdi_set_line_property(ftdic, BITS_8, STOP_BIT_2, NONE);
+    if(f < 0)
+    {
+        logError("unable to set line property: %d (%s)\n", f, ftdi_get_error_string(ftdic));
+        closeFtdiDevice(transport);
+        return -1;
+    }
+    
+    // apply the profile saved by satlink --calibrate for this DataLink
+    if(transport->serial[0] != '\0' && loadLinkProfile(transport->serial, &profile) == 0)
+    {
+        logInfo("Using calibrated profile for %s\n", transport->serial);
+        if(setFtdiProfile(transport, &profile) != 0)
+        {
+            closeFtdiDevice(transport);
+            return -1;
+        }
+    }
+    
+    return 0;
+}
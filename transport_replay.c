@@ -0,0 +1,509 @@
+//
+// Session recording and replay. startRecording wraps an open transport so every write, read and purge
+// the protocol code makes is appended to a log with the bytes that went each way, when the call was
+// made and how long it took. Reads are logged one call at a time, so the log keeps the boundaries the
+// usb transfers handed the data over in as well as the timeouts that cut them short.
+// openReplayDevice opens such a log as a DataLink: each call gets the result and bytes of the next
+// logged call, after the time it took on the real DataLink (scaled, or none at all), so a session from
+// the lab runs again byte for byte at a desk. Writes are compared with the logged ones, a difference
+// means the protocol code no longer does what it did when the log was made.
+//
+// The log is SAT_RECORD_MAGIC, a byte with the length of the serial number and the serial number,
+// then an event per call: the REC_ type byte, the ns since the end of the previous call, the ns the
+// call took, and for
+//   REC_WRITE   the size, the result and the size bytes written
+//   REC_READ    the size, the timeout in ms, the result and the bytes read
+//   REC_PURGE   the result
+// numbers are LEB128 varints, results zigzag encoded first since they can be negative.
+//
+
+#include <time.h>
+#include "transport.h"
+
+#define SAT_RECORD_MAGIC    "SLREC001"
+
+#define REC_WRITE           0
+#define REC_READ            1
+#define REC_PURGE           2
+
+#define RECORD_BUFFER       (1 << 20) // stdio buffer of the log, so recording doesn't wait on the disk
+
+// a transport being recorded
+typedef struct _SAT_RECORDER
+{
+    SAT_TRANSPORT inner;    // copy of the transport as it was opened, its functions and ctx do the work
+    FILE* file;
+    char* filename;
+    long long lastNs;       // when the previous call returned
+    DWORD events;
+} SAT_RECORDER, *PSAT_RECORDER;
+
+// a log being replayed
+typedef struct _SAT_REPLAY
+{
+    BYTE* log;
+    DWORD length;
+    DWORD offset;           // start of the next event
+    double timeScale;       // multiplies the logged call times, 0 doesn't wait at all
+    DWORD events;           // events replayed
+    DWORD differences;      // writes that didn't match the log
+    long long loggedNs;     // time the replayed calls took when they were logged
+    long long startNs;
+    char error[128];
+} SAT_REPLAY, *PSAT_REPLAY;
+
+// one logged call
+typedef struct _REPLAY_EVENT
+{
+    int type;
+    long long durationNs;
+    DWORD size;
+    DWORD timeoutMs;
+    int result;
+    BYTE* data;             // the bytes written or read, result of them for reads
+} REPLAY_EVENT, *PREPLAY_EVENT;
+
+static const char* eventNames[] = { "write", "read", "purge" };
+
+static long long getTimeNs()
+{
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void putVarint(FILE* file, unsigned long long value)
+{
+    while(value >= 0x80)
+    {
+        putc((value & 0x7f) | 0x80, file);
+        value >>= 7;
+    }
+    putc(value, file);
+}
+
+static void putSigned(FILE* file, int value)
+{
+    putVarint(file, ((unsigned int)value << 1) ^ (unsigned int)(value >> 31));
+}
+
+// appends the type and timing of a call that started at startNs and has just returned
+static void putEvent(PSAT_RECORDER recorder, int type, long long startNs)
+{
+    long long endNs;
+    
+    endNs = getTimeNs();
+    putc(type, recorder->file);
+    putVarint(recorder->file, startNs > recorder->lastNs ? startNs - recorder->lastNs : 0);
+    putVarint(recorder->file, endNs - startNs);
+    recorder->lastNs = endNs;
+    recorder->events++;
+}
+
+static int recordWrite(PSAT_TRANSPORT transport, BYTE* buffer, int size)
+{
+    PSAT_RECORDER recorder = (PSAT_RECORDER)transport->ctx;
+    long long startNs;
+    int result;
+    
+    startNs = getTimeNs();
+    result = recorder->inner.write(&recorder->inner, buffer, size);
+    putEvent(recorder, REC_WRITE, startNs);
+    putVarint(recorder->file, size);
+    putSigned(recorder->file, result);
+    fwrite(buffer, 1, size, recorder->file);
+    
+    return result;
+}
+
+static int recordRead(PSAT_TRANSPORT transport, BYTE* buffer, int size, int timeoutMs)
+{
+    PSAT_RECORDER recorder = (PSAT_RECORDER)transport->ctx;
+    long long startNs;
+    int result;
+    
+    startNs = getTimeNs();
+    result = recorder->inner.read(&recorder->inner, buffer, size, timeoutMs);
+    putEvent(recorder, REC_READ, startNs);
+    putVarint(recorder->file, size);
+    putVarint(recorder->file, timeoutMs);
+    putSigned(recorder->file, result);
+    if(result > 0)
+    {
+        fwrite(buffer, 1, result, recorder->file);
+    }
+    
+    return result;
+}
+
+static int recordPurge(PSAT_TRANSPORT transport)
+{
+    PSAT_RECORDER recorder = (PSAT_RECORDER)transport->ctx;
+    long long startNs;
+    int result;
+    
+    startNs = getTimeNs();
+    result = recorder->inner.purge(&recorder->inner);
+    putEvent(recorder, REC_PURGE, startNs);
+    putSigned(recorder->file, result);
+    
+    return result;
+}
+
+static const char* recordErrorString(PSAT_TRANSPORT transport)
+{
+    PSAT_RECORDER recorder = (PSAT_RECORDER)transport->ctx;
+    
+    return recorder->inner.errorString(&recorder->inner);
+}
+
+static void closeRecording(PSAT_TRANSPORT transport)
+{
+    PSAT_RECORDER recorder = (PSAT_RECORDER)transport->ctx;
+    
+    recorder->inner.close(&recorder->inner);
+    if(ferror(recorder->file) | fclose(recorder->file))
+    {
+        logError("Failed to write the recording %s!!\n", recorder->filename);
+    }
+    else
+    {
+        logInfo("Recorded %u transport calls to %s\n", recorder->events, recorder->filename);
+    }
+    
+    free(recorder->filename);
+    free(recorder);
+    transport->ctx = NULL;
+}
+
+int startRecording(PSAT_TRANSPORT transport, const char* filename)
+{
+    PSAT_RECORDER recorder;
+    BYTE serialLength;
+    
+    recorder = calloc(1, sizeof(SAT_RECORDER));
+    if(recorder == NULL)
+    {
+        return -1;
+    }
+    
+    recorder->filename = strdup(filename);
+    recorder->file = fopen(filename, "wb");
+    if(recorder->filename == NULL || recorder->file == NULL)
+    {
+        logError("Failed to create the recording %s!!\n", filename);
+        if(recorder->file != NULL)
+        {
+            fclose(recorder->file);
+        }
+        free(recorder->filename);
+        free(recorder);
+        return -2;
+    }
+    setvbuf(recorder->file, NULL, _IOFBF, RECORD_BUFFER);
+    
+    serialLength = strlen(transport->serial);
+    fwrite(SAT_RECORD_MAGIC, 1, strlen(SAT_RECORD_MAGIC), recorder->file);
+    putc(serialLength, recorder->file);
+    fwrite(transport->serial, 1, serialLength, recorder->file);
+    
+    // the protocol code keeps using transport, the calls go through the recorder to the copy
+    memcpy(&recorder->inner, transport, sizeof(SAT_TRANSPORT));
+    recorder->lastNs = getTimeNs();
+    transport->ctx = recorder;
+    transport->write = recordWrite;
+    transport->read = recordRead;
+    transport->purge = recordPurge;
+    transport->errorString = recordErrorString;
+    transport->close = closeRecording;
+    
+    return 0;
+}
+
+// reads a varint at replay->offset
+// Returns 0 for success, <0 if the log ends first
+static int getVarint(PSAT_REPLAY replay, unsigned long long* value)
+{
+    int shift;
+    BYTE c;
+    
+    *value = 0;
+    for(shift = 0; shift < 64; shift += 7)
+    {
+        if(replay->offset >= replay->length)
+        {
+            return -1;
+        }
+        c = replay->log[replay->offset++];
+        *value |= (unsigned long long)(c & 0x7f) << shift;
+        if((c & 0x80) == 0)
+        {
+            return 0;
+        }
+    }
+    
+    return -1;
+}
+
+// reads a zigzag encoded varint at replay->offset
+// Returns 0 for success, <0 if the log ends first
+static int getSigned(PSAT_REPLAY replay, int* value)
+{
+    unsigned long long encoded;
+    
+    if(getVarint(replay, &encoded) != 0)
+    {
+        return -1;
+    }
+    
+    *value = (int)(encoded >> 1) ^ -(int)(encoded & 1);
+    return 0;
+}
+
+// parses the next event of the log, which has to be a call of type
+// Returns 0 for success, <0 if the log ends or holds a different call
+static int getReplayEvent(PSAT_REPLAY replay, int type, PREPLAY_EVENT event)
+{
+    unsigned long long value;
+    unsigned long long gapNs;
+    unsigned long long durationNs;
+    DWORD dataLength;
+    int result;
+    
+    if(replay->offset >= replay->length)
+    {
+        snprintf(replay->error, sizeof(replay->error), "the recording ended after %u calls", replay->events);
+        return -1;
+    }
+    
+    event->type = replay->log[replay->offset];
+    if(event->type != type)
+    {
+        snprintf(replay->error, sizeof(replay->error), "call %u is a %s in the recording, not a %s", replay->events + 1,
+                 event->type <= REC_PURGE ? eventNames[event->type] : "?", eventNames[type]);
+        return -2;
+    }
+    replay->offset++;
+    
+    result = getVarint(replay, &gapNs);
+    result |= getVarint(replay, &durationNs);
+    event->durationNs = durationNs;
+    event->size = 0;
+    event->timeoutMs = 0;
+    event->data = NULL;
+    dataLength = 0;
+    
+    if(type == REC_WRITE || type == REC_READ)
+    {
+        result |= getVarint(replay, &value);
+        event->size = value;
+    }
+    if(type == REC_READ)
+    {
+        result |= getVarint(replay, &value);
+        event->timeoutMs = value;
+    }
+    result |= getSigned(replay, &event->result);
+    
+    if(type == REC_WRITE)
+    {
+        dataLength = event->size;
+    }
+    else if(type == REC_READ && event->result > 0)
+    {
+        dataLength = event->result;
+    }
+    if(result != 0 || dataLength > replay->length - replay->offset)
+    {
+        snprintf(replay->error, sizeof(replay->error), "call %u is cut short", replay->events + 1);
+        return -3;
+    }
+    event->data = replay->log + replay->offset;
+    replay->offset += dataLength;
+    
+    replay->events++;
+    replay->loggedNs += event->durationNs;
+    return 0;
+}
+
+// waits until the call that started at startNs has taken as long as the logged one, times timeScale
+static void waitReplayEvent(PSAT_REPLAY replay, long long startNs, PREPLAY_EVENT event)
+{
+    struct timespec ts;
+    long long endNs;
+    
+    if(replay->timeScale <= 0)
+    {
+        return;
+    }
+    
+    endNs = startNs + (long long)(event->durationNs * replay->timeScale);
+    ts.tv_sec = endNs / 1000000000LL;
+    ts.tv_nsec = endNs % 1000000000LL;
+    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0)
+    {
+    }
+}
+
+static int replayWrite(PSAT_TRANSPORT transport, BYTE* buffer, int size)
+{
+    PSAT_REPLAY replay = (PSAT_REPLAY)transport->ctx;
+    REPLAY_EVENT event;
+    long long startNs;
+    
+    startNs = getTimeNs();
+    if(getReplayEvent(replay, REC_WRITE, &event) != 0)
+    {
+        logError("replay: %s\n", replay->error);
+        return -1;
+    }
+    
+    if(event.size != size || memcmp(event.data, buffer, size) != 0)
+    {
+        if(replay->differences == 0)
+        {
+            logWarn("replay: call %u writes %d bytes that differ from the %u in the recording\n", replay->events, size, event.size);
+        }
+        replay->differences++;
+    }
+    
+    waitReplayEvent(replay, startNs, &event);
+    return event.result;
+}
+
+static int replayRead(PSAT_TRANSPORT transport, BYTE* buffer, int size, int timeoutMs)
+{
+    PSAT_REPLAY replay = (PSAT_REPLAY)transport->ctx;
+    REPLAY_EVENT event;
+    long long startNs;
+    
+    startNs = getTimeNs();
+    if(getReplayEvent(replay, REC_READ, &event) != 0)
+    {
+        logError("replay: %s\n", replay->error);
+        return -1;
+    }
+    
+    // a read for fewer bytes than the recorded one got loses the rest
+    if(event.result > size)
+    {
+        logWarn("replay: call %u reads %d bytes, the recording has %d\n", replay->events, size, event.result);
+        event.result = size;
+    }
+    if(event.result > 0)
+    {
+        memcpy(buffer, event.data, event.result);
+    }
+    
+    waitReplayEvent(replay, startNs, &event);
+    return event.result;
+}
+
+static int replayPurge(PSAT_TRANSPORT transport)
+{
+    PSAT_REPLAY replay = (PSAT_REPLAY)transport->ctx;
+    REPLAY_EVENT event;
+    long long startNs;
+    
+    startNs = getTimeNs();
+    if(getReplayEvent(replay, REC_PURGE, &event) != 0)
+    {
+        logError("replay: %s\n", replay->error);
+        return -1;
+    }
+    
+    waitReplayEvent(replay, startNs, &event);
+    return event.result;
+}
+
+static const char* replayErrorString(PSAT_TRANSPORT transport)
+{
+    PSAT_REPLAY replay = (PSAT_REPLAY)transport->ctx;
+    
+    return replay->error[0] != '\0' ? replay->error : "replayed error";
+}
+
+static void closeReplayDevice(PSAT_TRANSPORT transport)
+{
+    PSAT_REPLAY replay = (PSAT_REPLAY)transport->ctx;
+    
+    logInfo("Replayed %u calls in %.3f s, they took %.3f s when recorded. %u writes differed from the recording\n",
+            replay->events, (getTimeNs() - replay->startNs) / 1e9, replay->loggedNs / 1e9, replay->differences);
+    if(replay->offset < replay->length)
+    {
+        logWarn("replay: the session stopped %u bytes before the end of the recording\n", replay->length - replay->offset);
+    }
+    
+    free(replay->log);
+    free(replay);
+    transport->ctx = NULL;
+}
+
+int openReplayDevice(PSAT_TRANSPORT transport, const char* filename, double timeScale)
+{
+    PSAT_REPLAY replay;
+    FILE* file;
+    long size;
+    int magicLength;
+    int serialLength;
+    
+    memset(transport, 0, sizeof(SAT_TRANSPORT));
+    
+    replay = calloc(1, sizeof(SAT_REPLAY));
+    if(replay == NULL)
+    {
+        return -1;
+    }
+    
+    file = fopen(filename, "rb");
+    if(file == NULL)
+    {
+        logError("Failed to open the recording %s!!\n", filename);
+        free(replay);
+        return -2;
+    }
+    
+    fseek(file, 0, SEEK_END);
+    size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    replay->log = malloc(size > 0 ? size : 1);
+    if(replay->log == NULL || fread(replay->log, 1, size, file) != size)
+    {
+        logError("Failed to read the recording %s!!\n", filename);
+        fclose(file);
+        free(replay->log);
+        free(replay);
+        return -3;
+    }
+    fclose(file);
+    replay->length = size;
+    
+    magicLength = strlen(SAT_RECORD_MAGIC);
+    if(size <= magicLength || memcmp(replay->log, SAT_RECORD_MAGIC, magicLength) != 0 ||
+       size < magicLength + 1 + replay->log[magicLength])
+    {
+        logError("%s isn't a recording!!\n", filename);
+        free(replay->log);
+        free(replay);
+        return -4;
+    }
+    
+    // the serial number is kept apart, the real DataLink's profile and delta copies aren't touched
+    serialLength = replay->log[magicLength];
+    snprintf(transport->serial, sizeof(transport->serial), "replay-%.*s", serialLength, replay->log + magicLength + 1);
+    replay->offset = magicLength + 1 + serialLength;
+    replay->timeScale = timeScale;
+    replay->startNs = getTimeNs();
+    
+    transport->name = "replay";
+    transport->ctx = replay;
+    transport->write = replayWrite;
+    transport->read = replayRead;
+    transport->purge = replayPurge;
+    transport->errorString = replayErrorString;
+    transport->close = closeReplayDevice;
+    initLink(transport);
+    
+    return 0;
+}
@@ -0,0 +1,502 @@
+//
+// Simulated DataLink and Saturn.
+// Requests written by the host are handled as soon as they are written, but the bytes of every
+// response are only handed back to the host once the serial line and the usb link would have
+// delivered them, so the protocol code sees the same pacing it would see on real hardware.
+//
+
+#include <time.h>
+#include "transport.h"
+
+#define SIM_USB_PACKET   62      // data bytes in one FTDI usb packet (64 minus 2 status bytes)
+#define SIM_MAX_PIECES   8192    // usb packets that can be waiting for the host
+#define SIM_RX_LEN       16384   // request bytes that can be waiting to be parsed
+
+// a piece of the response stream the host can read once readyNs has passed
+typedef struct _SIM_PIECE
+{
+    long long readyNs;
+    int offset;         // bytes of data already read by the host
+    int length;
+    BYTE data[SIM_USB_PACKET];
+} SIM_PIECE, *PSIM_PIECE;
+
+// a range of Saturn memory
+typedef struct _SIM_REGION
+{
+    DWORD address;
+    DWORD size;
+    BYTE* data;
+} SIM_REGION, *PSIM_REGION;
+
+typedef struct _SIM_DATALINK
+{
+    SIM_CONFIG config;
+    SIM_STATS stats;
+    SIM_REGION regions[3];
+    
+    BYTE rxBuf[SIM_RX_LEN];     // request bytes not handled yet
+    int rxLength;
+    
+    SIM_PIECE* pieces;          // ring of response pieces
+    int firstPiece;
+    int numPieces;
+    
+    long long byteNs;           // time to send a byte on the serial line
+    long long toSatFreeNs;      // when the host to Saturn line is next idle
+    long long satFreeNs;        // when the Saturn is done with the last request
+    int inRead;                 // non zero between a READ_START and a READ_END
+    unsigned int random;
+} SIM_DATALINK, *PSIM_DATALINK;
+
+static int simDevices = 0; // numbers the serials of the simulated DataLinks
+
+// returns a monotonic timestamp in nanoseconds
+static long long getTimeNs()
+{
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void getDefaultSimConfig(PSIM_CONFIG config)
+{
+    config->baudRate = BAUD_RATE;
+    config->usbFrameUs = 1000;
+    config->usbLatencyUs = 16000;
+    config->jitterUs = 200;
+    config->processingUs = 20;
+    config->bufferRequests = 1;
+    config->errorRate = 0;
+    config->seed = 1;
+}
+
+// returns a pointer to numBytes of simulated memory at address, or NULL if the range isn't mapped
+static BYTE* findSimMemory(PSIM_DATALINK sim, DWORD address, DWORD numBytes)
+{
+    int i;
+    
+    for(i = 0; i < sizeof(sim->regions)/sizeof(sim->regions[0]); i++)
+    {
+        if(address >= sim->regions[i].address && numBytes <= sim->regions[i].size &&
+           address - sim->regions[i].address <= sim->regions[i].size - numBytes)
+        {
+            return sim->regions[i].data + (address - sim->regions[i].address);
+        }
+    }
+    
+    return NULL;
+}
+
+BYTE* getSimMemory(PSAT_TRANSPORT transport, DWORD address, DWORD numBytes)
+{
+    return findSimMemory((PSIM_DATALINK)transport->ctx, address, numBytes);
+}
+
+void getSimStats(PSAT_TRANSPORT transport, PSIM_STATS stats)
+{
+    PSIM_DATALINK sim = (PSIM_DATALINK)transport->ctx;
+    
+    memcpy(stats, &sim->stats, sizeof(SIM_STATS));
+}
+
+// queues packetLength bytes of response that start going out on the serial line at startNs
+static void queueResponse(PSIM_DATALINK sim, BYTE* packet, int packetLength, long long startNs)
+{
+    PSIM_PIECE piece;
+    long long jitterNs;
+    long long doneNs;
+    int sent;
+    int length;
+    
+    jitterNs = 0;
+    if(sim->config.jitterUs > 0)
+    {
+        jitterNs = (long long)(rand_r(&sim->random) % sim->config.jitterUs) * 1000;
+    }
+    
+    for(sent = 0; sent < packetLength; sent += length)
+    {
+        if(sim->numPieces == SIM_MAX_PIECES)
+        {
+            // the host isn't reading, the FTDI chip would drop the data too
+            return;
+        }
+        
+        length = packetLength - sent;
+        if(length > SIM_USB_PACKET)
+        {
+            length = SIM_USB_PACKET;
+        }
+        
+        // full usb packets go out on the next frame, a partial one waits for the latency timer
+        doneNs = startNs + (sent + length) * sim->byteNs;
+        if(length == SIM_USB_PACKET)
+        {
+            doneNs += (long long)sim->config.usbFrameUs * 1000;
+        }
+        else
+        {
+            doneNs += (long long)sim->config.usbLatencyUs * 1000;
+        }
+        
+        piece = &sim->pieces[(sim->firstPiece + sim->numPieces) % SIM_MAX_PIECES];
+        piece->readyNs = doneNs + jitterNs;
+        piece->offset = 0;
+        piece->length = length;
+        memcpy(piece->data, packet + sent, length);
+        sim->numPieces++;
+    }
+    
+    sim->satFreeNs = startNs + packetLength * sim->byteNs;
+}
+
+// handles one request packet that has been fully received by the Saturn at arrivedNs
+static void handleRequest(PSIM_DATALINK sim, BYTE* packet, long long arrivedNs)
+{
+    BYTE response[MAX_PACKETLEN + 2];
+    BYTE noise[3];
+    PSAT_WRITE_REQ req;
+    PSAT_READ_RESP resp;
+    long long startNs;
+    DWORD address;
+    BYTE* memory = NULL;
+    int packetLength;
+    int ok;
+    
+    req = (PSAT_WRITE_REQ)packet;
+    resp = (PSAT_READ_RESP)response;
+    address = ntohl(req->address);
+    
+    if(arrivedNs < sim->satFreeNs && !sim->config.bufferRequests)
+    {
+        sim->stats.dropped++;
+        return;
+    }
+    
+    startNs = arrivedNs;
+    if(startNs < sim->satFreeNs)
+    {
+        startNs = sim->satFreeNs;
+    }
+    startNs += (long long)sim->config.processingUs * 1000;
+    sim->stats.requests++;
+    
+    memset(response, 0, sizeof(response));
+    resp->dir = TO_PC;
+    resp->address = req->address;
+    ok = validateChecksum(packet) == 0;
+    
+    switch(req->opcode)
+    {
+        case READ_START:
+        case READ_CONT:
+        case READ_END:
+        {
+            if(req->opcode == READ_START)
+            {
+                sim->inRead = 1;
+            }
+            
+            memory = findSimMemory(sim, address, req->dataLength);
+            if(ok && sim->inRead && memory != NULL && req->packetLength == sizeof(SAT_READ_REQ) - 2)
+            {
+                resp->dataLength = req->dataLength;
+            }
+            else
+            {
+                ok = 0;
+            }
+            
+            if(req->opcode == READ_END)
+            {
+                sim->inRead = 0;
+            }
+            break;
+        }
+        case WRITE:
+        case WRITE_EXECUTE:
+        {
+            memory = findSimMemory(sim, address, req->dataLength);
+            if(ok && memory != NULL && req->packetLength == req->dataLength + sizeof(SAT_WRITE_RESP) - 2)
+            {
+                memcpy(memory, req->data, req->dataLength);
+                if(req->opcode == WRITE_EXECUTE)
+                {
+                    sim->stats.executed++;
+                    sim->stats.executeAddress = address;
+                }
+            }
+            else
+            {
+                ok = 0;
+            }
+            break;
+        }
+        default:
+        {
+            ok = 0;
+        }
+    };
+    
+    if(!ok)
+    {
+        resp->dataLength = 0;
+        sim->stats.errors++;
+    }
+    
+    resp->opcode = ok ? RESP_SUCCESS : RESP_ERROR;
+    resp->packetLength = resp->dataLength + sizeof(SAT_WRITE_RESP) - 2;
+    resp->data[resp->dataLength] = copyAndChecksum(NULL, response + 1, sizeof(SAT_WRITE_RESP) - 2);
+    if(resp->dataLength)
+    {
+        resp->data[resp->dataLength] += copyAndChecksum(resp->data, memory, resp->dataLength);
+    }
+    
+    packetLength = resp->packetLength + 2;
+    
+    // a noisy cable damages a byte, loses the whole response or adds noise in front of it
+    if(sim->config.errorRate > 0 && rand_r(&sim->random) % sim->config.errorRate < packetLength)
+    {
+        sim->stats.damaged++;
+        switch(rand_r(&sim->random) % 3)
+        {
+            case 0:
+                response[1 + rand_r(&sim->random) % (packetLength - 1)] ^= 1 << (rand_r(&sim->random) % 8);
+                break;
+            case 1:
+                sim->satFreeNs = startNs + packetLength * sim->byteNs;
+                return;
+            case 2:
+                memset(noise, TO_PC, sizeof(noise));
+                noise[1] = (BYTE)rand_r(&sim->random);
+                queueResponse(sim, noise, sizeof(noise), startNs);
+                startNs = sim->satFreeNs;
+                break;
+        }
+    }
+    
+    queueResponse(sim, response, packetLength, startNs);
+}
+
+static int simWrite(PSAT_TRANSPORT transport, BYTE* buffer, int size)
+{
+    PSIM_DATALINK sim = (PSIM_DATALINK)transport->ctx;
+    long long startNs;
+    int packetLength;
+    int length;
+    int used;
+    
+    length = size;
+    if(length > SIM_RX_LEN - sim->rxLength)
+    {
+        length = SIM_RX_LEN - sim->rxLength;
+    }
+    memcpy(sim->rxBuf + sim->rxLength, buffer, length);
+    sim->rxLength += length;
+    
+    // the bytes reach the DataLink on the next usb frame and then go out on the serial line one by one
+    startNs = getTimeNs() + (long long)sim->config.usbFrameUs * 1000;
+    if(startNs < sim->toSatFreeNs)
+    {
+        startNs = sim->toSatFreeNs;
+    }
+    
+    used = 0;
+    while(used < sim->rxLength)
+    {
+        // resynchronize on the start of a packet
+        if(sim->rxBuf[used] != TO_SAT)
+        {
+            used++;
+            startNs += sim->byteNs;
+            continue;
+        }
+        
+        if(sim->rxLength - used < 2 || sim->rxLength - used < sim->rxBuf[used + 1] + 2)
+        {
+            break;
+        }
+        
+        packetLength = sim->rxBuf[used + 1] + 2;
+        startNs += packetLength * sim->byteNs;
+        if(packetLength <= MAX_PACKETLEN + 2)
+        {
+            handleRequest(sim, sim->rxBuf + used, startNs);
+        }
+        used += packetLength;
+    }
+    
+    sim->toSatFreeNs = startNs;
+    sim->rxLength -= used;
+    memmove(sim->rxBuf, sim->rxBuf + used, sim->rxLength);
+    
+    return length;
+}
+
+// returns when the first size bytes of the response stream can be read, or -1 if they haven't been sent
+static long long getReadyNs(PSIM_DATALINK sim, int size)
+{
+    PSIM_PIECE piece;
+    long long readyNs;
+    int available;
+    int i;
+    
+    readyNs = 0;
+    available = 0;
+    for(i = 0; i < sim->numPieces && available < size; i++)
+    {
+        piece = &sim->pieces[(sim->firstPiece + i) % SIM_MAX_PIECES];
+        if(piece->readyNs > readyNs)
+        {
+            readyNs = piece->readyNs;
+        }
+        available += piece->length - piece->offset;
+    }
+    
+    return available < size ? -1 : readyNs;
+}
+
+// sleeps until the bytes would have arrived, or until the deadline if they never will
+static int simRead(PSAT_TRANSPORT transport, BYTE* buffer, int size, int timeoutMs)
+{
+    PSIM_DATALINK sim = (PSIM_DATALINK)transport->ctx;
+    PSIM_PIECE piece;
+    struct timespec wakeup;
+    long long deadlineNs;
+    long long readyNs;
+    long long nowNs;
+    int bytesRead;
+    int length;
+    
+    deadlineNs = getTimeNs() + (long long)timeoutMs * 1000000;
+    readyNs = getReadyNs(sim, size);
+    if(readyNs < 0 || readyNs > deadlineNs)
+    {
+        readyNs = deadlineNs;
+    }
+    
+    wakeup.tv_sec = readyNs / 1000000000;
+    wakeup.tv_nsec = readyNs % 1000000000;
+    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wakeup, NULL) != 0)
+    {
+    }
+    
+    nowNs = getTimeNs();
+    bytesRead = 0;
+    
+    while(bytesRead < size && sim->numPieces)
+    {
+        piece = &sim->pieces[sim->firstPiece];
+        if(piece->readyNs > nowNs)
+        {
+            break;
+        }
+        
+        length = piece->length - piece->offset;
+        if(length > size - bytesRead)
+        {
+            length = size - bytesRead;
+        }
+        memcpy(buffer + bytesRead, piece->data + piece->offset, length);
+        piece->offset += length;
+        bytesRead += length;
+        
+        if(piece->offset == piece->length)
+        {
+            sim->firstPiece = (sim->firstPiece + 1) % SIM_MAX_PIECES;
+            sim->numPieces--;
+        }
+    }
+    
+    return bytesRead;
+}
+
+static int simPurge(PSAT_TRANSPORT transport)
+{
+    PSIM_DATALINK sim = (PSIM_DATALINK)transport->ctx;
+    
+    sim->rxLength = 0;
+    sim->firstPiece = 0;
+    sim->numPieces = 0;
+    
+    return 0;
+}
+
+static const char* simErrorString(PSAT_TRANSPORT transport)
+{
+    return "simulated DataLink error";
+}
+
+static void closeSimDevice(PSAT_TRANSPORT transport)
+{
+    PSIM_DATALINK sim = (PSIM_DATALINK)transport->ctx;
+    int i;
+    
+    for(i = 0; i < sizeof(sim->regions)/sizeof(sim->regions[0]); i++)
+    {
+        free(sim->regions[i].data);
+    }
+    free(sim->pieces);
+    free(sim);
+    
+    transport->ctx = NULL;
+}
+
+int openSimDevice(PSAT_TRANSPORT transport, PSIM_CONFIG config)
+{
+    PSIM_DATALINK sim;
+    DWORD i;
+    
+    memset(transport, 0, sizeof(SAT_TRANSPORT));
+    
+    sim = calloc(1, sizeof(SIM_DATALINK));
+    if(sim == NULL)
+    {
+        logError("Failed to allocate simulated DataLink!!\n");
+        return -1;
+    }
+    
+    memcpy(&sim->config, config, sizeof(SIM_CONFIG));
+    sim->random = config->seed;
+    sim->byteNs = 11LL * 1000000000 / config->baudRate;
+    
+    // BIOS, low work RAM and high work RAM
+    sim->regions[0].address = BIOS_ADDR;
+    sim->regions[0].size = BIOS_SIZE;
+    sim->regions[1].address = 0x00200000;
+    sim->regions[1].size = 0x00100000;
+    sim->regions[2].address = 0x06000000;
+    sim->regions[2].size = 0x00100000;
+    
+    sim->pieces = malloc(SIM_MAX_PIECES * sizeof(SIM_PIECE));
+    transport->ctx = sim;
+    for(i = 0; i < sizeof(sim->regions)/sizeof(sim->regions[0]); i++)
+    {
+        sim->regions[i].data = calloc(1, sim->regions[i].size);
+        if(sim->regions[i].data == NULL || sim->pieces == NULL)
+        {
+            logError("Failed to allocate simulated memory!!\n");
+            closeSimDevice(transport);
+            return -1;
+        }
+    }
+    
+    // give the BIOS some recognizable contents
+    for(i = 0; i < BIOS_SIZE; i++)
+    {
+        sim->regions[0].data[i] = (BYTE)(i * 7 + (i >> 8));
+    }
+    
+    transport->name = "sim";
+    snprintf(transport->serial, sizeof(transport->serial), "SIM%d", simDevices++);
+    transport->write = simWrite;
+    transport->read = simRead;
+    transport->purge = simPurge;
+    transport->errorString = simErrorString;
+    transport->close = closeSimDevice;
+    initLink(transport);
+    
+    return 0;
+}
@@ -0,0 +1,438 @@
+//
+// Live memory monitor. satlink --watch 0x06001000:16,0x06002000:4 samples a few small regions at a
+// fixed rate over one open session and prints the bytes that changed since the last sample.
+// The reads of a sample are planned by planSatReads, so regions close together share one
+// READ_START..READ_END sequence and a sample costs as little link time as possible. Each sample is
+// compared with the last one using the widest compare the cpu supports. When it stops it reports the
+// sample rate it achieved and how regular it was, which is the latency ceiling of the link.
+//
+
+#define _GNU_SOURCE
+#include <time.h>
+#include <signal.h>
+#include <errno.h>
+#include <math.h>
+#include "transport.h"
+#include "satlinkd.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS
+#endif
+
+#define MAX_WATCH_REGIONS   64
+#define MAX_WATCH_LENGTH    4096        // largest region
+#define WATCH_LINE_BYTES    16          // changed bytes printed per line
+
+typedef struct _WATCH_REGION
+{
+    DWORD address;
+    DWORD length;
+    DWORD offset;       // where the region is in a sample
+} WATCH_REGION, *PWATCH_REGION;
+
+// returns the offset of the first byte from start on that differs between a and b, length if there isn't one
+typedef DWORD (*COMPARE_KERNEL)(const BYTE* a, const BYTE* b, DWORD start, DWORD length);
+
+static volatile sig_atomic_t watchStopping = 0;
+
+static void handleWatchSignal(int sig)
+{
+    watchStopping = 1;
+}
+
+static DWORD findChangeScalar(const BYTE* a, const BYTE* b, DWORD start, DWORD length)
+{
+    unsigned long long wordA;
+    unsigned long long wordB;
+    DWORD i;
+    
+    // a word at a time until something differs
+    for(i = start; i + 8 <= length; i += 8)
+    {
+        memcpy(&wordA, a + i, 8);
+        memcpy(&wordB, b + i, 8);
+        if(wordA != wordB)
+        {
+            break;
+        }
+    }
+    
+    for(; i < length; i++)
+    {
+        if(a[i] != b[i])
+        {
+            return i;
+        }
+    }
+    
+    return length;
+}
+
+#ifdef HAVE_X86_KERNELS
+
+// pcmpeqb and pmovmskb check 16 bytes at a time, the first clear bit is the first change
+__attribute__((target("sse2")))
+static DWORD findChangeSse2(const BYTE* a, const BYTE* b, DWORD start, DWORD length)
+{
+    __m128i equal;
+    unsigned int mask;
+    DWORD i;
+    
+    for(i = start; i + 16 <= length; i += 16)
+    {
+        equal = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a + i)), _mm_loadu_si128((const __m128i*)(b + i)));
+        mask = _mm_movemask_epi8(equal) ^ 0xFFFF;
+        if(mask != 0)
+        {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    
+    return findChangeScalar(a, b, i, length);
+}
+
+__attribute__((target("avx2")))
+static DWORD findChangeAvx2(const BYTE* a, const BYTE* b, DWORD start, DWORD length)
+{
+    __m256i equal;
+    unsigned int mask;
+    DWORD i;
+    
+    for(i = start; i + 32 <= length; i += 32)
+    {
+        equal = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(a + i)), _mm256_loadu_si256((const __m256i*)(b + i)));
+        mask = ~(unsigned int)_mm256_movemask_epi8(equal);
+        if(mask != 0)
+        {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    
+    return findChangeScalar(a, b, i, length);
+}
+
+#endif
+
+// picks the widest compare the cpu supports
+static COMPARE_KERNEL getCompareKernel()
+{
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))
+    {
+        return findChangeAvx2;
+    }
+    if(__builtin_cpu_supports("sse2"))
+    {
+        return findChangeSse2;
+    }
+#endif
+    
+    return findChangeScalar;
+}
+
+static long long getTimeNs()
+{
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void sleepUntilNs(long long ns)
+{
+    struct timespec ts;
+    
+    ts.tv_sec = ns / 1000000000;
+    ts.tv_nsec = ns % 1000000000;
+    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR && !watchStopping)
+    {
+    }
+}
+
+static int compareRegions(const void* a, const void* b)
+{
+    DWORD addressA = ((PWATCH_REGION)a)->address;
+    DWORD addressB = ((PWATCH_REGION)b)->address;
+    
+    return addressA < addressB ? -1 : addressA > addressB;
+}
+
+// parses addr:len[,addr:len...] into regions, sorted by address
+// Returns the number of regions, <0 for error
+static int parseRegions(const char* list, PWATCH_REGION regions)
+{
+    const char* next;
+    char* end;
+    int count;
+    
+    count = 0;
+    for(next = list; *next != '\0'; next = end + 1)
+    {
+        if(count == MAX_WATCH_REGIONS)
+        {
+            printf("Can't watch more than %d regions!!\n", MAX_WATCH_REGIONS);
+            return -1;
+        }
+    
+        regions[count].address = strtoul(next, &end, 0);
+        if(end == next || *end != ':')
+        {
+            return -2;
+        }
+    
+        next = end + 1;
+        regions[count].length = strtoul(next, &end, 0);
+        if(end == next || (*end != ',' && *end != '\0') || regions[count].length == 0 || regions[count].length > MAX_WATCH_LENGTH)
+        {
+            return -3;
+        }
+        count++;
+    
+        if(*end == '\0')
+        {
+            break;
+        }
+    }
+    
+    qsort(regions, count, sizeof(WATCH_REGION), compareRegions);
+    return count;
+}
+
+// plans the reads of a sample with planSatReads and places every region in the sample
+// Returns the number of reads, <0 for error
+static int planReads(PWATCH_REGION regions, int numRegions, PSAT_READ_SPAN reads, DWORD* sampleLength)
+{
+    SAT_READ_VEC vec[MAX_WATCH_REGIONS];
+    int readOf[MAX_WATCH_REGIONS];
+    int numReads;
+    int i;
+    
+    for(i = 0; i < numRegions; i++)
+    {
+        vec[i].address = regions[i].address;
+        vec[i].length = regions[i].length;
+        vec[i].buffer = NULL;
+    }
+    
+    numReads = planSatReads(vec, numRegions, reads, readOf, sampleLength);
+    for(i = 0; i < numRegions && numReads > 0; i++)
+    {
+        regions[i].offset = reads[readOf[i]].offset + (regions[i].address - reads[readOf[i]].address);
+    }
+    
+    return numReads;
+}
+
+// prints the changed bytes of a region, a run of changes per line
+static void printChanges(COMPARE_KERNEL findChange, PWATCH_REGION region, BYTE* previous, BYTE* sample, double seconds)
+{
+    BYTE* old = previous + region->offset;
+    BYTE* new = sample + region->offset;
+    DWORD start;
+    DWORD end;
+    DWORD i;
+    
+    for(start = findChange(old, new, 0, region->length); start < region->length; start = findChange(old, new, end, region->length))
+    {
+        for(end = start + 1; end < region->length && end - start < WATCH_LINE_BYTES && old[end] != new[end]; end++)
+        {
+        }
+    
+        printf("%12.6f 0x%08x ", seconds, region->address + start);
+        for(i = start; i < end; i++)
+        {
+            printf(" %02x", new[i]);
+        }
+        printf("  (was");
+        for(i = start; i < end; i++)
+        {
+            printf(" %02x", old[i]);
+        }
+        printf(")\n");
+    }
+}
+
+int watchMemory(PSAT_TRANSPORT transport, int daemonSocket, const char* regionList, int rate, DWORD samples)
+{
+    WATCH_REGION regions[MAX_WATCH_REGIONS];
+    SAT_READ_SPAN reads[MAX_WATCH_REGIONS];
+    COMPARE_KERNEL findChange;
+    struct sigaction action;
+    struct sigaction oldAction;
+    BYTE* previous;
+    BYTE* sample;
+    BYTE* swap;
+    DWORD sampleLength;
+    DWORD count;
+    long long period;
+    long long start;
+    long long next;
+    long long now;
+    long long last;
+    long long readNs;
+    long long missed;
+    long long minReadNs;
+    long long maxReadNs;
+    double totalReadNs;
+    double interval;
+    double intervalSum;
+    double intervalSquares;
+    double maxLateNs;
+    int numRegions;
+    int numReads;
+    int result;
+    DWORD j;
+    int i;
+    
+    numRegions = parseRegions(regionList, regions);
+    if(numRegions <= 0)
+    {
+        printf("Expected addr:len[,addr:len...] with lengths up to %d!!\n", MAX_WATCH_LENGTH);
+        return -1;
+    }
+    numReads = planReads(regions, numRegions, reads, &sampleLength);
+    if(numReads < 0)
+    {
+        return -2;
+    }
+    
+    previous = calloc(1, sampleLength);
+    sample = calloc(1, sampleLength);
+    if(previous == NULL || sample == NULL)
+    {
+        free(previous);
+        free(sample);
+        return -2;
+    }
+    
+    findChange = getCompareKernel();
+    period = rate > 0 ? 1000000000LL / rate : 0;
+    
+    printf("Watching %d regions with %d reads a sample", numRegions, numReads);
+    if(rate > 0)
+    {
+        printf(" at %d samples/s", rate);
+    }
+    printf(", Ctrl-C stops\n");
+    
+    // Ctrl-C ends the watch and prints the statistics
+    watchStopping = 0;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handleWatchSignal;
+    sigaction(SIGINT, &action, &oldAction);
+    
+    result = 0;
+    count = 0;
+    minReadNs = 0;
+    maxReadNs = 0;
+    totalReadNs = 0;
+    intervalSum = 0;
+    intervalSquares = 0;
+    maxLateNs = 0;
+    last = 0;
+    start = getTimeNs();
+    next = start;
+    
+    while(!watchStopping && (samples == 0 || count < samples))
+    {
+        if(period > 0)
+        {
+            sleepUntilNs(next);
+            if(watchStopping)
+            {
+                break;
+            }
+        }
+    
+        now = getTimeNs();
+        for(i = 0; i < numReads && result == 0; i++)
+        {
+            result = readSatMemoryVia(transport, daemonSocket, sample + reads[i].offset, reads[i].address, reads[i].length);
+        }
+        if(result != 0)
+        {
+            printf("Failed to read a sample!!\n");
+            break;
+        }
+        readNs = getTimeNs() - now;
+    
+        // the first sample is printed whole, after that only what changed
+        if(count == 0)
+        {
+            for(i = 0; i < numRegions; i++)
+            {
+                printf("%12.6f 0x%08x ", 0.0, regions[i].address);
+                for(j = 0; j < regions[i].length; j++)
+                {
+                    printf(" %02x", sample[regions[i].offset + j]);
+                }
+                printf("\n");
+            }
+            minReadNs = readNs;
+        }
+        else
+        {
+            for(i = 0; i < numRegions; i++)
+            {
+                printChanges(findChange, &regions[i], previous, sample, (now - start) / 1e9);
+            }
+    
+            interval = now - last;
+            intervalSum += interval;
+            intervalSquares += interval * interval;
+        }
+        fflush(stdout);
+    
+        if(readNs < minReadNs)
+        {
+            minReadNs = readNs;
+        }
+        if(readNs > maxReadNs)
+        {
+            maxReadNs = readNs;
+        }
+        totalReadNs += readNs;
+        // lateness is against the slots the rate asked for, not the restarted schedule, or a link that
+        // can't keep up would never look late
+        if(period > 0 && now - (start + count * period) > maxLateNs)
+        {
+            maxLateNs = now - (start + count * period);
+        }
+    
+        swap = previous;
+        previous = sample;
+        sample = swap;
+        last = now;
+        count++;
+    
+        // a sample that overran its slot isn't made up for with a burst, the schedule restarts from now
+        next += period;
+        if(period > 0 && next < getTimeNs())
+        {
+            next = getTimeNs();
+        }
+    }
+    
+    sigaction(SIGINT, &oldAction, NULL);
+    
+    if(count > 1)
+    {
+        interval = intervalSum / (count - 1);
+        printf("%d samples in %.3f s, %.1f samples/s. interval %.3f ms +- %.3f ms",
+               count, (last - start) / 1e9, 1e9 / interval, interval / 1e6,
+               sqrt(fabs(intervalSquares / (count - 1) - interval * interval)) / 1e6);
+        if(period > 0)
+        {
+            missed = (last - start) / period + 1 - count;
+            printf(", worst %.3f ms late, %lld slots missed", maxLateNs / 1e6, missed > 0 ? missed : 0);
+        }
+        printf("\nsample read took %.3f ms min, %.3f ms avg, %.3f ms max\n", minReadNs / 1e6,
+               totalReadNs / count / 1e6, maxReadNs / 1e6);
+    }
+    
+    free(previous);
+    free(sample);
+    return result;
+}